@@ -0,0 +1,326 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <openssl/sha.h>
+
+#include "check.h"
+#include "mock.h"
+#include "../shared/fcp-shared.h"
+#include "../server/device.h"
+#include "../server/event-loop.h"
+#include "../server/fcp-socket.h"
+#include "../server/log.h"
+
+// Longest a check may take before it fails
+#define CHECK_TIMEOUT_MS 10000
+
+// A client of the socket server: sends one request, then reads
+// responses until SUCCESS or ERROR
+struct check_client {
+  int                  fd;
+  struct event_source *source;
+  uint8_t             *request;
+  size_t               request_size;
+  size_t               sent;
+
+  uint8_t              buf[256];
+  size_t               buf_used;
+
+  int                  result;  // Error code, 0 for SUCCESS, -1 if none
+};
+
+static void handle_response(struct check_client *client) {
+  while (client->buf_used >= sizeof(struct fcp_socket_msg_header)) {
+    struct fcp_socket_msg_header *header = (void *)client->buf;
+    size_t size = sizeof(*header) + header->payload_length;
+
+    if (size > sizeof(client->buf)) {
+      client->result = FCP_SOCKET_ERR_INVALID_LENGTH;
+      event_loop_stop(0);
+      return;
+    }
+    if (client->buf_used < size)
+      return;
+
+    if (header->msg_type == FCP_SOCKET_RESPONSE_SUCCESS ||
+        header->msg_type == FCP_SOCKET_RESPONSE_ERROR) {
+      int16_t code = 0;
+
+      if (header->msg_type == FCP_SOCKET_RESPONSE_ERROR &&
+          header->payload_length == sizeof(code))
+        memcpy(&code, header + 1, sizeof(code));
+      client->result = code;
+      event_loop_stop(0);
+      return;
+    }
+
+    memmove(client->buf, client->buf + size, client->buf_used - size);
+    client->buf_used -= size;
+  }
+}
+
+static void handle_client_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct check_client *client = data;
+
+  if (events & EPOLLOUT) {
+    ssize_t n = send(
+      client->fd, client->request + client->sent,
+      client->request_size - client->sent, MSG_NOSIGNAL
+    );
+
+    if (n > 0)
+      client->sent += n;
+    if (n < 0 && errno != EAGAIN) {
+      log_error("Cannot send check request: %s", strerror(errno));
+      event_loop_stop(-errno);
+      return;
+    }
+    if (client->sent == client->request_size)
+      event_modify_fd(source, EPOLLIN);
+  }
+
+  if (events & (EPOLLIN | EPOLLHUP)) {
+    ssize_t n = recv(
+      client->fd, client->buf + client->buf_used,
+      sizeof(client->buf) - client->buf_used, 0
+    );
+
+    if (n <= 0) {
+      if (n < 0 && errno == EAGAIN)
+        return;
+      log_error("Server closed the check connection");
+      event_loop_stop(-EPIPE);
+      return;
+    }
+
+    client->buf_used += n;
+    handle_response(client);
+  }
+}
+
+static void handle_timeout(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  log_error("Check timed out");
+  event_loop_stop(-ETIMEDOUT);
+}
+
+/* Send a request to the device's socket server and run the event
+ * loop until it has been answered; returns the error code in the
+ * response, 0 for SUCCESS, or -1 if there wasn't one
+ */
+static int send_request(
+  struct fcp_device *device,
+  const char        *socket_path,
+  uint8_t           *request,
+  size_t             request_size
+) {
+  struct check_client client = {
+    .request      = request,
+    .request_size = request_size,
+    .result       = -1
+  };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+  client.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (client.fd < 0 ||
+      connect(client.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_error("Cannot connect to %s: %s", socket_path, strerror(errno));
+    if (client.fd >= 0)
+      close(client.fd);
+    return -1;
+  }
+
+  client.source = event_add_fd(
+    client.fd, EPOLLIN | EPOLLOUT, handle_client_event, &client
+  );
+  struct event_source *timer = event_add_timer(handle_timeout, NULL);
+
+  if (client.source && timer &&
+      event_timer_arm(timer, CHECK_TIMEOUT_MS, 0) >= 0)
+    event_loop_run();
+
+  event_remove(timer);
+  event_remove(client.source);
+  close(client.fd);
+
+  return client.result;
+}
+
+/* An App firmware update request for an image of size bytes,
+ * each seed plus its offset
+ */
+static uint8_t *firmware_request(
+  struct fcp_device *device,
+  uint8_t            msg_type,
+  uint32_t           size,
+  uint8_t            seed,
+  size_t            *request_size
+) {
+  *request_size = sizeof(struct fcp_socket_msg_header) +
+                  sizeof(struct firmware_payload) + size;
+  uint8_t *request = calloc(1, *request_size);
+  if (!request) {
+    log_error("Cannot allocate memory for check request");
+    exit(1);
+  }
+
+  struct fcp_socket_msg_header *header = (void *)request;
+  struct firmware_payload *payload = (void *)(header + 1);
+
+  header->magic = FCP_SOCKET_MAGIC_REQUEST;
+  header->msg_type = msg_type;
+  header->payload_length = sizeof(*payload) + size;
+  payload->size = size;
+  payload->usb_vid = device->usb_vid;
+  payload->usb_pid = device->usb_pid;
+  for (uint32_t i = 0; i < size; i++)
+    payload->data[i] = seed + i;
+  SHA256(payload->data, size, payload->sha256);
+
+  return request;
+}
+
+/* A flash write failing part way through an App firmware update
+ * must be reported, and the partly written image erased
+ */
+static bool check_firmware_write_error(
+  struct fcp_device *device,
+  const char        *socket_path
+) {
+  int segment_size;
+  const uint8_t *segment = mock_flash_segment("App_Upgrade", &segment_size);
+
+  if (!segment)
+    return false;
+
+  // Half the segment, failing half way through
+  uint32_t size = segment_size / 2;
+  size_t request_size;
+  uint8_t *request = firmware_request(
+    device, FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE, size, 1, &request_size
+  );
+
+  mock_flash_fail_writes(size / 2);
+  int result = send_request(device, socket_path, request, request_size);
+  mock_flash_fail_writes(-1);
+  free(request);
+
+  if (result != FCP_SOCKET_ERR_WRITE) {
+    log_error("Expected a write error, got %d", result);
+    return false;
+  }
+
+  for (int i = 0; i < segment_size; i++)
+    if (segment[i] != 0xff) {
+      log_error("Partly written image left in flash at offset %d", i);
+      return false;
+    }
+
+  return true;
+}
+
+/* A differential update to an image shorter than the one in flash
+ * must not leave the end of the old one behind
+ */
+static bool check_firmware_diff_tail(
+  struct fcp_device *device,
+  const char        *socket_path
+) {
+  int segment_size;
+  uint8_t *segment = mock_flash_segment("App_Upgrade", &segment_size);
+
+  if (!segment)
+    return false;
+
+  // The old image fills the segment; the new one is half of it,
+  // with the same start
+  for (int i = 0; i < segment_size; i++)
+    segment[i] = 1 + i;
+
+  uint32_t size = segment_size / 2;
+  size_t request_size;
+  uint8_t *request = firmware_request(
+    device, FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF, size, 1,
+    &request_size
+  );
+  const uint8_t *data = request + request_size - size;
+
+  int result = send_request(device, socket_path, request, request_size);
+  bool ok = !result && !memcmp(segment, data, size);
+  free(request);
+
+  if (!ok) {
+    log_error("Differential update failed: %d", result);
+    return false;
+  }
+
+  for (int i = size; i < segment_size; i++)
+    if (segment[i] != 0xff) {
+      log_error("Old image left in flash at offset %d", i);
+      return false;
+    }
+
+  return true;
+}
+
+static const struct {
+  const char *name;
+  bool      (*run)(struct fcp_device *device, const char *socket_path);
+} checks[] = {
+  { "firmware-write-error", check_firmware_write_error },
+  { "firmware-diff-tail",   check_firmware_diff_tail },
+};
+
+#define CHECK_COUNT ((int)(sizeof(checks) / sizeof(checks[0])))
+
+int run_checks(struct fcp_device *device) {
+  char dir[] = "/tmp/fcp-bench-XXXXXX";
+  char *socket_path;
+  int failed = 0;
+
+  if (!mkdtemp(dir)) {
+    log_error("Cannot create socket directory: %s", strerror(errno));
+    return CHECK_COUNT;
+  }
+  setenv("RUNTIME_DIRECTORY", dir, 1);
+
+  if (asprintf(&socket_path, "%s/fcp-%d.sock", dir, device->card_num) < 0 ||
+      event_loop_init() < 0 ||
+      fcp_socket_init(device) < 0) {
+    rmdir(dir);
+    return CHECK_COUNT;
+  }
+
+  for (int i = 0; i < CHECK_COUNT; i++) {
+    bool ok = checks[i].run(device, socket_path);
+
+    printf("%-24s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+    failed += !ok;
+  }
+
+  fcp_socket_cleanup(device);
+  unlink(socket_path);
+  rmdir(dir);
+  free(socket_path);
+
+  return failed;
+}
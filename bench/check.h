@@ -0,0 +1,14 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+struct fcp_device;
+
+/* Checks of how the server handles the simulated device failing,
+ * run with fcp-bench -c; each drives the server through its socket
+ * as fcp-tool would, with the event loop running
+ *
+ * Returns the number of checks which failed.
+ */
+int run_checks(struct fcp_device *device);
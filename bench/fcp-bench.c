@@ -0,0 +1,619 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "check.h"
+#include "mock.h"
+#include "replay.h"
+#include "../server/device-ops.h"
+#include "../server/control-utils.h"
+#include "../server/fcp.h"
+#include "../server/stats.h"
+#include "../server/log.h"
+
+/* Benchmark the server against a simulated device
+ *
+ * The device is set up as fcp-server would set it up, from a devmap
+ * and FCP ALSA map in the data directory, and then each workload is
+ * replayed against it, timing each operation.
+ */
+
+#define SWEEP_STEPS 128
+
+struct bench {
+  struct fcp_device  device;
+  uint32_t           rng;
+
+  // Controls which the device changes and notifies about
+  int               *notify_controls;
+  int                notify_count;
+
+  // Controls which can be written through ALSA
+  int               *write_controls;
+  int                write_count;
+  int               *presets[2];
+
+  int                sweep_control;  // -1 if none
+
+  int                upgrade_segment;
+  int                upgrade_size;
+  uint8_t           *firmware;
+
+  const char        *trace_path;  // NULL if no trace to replay
+  struct replay      replay;
+};
+
+struct workload {
+  const char *name;
+  const char *description;
+  int         divisor;  // Fewer iterations for long operations
+  int       (*prepare)(struct bench *bench);
+  int       (*run)(struct bench *bench, int iteration);
+};
+
+static uint32_t next_random(struct bench *bench) {
+  uint32_t x = bench->rng;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return bench->rng = x;
+}
+
+/* Pick a value for the control which isn't except (its current
+ * value), if it has more than one
+ */
+static int pick_value(
+  struct bench         *bench,
+  struct control_props *props,
+  int                   except
+) {
+  long range = (long)props->max - props->min + 1;
+
+  if (range <= 1)
+    return props->min;
+
+  int value = props->min + next_random(bench) % range;
+  if (value == except)
+    value = value == props->max ? props->min : value + 1;
+
+  return value;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write new values through ALSA in one batch, as when the server
+ * handles a set of control events, and then handle the notification
+ * which the device sends back
+ */
+static int apply_changes(
+  struct bench *bench,
+  const int    *indices,
+  const int    *values,
+  int           count
+) {
+  struct fcp_device *device = &bench->device;
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_value_t *value;
+  uint32_t echo = 0;
+  int err = 0;
+
+  snd_ctl_elem_id_alloca(&id);
+  snd_ctl_elem_value_alloca(&value);
+
+  mock_counters.notify_mask = 0;
+
+  device_batch_begin(device);
+
+  for (int i = 0; i < count && err >= 0; i++) {
+    struct control_props *props = &device->ctrl_mgr.controls[indices[i]];
+
+    snd_ctl_elem_id_set_numid(id, props->numid);
+    snd_ctl_elem_id_set_interface(id, props->interface);
+    snd_ctl_elem_id_set_name(id, props->name);
+    snd_ctl_elem_value_set_id(value, id);
+    snd_ctl_elem_value_set_integer(value, 0, values[i]);
+
+    err = device_handle_control_change(device, id, value);
+    if (props->notify_device)
+      echo |= props->notify_client;
+  }
+
+  int end_err = device_batch_end(device);
+  if (err >= 0)
+    err = end_err;
+
+  if (mock_counters.notify_mask && echo)
+    device_handle_notification(device, echo);
+
+  return err;
+}
+
+static int prepare_notify(struct bench *bench) {
+  return bench->notify_count ? 0 : -ENOENT;
+}
+
+/* Change one control at the device and notify the server */
+static int run_notify(struct bench *bench, int iteration) {
+  struct fcp_device *device = &bench->device;
+  int index = bench->notify_controls[next_random(bench) % bench->notify_count];
+  struct control_props *props = &device->ctrl_mgr.controls[index];
+
+  int value = pick_value(bench, props, props->value);
+  if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED && props->enum_values)
+    value = props->enum_values[value];
+
+  int width = data_type_width(props->data_type);
+  uint8_t *data = mock_app_space() + props->offset + props->array_index * width;
+
+  for (int i = 0; i < width; i++)
+    data[i] = value >> (i * 8);
+
+  device_handle_notification(device, props->notify_client);
+  return 0;
+}
+
+static int prepare_sweep(struct bench *bench) {
+  return bench->sweep_control < 0 ? -ENOENT : 0;
+}
+
+/* Move one fader up and down through its range */
+static int run_sweep(struct bench *bench, int iteration) {
+  struct control_props *props =
+    &bench->device.ctrl_mgr.controls[bench->sweep_control];
+  int step = iteration % (SWEEP_STEPS * 2);
+
+  if (step > SWEEP_STEPS)
+    step = SWEEP_STEPS * 2 - step;
+
+  int value = props->min + (long)(props->max - props->min) * step / SWEEP_STEPS;
+  if (value == props->value)
+    value = value == props->max ? value - 1 : value + 1;
+
+  return apply_changes(bench, &bench->sweep_control, &value, 1);
+}
+
+static int prepare_preset(struct bench *bench) {
+  if (!bench->write_count)
+    return -ENOENT;
+
+  for (int p = 0; p < 2; p++) {
+    bench->presets[p] = malloc(bench->write_count * sizeof(int));
+    if (!bench->presets[p]) {
+      log_error("Cannot allocate memory for presets");
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < bench->write_count; i++) {
+    struct control_props *props =
+      &bench->device.ctrl_mgr.controls[bench->write_controls[i]];
+
+    bench->presets[0][i] = pick_value(bench, props, props->value);
+    bench->presets[1][i] = pick_value(bench, props, bench->presets[0][i]);
+  }
+
+  return 0;
+}
+
+/* Set every writable control, alternating between two presets */
+static int run_preset(struct bench *bench, int iteration) {
+  return apply_changes(
+    bench,
+    bench->write_controls,
+    bench->presets[iteration % 2],
+    bench->write_count
+  );
+}
+
+static int prepare_firmware(struct bench *bench) {
+  snd_hwdep_t *hwdep = bench->device.hwdep;
+  int size, count;
+
+  int err = fcp_flash_info(hwdep, &size, &count);
+  if (err < 0)
+    return err;
+
+  for (int i = 0; i < count; i++) {
+    uint32_t flags;
+    char *name;
+
+    err = fcp_flash_segment_info(hwdep, i, &size, &flags, &name);
+    if (err < 0)
+      return err;
+
+    if (!strcmp(name, "App_Upgrade")) {
+      bench->upgrade_segment = i;
+      bench->upgrade_size = size;
+    }
+    free(name);
+  }
+
+  if (!bench->upgrade_segment)
+    return -ENOENT;
+
+  bench->firmware = malloc(bench->upgrade_size);
+  if (!bench->firmware) {
+    log_error("Cannot allocate memory for firmware");
+    exit(1);
+  }
+  for (int i = 0; i < bench->upgrade_size; i++)
+    bench->firmware[i] = next_random(bench);
+
+  return 0;
+}
+
+/* Erase the upgrade segment and write a firmware image to it */
+static int run_firmware(struct bench *bench, int iteration) {
+  snd_hwdep_t *hwdep = bench->device.hwdep;
+  int segment = bench->upgrade_segment;
+
+  int err = fcp_flash_erase(hwdep, segment);
+  if (err < 0)
+    return err;
+
+  do {
+    err = fcp_flash_erase_progress(hwdep, segment);
+    if (err < 0)
+      return err;
+  } while (err != 255);
+
+  for (int offset = 0; offset < bench->upgrade_size;
+       offset += FCP_FLASH_WRITE_MAX) {
+    int size = bench->upgrade_size - offset;
+
+    if (size > FCP_FLASH_WRITE_MAX)
+      size = FCP_FLASH_WRITE_MAX;
+
+    err = fcp_flash_write(hwdep, segment, offset, size,
+                          bench->firmware + offset);
+    if (err < 0)
+      return err;
+  }
+
+  return 0;
+}
+
+static int prepare_replay(struct bench *bench) {
+  return bench->replay.notification_count ? 0 : -ENOENT;
+}
+
+/* Handle the next notification in the trace, after giving the
+ * simulated device the values the real one reported in response to
+ * it; wraps around at the end of the trace
+ */
+static int run_replay(struct bench *bench, int iteration) {
+  struct replay *replay = &bench->replay;
+  int n = iteration % replay->notification_count;
+  int first = replay->notifications[n];
+  int last = n + 1 < replay->notification_count
+    ? replay->notifications[n + 1]
+    : replay->count;
+
+  replay_apply(replay, first + 1, last);
+  device_handle_notification(&bench->device, replay->records[first]->opcode);
+  return 0;
+}
+
+static const struct workload workloads[] = {
+  { "notify",   "one control changed at the device per notification",
+    1,   prepare_notify,   run_notify },
+  { "sweep",    "one fader moved through its range",
+    1,   prepare_sweep,    run_sweep },
+  { "preset",   "every writable control set in one batch",
+    10,  prepare_preset,   run_preset },
+  { "firmware", "upgrade segment erased and written",
+    100, prepare_firmware, run_firmware },
+  { "replay",   "notifications recorded with FCP_TRACE (needs -r)",
+    1,   prepare_replay,   run_replay },
+};
+
+#define WORKLOAD_COUNT ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void run_workload(
+  struct bench          *bench,
+  const struct workload *workload,
+  int                    iterations
+) {
+  int count = iterations / workload->divisor;
+  if (count < 1)
+    count = 1;
+
+  int err = workload->prepare(bench);
+  if (err < 0) {
+    printf("%-10s skipped: %s\n", workload->name, snd_strerror(err));
+    return;
+  }
+
+  uint64_t *samples = malloc(count * sizeof(*samples));
+  if (!samples) {
+    log_error("Cannot allocate memory for samples");
+    exit(1);
+  }
+
+  struct mock_counters before = mock_counters;
+  uint64_t start = now_ns();
+
+  for (int i = 0; i < count; i++) {
+    uint64_t op_start = now_ns();
+
+    err = workload->run(bench, i);
+    samples[i] = now_ns() - op_start;
+    if (err < 0) {
+      log_error("%s failed: %s", workload->name, snd_strerror(err));
+      count = i + 1;
+      break;
+    }
+  }
+
+  uint64_t elapsed = now_ns() - start;
+
+  qsort(samples, count, sizeof(*samples), compare_u64);
+
+  printf(
+    "%-10s %7d %10.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n",
+    workload->name,
+    count,
+    elapsed ? count * 1e9 / elapsed : 0,
+    samples[(count - 1) * 50 / 100] / 1e3,
+    samples[(count - 1) * 99 / 100] / 1e3,
+    samples[count - 1] / 1e3,
+    (double)(mock_counters.transfers - before.transfers) / count,
+    (double)(mock_counters.alsa_writes - before.alsa_writes) / count
+  );
+
+  free(samples);
+}
+
+/* Collect the controls each workload uses */
+static void find_controls(struct bench *bench) {
+  struct control_manager *ctrl_mgr = &bench->device.ctrl_mgr;
+
+  bench->notify_controls = calloc(ctrl_mgr->num_controls + 1, sizeof(int));
+  bench->write_controls = calloc(ctrl_mgr->num_controls + 1, sizeof(int));
+  if (!bench->notify_controls || !bench->write_controls) {
+    log_error("Cannot allocate memory for control lists");
+    exit(1);
+  }
+
+  bench->sweep_control = -1;
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++) {
+    struct control_props *props = &ctrl_mgr->controls[i];
+
+    if (props->type == SND_CTL_ELEM_TYPE_BYTES || props->component_count)
+      continue;
+
+    int width = data_type_width(props->data_type);
+
+    if (props->read_func == read_data_control &&
+        props->notify_client && props->offset > 0 && width &&
+        props->offset + (props->array_index + 1) * width <= MOCK_APP_SPACE_SIZE)
+      bench->notify_controls[bench->notify_count++] = i;
+
+    if (props->read_only || !props->write_func || props->max <= props->min)
+      continue;
+
+    bench->write_controls[bench->write_count++] = i;
+
+    // Prefer a mixer fader for the sweep
+    if (props->type == SND_CTL_ELEM_TYPE_INTEGER &&
+        (bench->sweep_control < 0 ||
+         (props->category == CATEGORY_MIX &&
+          ctrl_mgr->controls[bench->sweep_control].category != CATEGORY_MIX)))
+      bench->sweep_control = i;
+  }
+}
+
+/* Set up the device as fcp-server does, against the simulated
+ * hardware
+ */
+static int setup_device(struct bench *bench, int usb_pid) {
+  struct fcp_device *device = &bench->device;
+  int err;
+
+  device->usb_vid = 0x1235;
+  device->usb_pid = usb_pid;
+
+  err = snd_ctl_open(&device->ctl, "hw:0", 0);
+  if (err < 0)
+    return err;
+  err = snd_hwdep_open(&device->hwdep, "hw:0", 0);
+  if (err < 0)
+    return err;
+
+  fcp_init(device->hwdep);
+
+  err = device_load_config(device);
+  if (err < 0)
+    return err;
+
+  mock_device_init(device->devmap, device->fam);
+
+  // Start from the values the traced device reported before its
+  // first notification
+  if (bench->trace_path) {
+    struct replay *replay = &bench->replay;
+
+    err = replay_load(replay, bench->trace_path, 0);
+    if (err < 0)
+      return err;
+
+    replay_apply(
+      replay, 0,
+      replay->notification_count ? replay->notifications[0] : replay->count
+    );
+  }
+
+  err = device_init_controls(device);
+  if (err < 0)
+    return err;
+
+  device_release_config(device);
+  device_release_shared_config();
+
+  // The event loop isn't run, so read the deferred values now
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  for (int i = 0; i < ctrl_mgr->num_controls; i++)
+    if (ctrl_mgr->controls[i].value_pending)
+      init_user_control_value(device, &ctrl_mgr->controls[i]);
+
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(
+    stderr,
+    "Usage: %s [options] <usb-pid>\n"
+    "\n"
+    "Options:\n"
+    "  -d <dir>   directory with fcp-devmap-<pid>.json and\n"
+    "             fcp-alsa-map-<pid>.json (default: data)\n"
+    "  -l <us>    latency of each FCP command (default: 125)\n"
+    "  -b <ns>    additional latency per byte transferred (default: 0)\n"
+    "  -n <num>   iterations (default: 1000)\n"
+    "  -s <seed>  random seed (default: 1)\n"
+    "  -w <name>  only run the named workload\n"
+    "  -r <file>  trace recorded by fcp-server with FCP_TRACE=<file>,\n"
+    "             for the replay workload\n"
+    "  -c         check the server's handling of device errors\n"
+    "             instead of running the workloads\n"
+    "\n"
+    "Workloads:\n",
+    argv0
+  );
+  for (int i = 0; i < WORKLOAD_COUNT; i++)
+    fprintf(stderr, "  %-10s %s\n", workloads[i].name, workloads[i].description);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench *bench = calloc(1, sizeof(*bench));
+  const char *data_dir = "data";
+  const char *only = NULL;
+  int latency_us = 125, byte_ns = 0, iterations = 1000;
+  bool check = false;
+  int opt;
+
+  if (!bench) {
+    fprintf(stderr, "Cannot allocate memory for benchmark\n");
+    return 1;
+  }
+  bench->rng = 1;
+
+  while ((opt = getopt(argc, argv, "d:l:b:n:s:w:r:ch")) != -1) {
+    switch (opt) {
+      case 'd': data_dir = optarg; break;
+      case 'l': latency_us = atoi(optarg); break;
+      case 'b': byte_ns = atoi(optarg); break;
+      case 'n': iterations = atoi(optarg); break;
+      case 's': bench->rng = strtoul(optarg, NULL, 0); break;
+      case 'w': only = optarg; break;
+      case 'r': bench->trace_path = optarg; break;
+      case 'c': check = true; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || iterations < 1 || latency_us < 0 || byte_ns < 0 ||
+      !bench->rng) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int usb_pid = strtol(argv[optind], NULL, 16);
+  if (usb_pid <= 0 || usb_pid > 0xffff) {
+    fprintf(stderr, "Invalid USB PID: %s\n", argv[optind]);
+    return 1;
+  }
+
+  // The devmap must be in the data directory, since the simulated
+  // device can't supply one
+  char *devmap_path;
+  if (asprintf(&devmap_path, "%s/fcp-devmap-%04x.json", data_dir, usb_pid) < 0)
+    return 1;
+  if (access(devmap_path, R_OK) < 0) {
+    fprintf(
+      stderr,
+      "Cannot read %s: %s\n"
+      "Copy the device map cached by fcp-server there (from\n"
+      "/var/lib/fcp-server/devmap-1235-%04x-<version>.json)\n",
+      devmap_path, strerror(errno), usb_pid
+    );
+    return 1;
+  }
+  free(devmap_path);
+
+  setenv("FCP_SERVER_DATA_DIR", data_dir, 1);
+  setenv("LOG_LEVEL", "warning", 0);
+
+  // Writes are timed as sent, not after a debounce delay
+  unsetenv("FCP_MIX_DEBOUNCE_MS");
+  unsetenv("FCP_NOTIFY_DEBOUNCE_MS");
+
+  log_init();
+  stats_init();
+
+  // No latency while the controls are created
+  mock_device_set_latency(0, 0);
+
+  int err = setup_device(bench, usb_pid);
+  if (err < 0) {
+    fprintf(stderr, "Device setup failed: %s\n", snd_strerror(err));
+    return 1;
+  }
+
+  if (check)
+    return run_checks(&bench->device) ? 1 : 0;
+
+  find_controls(bench);
+
+  mock_device_set_latency(latency_us, byte_ns);
+
+  printf(
+    "%04x: %d controls (%d ALSA elements), %d us per command + %d ns/byte\n\n",
+    usb_pid, bench->device.ctrl_mgr.num_controls, mock_alsa_elem_count(),
+    latency_us, byte_ns
+  );
+  printf(
+    "%-10s %7s %10s %9s %9s %9s %8s %8s\n",
+    "workload", "ops", "ops/s", "p50 us", "p99 us", "max us",
+    "cmds/op", "alsa/op"
+  );
+
+  bool found = false;
+  for (int i = 0; i < WORKLOAD_COUNT; i++) {
+    if (only && strcmp(only, workloads[i].name))
+      continue;
+    found = true;
+    run_workload(bench, &workloads[i], iterations);
+  }
+
+  if (!found) {
+    fprintf(stderr, "Unknown workload: %s\n", only);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,299 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "mock.h"
+#include "../server/log.h"
+
+#define NAME_HASH_SIZE 4096
+
+/* A control element; numid is its index + 1 */
+struct mock_elem {
+  char                *name;  // NULL once removed
+  snd_ctl_elem_iface_t iface;
+  snd_ctl_elem_type_t  type;
+  unsigned int         count;
+  long                *values;
+  unsigned char       *bytes;
+  int                  next;  // Next index in the name hash chain; -1 at end
+};
+
+static struct {
+  struct mock_elem *elems;
+  int               count;
+  int               capacity;
+  int               name_hash[NAME_HASH_SIZE];  // Index + 1; 0 = empty
+  int               fds[2];
+} ctl;
+
+static unsigned int hash_name(const char *name) {
+  unsigned int hash = 2166136261u;
+
+  while (*name)
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+  return hash % NAME_HASH_SIZE;
+}
+
+int mock_alsa_elem_count(void) {
+  return ctl.count;
+}
+
+/* Find an element by numid, or by interface and name if the ID has
+ * no numid
+ */
+static struct mock_elem *find_elem(const snd_ctl_elem_id_t *id) {
+  unsigned int numid = snd_ctl_elem_id_get_numid(id);
+
+  if (numid) {
+    if (numid > (unsigned int)ctl.count || !ctl.elems[numid - 1].name)
+      return NULL;
+    return &ctl.elems[numid - 1];
+  }
+
+  const char *name = snd_ctl_elem_id_get_name(id);
+  snd_ctl_elem_iface_t iface = snd_ctl_elem_id_get_interface(id);
+
+  for (int i = ctl.name_hash[hash_name(name)] - 1; i >= 0;
+       i = ctl.elems[i].next) {
+    struct mock_elem *elem = &ctl.elems[i];
+
+    if (elem->name && elem->iface == iface && !strcmp(elem->name, name))
+      return elem;
+  }
+
+  return NULL;
+}
+
+static int add_elem(
+  snd_ctl_elem_info_t *info,
+  snd_ctl_elem_type_t  type,
+  unsigned int         count
+) {
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_id_alloca(&id);
+
+  snd_ctl_elem_info_get_id(info, id);
+  snd_ctl_elem_id_set_numid(id, 0);
+  if (find_elem(id))
+    return -EBUSY;
+
+  if (ctl.count == ctl.capacity) {
+    int new_capacity = ctl.capacity ? ctl.capacity * 2 : 256;
+    struct mock_elem *new_elems = realloc(
+      ctl.elems, new_capacity * sizeof(*new_elems)
+    );
+    if (!new_elems) {
+      log_error("Cannot allocate memory for mock elements");
+      exit(1);
+    }
+    ctl.elems = new_elems;
+    ctl.capacity = new_capacity;
+  }
+
+  const char *name = snd_ctl_elem_id_get_name(id);
+  unsigned int hash = hash_name(name);
+  struct mock_elem *elem = &ctl.elems[ctl.count];
+
+  elem->name = strdup(name);
+  elem->iface = snd_ctl_elem_id_get_interface(id);
+  elem->type = type;
+  elem->count = count;
+  elem->values = NULL;
+  elem->bytes = NULL;
+  if (type == SND_CTL_ELEM_TYPE_BYTES)
+    elem->bytes = calloc(1, count);
+  else
+    elem->values = calloc(count, sizeof(long));
+  if (!elem->name || (!elem->values && !elem->bytes)) {
+    log_error("Cannot allocate memory for mock element");
+    exit(1);
+  }
+
+  elem->next = ctl.name_hash[hash] - 1;
+  ctl.name_hash[hash] = ++ctl.count;
+
+  snd_ctl_elem_info_set_numid(info, ctl.count);
+  return 0;
+}
+
+/* Wrapped control functions */
+
+int __wrap_snd_ctl_open(snd_ctl_t **ctlp, const char *name, int mode) {
+  if (!ctl.fds[0] && pipe(ctl.fds) < 0)
+    return -errno;
+
+  *ctlp = (snd_ctl_t *)&ctl;
+  return 0;
+}
+
+int __wrap_snd_ctl_close(snd_ctl_t *handle) {
+  return 0;
+}
+
+int __wrap_snd_ctl_poll_descriptors_count(snd_ctl_t *handle) {
+  return 1;
+}
+
+int __wrap_snd_ctl_poll_descriptors(
+  snd_ctl_t     *handle,
+  struct pollfd *pfds,
+  unsigned int   space
+) {
+  if (space < 1)
+    return -EINVAL;
+
+  pfds[0].fd = ctl.fds[0];
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  return 1;
+}
+
+int __wrap_snd_ctl_subscribe_events(snd_ctl_t *handle, int subscribe) {
+  return 0;
+}
+
+int __wrap_snd_ctl_nonblock(snd_ctl_t *handle, int nonblock) {
+  return 0;
+}
+
+/* Elements written by the server aren't echoed back as events */
+int __wrap_snd_ctl_read(snd_ctl_t *handle, snd_ctl_event_t *event) {
+  return -EAGAIN;
+}
+
+/* No driver elements; the list is left empty */
+int __wrap_snd_ctl_elem_list(snd_ctl_t *handle, snd_ctl_elem_list_t *list) {
+  return 0;
+}
+
+int __wrap_snd_ctl_elem_info(snd_ctl_t *handle, snd_ctl_elem_info_t *info) {
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_id_alloca(&id);
+
+  snd_ctl_elem_info_get_id(info, id);
+  struct mock_elem *elem = find_elem(id);
+  if (!elem)
+    return -ENOENT;
+
+  snd_ctl_elem_info_set_numid(info, elem - ctl.elems + 1);
+  return 0;
+}
+
+int __wrap_snd_ctl_elem_remove(snd_ctl_t *handle, snd_ctl_elem_id_t *id) {
+  struct mock_elem *elem = find_elem(id);
+  if (!elem)
+    return -ENOENT;
+
+  free(elem->name);
+  free(elem->values);
+  free(elem->bytes);
+  elem->name = NULL;
+  elem->values = NULL;
+  elem->bytes = NULL;
+  return 0;
+}
+
+int __wrap_snd_ctl_add_integer_elem_set(
+  snd_ctl_t           *handle,
+  snd_ctl_elem_info_t *info,
+  unsigned int         element_count,
+  unsigned int         member_count,
+  long                 min,
+  long                 max,
+  long                 step
+) {
+  return add_elem(info, SND_CTL_ELEM_TYPE_INTEGER, member_count);
+}
+
+int __wrap_snd_ctl_add_boolean_elem_set(
+  snd_ctl_t           *handle,
+  snd_ctl_elem_info_t *info,
+  unsigned int         element_count,
+  unsigned int         member_count
+) {
+  return add_elem(info, SND_CTL_ELEM_TYPE_BOOLEAN, member_count);
+}
+
+int __wrap_snd_ctl_add_enumerated_elem_set(
+  snd_ctl_t           *handle,
+  snd_ctl_elem_info_t *info,
+  unsigned int         element_count,
+  unsigned int         member_count,
+  unsigned int         items,
+  const char *const    labels[]
+) {
+  return add_elem(info, SND_CTL_ELEM_TYPE_ENUMERATED, member_count);
+}
+
+int __wrap_snd_ctl_add_bytes_elem_set(
+  snd_ctl_t           *handle,
+  snd_ctl_elem_info_t *info,
+  unsigned int         element_count,
+  unsigned int         member_count
+) {
+  return add_elem(info, SND_CTL_ELEM_TYPE_BYTES, member_count);
+}
+
+int __wrap_snd_ctl_elem_tlv_write(
+  snd_ctl_t               *handle,
+  const snd_ctl_elem_id_t *id,
+  const unsigned int      *tlv
+) {
+  return 0;
+}
+
+int __wrap_snd_ctl_elem_lock(snd_ctl_t *handle, snd_ctl_elem_id_t *id) {
+  return find_elem(id) ? 0 : -ENOENT;
+}
+
+int __wrap_snd_ctl_elem_unlock(snd_ctl_t *handle, snd_ctl_elem_id_t *id) {
+  return find_elem(id) ? 0 : -ENOENT;
+}
+
+int __wrap_snd_ctl_elem_read(snd_ctl_t *handle, snd_ctl_elem_value_t *value) {
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_id_alloca(&id);
+
+  snd_ctl_elem_value_get_id(value, id);
+  struct mock_elem *elem = find_elem(id);
+  if (!elem)
+    return -ENOENT;
+
+  if (elem->bytes) {
+    snd_ctl_elem_set_bytes(value, elem->bytes, elem->count);
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < elem->count; i++)
+    snd_ctl_elem_value_set_integer(value, i, elem->values[i]);
+  return 0;
+}
+
+int __wrap_snd_ctl_elem_write(snd_ctl_t *handle, snd_ctl_elem_value_t *value) {
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_id_alloca(&id);
+
+  mock_counters.alsa_writes++;
+
+  snd_ctl_elem_value_get_id(value, id);
+  struct mock_elem *elem = find_elem(id);
+  if (!elem)
+    return -ENOENT;
+
+  if (elem->bytes) {
+    memcpy(elem->bytes, snd_ctl_elem_value_get_bytes(value), elem->count);
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < elem->count; i++)
+    elem->values[i] = snd_ctl_elem_value_get_integer(value, i);
+  return 0;
+}
@@ -0,0 +1,621 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "mock.h"
+#include "../server/fcp.h"
+#include "../server/log.h"
+#include "../server/uapi-fcp.h"
+
+#define MOCK_FIRMWARE_VERSION 2417
+#define MOCK_MUX_MAX          255   // MUX_READ count is 8-bit
+#define MOCK_MIX_MAX          255   // MIX_INFO sizes are 8-bit
+
+struct mock_segment {
+  const char *name;
+  int         size;
+  uint8_t    *data;
+};
+
+static struct mock_segment segments[] = {
+  { "App_Gold",     0x40000 },
+  { "App_Upgrade",  0x40000 },
+  { "App_Settings", 0x10000 },
+  { "App_Disk",     0x20000 },
+  { "App_Env",      0x10000 },
+};
+
+#define SEGMENT_COUNT ((int)(sizeof(segments) / sizeof(segments[0])))
+
+/* The simulated device */
+static struct {
+  uint8_t  app_space[MOCK_APP_SPACE_SIZE];
+  int      mix_outputs;
+  int      mix_inputs;
+  uint16_t *mix;
+  int      mux_size[3];
+  uint32_t *mux[3];
+  int      meter_count;
+  uint32_t meter_tick;
+  int      erase_segment;
+  int      erase_progress;  // Blocks erased
+  int      fail_offset;     // Flash writes past here fail, or -1
+  int      fds[2];          // Never readable; no notifications are sent
+  long     transfer_ns;
+  long     byte_ns;
+} mock;
+
+struct mock_counters mock_counters;
+
+/* Request copied out of the command buffer, which is also where the
+ * response is returned; with room for the fixed fields of a short
+ * request to read as zero
+ */
+#define REQ_PAD 16
+static uint8_t req_buf[0x10000 + REQ_PAD];
+
+static int get_int_field(json_object *obj, const char *field, int *value) {
+  json_object *field_obj;
+
+  if (!json_object_object_get_ex(obj, field, &field_obj))
+    return -1;
+
+  // Router pins are strings
+  if (json_object_is_type(field_obj, json_type_string))
+    *value = atoi(json_object_get_string(field_obj));
+  else
+    *value = json_object_get_int(field_obj);
+
+  return 0;
+}
+
+static json_object *get_spec_array(json_object *devmap, const char *name) {
+  json_object *spec, *array;
+
+  if (!json_object_object_get_ex(devmap, "device-specification", &spec) ||
+      !json_object_object_get_ex(spec, name, &array))
+    return NULL;
+
+  return array;
+}
+
+/* Count the mix outputs ("Mix X" sources) and the mixer inputs
+ * (the largest mixer input index or "Mixer N" sink number)
+ */
+static void init_mix(json_object *devmap, json_object *fam) {
+  json_object *sources, *sinks;
+  json_object *dests = get_spec_array(devmap, "destinations");
+
+  if (json_object_object_get_ex(fam, "sources", &sources)) {
+    for (int i = 0; i < json_object_array_length(sources); i++) {
+      json_object *alsa_name;
+
+      if (json_object_object_get_ex(
+            json_object_array_get_idx(sources, i), "alsa_name", &alsa_name
+          ) &&
+          !strncmp(json_object_get_string(alsa_name), "Mix ", 4))
+        mock.mix_outputs++;
+    }
+  }
+
+  if (json_object_object_get_ex(fam, "sinks", &sinks)) {
+    for (int i = 0; i < json_object_array_length(sinks); i++) {
+      json_object *alsa_name;
+
+      if (!json_object_object_get_ex(
+            json_object_array_get_idx(sinks, i), "alsa_name", &alsa_name
+          ))
+        continue;
+
+      const char *name = json_object_get_string(alsa_name);
+      if (!strncmp(name, "Mixer ", 6) && atoi(name + 6) > mock.mix_inputs)
+        mock.mix_inputs = atoi(name + 6);
+    }
+  }
+
+  for (int i = 0; dests && i < json_object_array_length(dests); i++) {
+    int index;
+
+    if (!get_int_field(json_object_array_get_idx(dests, i),
+                       "mixer-input-index", &index) &&
+        index >= mock.mix_inputs)
+      mock.mix_inputs = index + 1;
+  }
+
+  if (mock.mix_outputs > MOCK_MIX_MAX)
+    mock.mix_outputs = MOCK_MIX_MAX;
+  if (mock.mix_inputs > MOCK_MIX_MAX)
+    mock.mix_inputs = MOCK_MIX_MAX;
+
+  mock.mix = calloc(mock.mix_outputs * mock.mix_inputs + 1, sizeof(uint16_t));
+  if (!mock.mix) {
+    log_error("Cannot allocate memory for mock mix");
+    exit(1);
+  }
+}
+
+/* Route source 0 to each destination's router pin, so that the
+ * server finds a router slot for every destination
+ */
+static void init_mux(json_object *devmap) {
+  json_object *dests = get_spec_array(devmap, "destinations");
+  int count = dests ? json_object_array_length(dests) : 0;
+
+  for (int rate = 0; rate < 3; rate++) {
+    mock.mux[rate] = calloc(MOCK_MUX_MAX, sizeof(uint32_t));
+    if (!mock.mux[rate]) {
+      log_error("Cannot allocate memory for mock mux");
+      exit(1);
+    }
+
+    for (int i = 0; i < count && mock.mux_size[rate] < MOCK_MUX_MAX; i++) {
+      int pin;
+
+      if (!get_int_field(json_object_array_get_idx(dests, i),
+                         "router-pin", &pin) &&
+          pin > 0 && pin <= 0xfff)
+        mock.mux[rate][mock.mux_size[rate]++] = pin;
+    }
+  }
+}
+
+/* One meter slot for each peak index */
+static void init_meter(json_object *devmap) {
+  const char *arrays[] = { "sources", "destinations" };
+
+  for (int a = 0; a < 2; a++) {
+    json_object *array = get_spec_array(devmap, arrays[a]);
+
+    for (int i = 0; array && i < json_object_array_length(array); i++) {
+      int index;
+
+      if (!get_int_field(json_object_array_get_idx(array, i),
+                         "peak-index", &index) &&
+          index >= mock.meter_count)
+        mock.meter_count = index + 1;
+    }
+  }
+
+  if (mock.meter_count > 255)
+    mock.meter_count = 255;
+}
+
+void mock_device_init(json_object *devmap, json_object *fam) {
+  init_mix(devmap, fam);
+  init_mux(devmap);
+  init_meter(devmap);
+
+  for (int i = 0; i < SEGMENT_COUNT; i++) {
+    segments[i].data = malloc(segments[i].size);
+    if (!segments[i].data) {
+      log_error("Cannot allocate memory for mock flash");
+      exit(1);
+    }
+    memset(segments[i].data, 0xff, segments[i].size);
+  }
+  mock.fail_offset = -1;
+
+  if (pipe(mock.fds) < 0) {
+    log_error("Cannot create mock hwdep descriptor: %s", strerror(errno));
+    exit(1);
+  }
+
+  log_debug(
+    "Mock device: mix %dx%d, mux %d/%d/%d, %d meters",
+    mock.mix_outputs, mock.mix_inputs,
+    mock.mux_size[0], mock.mux_size[1], mock.mux_size[2],
+    mock.meter_count
+  );
+}
+
+void mock_device_set_latency(int transfer_us, int byte_ns) {
+  mock.transfer_ns = transfer_us * 1000L;
+  mock.byte_ns = byte_ns;
+}
+
+uint8_t *mock_app_space(void) {
+  return mock.app_space;
+}
+
+void mock_flash_fail_writes(int offset) {
+  mock.fail_offset = offset;
+}
+
+uint8_t *mock_flash_segment(const char *name, int *size) {
+  for (int i = 0; i < SEGMENT_COUNT; i++)
+    if (!strcmp(segments[i].name, name)) {
+      *size = segments[i].size;
+      return segments[i].data;
+    }
+
+  return NULL;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Spin rather than sleep; sleeps overshoot by more than a USB round
+ * trip takes
+ */
+static void transfer_delay(size_t bytes) {
+  uint64_t ns = mock.transfer_ns + bytes * mock.byte_ns;
+
+  if (!ns)
+    return;
+
+  uint64_t end = now_ns() + ns;
+  while (now_ns() < end)
+    ;
+}
+
+static int check_range(int offset, int size, int limit) {
+  return offset < 0 || size < 0 || offset + size > limit ? -EINVAL : 0;
+}
+
+static int u32_at(const uint8_t *buf, int offset) {
+  uint32_t value;
+
+  memcpy(&value, buf + offset, sizeof(value));
+  return le32toh(value);
+}
+
+static int u16_at(const uint8_t *buf, int offset) {
+  uint16_t value;
+
+  memcpy(&value, buf + offset, sizeof(value));
+  return le16toh(value);
+}
+
+static void put_u16(uint8_t *buf, int index, int value) {
+  uint16_t le = htole16(value);
+
+  memcpy(buf + index * sizeof(le), &le, sizeof(le));
+}
+
+static void put_u32(uint8_t *buf, int index, uint32_t value) {
+  uint32_t le = htole32(value);
+
+  memcpy(buf + index * sizeof(le), &le, sizeof(le));
+}
+
+void mock_device_apply(
+  uint32_t       opcode,
+  const uint8_t *req,
+  int            req_size,
+  const uint8_t *resp,
+  int            resp_size
+) {
+  uint8_t buf[16] = { 0 };
+
+  // Short requests read as zero, as in handle_cmd()
+  memcpy(buf, req, req_size < sizeof(buf) ? req_size : sizeof(buf));
+
+  if (opcode == FCP_OPCODE_DATA_READ) {
+    int offset = u32_at(buf, 0);
+
+    if (!check_range(offset, resp_size, MOCK_APP_SPACE_SIZE))
+      memcpy(mock.app_space + offset, resp, resp_size);
+
+  } else if (opcode == FCP_OPCODE_MIX_READ) {
+    int mix_num = u16_at(buf, 0);
+    int count = resp_size / 2;
+
+    if (mix_num < mock.mix_outputs && count <= mock.mix_inputs)
+      for (int i = 0; i < count; i++)
+        mock.mix[mix_num * mock.mix_inputs + i] = u16_at(resp, i * 2);
+
+  } else if (opcode == FCP_OPCODE_MUX_READ) {
+    int offset = buf[0], mux_num = buf[3];
+    int count = resp_size / 4;
+
+    if (mux_num <= 2 && !check_range(offset, count, mock.mux_size[mux_num]))
+      for (int i = 0; i < count; i++)
+        mock.mux[mux_num][offset + i] = u32_at(resp, i * 4);
+  }
+}
+
+static int cap_read(const uint8_t *req, uint8_t *resp) {
+  switch (u16_at(req, 0)) {
+    case FCP_OPCODE_CATEGORY_INIT:
+    case FCP_OPCODE_CATEGORY_DATA:
+    case FCP_OPCODE_CATEGORY_SYNC:
+    case FCP_OPCODE_CATEGORY_FLASH:
+      resp[0] = 1;
+      break;
+    case FCP_OPCODE_CATEGORY_METER:
+      resp[0] = mock.meter_count > 0;
+      break;
+    case FCP_OPCODE_CATEGORY_MIX:
+      resp[0] = mock.mix_outputs > 0 && mock.mix_inputs > 0;
+      break;
+    case FCP_OPCODE_CATEGORY_MUX:
+      resp[0] = mock.mux_size[0] > 0;
+      break;
+  }
+  return 0;
+}
+
+static int mix_cmd(int opcode, const uint8_t *req, int req_size, uint8_t *resp) {
+  int mix_num = u16_at(req, 0);
+
+  if (opcode == FCP_OPCODE_MIX_INFO) {
+    resp[0] = mock.mix_outputs;
+    resp[1] = mock.mix_inputs;
+    return 0;
+  }
+
+  if (mix_num >= mock.mix_outputs)
+    return -EINVAL;
+
+  uint16_t *row = mock.mix + mix_num * mock.mix_inputs;
+
+  if (opcode == FCP_OPCODE_MIX_READ) {
+    int count = u16_at(req, 2);
+
+    if (count > mock.mix_inputs)
+      return -EINVAL;
+    for (int i = 0; i < count; i++)
+      put_u16(resp, i, row[i]);
+    return 0;
+  }
+
+  int count = (req_size - 2) / 2;
+  if (count > mock.mix_inputs)
+    return -EINVAL;
+  for (int i = 0; i < count; i++)
+    row[i] = u16_at(req, 2 + i * 2);
+  return 0;
+}
+
+static int mux_cmd(int opcode, const uint8_t *req, int req_size, uint8_t *resp) {
+  if (opcode == FCP_OPCODE_MUX_INFO) {
+    for (int i = 0; i < 3; i++)
+      put_u16(resp, i, mock.mux_size[i]);
+    return 0;
+  }
+
+  if (opcode == FCP_OPCODE_MUX_READ) {
+    int offset = req[0], count = req[2], mux_num = req[3];
+
+    if (mux_num > 2 || check_range(offset, count, mock.mux_size[mux_num]))
+      return -EINVAL;
+    for (int i = 0; i < count; i++)
+      put_u32(resp, i, mock.mux[mux_num][offset + i]);
+    return 0;
+  }
+
+  int mux_num = u16_at(req, 2);
+  int count = (req_size - 4) / 4;
+
+  if (mux_num > 2 || count > mock.mux_size[mux_num])
+    return -EINVAL;
+  for (int i = 0; i < count; i++)
+    mock.mux[mux_num][i] = u32_at(req, 4 + i * 4);
+  return 0;
+}
+
+static struct mock_segment *get_segment(int segment_num) {
+  return segment_num >= 0 && segment_num < SEGMENT_COUNT
+    ? &segments[segment_num]
+    : NULL;
+}
+
+static int flash_cmd(int opcode, const uint8_t *req, int req_size, uint8_t *resp) {
+  struct mock_segment *segment;
+  int offset, size;
+
+  switch (opcode) {
+    case FCP_OPCODE_FLASH_INFO: {
+      int total = 0;
+
+      for (int i = 0; i < SEGMENT_COUNT; i++)
+        total += segments[i].size;
+      put_u32(resp, 0, total);
+      put_u32(resp, 1, SEGMENT_COUNT);
+      return 0;
+    }
+
+    case FCP_OPCODE_FLASH_SEGMENT_INFO:
+      segment = get_segment(u32_at(req, 0));
+      if (!segment)
+        return -EINVAL;
+      put_u32(resp, 0, segment->size);
+      put_u32(resp, 1, 0);
+      strncpy((char *)resp + 8, segment->name, 15);
+      return 0;
+
+    case FCP_OPCODE_FLASH_ERASE:
+      segment = get_segment(req[0]);
+      if (!segment)
+        return -EINVAL;
+      memset(segment->data, 0xff, segment->size);
+      mock.erase_segment = req[0];
+      mock.erase_progress = 0;
+      return 0;
+
+    // One block is erased per poll; 255 when finished
+    case FCP_OPCODE_FLASH_ERASE_PROGRESS:
+      segment = get_segment(u32_at(req, 0));
+      if (!segment)
+        return -EINVAL;
+      if (u32_at(req, 0) != mock.erase_segment ||
+          ++mock.erase_progress >= segment->size / FCP_FLASH_SEGMENT_SIZE)
+        resp[0] = 255;
+      else
+        resp[0] = mock.erase_progress;
+      return 0;
+
+    case FCP_OPCODE_FLASH_WRITE:
+      segment = get_segment(u32_at(req, 0));
+      offset = u32_at(req, 4);
+      size = req_size - 12;
+      if (!segment || check_range(offset, size, segment->size))
+        return -EINVAL;
+      if (mock.fail_offset >= 0 && offset + size > mock.fail_offset)
+        return -EIO;
+      memcpy(segment->data + offset, req + 12, size);
+      return 0;
+
+    case FCP_OPCODE_FLASH_READ:
+      segment = get_segment(u32_at(req, 0));
+      offset = u32_at(req, 4);
+      size = u32_at(req, 8);
+      if (!segment || check_range(offset, size, segment->size))
+        return -EINVAL;
+      memcpy(resp, segment->data + offset, size);
+      return 0;
+  }
+
+  return -EINVAL;
+}
+
+static int data_cmd(int opcode, const uint8_t *req, int req_size, uint8_t *resp) {
+  int offset = u32_at(req, 0);
+  int size = u32_at(req, 4);
+
+  switch (opcode) {
+    case FCP_OPCODE_DATA_READ:
+      if (check_range(offset, size, MOCK_APP_SPACE_SIZE))
+        return -EINVAL;
+      memcpy(resp, mock.app_space + offset, size);
+      return 0;
+
+    case FCP_OPCODE_DATA_WRITE:
+      if (size > req_size - 8 ||
+          check_range(offset, size, MOCK_APP_SPACE_SIZE))
+        return -EINVAL;
+      memcpy(mock.app_space + offset, req + 8, size);
+      return 0;
+
+    case FCP_OPCODE_DATA_NOTIFY:
+      mock_counters.notifies++;
+      mock_counters.notify_mask |= u32_at(req, 0);
+      return 0;
+  }
+
+  // The devmap is loaded from FCP_SERVER_DATA_DIR instead
+  return -EINVAL;
+}
+
+static int handle_cmd(struct fcp_cmd *cmd) {
+  int opcode = cmd->opcode;
+  int req_size = cmd->req_size;
+  uint8_t *resp = cmd->data;
+
+  mock_counters.transfers++;
+  mock_counters.bytes += cmd->req_size + cmd->resp_size;
+  transfer_delay(cmd->req_size + cmd->resp_size);
+
+  memcpy(req_buf, cmd->data, req_size);
+  memset(req_buf + req_size, 0, REQ_PAD);
+  memset(resp, 0, cmd->resp_size);
+
+  switch (opcode >> 12) {
+    case FCP_OPCODE_CATEGORY_INIT:
+      if (opcode == FCP_OPCODE_CAP_READ)
+        return cap_read(req_buf, resp);
+      return 0;
+
+    case FCP_OPCODE_CATEGORY_METER:
+      if (opcode == FCP_OPCODE_METER_INFO) {
+        resp[0] = mock.meter_count;
+        return 0;
+      }
+      mock.meter_tick++;
+      for (int i = 0; i < cmd->resp_size / 4; i++)
+        put_u32(resp, i, (mock.meter_tick * 97 + i * 1021) & 0xfff);
+      return 0;
+
+    case FCP_OPCODE_CATEGORY_MIX:
+      return mix_cmd(opcode, req_buf, req_size, resp);
+
+    case FCP_OPCODE_CATEGORY_MUX:
+      return mux_cmd(opcode, req_buf, req_size, resp);
+
+    case FCP_OPCODE_CATEGORY_FLASH:
+      return flash_cmd(opcode, req_buf, req_size, resp);
+
+    case FCP_OPCODE_CATEGORY_SYNC:
+      put_u32(resp, 0, 1);
+      return 0;
+
+    case FCP_OPCODE_CATEGORY_DATA:
+      return data_cmd(opcode, req_buf, req_size, resp);
+  }
+
+  return -EINVAL;
+}
+
+/* Wrapped hwdep functions */
+
+int __wrap_snd_hwdep_open(snd_hwdep_t **hwdep, const char *name, int mode) {
+  *hwdep = (snd_hwdep_t *)&mock;
+  return 0;
+}
+
+int __wrap_snd_hwdep_close(snd_hwdep_t *hwdep) {
+  return 0;
+}
+
+int __wrap_snd_hwdep_poll_descriptors_count(snd_hwdep_t *hwdep) {
+  return 1;
+}
+
+int __wrap_snd_hwdep_poll_descriptors(
+  snd_hwdep_t   *hwdep,
+  struct pollfd *pfds,
+  unsigned int   space
+) {
+  if (space < 1)
+    return -EINVAL;
+
+  pfds[0].fd = mock.fds[0];
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  return 1;
+}
+
+ssize_t __wrap_snd_hwdep_read(snd_hwdep_t *hwdep, void *buffer, size_t size) {
+  return -EAGAIN;
+}
+
+int __wrap_snd_hwdep_ioctl(snd_hwdep_t *hwdep, unsigned int request, void *arg) {
+  switch (request) {
+    case FCP_IOCTL_PVERSION:
+      *(int *)arg = FCP_HWDEP_VERSION;
+      return 0;
+
+    case FCP_IOCTL_INIT: {
+      struct fcp_init *init = arg;
+      uint32_t version = htole32(MOCK_FIRMWARE_VERSION);
+
+      memset(init->resp, 0, init->step0_resp_size + init->step2_resp_size);
+      if (init->step2_resp_size >= 12)
+        memcpy(init->resp + init->step0_resp_size + 8,
+               &version, sizeof(version));
+      return 0;
+    }
+
+    case FCP_IOCTL_CMD:
+      return handle_cmd(arg);
+
+    case FCP_IOCTL_SET_METER_MAP:
+    case FCP_IOCTL_SET_METER_LABELS:
+      return 0;
+  }
+
+  return -ENOTTY;
+}
@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <json-c/json.h>
+
+/* Simulated FCP device and ALSA control interface for fcp-bench
+ *
+ * The server objects are linked with -Wl,--wrap for the ALSA hwdep
+ * and control calls they make (see BENCH_WRAP in the Makefile), so
+ * that the FCP commands sent through snd_hwdep_ioctl() are answered
+ * from the in-memory APP_SPACE, mix, mux, and flash below, and the
+ * elements the server creates are kept in memory.
+ */
+
+/* Size of the simulated APP_SPACE */
+#define MOCK_APP_SPACE_SIZE 0x10000
+
+/* Work done by the simulated device and ALSA, for reporting per
+ * operation
+ */
+struct mock_counters {
+  uint64_t transfers;    // FCP commands
+  uint64_t bytes;        // Request + response bytes
+  uint64_t notifies;     // FCP_OPCODE_DATA_NOTIFY commands
+  uint32_t notify_mask;  // Events sent since last cleared
+  uint64_t alsa_writes;  // snd_ctl_elem_write() calls
+};
+
+extern struct mock_counters mock_counters;
+
+/* Size the mix and mux tables from the devmap and FCP ALSA map, as
+ * the device would report them
+ */
+void mock_device_init(json_object *devmap, json_object *fam);
+
+/* Time each FCP command takes: transfer_us plus byte_ns for each
+ * request and response byte
+ */
+void mock_device_set_latency(int transfer_us, int byte_ns);
+
+/* The simulated APP_SPACE, for changing values "at the device" */
+uint8_t *mock_app_space(void);
+
+/* Make flash writes which reach past offset fail (-1 for none) */
+void mock_flash_fail_writes(int offset);
+
+/* The simulated flash segment with this name, or NULL; for
+ * changing its contents "at the device"
+ */
+uint8_t *mock_flash_segment(const char *name, int *size);
+
+/* Take the values in the response to a recorded read command
+ * (APP_SPACE, mix, or mux) as the device's
+ */
+void mock_device_apply(
+  uint32_t       opcode,
+  const uint8_t *req,
+  int            req_size,
+  const uint8_t *resp,
+  int            resp_size
+);
+
+/* Number of snd_ctl elements created */
+int mock_alsa_elem_count(void);
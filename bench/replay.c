@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "replay.h"
+#include "mock.h"
+#include "../server/log.h"
+
+static int read_file(const char *path, uint8_t **data, size_t *size) {
+  FILE *f = fopen(path, "rb");
+
+  if (!f)
+    return -errno;
+
+  size_t alloc = 0;
+  *data = NULL;
+  *size = 0;
+
+  while (1) {
+    if (*size == alloc) {
+      alloc = alloc ? alloc * 2 : 1024 * 1024;
+      *data = realloc(*data, alloc);
+      if (!*data) {
+        log_error("Cannot allocate memory for trace");
+        exit(1);
+      }
+    }
+
+    size_t count = fread(*data + *size, 1, alloc - *size, f);
+    if (!count)
+      break;
+    *size += count;
+  }
+
+  int err = ferror(f) ? -EIO : 0;
+  fclose(f);
+  return err;
+}
+
+int replay_load(struct replay *replay, const char *path, int device) {
+  int err = read_file(path, &replay->data, &replay->size);
+  if (err < 0) {
+    log_error("Cannot read trace %s: %s", path, strerror(-err));
+    return err;
+  }
+
+  const struct fcp_trace_header *header = (const void *)replay->data;
+
+  if (replay->size < sizeof(*header) ||
+      memcmp(header->magic, FCP_TRACE_MAGIC, sizeof(header->magic)) ||
+      header->version != FCP_TRACE_VERSION) {
+    log_error("%s is not an FCP trace (version %d)", path, FCP_TRACE_VERSION);
+    return -EINVAL;
+  }
+
+  // Upper bound on the number of records
+  int max_records = replay->size / sizeof(struct fcp_trace_record);
+
+  replay->records = malloc(max_records * sizeof(*replay->records));
+  replay->notifications = malloc(max_records * sizeof(int));
+  if (!replay->records || !replay->notifications) {
+    log_error("Cannot allocate memory for trace records");
+    exit(1);
+  }
+
+  size_t offset = sizeof(*header);
+
+  while (offset + sizeof(struct fcp_trace_record) <= replay->size) {
+    const struct fcp_trace_record *rec = (const void *)(replay->data + offset);
+    size_t size = sizeof(*rec) + rec->req_size + rec->resp_size;
+
+    if (offset + size > replay->size) {
+      log_warning("Trace %s is truncated", path);
+      break;
+    }
+    offset += size;
+
+    if (rec->device != device)
+      continue;
+
+    if (rec->type == FCP_TRACE_NOTIFICATION)
+      replay->notifications[replay->notification_count++] = replay->count;
+    replay->records[replay->count++] = rec;
+  }
+
+  return 0;
+}
+
+void replay_apply(const struct replay *replay, int first, int last) {
+  for (int i = first; i < last; i++) {
+    const struct fcp_trace_record *rec = replay->records[i];
+    const uint8_t *req = (const uint8_t *)(rec + 1);
+
+    if (rec->type != FCP_TRACE_CMD || rec->result < 0)
+      continue;
+
+    mock_device_apply(
+      rec->opcode, req, rec->req_size, req + rec->req_size, rec->resp_size
+    );
+  }
+}
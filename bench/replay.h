@@ -0,0 +1,29 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../server/trace.h"
+
+/* A trace recorded with FCP_TRACE, for replaying the notifications
+ * of one device against the simulated device
+ */
+struct replay {
+  uint8_t                        *data;
+  size_t                          size;
+  const struct fcp_trace_record **records;  // Of the replayed device
+  int                             count;
+  int                            *notifications;  // Indices in records
+  int                             notification_count;
+};
+
+/* Load a trace, keeping the records of the device'th device in it */
+int replay_load(struct replay *replay, const char *path, int device);
+
+/* Give the simulated device the values which the real one reported
+ * in records [first, last)
+ */
+void replay_apply(const struct replay *replay, int first, int last);
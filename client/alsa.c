@@ -183,65 +183,156 @@ static void get_firmware_version(
     version[i] = snd_ctl_elem_value_get_integer(value, i);
 }
 
-// Enumerate all cards and return an array of sound_card pointers
-struct sound_card **enum_cards(int *count, bool quiet) {
-  struct sound_card **cards = NULL;
-  *count = 0;
-  int card_num = -1;
+int read_card_id(int card_num, struct card_id *id) {
+  char card_name[32];
+  int vid, pid;
+  snprintf(card_name, sizeof(card_name), "card%d", card_num);
 
-  if (snd_card_next(&card_num) < 0 || card_num < 0)
-    return NULL;
+  if (!get_usb_id(card_name, &vid, &pid))
+    return 0;
 
-  while (card_num >= 0) {
-    snd_ctl_t *ctl = NULL;
-    char card_name[32];
-    int vid, pid;
-    snprintf(card_name, sizeof(card_name), "card%d", card_num);
+  if (!get_supported_device_by_pid(pid))
+    return 0;
 
-    if (!get_usb_id(card_name, &vid, &pid))
-      goto next;
+  char *serial = get_device_serial(card_num);
 
-    struct supported_device *dev = get_supported_device_by_pid(pid);
-    if (!dev)
-      goto next;
+  if (!serial) {
+    fprintf(
+      stderr,
+      "Warning: can't get serial for card %d; skipping\n",
+      card_num
+    );
+    return 0;
+  }
 
-    char *serial = get_device_serial(card_num);
+  id->card_num = card_num;
+  id->usb_vid = vid;
+  id->usb_pid = pid;
+  id->serial = serial;
 
-    if (!serial) {
-      fprintf(
-        stderr,
-        "Warning: can't get serial for card %d; skipping\n",
-        card_num
-      );
-      goto next;
-    }
+  return 1;
+}
 
-    char alsa_name[32];
-    snprintf(alsa_name, sizeof(alsa_name), "hw:%d", card_num);
+// Supported cards found by enum_card_ids(); count -1 until scanned
+static struct card_id *card_ids;
+static int card_id_count = -1;
 
-    if (snd_ctl_open(&ctl, alsa_name, 0) < 0) {
-      fprintf(
-        stderr,
-        "Cannot open control for card %d (%s)\n",
-        card_num,
-        alsa_name
-      );
-      goto next;
+int enum_card_ids(const struct card_id **ids) {
+  if (card_id_count < 0) {
+    int card_num = -1;
+
+    card_id_count = 0;
+
+    while (snd_card_next(&card_num) >= 0 && card_num >= 0) {
+      struct card_id id;
+
+      if (!read_card_id(card_num, &id))
+        continue;
+
+      card_ids = realloc(card_ids, sizeof(*card_ids) * (card_id_count + 1));
+      if (!card_ids) {
+        perror("realloc");
+        exit(1);
+      }
+      card_ids[card_id_count++] = id;
     }
+  }
 
-    char *socket_path = get_socket_path(ctl, card_num, quiet);
-    if (!socket_path)
-      goto next;
+  *ids = card_ids;
+  return card_id_count;
+}
 
-    uint32_t firmware_version[4];
-    uint32_t esp_firmware_version[4];
+void forget_cards(void) {
+  for (int i = 0; i < card_id_count; i++)
+    free(card_ids[i].serial);
+  free(card_ids);
+  card_ids = NULL;
+  card_id_count = -1;
+}
 
-    get_firmware_version(
-      ctl, card_num, "Firmware Version", firmware_version
-    );
-    get_firmware_version(
-      ctl, card_num, "ESP Firmware Version", esp_firmware_version
+struct sound_card *probe_card(const struct card_id *id, bool quiet) {
+  struct sound_card *card = NULL;
+  snd_ctl_t *ctl = NULL;
+  int card_num = id->card_num;
+  char card_name[32];
+  snprintf(card_name, sizeof(card_name), "card%d", card_num);
+
+  struct supported_device *dev = get_supported_device_by_pid(id->usb_pid);
+  if (!dev)
+    return NULL;
+
+  char alsa_name[32];
+  snprintf(alsa_name, sizeof(alsa_name), "hw:%d", card_num);
+
+  if (snd_ctl_open(&ctl, alsa_name, 0) < 0) {
+    fprintf(
+      stderr,
+      "Cannot open control for card %d (%s)\n",
+      card_num,
+      alsa_name
     );
+    return NULL;
+  }
+
+  char *socket_path = get_socket_path(ctl, card_num, quiet);
+  if (!socket_path)
+    goto done;
+
+  uint32_t firmware_version[4];
+  uint32_t esp_firmware_version[4];
+
+  get_firmware_version(
+    ctl, card_num, "Firmware Version", firmware_version
+  );
+  get_firmware_version(
+    ctl, card_num, "ESP Firmware Version", esp_firmware_version
+  );
+
+  card = calloc(1, sizeof(*card));
+  if (!card) {
+    perror("calloc");
+    exit(1);
+  }
+
+  card->card_num = card_num;
+  card->usb_vid = id->usb_vid;
+  card->usb_pid = id->usb_pid;
+  card->card_name = strdup(card_name);
+  card->serial = strdup(id->serial);
+  card->product_name = strdup(dev->name);
+  card->alsa_name = strdup(alsa_name);
+  card->socket_path = socket_path;
+  card->socket_fd = -1;
+  memcpy(
+    card->firmware_version,
+    firmware_version,
+    sizeof(firmware_version)
+  );
+  memcpy(
+    card->esp_firmware_version,
+    esp_firmware_version,
+    sizeof(esp_firmware_version)
+  );
+
+done:
+  snd_ctl_close(ctl);
+
+  return card;
+}
+
+// Enumerate all cards and return an array of sound_card pointers
+struct sound_card **enum_cards(int *count, bool quiet) {
+  struct sound_card **cards = NULL;
+  const struct card_id *ids;
+  int id_count = enum_card_ids(&ids);
+
+  *count = 0;
+
+  for (int i = 0; i < id_count; i++) {
+    struct sound_card *card = probe_card(&ids[i], quiet);
+
+    if (!card)
+      continue;
 
     *count += 1;
     cards = realloc(cards, sizeof(*cards) * *count);
@@ -249,37 +340,7 @@ struct sound_card **enum_cards(int *count, bool quiet) {
       perror("realloc");
       exit(1);
     }
-
-    struct sound_card *card = calloc(1, sizeof(*card));
     cards[*count - 1] = card;
-
-    card->card_num = card_num;
-    card->usb_vid = vid;
-    card->usb_pid = pid;
-    card->card_name = strdup(card_name);
-    card->serial = serial;
-    card->product_name = strdup(dev->name);
-    card->alsa_name = strdup(alsa_name);
-    card->socket_path = socket_path;
-    card->socket_fd = -1;
-    memcpy(
-      card->firmware_version,
-      firmware_version,
-      sizeof(firmware_version)
-    );
-    memcpy(
-      card->esp_firmware_version,
-      esp_firmware_version,
-      sizeof(esp_firmware_version)
-    );
-
-next:
-    if (ctl) {
-      snd_ctl_close(ctl);
-      ctl = NULL;
-    }
-    if (snd_card_next(&card_num) < 0)
-      break;
   }
 
   return cards;
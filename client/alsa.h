@@ -20,7 +20,32 @@ struct sound_card {
   uint32_t  esp_firmware_version[4];
 };
 
-// Returns array of found cards, caller must free
+/* A supported card, as found from /proc and sysfs without opening
+ * it
+ */
+struct card_id {
+  int   card_num;
+  int   usb_vid;
+  int   usb_pid;
+  char *serial;
+};
+
+// Returns 1 and fills in id (caller frees serial) if the card is a
+// supported device, otherwise 0
+int read_card_id(int card_num, struct card_id *id);
+
+// Find the supported cards; the list is kept until forget_cards()
+int enum_card_ids(const struct card_id **ids);
+
+// Discard the list, e.g. when devices have rebooted
+void forget_cards(void);
+
+// Open a card to get the rest of its details; NULL if fcp-server
+// isn't running for it
+struct sound_card *probe_card(const struct card_id *id, bool quiet);
+
+// Returns array of found cards (all of the card IDs probed), caller
+// must free
 struct sound_card **enum_cards(int *count, bool quiet);
 
 // Connect to the fcp server for the sound card
@@ -3,34 +3,57 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <endian.h>
+#include <unistd.h>
+#include <sys/types.h>
 
 #include "data-cmd.h"
+#include "../shared/fcp-shared.h"
+
+// Most bytes in one DATA_READ command; longer reads are split
+#define DATA_READ_MAX 1024
+
+/* Most requests sent before waiting for their responses; the server
+ * doesn't wait for the client to read, so the responses (up to
+ * DATA_READ_MAX bytes each) have to fit in the socket buffer
+ */
+#define PIPELINE_DEPTH 32
 
 static void data_usage(void) {
   fprintf(stderr,
     "Usage: %s -c <card> data <subcommand> [args...]\n"
     "\n"
     "Subcommands:\n"
-    "  read <offset> <length>         Read <length> bytes from <offset>\n"
+    "  read <offset> <length> [<offset> <length>...]\n"
+    "                                 Read <length> bytes from <offset>;\n"
+    "                                 several ranges are read in one batch\n"
     "  write <offset> <length> <val>  Write <length> (1/2/4) byte value\n"
     "  notify <value>                 Send notify event <value>\n"
+    "  batch [<file>]                 Run read/write/notify commands, one\n"
+    "                                 per line, from <file> or stdin\n"
     "\n"
     "Values can be decimal, hex (0x prefix), or negative.\n"
     "Hex writes are raw bytes; decimal writes are little-endian.\n"
     "\n"
     "Examples:\n"
     "  %s -c 0 data read 442 1          Read 1 byte at offset 442\n"
+    "  %s -c 0 data read 442 1 500 4    Read offsets 442 and 500\n"
     "  %s -c 0 data write 442 1 35      Write 1-byte value 35\n"
     "  %s -c 0 data write 442 4 0x12345678  Write raw bytes 12 34 56 78\n"
     "  %s -c 0 data write 442 4 -1      Write 4-byte value -1 (ff ff ff ff)\n"
     "  %s -c 0 data notify 35           Send notify event 35\n"
+    "  %s -c 0 data read 0 65536        Dump the first 64KiB\n"
+    "  %s -c 0 data batch < cmds.txt    Run the commands in cmds.txt\n"
+    "\n"
+    "Reads longer than %d bytes and the commands in a batch are sent\n"
+    "without waiting for each response.\n"
     "\n"
     "Note: Requires FCP_DEBUG=1 when starting fcp-server.\n",
     program_name, program_name, program_name, program_name, program_name,
-    program_name
+    program_name, program_name, program_name, program_name, DATA_READ_MAX
   );
   exit(EXIT_FAILURE);
 }
@@ -46,44 +69,27 @@ static long parse_number(const char *str) {
   return val;
 }
 
-static int data_read(void) {
-  if (cmd_argc < 2) {
-    fprintf(stderr, "data read: requires <offset> <size>\n");
-    data_usage();
-  }
-
-  uint32_t offset = parse_number(cmd_argv[0]);
-  uint32_t size = parse_number(cmd_argv[1]);
-
-  if (size < 1 || size > 1024) {
-    fprintf(stderr, "data read: size must be 1-1024\n");
-    return -1;
-  }
-
-  struct {
-    uint32_t offset;
-    uint32_t size;
-  } __attribute__((packed)) req = {
-    .offset = htole32(offset),
-    .size = htole32(size)
-  };
-
-  int ret = send_fcp_cmd(FCP_OPCODE_DATA_READ, &req, sizeof(req), size);
-  if (ret != 0)
-    return ret;
-
-  uint8_t *data = data_response;
-
-  if (data_response_size >= 16) {
+// Show data read from offset; label is set to prefix short values
+// with their offset when several ranges are shown
+static void print_data(
+  uint32_t       offset,
+  const uint8_t *data,
+  size_t         size,
+  bool           label
+) {
+  if (label && size < 16)
+    printf("%u: ", offset);
+
+  if (size >= 16) {
     // Hexdump style
-    for (size_t off = 0; off < data_response_size; off += 16) {
+    for (size_t off = 0; off < size; off += 16) {
       printf("%08zx ", (size_t)offset + off);
 
       // Hex bytes
       for (size_t i = 0; i < 16; i++) {
         if (i == 8)
           printf(" ");
-        if (off + i < data_response_size)
+        if (off + i < size)
           printf(" %02x", data[off + i]);
         else
           printf("   ");
@@ -91,30 +97,30 @@ static int data_read(void) {
 
       // ASCII
       printf("  |");
-      for (size_t i = 0; i < 16 && off + i < data_response_size; i++) {
+      for (size_t i = 0; i < 16 && off + i < size; i++) {
         char c = data[off + i];
         putchar((c >= 32 && c < 127) ? c : '.');
       }
       printf("|\n");
     }
-  } else if (data_response_size <= 4) {
+  } else if (size <= 4) {
     // Show as little-endian integer with 0x prefix
     uint32_t val = 0;
-    for (size_t i = 0; i < data_response_size; i++)
+    for (size_t i = 0; i < size; i++)
       val |= (uint32_t)data[i] << (i * 8);
 
     // Check if MSB is set
-    int msb_set = data[data_response_size - 1] & 0x80;
+    int msb_set = data[size - 1] & 0x80;
 
     // Format string based on size
-    const char *hex_fmt = data_response_size == 1 ? "0x%02X" :
-                          data_response_size == 2 ? "0x%04X" : "0x%08X";
+    const char *hex_fmt = size == 1 ? "0x%02X" :
+                          size == 2 ? "0x%04X" : "0x%08X";
     printf(hex_fmt, val);
 
     if (msb_set) {
       // Show both signed and unsigned
       int32_t sval;
-      switch (data_response_size) {
+      switch (size) {
         case 1: sval = (int8_t)val; break;
         case 2: sval = (int16_t)val; break;
         default: sval = (int32_t)val; break;
@@ -126,13 +132,13 @@ static int data_read(void) {
     printf("\n");
   } else {
     // 5-15 bytes: hex + ASCII
-    for (size_t i = 0; i < data_response_size; i++) {
+    for (size_t i = 0; i < size; i++) {
       printf("%02x", data[i]);
-      if (i < data_response_size - 1)
+      if (i < size - 1)
         printf(" ");
     }
     printf(" \"");
-    for (size_t i = 0; i < data_response_size; i++) {
+    for (size_t i = 0; i < size; i++) {
       char c = data[i];
       if (c >= 32 && c < 127)
         putchar(c);
@@ -141,36 +147,303 @@ static int data_read(void) {
     }
     printf("\"\n");
   }
+}
+
+// A read which may be split over several DATA_READ commands
+struct read_op {
+  uint32_t  offset;
+  uint32_t  size;
+  uint8_t  *data;
+  bool      failed;
+  bool      label;
+};
+
+// A command which has been sent but not yet answered
+struct pending_cmd {
+  uint32_t        opcode;
+  struct read_op *read;   // DATA_READ only
+  uint32_t        start;  // Within read->data
+  uint32_t        size;
+};
+
+// Commands in the order sent, which is the order answered
+static struct pending_cmd pending[PIPELINE_DEPTH];
+static int pending_first;
+static int pending_count;
+static int pipeline_failed;
+
+static void finish_read(struct read_op *read) {
+  if (read->failed) {
+    if (read->label)
+      printf("%u: error\n", read->offset);
+    pipeline_failed = 1;
+  } else {
+    print_data(read->offset, read->data, read->size, read->label);
+  }
+
+  free(read->data);
+  free(read);
+}
+
+// Wait for the response to the oldest pending command
+static void pipeline_complete_one(void) {
+  struct pending_cmd *cmd = &pending[pending_first];
+  int ret = read_fcp_response();
+
+  pending_first = (pending_first + 1) % PIPELINE_DEPTH;
+  pending_count--;
+
+  if (cmd->opcode == FCP_OPCODE_DATA_READ) {
+    struct read_op *read = cmd->read;
+
+    if (ret != 0 || data_response_size != cmd->size)
+      read->failed = true;
+    else
+      memcpy(read->data + cmd->start, data_response, cmd->size);
+
+    if (cmd->start + cmd->size == read->size)
+      finish_read(read);
+  } else if (ret == 0) {
+    printf("OK\n");
+  } else {
+    pipeline_failed = 1;
+  }
 
   free(data_response);
   data_response = NULL;
   data_response_size = 0;
+}
+
+static void pipeline_drain(void) {
+  while (pending_count)
+    pipeline_complete_one();
+}
+
+static int pipeline_send(
+  uint32_t        opcode,
+  const void     *req,
+  size_t          req_size,
+  struct read_op *read,
+  uint32_t        start,
+  uint32_t        resp_size
+) {
+  if (pending_count == PIPELINE_DEPTH)
+    pipeline_complete_one();
+
+  int ret = send_fcp_cmd_request(opcode, req, req_size, resp_size);
+  if (ret != 0)
+    return ret;
+
+  pending[(pending_first + pending_count) % PIPELINE_DEPTH] =
+    (struct pending_cmd){
+      .opcode = opcode,
+      .read   = read,
+      .start  = start,
+      .size   = resp_size
+    };
+  pending_count++;
 
   return 0;
 }
 
-static int data_write(void) {
-  if (cmd_argc != 3) {
-    fprintf(stderr, "data write: requires <offset> <length> <value>\n");
-    data_usage();
+// Send the DATA_READ commands for a read of any size
+static int pipeline_read(uint32_t offset, uint32_t size, bool label) {
+  struct read_op *read = calloc(1, sizeof(*read));
+  if (!read || !(read->data = malloc(size))) {
+    fprintf(stderr, "Failed to allocate read buffer\n");
+    free(read);
+    return -1;
   }
 
-  uint32_t offset = parse_number(cmd_argv[0]);
-  int length = parse_number(cmd_argv[1]);
-  const char *val_str = cmd_argv[2];
+  read->offset = offset;
+  read->size = size;
+  read->label = label;
+
+  for (uint32_t start = 0; start < size; start += DATA_READ_MAX) {
+    uint32_t chunk = size - start < DATA_READ_MAX
+                       ? size - start : DATA_READ_MAX;
+    struct {
+      uint32_t offset;
+      uint32_t size;
+    } __attribute__((packed)) req = {
+      .offset = htole32(offset + start),
+      .size = htole32(chunk)
+    };
+
+    int ret = pipeline_send(
+      FCP_OPCODE_DATA_READ, &req, sizeof(req), read, start, chunk
+    );
+
+    // The read can't be completed; it's dropped once the chunks
+    // already sent are answered
+    if (ret != 0) {
+      if (start == 0) {
+        free(read->data);
+        free(read);
+        return ret;
+      }
+      read->size = start;
+      read->failed = true;
+      pipeline_drain();
+      return ret;
+    }
+  }
 
-  if (length < 1 || length > 4) {
-    fprintf(stderr, "data write: length must be 1, 2, or 4\n");
+  return 0;
+}
+
+// Read several ranges with one FCP_CMD_BATCH request
+static int data_read_batch(void) {
+  if (cmd_argc % 2) {
+    fprintf(stderr, "data read: requires <offset> <size> pairs\n");
+    data_usage();
+  }
+
+  uint32_t count = cmd_argc / 2;
+  if (count > FCP_CMD_BATCH_MAX) {
+    fprintf(stderr, "data read: at most %d ranges\n", FCP_CMD_BATCH_MAX);
     return -1;
   }
 
-  size_t req_size = sizeof(uint32_t) * 2 + length;
-  uint8_t *req = malloc(req_size);
-  if (!req) {
+  struct read_req {
+    struct fcp_cmd_batch_request cmd;
+    uint32_t                     offset;
+    uint32_t                     size;
+  } __attribute__((packed));
+
+  size_t payload_size =
+    sizeof(struct fcp_cmd_batch_header) + count * sizeof(struct read_req);
+  uint8_t *payload = malloc(payload_size);
+  if (!payload) {
     fprintf(stderr, "Failed to allocate request buffer\n");
     return -1;
   }
 
+  ((struct fcp_cmd_batch_header *)payload)->count = count;
+  struct read_req *reqs =
+    (struct read_req *)(payload + sizeof(struct fcp_cmd_batch_header));
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t offset = parse_number(cmd_argv[i * 2]);
+    uint32_t size = parse_number(cmd_argv[i * 2 + 1]);
+
+    if (size < 1 || size > DATA_READ_MAX) {
+      fprintf(stderr, "data read: size must be 1-%d\n", DATA_READ_MAX);
+      free(payload);
+      return -1;
+    }
+
+    reqs[i].cmd.opcode = FCP_OPCODE_DATA_READ;
+    reqs[i].cmd.req_size = sizeof(uint32_t) * 2;
+    reqs[i].cmd.resp_size = size;
+    reqs[i].offset = htole32(offset);
+    reqs[i].size = htole32(size);
+  }
+
+  int ret = send_fcp_cmd_batch(payload, payload_size);
+  if (ret != 0) {
+    free(payload);
+    return ret;
+  }
+
+  // Walk the results, checking each against its request
+  const uint8_t *p = data_response;
+  const uint8_t *end = p + data_response_size;
+
+  if (data_response_size < sizeof(struct fcp_cmd_batch_header) ||
+      ((const struct fcp_cmd_batch_header *)p)->count != count) {
+    fprintf(stderr, "Invalid batch response\n");
+    ret = -1;
+    goto done;
+  }
+  p += sizeof(struct fcp_cmd_batch_header);
+
+  for (uint32_t i = 0; i < count; i++) {
+    const struct fcp_cmd_batch_result *result = (const void *)p;
+    uint32_t offset = le32toh(reqs[i].offset);
+
+    if (end - p < (ssize_t)sizeof(*result) ||
+        end - p - sizeof(*result) < result->resp_size) {
+      fprintf(stderr, "Truncated batch response\n");
+      ret = -1;
+      goto done;
+    }
+
+    if (result->error) {
+      printf("%u: error %d\n", offset, result->error);
+      ret = -1;
+    } else {
+      print_data(offset, result->resp_data, result->resp_size, true);
+    }
+
+    p += sizeof(*result) + result->resp_size;
+  }
+
+done:
+  free(payload);
+  free(data_response);
+  data_response = NULL;
+  data_response_size = 0;
+
+  return ret;
+}
+
+static int data_read(void) {
+  if (cmd_argc < 2) {
+    fprintf(stderr, "data read: requires <offset> <size>\n");
+    data_usage();
+  }
+
+  if (cmd_argc % 2) {
+    fprintf(stderr, "data read: requires <offset> <size> pairs\n");
+    data_usage();
+  }
+
+  // Short ranges go in one FCP_CMD_BATCH; longer ones are split
+  // into pipelined commands
+  bool split = false;
+  for (int i = 1; i < cmd_argc; i += 2) {
+    long size = parse_number(cmd_argv[i]);
+
+    if (size < 1 || size > UINT32_MAX) {
+      fprintf(stderr, "data read: invalid size %ld\n", size);
+      return -1;
+    }
+    if (size > DATA_READ_MAX)
+      split = true;
+  }
+
+  if (cmd_argc > 2 && !split)
+    return data_read_batch();
+
+  for (int i = 0; i < cmd_argc; i += 2) {
+    int ret = pipeline_read(
+      parse_number(cmd_argv[i]),
+      parse_number(cmd_argv[i + 1]),
+      cmd_argc > 2
+    );
+    if (ret != 0)
+      return ret;
+  }
+
+  pipeline_drain();
+  return pipeline_failed ? -1 : 0;
+}
+
+/* Make the DATA_WRITE request from <offset> <length> <value>;
+ * req must have space for 12 bytes
+ */
+static int make_write_req(char **argv, uint8_t *req, size_t *req_size) {
+  uint32_t offset = parse_number(argv[0]);
+  int length = parse_number(argv[1]);
+  const char *val_str = argv[2];
+
+  if (length < 1 || length > 4) {
+    fprintf(stderr, "data write: length must be 1, 2, or 4\n");
+    return -1;
+  }
+
+  *req_size = sizeof(uint32_t) * 2 + length;
   *(uint32_t *)req = htole32(offset);
   *(uint32_t *)(req + 4) = htole32(length);
 
@@ -182,14 +455,12 @@ static int data_write(void) {
       fprintf(stderr,
         "data write: hex value must have exactly %d hex digits for length %d\n",
         length * 2, length);
-      free(req);
       return -1;
     }
     for (int i = 0; i < length; i++) {
       unsigned int byte;
       if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
         fprintf(stderr, "data write: invalid hex digit\n");
-        free(req);
         return -1;
       }
       req[8 + i] = byte;
@@ -201,8 +472,22 @@ static int data_write(void) {
       req[8 + i] = (val >> (i * 8)) & 0xff;
   }
 
+  return 0;
+}
+
+static int data_write(void) {
+  if (cmd_argc != 3) {
+    fprintf(stderr, "data write: requires <offset> <length> <value>\n");
+    data_usage();
+  }
+
+  uint8_t req[12];
+  size_t req_size;
+
+  if (make_write_req(cmd_argv, req, &req_size) < 0)
+    return -1;
+
   int ret = send_fcp_cmd(FCP_OPCODE_DATA_WRITE, req, req_size, 0);
-  free(req);
 
   if (ret == 0)
     printf("OK\n");
@@ -231,6 +516,106 @@ static int data_notify(void) {
   return ret;
 }
 
+/* Run the commands in a file (or typed in), one per line; the
+ * commands are pipelined, other than when typed in where each waits
+ * for its result
+ */
+static int data_batch(void) {
+  if (cmd_argc > 1) {
+    fprintf(stderr, "data batch: too many arguments\n");
+    data_usage();
+  }
+
+  FILE *f = stdin;
+
+  if (cmd_argc && strcmp(cmd_argv[0], "-")) {
+    f = fopen(cmd_argv[0], "r");
+    if (!f) {
+      perror(cmd_argv[0]);
+      return -1;
+    }
+  }
+
+  bool interactive = isatty(fileno(f));
+  char line[1024];
+  int line_num = 0;
+  int ret = 0;
+
+  while (1) {
+    if (interactive) {
+      printf("data> ");
+      fflush(stdout);
+    }
+    if (!fgets(line, sizeof(line), f))
+      break;
+    line_num++;
+
+    // Split into words, ignoring comments
+    char *argv[16];
+    int argc = 0;
+    char *comment = strchr(line, '#');
+
+    if (comment)
+      *comment = '\0';
+    for (char *word = strtok(line, " \t\r\n");
+         word && argc < 16;
+         word = strtok(NULL, " \t\r\n"))
+      argv[argc++] = word;
+
+    if (!argc)
+      continue;
+
+    const char *name = argv[0];
+    int err = 0;
+
+    if (!strcmp(name, "quit") || !strcmp(name, "exit")) {
+      break;
+    } else if (!strcmp(name, "read") && argc >= 3 && argc % 2) {
+      for (int i = 1; i < argc && !err; i += 2) {
+        long size = parse_number(argv[i + 1]);
+
+        if (size < 1 || size > UINT32_MAX) {
+          fprintf(stderr, "line %d: invalid size %ld\n", line_num, size);
+          err = -1;
+        } else {
+          err = pipeline_read(parse_number(argv[i]), size, true);
+        }
+      }
+    } else if (!strcmp(name, "write") && argc == 4) {
+      uint8_t req[12];
+      size_t req_size;
+
+      err = make_write_req(argv + 1, req, &req_size);
+      if (!err)
+        err = pipeline_send(
+          FCP_OPCODE_DATA_WRITE, req, req_size, NULL, 0, 0
+        );
+    } else if (!strcmp(name, "notify") && argc == 2) {
+      uint32_t event = htole32(parse_number(argv[1]));
+
+      err = pipeline_send(
+        FCP_OPCODE_DATA_NOTIFY, &event, sizeof(event), NULL, 0, 0
+      );
+    } else {
+      fprintf(stderr, "line %d: invalid command: %s\n", line_num, name);
+      err = -1;
+    }
+
+    if (err)
+      ret = -1;
+
+    if (interactive)
+      pipeline_drain();
+  }
+
+  pipeline_drain();
+
+  if (f != stdin)
+    fclose(f);
+
+  return ret || pipeline_failed ? -1 : 0;
+}
+
 int data_cmd(void) {
   if (cmd_argc < 1)
     data_usage();
@@ -245,6 +630,8 @@ int data_cmd(void) {
     return data_write();
   if (!strcmp(subcmd, "notify"))
     return data_notify();
+  if (!strcmp(subcmd, "batch"))
+    return data_batch();
 
   fprintf(stderr, "Unknown data subcommand: %s\n", subcmd);
   data_usage();
@@ -23,6 +23,21 @@ int send_fcp_cmd(
   size_t resp_size
 );
 
+// Send an FCP command without waiting for the response, and read
+// the next response (implemented in main.c); the server answers
+// the requests on a connection in order
+int send_fcp_cmd_request(
+  uint32_t    opcode,
+  const void *req_data,
+  size_t      req_size,
+  size_t      resp_size
+);
+int read_fcp_response(void);
+
+// Send an FCP_CMD_BATCH request (implemented in main.c); the
+// payload is a struct fcp_cmd_batch_header followed by the entries
+int send_fcp_cmd_batch(const void *payload, size_t payload_size);
+
 // Response storage (in main.c)
 extern void *data_response;
 extern size_t data_response_size;
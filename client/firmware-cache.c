@@ -0,0 +1,335 @@
+// SPDX-FileCopyrightText: 2024-2025 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "firmware-cache.h"
+
+#define CACHE_MAGIC "fcp-tool firmware index 1"
+
+// Read headers with threads when at least this many files are new
+#define SCAN_THREAD_MIN 16
+#define SCAN_THREAD_MAX 8
+
+struct scan_entry {
+  char                      *name;
+  char                      *path;
+  long long                  size;
+  long long                  mtime_sec;
+  long                       mtime_nsec;
+  struct firmware_container *firmware;
+  bool                       cached;    // firmware came from the cache
+};
+
+struct scan {
+  struct scan_entry *entries;
+  int                count;
+  int                next;      // Next entry to read, shared by threads
+};
+
+static int scan_entry_cmp(const void *p1, const void *p2) {
+  const struct scan_entry *e1 = p1;
+  const struct scan_entry *e2 = p2;
+
+  return strcmp(e1->name, e2->name);
+}
+
+static char *get_cache_path(void) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char *path;
+
+  if (cache_home && *cache_home) {
+    if (asprintf(&path, "%s/fcp-tool/firmware-index", cache_home) < 0)
+      return NULL;
+  } else if (home && *home) {
+    if (asprintf(&path, "%s/.cache/fcp-tool/firmware-index", home) < 0)
+      return NULL;
+  } else {
+    return NULL;
+  }
+
+  return path;
+}
+
+/* Make the directories leading to path */
+static void make_parent_dirs(char *path) {
+  for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+}
+
+/* Load the cache of dirname's headers into entries, sorted by name;
+ * returns the number loaded
+ */
+static int load_cache(
+  const char         *cache_path,
+  const char         *dirname,
+  struct scan_entry **entries
+) {
+  FILE *file = fopen(cache_path, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+  int count = 0, alloc = 0;
+
+  *entries = NULL;
+  if (!file)
+    return 0;
+
+  // Check the format and that the cache is for this directory
+  if (getline(&line, &line_size, file) < 0 ||
+      strcmp(line, CACHE_MAGIC "\n") ||
+      getline(&line, &line_size, file) < 0 ||
+      strncmp(line, "dir ", 4) ||
+      strncmp(line + 4, dirname, strlen(dirname)) ||
+      strcmp(line + 4 + strlen(dirname), "\n"))
+    goto done;
+
+  while (getline(&line, &line_size, file) > 0) {
+    struct scan_entry entry = { 0 };
+    unsigned int vid, pid, version[4];
+    int name_start;
+
+    line[strcspn(line, "\n")] = '\0';
+
+    if (sscanf(
+          line, "%lld %lld %ld %x %x %u %u %u %u %n",
+          &entry.size, &entry.mtime_sec, &entry.mtime_nsec, &vid, &pid,
+          &version[0], &version[1], &version[2], &version[3], &name_start
+        ) != 9 || !line[name_start])
+      continue;
+
+    entry.name = strdup(line + name_start);
+    entry.firmware = calloc(1, sizeof(struct firmware_container));
+    if (!entry.name || !entry.firmware) {
+      perror("Failed to allocate memory for firmware index");
+      exit(EXIT_FAILURE);
+    }
+    entry.firmware->usb_vid = vid;
+    entry.firmware->usb_pid = pid;
+    for (int i = 0; i < 4; i++)
+      entry.firmware->firmware_version[i] = version[i];
+
+    if (count == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      *entries = realloc(*entries, alloc * sizeof(**entries));
+      if (!*entries) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    (*entries)[count++] = entry;
+  }
+
+  qsort(*entries, count, sizeof(**entries), scan_entry_cmp);
+
+done:
+  free(line);
+  fclose(file);
+  return count;
+}
+
+/* Replace the cache with the headers read by this scan; written to
+ * a temporary file first so that a concurrent scan never sees half
+ * of it
+ */
+static void save_cache(
+  const char        *cache_path,
+  const char        *dirname,
+  const struct scan *scan
+) {
+  char *tmp_path;
+
+  if (asprintf(&tmp_path, "%s.%d", cache_path, getpid()) < 0)
+    return;
+
+  make_parent_dirs(tmp_path);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (!file) {
+    free(tmp_path);
+    return;
+  }
+
+  fprintf(file, CACHE_MAGIC "\ndir %s\n", dirname);
+
+  for (int i = 0; i < scan->count; i++) {
+    const struct scan_entry *entry = &scan->entries[i];
+    const struct firmware_container *firmware = entry->firmware;
+
+    // Files which couldn't be read are tried again next time
+    if (!firmware)
+      continue;
+
+    fprintf(
+      file, "%lld %lld %ld %x %x %u %u %u %u %s\n",
+      entry->size, entry->mtime_sec, entry->mtime_nsec,
+      firmware->usb_vid, firmware->usb_pid,
+      firmware->firmware_version[0], firmware->firmware_version[1],
+      firmware->firmware_version[2], firmware->firmware_version[3],
+      entry->name
+    );
+  }
+
+  if (fclose(file) || rename(tmp_path, cache_path))
+    unlink(tmp_path);
+
+  free(tmp_path);
+}
+
+static void *read_headers(void *arg) {
+  struct scan *scan = arg;
+
+  while (1) {
+    int i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+    if (i >= scan->count)
+      break;
+
+    struct scan_entry *entry = &scan->entries[i];
+    if (!entry->cached)
+      entry->firmware = read_firmware_header(entry->path);
+  }
+
+  return NULL;
+}
+
+/* Read the headers of the entries not found in the cache */
+static void read_new_headers(struct scan *scan, int new_count) {
+  int thread_count = 0;
+  pthread_t threads[SCAN_THREAD_MAX];
+
+  if (new_count >= SCAN_THREAD_MIN) {
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > SCAN_THREAD_MAX)
+      thread_count = SCAN_THREAD_MAX;
+    if (thread_count > new_count / (SCAN_THREAD_MIN / 2))
+      thread_count = new_count / (SCAN_THREAD_MIN / 2);
+  }
+
+  int started = 0;
+  for (; started < thread_count - 1; started++)
+    if (pthread_create(&threads[started], NULL, read_headers, scan))
+      break;
+
+  // Any left over are read here
+  read_headers(scan);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+int firmware_scan_dir(const char *dirname, firmware_found_func found) {
+  DIR *dir = opendir(dirname);
+  if (!dir)
+    return -errno;
+
+  struct scan scan = { 0 };
+  int alloc = 0;
+  struct dirent *dirent;
+
+  while ((dirent = readdir(dir)) != NULL) {
+
+    // Check if the file is a .bin file
+    if (!strstr(dirent->d_name, ".bin"))
+      continue;
+
+    struct stat st;
+    if (fstatat(dirfd(dir), dirent->d_name, &st, 0) < 0 ||
+        !S_ISREG(st.st_mode))
+      continue;
+
+    if (scan.count == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      scan.entries = realloc(scan.entries, alloc * sizeof(*scan.entries));
+      if (!scan.entries) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    struct scan_entry *entry = &scan.entries[scan.count++];
+
+    memset(entry, 0, sizeof(*entry));
+    entry->name = strdup(dirent->d_name);
+    if (!entry->name ||
+        asprintf(&entry->path, "%s/%s", dirname, dirent->d_name) < 0) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    entry->size = st.st_size;
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+
+  closedir(dir);
+
+  qsort(scan.entries, scan.count, sizeof(*scan.entries), scan_entry_cmp);
+
+  // Take the headers of the unchanged files from the cache
+  char *cache_path = get_cache_path();
+  struct scan_entry *cache = NULL;
+  int cache_count = cache_path ? load_cache(cache_path, dirname, &cache) : 0;
+  int new_count = 0;
+
+  for (int i = 0; i < scan.count; i++) {
+    struct scan_entry *entry = &scan.entries[i];
+    struct scan_entry *cached = bsearch(
+      entry, cache, cache_count, sizeof(*cache), scan_entry_cmp
+    );
+
+    if (cached && cached->firmware &&
+        cached->size == entry->size &&
+        cached->mtime_sec == entry->mtime_sec &&
+        cached->mtime_nsec == entry->mtime_nsec) {
+      entry->firmware = cached->firmware;
+      entry->cached = true;
+      cached->firmware = NULL;
+    } else {
+      new_count++;
+    }
+  }
+
+  // Rewrite the cache if any files were added, changed, or removed
+  bool changed = new_count || cache_count != scan.count - new_count;
+
+  if (new_count)
+    read_new_headers(&scan, new_count);
+
+  if (changed && cache_path)
+    save_cache(cache_path, dirname, &scan);
+
+  for (int i = 0; i < cache_count; i++) {
+    free(cache[i].name);
+    free_firmware_container(cache[i].firmware);
+  }
+  free(cache);
+  free(cache_path);
+
+  for (int i = 0; i < scan.count; i++) {
+    struct scan_entry *entry = &scan.entries[i];
+
+    if (entry->firmware) {
+      found(entry->path, entry->firmware);
+    } else {
+      fprintf(stderr, "Failed to read firmware file: %s\n", entry->path);
+      free(entry->path);
+    }
+    free(entry->name);
+  }
+  free(scan.entries);
+
+  return 0;
+}
@@ -0,0 +1,26 @@
+// SPDX-FileCopyrightText: 2024-2025 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "firmware.h"
+
+/* Called for each firmware file found, in filename order; fn is the
+ * full path and is owned by the callee, as is firmware
+ */
+typedef void (*firmware_found_func)(
+  char                      *fn,
+  struct firmware_container *firmware
+);
+
+/* Read the container headers of the .bin files in dirname
+ *
+ * The headers are cached in $XDG_CACHE_HOME/fcp-tool/firmware-index
+ * (or ~/.cache/...) keyed by filename, size, and mtime, so only new
+ * and changed files are read; those are read by several threads if
+ * there are many. Firmware from the cache has no sections; use
+ * read_firmware_file() to get them.
+ *
+ * Returns 0, or -errno if the directory can't be opened.
+ */
+int firmware_scan_dir(const char *dirname, firmware_found_func found);
@@ -5,6 +5,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <openssl/sha.h>
 #include <openssl/evp.h>
@@ -16,45 +22,6 @@ const char *firmware_type_magic[] = {
   [FIRMWARE_LEAPFROG]  = "SCARLEAP"
 };
 
-static int verify_sha256(
-  const unsigned char *data,
-  size_t length,
-  const unsigned char *expected_hash
-) {
-  unsigned char computed_hash[SHA256_DIGEST_LENGTH];
-  SHA256(data, length, computed_hash);
-  return memcmp(computed_hash, expected_hash, SHA256_DIGEST_LENGTH) == 0;
-}
-
-// calculate MD5
-static void md5(
-  const unsigned char *data,
-  size_t               length,
-  unsigned char       *md5
-) {
-  EVP_MD_CTX   *mdctx;
-  const EVP_MD *md;
-  unsigned int  md_len;
-
-  mdctx = EVP_MD_CTX_new();
-  if (mdctx == NULL) {
-    fprintf(stderr, "Failed to create MD5 context\n");
-    exit(1);
-  }
-  md = EVP_md5();
-  if (md == NULL) {
-    fprintf(stderr, "Failed to get MD5 digest\n");
-    EVP_MD_CTX_free(mdctx);
-    exit(1);
-  }
-
-  EVP_DigestInit_ex(mdctx, md, NULL);
-  EVP_DigestUpdate(mdctx, data, length);
-  EVP_DigestFinal_ex(mdctx, md5, &md_len);
-
-  EVP_MD_CTX_free(mdctx);
-}
-
 // Convert magic string to enum
 static int firmware_type_from_magic(const char *magic) {
   for (int i = 0; i < FIRMWARE_TYPE_COUNT; i++)
@@ -63,17 +30,6 @@ static int firmware_type_from_magic(const char *magic) {
   return -1;
 }
 
-int read_magic(FILE *file, const char *fn) {
-  char magic[8];
-  if (fread(magic, sizeof(magic), 1, file) != 1) {
-    perror("Failed to read magic");
-    fprintf(stderr, "Error reading magic from %s\n", fn);
-    return -1;
-  }
-
-  return firmware_type_from_magic(magic);
-}
-
 // Convert from disk format to memory format
 static struct firmware *firmware_header_disk_to_mem(
   int type,
@@ -117,270 +73,355 @@ static struct firmware_container *firmware_container_header_disk_to_mem(
   return container;
 }
 
-static struct firmware *read_header(
-  FILE       *file,
-  const char *fn,
-  int         type
-) {
-  struct firmware_header_disk disk_header;
-  size_t read_count = fread(
-    &disk_header, sizeof(struct firmware_header_disk), 1, file
-  );
-
-  if (read_count != 1) {
-    fprintf(stderr, "Error reading firmware header\n");
-    goto error;
+/* Map the first size bytes of a file, or fewer if it's shorter;
+ * returns the number of bytes mapped, or -1
+ */
+static ssize_t map_file_start(const char *fn, size_t size, void **map) {
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
+    fprintf(stderr, "Unable to open %s\n", fn);
+    return -1;
   }
 
-  struct firmware *firmware = firmware_header_disk_to_mem(type, &disk_header);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    fprintf(stderr, "Unable to stat %s\n", fn);
+    close(fd);
+    return -1;
+  }
 
-  if (!firmware) {
-    fprintf(stderr, "Invalid firmware header\n");
-    goto error;
+  if (st.st_size < size)
+    size = st.st_size;
+  if (!size) {
+    close(fd);
+    *map = NULL;
+    return 0;
   }
 
-  return firmware;
+  *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*map == MAP_FAILED) {
+    perror("mmap");
+    fprintf(stderr, "Unable to map %s\n", fn);
+    return -1;
+  }
 
-error:
-  free(firmware);
-  return NULL;
+  return size;
 }
 
-static struct firmware *read_header_and_data(
-  FILE       *file,
-  const char *fn,
-  int         type
+/* The headers are read from a mapping of the start of the file
+ * rather than through stdio, as every file in the firmware directory
+ * is read when looking for updates
+ */
+struct firmware_container *read_firmware_header(
+  const char *fn
 ) {
-  struct firmware *firmware = read_header(file, fn, type);
-  if (!firmware) {
-    fprintf(stderr, "Error reading firmware header from %s\n", fn);
-    goto error;
+  const size_t magic_size = 8;
+  size_t max_size = magic_size + (
+    sizeof(struct firmware_header_disk) >
+      sizeof(struct firmware_container_header_disk)
+    ? sizeof(struct firmware_header_disk)
+    : sizeof(struct firmware_container_header_disk)
+  );
+  void *map;
+
+  ssize_t size = map_file_start(fn, max_size, &map);
+  if (size < 0)
+    return NULL;
+
+  const uint8_t *data = map;
+  struct firmware_container *container = NULL;
+
+  if (size < magic_size) {
+    fprintf(stderr, "Error reading magic from %s\n", fn);
+    goto done;
   }
 
-  // Read firmware data
-  firmware->firmware_data = malloc(firmware->firmware_length);
-  if (!firmware->firmware_data) {
-    perror("Failed to allocate memory for firmware data");
-    goto error;
+  int type = firmware_type_from_magic((const char *)data);
+
+  if (type == FIRMWARE_CONTAINER) {
+    if (size < magic_size + sizeof(struct firmware_container_header_disk)) {
+      fprintf(stderr, "Error reading container header from %s\n", fn);
+      goto done;
+    }
+
+    container = firmware_container_header_disk_to_mem(
+      (const struct firmware_container_header_disk *)(data + magic_size)
+    );
+    goto done;
   }
-  size_t read_count = fread(
-    firmware->firmware_data, 1, firmware->firmware_length, file
-  );
-  if (read_count != firmware->firmware_length) {
-    if (feof(file))
-      fprintf(stderr, "Unexpected end of file\n");
-    else
-      perror("Failed to read firmware data");
-    fprintf(stderr, "Error reading firmware data from %s\n", fn);
-    goto error;
+
+  if (size < magic_size + sizeof(struct firmware_header_disk)) {
+    fprintf(stderr, "Error reading firmware header from %s\n", fn);
+    goto done;
   }
 
-  // Verify the firmware data
-  if (!verify_sha256(
-    firmware->firmware_data,
-    firmware->firmware_length,
-    firmware->sha256
-  )) {
-    fprintf(stderr, "Corrupt firmware (failed checksum) in %s\n", fn);
-    goto error;
+  struct firmware *firmware = firmware_header_disk_to_mem(
+    type, (const struct firmware_header_disk *)(data + magic_size)
+  );
+  if (!firmware) {
+    fprintf(stderr, "Error reading firmware header from %s\n", fn);
+    goto done;
   }
 
-  // add the MD5 for ESP firmware
-  if (firmware->type == FIRMWARE_ESP) {
-    md5(
-      firmware->firmware_data,
-      firmware->firmware_length,
-      firmware->md5
-    );
+  container = calloc(1, sizeof(struct firmware_container));
+  if (!container) {
+    perror("Failed to allocate memory for firmware container");
+    free(firmware);
+    goto done;
   }
 
-  return firmware;
+  container->num_sections = 1;
+  container->sections = calloc(1, sizeof(struct firmware *));
+  container->sections[0] = firmware;
 
-error:
-  free(firmware->firmware_data);
-  free(firmware);
-  return NULL;
+done:
+  if (size)
+    munmap(map, size);
+
+  return container;
 }
 
-struct firmware *read_magic_and_header_and_data(
-  FILE       *file,
-  const char *fn,
-  int         section
-) {
-  int type = read_magic(file, fn);
-
-  if (type < 0 || type == FIRMWARE_CONTAINER) {
-    fprintf(
-      stderr,
-      "Invalid firmware type %d in section %d of %s\n",
-      type,
-      section + 1,
-      fn
-    );
-    return NULL;
-  }
+/* Compute the SHA-256, and for ESP firmware the MD5, in one pass
+ * over the data, and check the SHA-256 against the header
+ */
+static void *hash_firmware(void *arg) {
+  struct firmware *firmware = arg;
+  const size_t chunk_size = 64 * 1024;
 
-  return read_header_and_data(file, fn, type);
-}
+  EVP_MD_CTX *sha256 = EVP_MD_CTX_new();
+  EVP_MD_CTX *md5 = firmware->type == FIRMWARE_ESP ? EVP_MD_CTX_new() : NULL;
 
-struct firmware_container *read_firmware_container_header(
-  FILE       *file,
-  const char *fn
-) {
-  struct firmware_container_header_disk disk_header;
-
-  // Read header
-  if (fread(
-    &disk_header,
-    sizeof(struct firmware_container_header_disk),
-    1,
-    file
-  ) != 1) {
-    perror("Failed to read container header");
-    fprintf(stderr, "Error reading container header from %s\n", fn);
-    return NULL;
+  if (!sha256 || (firmware->type == FIRMWARE_ESP && !md5) ||
+      !EVP_DigestInit_ex(sha256, EVP_sha256(), NULL) ||
+      (md5 && !EVP_DigestInit_ex(md5, EVP_md5(), NULL))) {
+    fprintf(stderr, "Failed to create firmware digest contexts\n");
+    exit(1);
   }
 
-  return firmware_container_header_disk_to_mem(&disk_header);
-}
+  // Both digests are updated from each chunk while it is in cache
+  for (size_t offset = 0; offset < firmware->firmware_length;
+       offset += chunk_size) {
+    size_t size = firmware->firmware_length - offset;
+    if (size > chunk_size)
+      size = chunk_size;
 
-struct firmware_container *read_firmware_container(
-  FILE       *file,
-  const char *fn
-) {
-  struct firmware_container *container = read_firmware_container_header(file, fn);
-  if (!container) {
-    fprintf(stderr, "Error reading container header from %s\n", fn);
-    return NULL;
+    EVP_DigestUpdate(sha256, firmware->firmware_data + offset, size);
+    if (md5)
+      EVP_DigestUpdate(md5, firmware->firmware_data + offset, size);
   }
 
-  if (container->num_sections < 1 || container->num_sections > 3) {
-    fprintf(
-      stderr,
-      "Invalid number of sections in %s: %d\n",
-      fn,
-      container->num_sections
-    );
-    goto error;
-  }
+  unsigned char computed_hash[SHA256_DIGEST_LENGTH];
+  unsigned int md_len;
 
-  // Allocate memory for sections
-  container->sections = calloc(
-    container->num_sections, sizeof(struct firmware *)
-  );
-  if (!container->sections) {
-    perror("Failed to allocate memory for firmware sections");
-    goto error;
-  }
+  EVP_DigestFinal_ex(sha256, computed_hash, &md_len);
+  if (md5)
+    EVP_DigestFinal_ex(md5, firmware->md5, &md_len);
 
-  // Read sections
-  for (int i = 0; i < container->num_sections; i++) {
-    container->sections[i] = read_magic_and_header_and_data(file, fn, i);
-    if (!container->sections[i]) {
-      fprintf(stderr, "Error reading section %d from %s\n", i + 1, fn);
-      goto error;
-    }
-  }
+  EVP_MD_CTX_free(sha256);
+  EVP_MD_CTX_free(md5);
 
-  return container;
+  firmware->hash_result = memcmp(
+    computed_hash, firmware->sha256, SHA256_DIGEST_LENGTH
+  ) ? -1 : 0;
 
-error:
-  free_firmware_container(container);
   return NULL;
 }
 
-struct firmware_container *read_firmware_header(
-  const char *fn
-) {
-  FILE *file = fopen(fn, "rb");
-  if (!file) {
-    perror("fopen");
-    fprintf(stderr, "Unable to open %s\n", fn);
-    return NULL;
+int firmware_wait_hash(struct firmware *firmware, const char *fn) {
+  if (firmware->hash_running) {
+    pthread_join(firmware->hash_thread, NULL);
+    firmware->hash_running = false;
   }
 
-  int type = read_magic(file, fn);
+  if (firmware->hash_result < 0)
+    fprintf(stderr, "Corrupt firmware (failed checksum) in %s\n", fn);
 
-  struct firmware_container *container = NULL;
+  return firmware->hash_result;
+}
 
-  if (type == FIRMWARE_CONTAINER) {
-    container = read_firmware_container_header(file, fn);
-    fclose(file);
+/* Parse the section at offset in the mapped file; returns the
+ * offset of the next one, or 0 on error
+ */
+static size_t parse_section(
+  const uint8_t    *data,
+  size_t            size,
+  size_t            offset,
+  const char       *fn,
+  int               section,
+  bool              in_container,
+  struct firmware **firmware
+) {
+  const size_t magic_size = 8;
+  size_t header_end = offset + magic_size + sizeof(struct firmware_header_disk);
 
-    return container;
+  if (size < offset + magic_size) {
+    fprintf(stderr, "Error reading magic from %s\n", fn);
+    return 0;
   }
 
-  struct firmware *firmware = read_header(file, fn, type);
-  if (!firmware) {
+  int type = firmware_type_from_magic((const char *)data + offset);
+
+  if (type < 0 || (in_container && type == FIRMWARE_CONTAINER)) {
+    if (in_container)
+      fprintf(
+        stderr,
+        "Invalid firmware type %d in section %d of %s\n",
+        type,
+        section + 1,
+        fn
+      );
+    else
+      fprintf(stderr, "Invalid firmware type\n");
+    return 0;
+  }
+
+  if (size < header_end) {
     fprintf(stderr, "Error reading firmware header from %s\n", fn);
-    fclose(file);
-    return NULL;
+    return 0;
   }
 
-  container = calloc(1, sizeof(struct firmware_container));
-  if (!container) {
-    perror("Failed to allocate memory for firmware container");
-    fclose(file);
-    return NULL;
+  *firmware = firmware_header_disk_to_mem(
+    type,
+    (const struct firmware_header_disk *)(data + offset + magic_size)
+  );
+  if (!*firmware) {
+    fprintf(stderr, "Error reading firmware header from %s\n", fn);
+    return 0;
   }
 
-  container->num_sections = 1;
-  container->sections = calloc(1, sizeof(struct firmware *));
-  container->sections[0] = firmware;
+  if (size - header_end < (*firmware)->firmware_length) {
+    fprintf(stderr, "Unexpected end of file\n");
+    fprintf(stderr, "Error reading firmware data from %s\n", fn);
+    return 0;
+  }
 
-  fclose(file);
+  (*firmware)->firmware_data = (uint8_t *)data + header_end;
 
-  return container;
+  return header_end + (*firmware)->firmware_length;
 }
 
+/* The file is mapped and the sections point into the mapping; their
+ * hashes are computed by one thread each, so that the first section
+ * can be sent while the others are still being checked
+ */
 struct firmware_container *read_firmware_file(const char *fn) {
-
-  // Open file
-  FILE *file = fopen(fn, "rb");
-  if (!file) {
-    perror("fopen");
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
     fprintf(stderr, "Unable to open %s\n", fn);
     return NULL;
   }
 
-  // Read magic string
-  int type = read_magic(file, fn);
-
-  if (type < 0) {
-    fprintf(stderr, "Invalid firmware type\n");
-    fclose(file);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !st.st_size) {
+    fprintf(stderr, "Error reading magic from %s\n", fn);
+    close(fd);
     return NULL;
   }
 
-  // Container?
-  if (type == FIRMWARE_CONTAINER)
-    return read_firmware_container(file, fn);
-
-  // Not a container; read the firmware header and data
-  struct firmware *firmware = read_header_and_data(file, fn, type);
-  if (!firmware) {
-    fprintf(stderr, "Error reading firmware from %s\n", fn);
-    fclose(file);
+  size_t size = st.st_size;
+  uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    fprintf(stderr, "Unable to map %s\n", fn);
     return NULL;
   }
 
-  fclose(file);
+  // Read ahead the whole file for the hashing threads
+  madvise(data, size, MADV_WILLNEED);
 
-  // Put the firmware header and data into a container
   struct firmware_container *container = calloc(
     1, sizeof(struct firmware_container)
   );
   if (!container) {
     perror("Failed to allocate memory for firmware container");
+    munmap(data, size);
     return NULL;
   }
-  container->num_sections = 1;
+  container->map = data;
+  container->map_size = size;
+
+  const size_t magic_size = 8;
+  size_t offset = 0;
+  bool is_container = size >= magic_size &&
+    firmware_type_from_magic((const char *)data) == FIRMWARE_CONTAINER;
+
+  if (is_container) {
+    if (size < magic_size + sizeof(struct firmware_container_header_disk)) {
+      fprintf(stderr, "Error reading container header from %s\n", fn);
+      goto error;
+    }
+
+    struct firmware_container *header = firmware_container_header_disk_to_mem(
+      (const struct firmware_container_header_disk *)(data + magic_size)
+    );
+    if (!header)
+      goto error;
+
+    container->usb_vid = header->usb_vid;
+    container->usb_pid = header->usb_pid;
+    memcpy(container->firmware_version, header->firmware_version,
+           sizeof(container->firmware_version));
+    container->num_sections = header->num_sections;
+    free(header);
+
+    if (container->num_sections < 1 || container->num_sections > 3) {
+      fprintf(
+        stderr,
+        "Invalid number of sections in %s: %d\n",
+        fn,
+        container->num_sections
+      );
+      goto error;
+    }
+
+    offset = magic_size + sizeof(struct firmware_container_header_disk);
+
+  // Not a container; the file is one section
+  } else {
+    container->num_sections = 1;
+  }
+
   container->sections = calloc(
-    1, sizeof(struct firmware *)
+    container->num_sections, sizeof(struct firmware *)
   );
-  container->sections[0] = firmware;
+  if (!container->sections) {
+    perror("Failed to allocate memory for firmware sections");
+    goto error;
+  }
+
+  for (int i = 0; i < container->num_sections; i++) {
+    offset = parse_section(
+      data, size, offset, fn, i, is_container,
+      &container->sections[i]
+    );
+    if (!offset) {
+      if (container->num_sections > 1)
+        fprintf(stderr, "Error reading section %d from %s\n", i + 1, fn);
+      else
+        fprintf(stderr, "Error reading firmware from %s\n", fn);
+      goto error;
+    }
+  }
+
+  for (int i = 0; i < container->num_sections; i++) {
+    struct firmware *firmware = container->sections[i];
+
+    if (pthread_create(&firmware->hash_thread, NULL, hash_firmware, firmware))
+      hash_firmware(firmware);
+    else
+      firmware->hash_running = true;
+  }
 
   return container;
+
+error:
+  free_firmware_container(container);
+  return NULL;
 }
 
 void free_firmware_container(
@@ -395,13 +436,17 @@ void free_firmware_container(
       if (!firmware)
         continue;
 
-      free(firmware->firmware_data);
+      if (firmware->hash_running)
+        pthread_join(firmware->hash_thread, NULL);
       free(firmware);
     }
 
     free(container->sections);
   }
 
+  if (container->map)
+    munmap(container->map, container->map_size);
+
   free(container);
 }
 
@@ -4,6 +4,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 enum firmware_type {
   FIRMWARE_CONTAINER,
@@ -42,8 +45,13 @@ struct firmware {
   uint32_t  firmware_version[4];
   uint32_t  firmware_length;
   uint8_t   sha256[32];
-  uint8_t   md5[16];
-  uint8_t  *firmware_data;
+  uint8_t   md5[16];        // ESP only; set once hashed
+  uint8_t  *firmware_data;  // In the container's mapping of the file
+
+  // Hashing started by read_firmware_file()
+  pthread_t hash_thread;
+  bool      hash_running;
+  int       hash_result;    // 0 if the SHA-256 matched, once hashed
 };
 
 /* In-memory representation of the firmware container */
@@ -53,14 +61,23 @@ struct firmware_container {
   uint32_t          firmware_version[4];
   uint32_t          num_sections;
   struct firmware **sections;
+  void             *map;  // Mapping of the file, if read with data
+  size_t            map_size;
 };
 
 /* Read just the firmware container header from a file */
 struct firmware_container *read_firmware_header(const char *fn);
 
-/* Read all sections of a firmware container from a file */
+/* Read all sections of a firmware container from a file; their
+ * hashes are checked in the background
+ */
 struct firmware_container *read_firmware_file(const char *fn);
 
+/* Wait for a section's hashes; returns 0 if the SHA-256 matched,
+ * otherwise prints an error and returns -1
+ */
+int firmware_wait_hash(struct firmware *firmware, const char *fn);
+
 void free_firmware_container(struct firmware_container *container);
 
 const char *firmware_type_to_string(enum firmware_type type);
@@ -0,0 +1,227 @@
+// SPDX-FileCopyrightText: 2024-2025 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "fleet.h"
+
+#define LINE_MAX_LEN 256
+
+struct fleet_member {
+  int   card_num;
+  pid_t pid;
+  int   fd;                  // -1 once the output is finished
+  char  line[LINE_MAX_LEN];  // Output since the last \n or \r
+  int   len;
+  int   percent;             // From the last progress bar; -1 if none
+};
+
+static bool status_shown;
+
+static void clear_status(void) {
+  if (status_shown)
+    printf("\r\033[K");
+  status_shown = false;
+}
+
+static void show_status(struct fleet_member *members, int count) {
+  if (!isatty(STDOUT_FILENO))
+    return;
+
+  clear_status();
+
+  for (int i = 0; i < count; i++) {
+    if (members[i].fd < 0 || members[i].percent < 0)
+      continue;
+
+    printf(
+      "%scard %d: %3d%%",
+      status_shown ? "  " : "",
+      members[i].card_num,
+      members[i].percent
+    );
+    status_shown = true;
+  }
+}
+
+/* Take the percentage from the end of a progress bar,
+ * "[###...] NN%"
+ */
+static int parse_percent(const char *line) {
+  const char *pct = strrchr(line, '%');
+
+  if (!pct)
+    return -1;
+
+  const char *p = pct;
+  while (p > line && p[-1] >= '0' && p[-1] <= '9')
+    p--;
+
+  return p < pct ? atoi(p) : -1;
+}
+
+static void end_line(
+  struct fleet_member *members,
+  int                  count,
+  struct fleet_member *member,
+  bool                 progress
+) {
+  member->line[member->len] = '\0';
+
+  if (progress) {
+    int percent = parse_percent(member->line);
+    if (percent >= 0)
+      member->percent = percent;
+
+  // Blank lines are left out, as they're only separators
+  } else if (member->len) {
+    clear_status();
+    printf("[card %d] %s\n", member->card_num, member->line);
+    member->percent = -1;
+  }
+
+  member->len = 0;
+  show_status(members, count);
+}
+
+static void handle_output(
+  struct fleet_member *members,
+  int                  count,
+  struct fleet_member *member
+) {
+  char buf[4096];
+  ssize_t n = read(member->fd, buf, sizeof(buf));
+
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+
+  if (n <= 0) {
+    if (member->len)
+      end_line(members, count, member, false);
+    close(member->fd);
+    member->fd = -1;
+    show_status(members, count);
+    return;
+  }
+
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] == '\n' || buf[i] == '\r') {
+      end_line(members, count, member, buf[i] == '\r');
+    } else if (member->len < LINE_MAX_LEN - 1) {
+      member->line[member->len++] = buf[i];
+    }
+  }
+}
+
+static int start_member(struct fleet_member *member, int (*func)(int)) {
+  int fds[2];
+
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (!pid) {
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    exit(!!func(member->card_num));
+  }
+
+  close(fds[1]);
+  member->pid = pid;
+  member->fd = fds[0];
+  return 0;
+}
+
+int fleet_run(int count, const int *card_nums, int (*func)(int card_num)) {
+  struct fleet_member *members = calloc(count, sizeof(*members));
+  struct pollfd *pfds = calloc(count, sizeof(*pfds));
+  int failed = 0;
+
+  if (!members || !pfds) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < count; i++) {
+    members[i].card_num = card_nums[i];
+    members[i].fd = -1;
+    members[i].percent = -1;
+
+    if (start_member(&members[i], func) < 0) {
+      printf("[card %d] Not started\n", card_nums[i]);
+      failed++;
+    }
+  }
+
+  while (1) {
+    int watching = 0;
+
+    for (int i = 0; i < count; i++) {
+      pfds[i].fd = members[i].fd;
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+      if (members[i].fd >= 0)
+        watching++;
+    }
+
+    if (!watching)
+      break;
+
+    if (poll(pfds, count, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    for (int i = 0; i < count; i++)
+      if (pfds[i].revents)
+        handle_output(members, count, &members[i]);
+  }
+
+  clear_status();
+
+  for (int i = 0; i < count; i++) {
+    int status;
+
+    if (!members[i].pid)
+      continue;
+
+    if (members[i].fd >= 0)
+      close(members[i].fd);
+
+    if (waitpid(members[i].pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status)) {
+      printf("[card %d] Failed\n", members[i].card_num);
+      failed++;
+    } else {
+      printf("[card %d] Done\n", members[i].card_num);
+    }
+  }
+
+  free(members);
+  free(pfds);
+  return failed;
+}
@@ -0,0 +1,16 @@
+// SPDX-FileCopyrightText: 2024-2025 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+/* Run func for several cards at once, each in its own process
+ *
+ * The output of each is printed a line at a time, prefixed with its
+ * card number. Progress bars (lines rewritten with \r) are combined
+ * into one status line showing each card's percentage, if stdout is
+ * a terminal.
+ *
+ * Returns the number of cards for which func failed (returned
+ * non-zero) or which exited abnormally.
+ */
+int fleet_run(int count, const int *card_nums, int (*func)(int card_num));
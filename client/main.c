@@ -11,7 +11,9 @@
 #include <errno.h>
 #include <dirent.h>
 #include <endian.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
@@ -21,6 +23,8 @@
 #include "../shared/fcp-shared.h"
 
 #include "firmware.h"
+#include "firmware-cache.h"
+#include "fleet.h"
 #include "alsa.h"
 #include "wait.h"
 #include "devices.h"
@@ -58,7 +62,12 @@ int selected_card_num = -1;
 struct sound_card *selected_card = NULL;
 const char *selected_firmware_file = NULL;
 struct firmware_container *selected_firmware = NULL;
+const char *selected_firmware_path = NULL;
 char *card_serial = NULL;
+bool verify_flash = false;
+bool diff_update = false;
+bool show_stats = false;
+bool all_cards = false;
 
 // Additional command arguments
 int cmd_argc = 0;
@@ -70,6 +79,9 @@ size_t data_response_size = 0;
 
 static int showing_progress = false;
 
+// Latest ESP transfer rate from the server (bytes/s), if requested
+static uint32_t transfer_rate = 0;
+
 // Array of supported commands and requirements
 struct command {
   const char *name;
@@ -178,53 +190,20 @@ static void add_found_firmware(
 }
 
 static void enum_firmware_dir(const char *dirname) {
-  DIR *dir;
-  struct dirent *entry;
-
-  if ((dir = opendir(dirname)) == NULL) {
-    if (errno == ENOENT) {
-      fprintf(stderr, "Firmware directory %s not found\n", dirname);
-      fprintf(stderr, "Please install the firmware package from:\n");
-      fprintf(stderr, "  %s\n\n", FIRMWARE_URL);
-      return;
-    }
+  int err = firmware_scan_dir(dirname, add_found_firmware);
+
+  if (err == -ENOENT) {
+    fprintf(stderr, "Firmware directory %s not found\n", dirname);
+    fprintf(stderr, "Please install the firmware package from:\n");
+    fprintf(stderr, "  %s\n\n", FIRMWARE_URL);
+  } else if (err < 0) {
     fprintf(
       stderr,
       "Unable to open directory %s: %s\n",
       dirname,
-      strerror(errno)
+      strerror(-err)
     );
-    return;
-  }
-
-  while ((entry = readdir(dir)) != NULL) {
-
-    // Check if the file is a .bin file
-    if (!strstr(entry->d_name, ".bin"))
-      continue;
-
-    // Construct full path
-    size_t path_len = strlen(dirname) + strlen(entry->d_name) + 2;
-    char *full_path = malloc(path_len);
-
-    if (!full_path) {
-      perror("malloc");
-      return;
-    }
-
-    snprintf(full_path, path_len, "%s/%s", dirname, entry->d_name);
-
-    // Parse the firmware file
-    struct firmware_container *firmware = read_firmware_header(full_path);
-    if (firmware) {
-      add_found_firmware(full_path, firmware);
-    } else {
-      fprintf(stderr, "Failed to read firmware file: %s\n", full_path);
-      free(full_path);
-    }
   }
-
-  closedir(dir);
 }
 
 static int found_firmware_cmp(const void *p1, const void *p2) {
@@ -301,6 +280,9 @@ static void show_progress(int percent) {
   }
 
   printf("\r[%s] %3d%%", progress, percent);
+
+  if (transfer_rate)
+    printf(" %7.1f KiB/s", transfer_rate / 1024.0);
 }
 
 static void handle_progress_message(const void *payload, size_t length) {
@@ -314,6 +296,24 @@ static void handle_progress_message(const void *payload, size_t length) {
   show_progress(percent);
 }
 
+static void handle_transfer_stats_message(const void *payload, size_t length) {
+  if (length != sizeof(struct transfer_stats)) {
+    fprintf(stderr, "Invalid transfer stats message size\n");
+    return;
+  }
+
+  const struct transfer_stats *stats = payload;
+
+  transfer_rate = stats->bytes_per_sec;
+  show_progress(stats->percent);
+}
+
+/* Code of the last error response */
+static int last_error_code = 0;
+
+/* Set while waiting for the response to a FIRMWARE_FD request */
+static bool fd_request_pending = false;
+
 static void handle_error_message(const void *payload, size_t length) {
   if (length != sizeof(int16_t)) {
     fprintf(stderr, "\nInvalid error message size\n");
@@ -327,6 +327,13 @@ static void handle_error_message(const void *payload, size_t length) {
     return;
   }
 
+  last_error_code = error_code;
+
+  // Servers without FIRMWARE_FD reject it, and the request is then
+  // sent on the socket instead
+  if (fd_request_pending && error_code == FCP_SOCKET_ERR_INVALID_COMMAND)
+    return;
+
   fprintf(stderr, "\nError: %s\n", fcp_socket_error_messages[error_code]);
 }
 
@@ -384,6 +391,11 @@ static int handle_server_message(int sock_fd, bool quiet) {
       result = 1;
       break;
 
+    case FCP_SOCKET_RESPONSE_TRANSFER_STATS:
+      handle_transfer_stats_message(payload, header.payload_length);
+      result = 1;
+      break;
+
     case FCP_SOCKET_RESPONSE_ERROR:
       handle_error_message(payload, header.payload_length);
       result = -1;
@@ -471,33 +483,96 @@ static int send_simple_command(uint8_t command, int quiet) {
   return handle_server_responses(sock_fd, quiet);
 }
 
+/* Write a request into a sealed memfd and pass that to the server
+ * Returns 0 if sent, 1 if memfds aren't available, -1 on error
+ */
+static int send_request_fd(
+  int                 sock_fd,
+  const struct iovec *iov,
+  int                 iov_count,
+  size_t              total
+) {
+  int fd = memfd_create("fcp-request", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return 1;
+
+  if (writev(fd, iov, iov_count) != total ||
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    close(fd);
+    return 1;
+  }
+
+  struct fcp_socket_msg_header header = {
+    .magic          = FCP_SOCKET_MAGIC_REQUEST,
+    .msg_type       = FCP_SOCKET_REQUEST_FIRMWARE_FD,
+    .payload_length = 0
+  };
+  struct iovec header_iov = { &header, sizeof(header) };
+  union {
+    char           buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov        = &header_iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+
+  memset(&control, 0, sizeof(control));
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+  ssize_t n = sendmsg(sock_fd, &msg, 0);
+  close(fd);
+
+  if (n != sizeof(header)) {
+    perror("Error sending firmware");
+    return -1;
+  }
+
+  return 0;
+}
+
 static int send_firmware(struct firmware *fw) {
   int sock_fd = selected_card->socket_fd;
   int command;
 
   if (fw->type == FIRMWARE_LEAPFROG ||
       fw->type == FIRMWARE_APP) {
-    command = FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE;
+    if (diff_update)
+      command = FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF;
+    else if (verify_flash)
+      command = FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY;
+    else
+      command = FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE;
   } else if (fw->type == FIRMWARE_ESP) {
-    command = FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE;
+    command = show_stats
+      ? FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS
+      : FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE;
   } else {
     fprintf(stderr, "Invalid firmware type\n");
     exit(1);
   }
 
-  // Prepare and send header
+  // The ESP MD5 goes in the request, so wait for it; the others are
+  // sent while their hash is still being checked, since the server
+  // checks the SHA-256 of what it receives against the header too
+  if (fw->type == FIRMWARE_ESP &&
+      firmware_wait_hash(fw, selected_firmware_path) < 0)
+    return -1;
+
+  // Prepare header and firmware payload header
   struct fcp_socket_msg_header header = {
     .magic          = FCP_SOCKET_MAGIC_REQUEST,
     .msg_type       = command,
     .payload_length = sizeof(struct firmware_payload) + fw->firmware_length
   };
 
-  if (write(sock_fd, &header, sizeof(header)) != sizeof(header)) {
-    perror("Error sending header");
-    return -1;
-  }
-
-  // Send firmware payload
   struct firmware_payload payload = {
     .size    = fw->firmware_length,
     .usb_vid = fw->usb_vid,
@@ -506,19 +581,42 @@ static int send_firmware(struct firmware *fw) {
   memcpy(payload.sha256, fw->sha256, SHA256_DIGEST_LENGTH);
   memcpy(payload.md5, fw->md5, MD5_DIGEST_LENGTH);
 
-  if (write(sock_fd, &payload, sizeof(payload)) != sizeof(payload)) {
-    perror("Error sending payload header");
+  struct iovec iov[] = {
+    { &header,           sizeof(header)       },
+    { &payload,          sizeof(payload)      },
+    { fw->firmware_data, fw->firmware_length  }
+  };
+  size_t total = sizeof(header) + header.payload_length;
+
+  // Hand the server a sealed memfd to map if we can, otherwise send
+  // it all on the socket
+  int result = send_request_fd(sock_fd, iov, 3, total);
+  if (result < 0)
     return -1;
+
+  if (result == 0) {
+    last_error_code = 0;
+    fd_request_pending = true;
+    result = handle_server_responses(sock_fd, false);
+    fd_request_pending = false;
+
+    if (result < 0 && last_error_code == FCP_SOCKET_ERR_INVALID_COMMAND)
+      result = 1;
   }
 
-  // Send firmware data
-  int result = write(sock_fd, fw->firmware_data, fw->firmware_length);
-  if (result != fw->firmware_length) {
-    perror("Error sending firmware data");
-    return -1;
+  if (result > 0) {
+    if (writev(sock_fd, iov, 3) != total) {
+      perror("Error sending firmware");
+      return -1;
+    }
+
+    result = handle_server_responses(sock_fd, false);
   }
 
-  return handle_server_responses(sock_fd, false);
+  if (firmware_wait_hash(fw, selected_firmware_path) < 0)
+    return -1;
+
+  return result;
 }
 
 static struct firmware* find_firmware_by_type(enum firmware_type type) {
@@ -542,6 +640,41 @@ static int send_firmware_of_type(enum firmware_type required_type) {
 
 // Device Helpers
 
+/* Open only the card that will be used when it can be picked from
+ * the card IDs; otherwise open them all so that check_card_selection()
+ * can say why not
+ */
+static void enum_selected_card(void) {
+  const struct card_id *ids;
+  const struct card_id *id = NULL;
+  int count = enum_card_ids(&ids);
+
+  if (selected_card_num == -1 && count == 1)
+    id = &ids[0];
+
+  for (int i = 0; i < count; i++)
+    if (ids[i].card_num == selected_card_num)
+      id = &ids[i];
+
+  if (!id) {
+    cards = enum_cards(&card_count, false);
+    return;
+  }
+
+  struct sound_card *card = probe_card(id, false);
+
+  if (!card)
+    return;
+
+  cards = malloc(sizeof(*cards));
+  if (!cards) {
+    perror("malloc");
+    exit(1);
+  }
+  cards[0] = card;
+  card_count = 1;
+}
+
 static void check_card_selection(void) {
   if (!card_count) {
     fprintf(stderr, "No supported devices found\n");
@@ -650,6 +783,7 @@ static void check_firmware_selection(void) {
 
   // read the firmware file
   selected_firmware = read_firmware_file(ff->fn);
+  selected_firmware_path = ff->fn;
 
   if (!selected_firmware) {
     fprintf(stderr, "Unable to load firmware\n");
@@ -749,10 +883,22 @@ static int usage(void) {
     "  upload-leapfrog       Upload Leapfrog firmware\n"
     "  upload-esp            Upload ESP firmware\n"
     "  upload-app            Upload App firmware\n"
+    "  stats                 Show the server's latency statistics\n"
+    "  snapshot <file>       Save the device's settings to <file>\n"
+    "  restore <file>        Put the device back to a saved snapshot\n"
+    "  routing [<input>...]  Show the input of each mux output, or\n"
+    "                        set them all\n"
     "\n"
     "Lesser-used options:\n"
     "  -c, --card <num>      Select a specific card number\n"
     "  -f, --firmware <file> Specify a firmware file\n"
+    "  --verify              Read back and check App firmware as it\n"
+    "                        is written\n"
+    "  --diff                Only write the parts of the App firmware\n"
+    "                        which differ from what is on the device\n"
+    "  --stats               Show the ESP firmware transfer rate\n"
+    "  --all                 With update, update every connected device\n"
+    "                        at once\n"
     "\n"
     "Support: %s\n"
     "Configuration GUI: %s\n"
@@ -875,8 +1021,288 @@ static int erase_app(void) {
   return send_simple_command(FCP_SOCKET_REQUEST_APP_FIRMWARE_ERASE, false);
 }
 
+// Stats Command
+
+// Upper bound of the bucket holding the given fraction of samples
+static uint64_t histogram_percentile(
+  const struct fcp_stats_histogram *hist,
+  double                            fraction
+) {
+  uint64_t target = hist->count * fraction;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < FCP_STATS_BUCKETS - 1; i++) {
+    seen += hist->buckets[i];
+    if (seen > target)
+      return (uint64_t)1 << i;
+  }
+
+  return hist->max;
+}
+
+static void print_histogram(
+  const char                       *name,
+  const struct fcp_stats_histogram *hist
+) {
+  if (!hist->count) {
+    printf("  %-24s %10s\n", name, "-");
+    return;
+  }
+
+  printf(
+    "  %-24s %10u %9llu %9llu %9llu %9u\n",
+    name,
+    hist->count,
+    (unsigned long long)(hist->total / hist->count),
+    (unsigned long long)histogram_percentile(hist, 0.5),
+    (unsigned long long)histogram_percentile(hist, 0.99),
+    hist->max
+  );
+}
+
+static int stats_cmd(void) {
+  static const char *category_names[FCP_STATS_CMD_COUNT] = {
+    "init", "meter", "mix", "mux", "flash", "5",
+    "sync", "7", "8", "esp-dfu", "data"
+  };
+
+  int result = send_simple_command(FCP_SOCKET_REQUEST_STATS, true);
+  if (result != 0)
+    return result;
+
+  if (data_response_size < sizeof(struct fcp_stats)) {
+    fprintf(stderr, "Invalid stats response from server\n");
+    return -1;
+  }
+
+  const struct fcp_stats *stats = data_response;
+
+  printf(
+    "Server up %uh %02um %02us\n"
+    "  Notifications handled:   %u\n"
+    "  Control changes written: %u\n"
+    "  FCP command errors:      %u\n"
+    "\n"
+    "Latency (us; p50/p99 are bucket upper bounds):\n"
+    "  %-24s %10s %9s %9s %9s %9s\n",
+    stats->uptime / 3600,
+    stats->uptime / 60 % 60,
+    stats->uptime % 60,
+    stats->notifications,
+    stats->control_changes,
+    stats->fcp_cmd_errors,
+    "", "count", "avg", "p50", "p99", "max"
+  );
+
+  for (int i = 0; i < FCP_STATS_CMD_COUNT; i++) {
+    char name[32];
+
+    if (!stats->fcp_cmd[i].count)
+      continue;
+    snprintf(name, sizeof(name), "FCP %s command", category_names[i]);
+    print_histogram(name, &stats->fcp_cmd[i]);
+  }
+  print_histogram("Notification to ALSA", &stats->notify_to_alsa);
+  print_histogram("ALSA to device", &stats->alsa_to_device);
+
+  printf("\nPer notification:\n");
+  print_histogram("Controls re-read", &stats->notify_rereads);
+
+  free(data_response);
+  data_response = NULL;
+
+  return 0;
+}
+
+static int snapshot_cmd(void) {
+  if (cmd_argc != 1) {
+    fprintf(stderr, "Usage: %s snapshot <file>\n", program_name);
+    return -1;
+  }
+
+  const char *fn = cmd_argv[0];
+  int result = send_simple_command(FCP_SOCKET_REQUEST_SNAPSHOT, true);
+  if (result != 0)
+    return result;
+
+  const struct fcp_snapshot_header *header = data_response;
+
+  if (data_response_size < sizeof(*header) ||
+      le32toh(header->magic) != FCP_SNAPSHOT_MAGIC) {
+    fprintf(stderr, "Invalid snapshot response from server\n");
+    free(data_response);
+    data_response = NULL;
+    return -1;
+  }
+
+  FILE *f = fopen(fn, "wb");
+  if (!f) {
+    perror(fn);
+    free(data_response);
+    data_response = NULL;
+    return -1;
+  }
+
+  size_t n = fwrite(data_response, 1, data_response_size, f);
+  if (fclose(f) != 0 || n != data_response_size) {
+    perror(fn);
+    result = -1;
+  } else {
+    printf("Saved snapshot (%zu bytes) to %s\n", data_response_size, fn);
+  }
+
+  free(data_response);
+  data_response = NULL;
+
+  return result;
+}
+
+static int restore_cmd(void) {
+  if (cmd_argc != 1) {
+    fprintf(stderr, "Usage: %s restore <file>\n", program_name);
+    return -1;
+  }
+
+  const char *fn = cmd_argv[0];
+  FILE *f = fopen(fn, "rb");
+  if (!f) {
+    perror(fn);
+    return -1;
+  }
+
+  uint8_t *data = malloc(MAX_PAYLOAD_LENGTH);
+  if (!data) {
+    fprintf(stderr, "Failed to allocate snapshot buffer\n");
+    fclose(f);
+    return -1;
+  }
+
+  size_t size = fread(data, 1, MAX_PAYLOAD_LENGTH, f);
+  fclose(f);
+
+  if (size < sizeof(struct fcp_snapshot_header) ||
+      le32toh(((struct fcp_snapshot_header *)data)->magic) !=
+        FCP_SNAPSHOT_MAGIC) {
+    fprintf(stderr, "%s is not a snapshot\n", fn);
+    free(data);
+    return -1;
+  }
+
+  int sock_fd = selected_card->socket_fd;
+  struct fcp_socket_msg_header header = {
+    .magic          = FCP_SOCKET_MAGIC_REQUEST,
+    .msg_type       = FCP_SOCKET_REQUEST_RESTORE,
+    .payload_length = size
+  };
+  struct iovec iov[] = {
+    { &header, sizeof(header) },
+    { data,    size           }
+  };
+  struct timeval start, end;
+
+  gettimeofday(&start, NULL);
+
+  if (writev(sock_fd, iov, 2) != (ssize_t)(sizeof(header) + size)) {
+    perror("Error sending snapshot");
+    free(data);
+    return -1;
+  }
+  free(data);
+
+  int result = handle_server_responses(sock_fd, true);
+  if (result != 0)
+    return result;
+
+  gettimeofday(&end, NULL);
+  printf(
+    "Restored %s in %.1fms\n",
+    fn,
+    (end.tv_sec - start.tv_sec) * 1000.0 +
+      (end.tv_usec - start.tv_usec) / 1000.0
+  );
+
+  return 0;
+}
+
+static int routing_cmd(void) {
+  int result = send_simple_command(FCP_SOCKET_REQUEST_MUX_ROUTING_READ, true);
+  if (result != 0)
+    return result;
+
+  struct fcp_mux_routing_header *routing = data_response;
+
+  if (data_response_size < sizeof(*routing) ||
+      data_response_size != sizeof(*routing) +
+        le16toh(routing->output_count) * sizeof(uint16_t)) {
+    fprintf(stderr, "Invalid mux routing response from server\n");
+    free(data_response);
+    data_response = NULL;
+    return -1;
+  }
+
+  int output_count = le16toh(routing->output_count);
+  int input_count = le16toh(routing->input_count);
+  uint16_t *inputs = (uint16_t *)(routing + 1);
+
+  // No inputs given; show the current routing
+  if (!cmd_argc) {
+    for (int i = 0; i < output_count; i++)
+      printf("%d: %d\n", i, le16toh(inputs[i]));
+    free(data_response);
+    data_response = NULL;
+    return 0;
+  }
+
+  if (cmd_argc != output_count) {
+    fprintf(stderr, "Expected %d inputs, one for each output\n", output_count);
+    free(data_response);
+    data_response = NULL;
+    return -1;
+  }
+
+  for (int i = 0; i < output_count; i++) {
+    char *end;
+    long input = strtol(cmd_argv[i], &end, 0);
+
+    if (*end || input < 0 || input >= input_count) {
+      fprintf(stderr, "Invalid input: %s\n", cmd_argv[i]);
+      free(data_response);
+      data_response = NULL;
+      return -1;
+    }
+    inputs[i] = htole16(input);
+  }
+
+  struct fcp_socket_msg_header header = {
+    .magic          = FCP_SOCKET_MAGIC_REQUEST,
+    .msg_type       = FCP_SOCKET_REQUEST_MUX_ROUTING_WRITE,
+    .payload_length = data_response_size
+  };
+  struct iovec iov[] = {
+    { &header,       sizeof(header)     },
+    { data_response, data_response_size }
+  };
+  int sock_fd = selected_card->socket_fd;
+
+  if (writev(sock_fd, iov, 2) !=
+        (ssize_t)(sizeof(header) + data_response_size)) {
+    perror("Error sending mux routing");
+    result = -1;
+  }
+
+  free(data_response);
+  data_response = NULL;
+
+  if (result != 0)
+    return result;
+
+  return handle_server_responses(sock_fd, true);
+}
+
 static int erase_and_upload(enum firmware_type type) {
-  if (type != FIRMWARE_ESP) {
+
+  // A differential update erases only if it needs to
+  if (type != FIRMWARE_ESP && !diff_update) {
     printf("Erasing App firmware...\n");
     int result = send_simple_command(
       FCP_SOCKET_REQUEST_APP_FIRMWARE_ERASE,
@@ -1074,6 +1500,14 @@ static int update(void) {
     }
   }
 
+  // Nothing is erased unless every section is intact; the sections
+  // are hashed in parallel, so this is a short wait
+  for (int i = 0; i < selected_firmware->num_sections; i++)
+    if (firmware_wait_hash(
+          selected_firmware->sections[i], selected_firmware_path
+        ) < 0)
+      return -1;
+
   for (int i = 0; i < selected_firmware->num_sections; i++) {
     struct firmware *fw = selected_firmware->sections[i];
 
@@ -1097,9 +1531,65 @@ static int update(void) {
   return 0;
 }
 
+// Update one card of update --all, in its own process
+static int update_card(int card_num) {
+  selected_card_num = card_num;
+  check_card_selection();
+  check_firmware_selection();
+
+  return update();
+}
+
+/* Update every card which has fcp-server running, concurrently so
+ * that the erases, uploads, and reboots overlap
+ */
+static int update_all(void) {
+  int *card_nums = calloc(card_count + 1, sizeof(int));
+  int count = 0;
+
+  if (!card_nums) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < card_count; i++) {
+    struct sound_card *card = cards[i];
+    struct found_firmware *ff = get_latest_firmware(card->usb_pid);
+
+    if (!card->socket_path) {
+      printf("[card %d] fcp-server not running; skipped\n", card->card_num);
+    } else if (!selected_firmware_file &&
+               (!ff || firmware_cmp(card->firmware_version,
+                                    ff->firmware->firmware_version) >= 0)) {
+      printf(
+        "[card %d] %s is up to date\n", card->card_num, card->product_name
+      );
+    } else {
+      card_nums[count++] = card->card_num;
+    }
+  }
+
+  if (!count) {
+    free(card_nums);
+    return 0;
+  }
+
+  printf("Updating %d device%s\n", count, count == 1 ? "" : "s");
+
+  int failed = fleet_run(count, card_nums, update_card);
+
+  free(card_nums);
+  return failed ? -1 : 0;
+}
+
 // Data Command
 
-int send_fcp_cmd(uint32_t opcode, const void *req_data, size_t req_size, size_t resp_size) {
+int send_fcp_cmd_request(
+  uint32_t    opcode,
+  const void *req_data,
+  size_t      req_size,
+  size_t      resp_size
+) {
   int sock_fd = selected_card->socket_fd;
 
   size_t payload_size = sizeof(struct fcp_cmd_request) + req_size;
@@ -1131,6 +1621,40 @@ int send_fcp_cmd(uint32_t opcode, const void *req_data, size_t req_size, size_t
   }
 
   free(buf);
+  return 0;
+}
+
+int read_fcp_response(void) {
+  return handle_server_responses(selected_card->socket_fd, true);
+}
+
+int send_fcp_cmd(uint32_t opcode, const void *req_data, size_t req_size, size_t resp_size) {
+  int ret = send_fcp_cmd_request(opcode, req_data, req_size, resp_size);
+
+  if (ret != 0)
+    return ret;
+
+  return read_fcp_response();
+}
+
+int send_fcp_cmd_batch(const void *payload, size_t payload_size) {
+  int sock_fd = selected_card->socket_fd;
+
+  struct fcp_socket_msg_header header = {
+    .magic          = FCP_SOCKET_MAGIC_REQUEST,
+    .msg_type       = FCP_SOCKET_REQUEST_FCP_CMD_BATCH,
+    .payload_length = payload_size
+  };
+  struct iovec iov[] = {
+    { &header,         sizeof(header) },
+    { (void *)payload, payload_size   }
+  };
+
+  if (writev(sock_fd, iov, 2) != (ssize_t)(sizeof(header) + payload_size)) {
+    perror("Error sending FCP command batch");
+    return -1;
+  }
+
   return handle_server_responses(sock_fd, true);
 }
 
@@ -1224,6 +1748,22 @@ static void parse_args(int argc, char *argv[]) {
 
       selected_firmware_file = firmware_file;
 
+    // --verify
+    } else if (!strcmp(arg, "--verify")) {
+      verify_flash = true;
+
+    // --diff
+    } else if (!strcmp(arg, "--diff")) {
+      diff_update = true;
+
+    // --stats
+    } else if (!strcmp(arg, "--stats")) {
+      show_stats = true;
+
+    // --all
+    } else if (!strcmp(arg, "--all")) {
+      all_cards = true;
+
     // short-form commands
     } else if (arg[0] == '-') {
       char *short_command = NULL;
@@ -1267,6 +1807,11 @@ static void parse_args(int argc, char *argv[]) {
     fprintf(stderr, "Error: card specified but no command\n");
     short_help();
   }
+
+  if (all_cards && selected_card_num != -1) {
+    fprintf(stderr, "Error: --all and a card cannot both be specified\n");
+    short_help();
+  }
 }
 
 // Main
@@ -1284,6 +1829,10 @@ static struct command commands[] = {
   { "list-all",        list_all,        true,  false, true,  false },
   { "update",          update,          true,  true,  true,  true  },
   { "data",            data_cmd,        true,  true,  false, false },
+  { "stats",           stats_cmd,       true,  true,  false, false },
+  { "snapshot",        snapshot_cmd,    true,  true,  false, false },
+  { "restore",         restore_cmd,     true,  true,  false, false },
+  { "routing",         routing_cmd,     true,  true,  false, false },
   { 0 }
 };
 
@@ -1312,9 +1861,25 @@ int main(int argc, char *argv[]) {
     short_help();
   }
 
-  if (cmd->requires_cards)
+  if (cmd->requires_card_selection && !all_cards)
+    enum_selected_card();
+  else if (cmd->requires_cards)
     cards = enum_cards(&card_count, false);
 
+  if (all_cards) {
+    if (cmd->handler != update) {
+      fprintf(stderr, "Error: --all is only supported with update\n");
+      short_help();
+    }
+    if (!card_count) {
+      fprintf(stderr, "No supported devices found\n");
+      return EXIT_FAILURE;
+    }
+
+    enum_firmwares();
+    return !!update_all();
+  }
+
   if (cmd->requires_card_selection)
     check_card_selection();
 
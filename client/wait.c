@@ -2,40 +2,191 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #include "wait.h"
-#include "usb.h"
 #include "alsa.h"
 
-// Find device with matching serial number
+#define SND_DEV_DIR "/dev/snd"
+
+// How often to check without inotify
+#define WAIT_CHECKS_PER_SEC 4
+
+// Most poll descriptors of the watched card's control
+#define MAX_CTL_FDS 4
+
+// fcp-server locks its Firmware Version control just after the last
+// event of its setup, so check again this soon after an event
+#define RECHECK_MS 100
+
+// Find device with matching serial number; only that card is opened
 static struct sound_card *find_by_serial(const char *serial, bool quiet) {
-  int count;
-  struct sound_card **cards = enum_cards(&count, quiet);
-  if (!cards)
-    return NULL;
-
-  struct sound_card *match = NULL;
-  for (int i = 0; i < count; i++) {
-    char *card_serial = get_device_serial(cards[i]->card_num);
-
-    if (card_serial && strcmp(card_serial, serial) == 0) {
-      match = cards[i];
-      cards[i] = NULL;
-      free(card_serial);
-      break;
+  const struct card_id *ids;
+
+  // The cards may have changed since they were last listed
+  forget_cards();
+
+  int count = enum_card_ids(&ids);
+
+  for (int i = 0; i < count; i++)
+    if (!strcmp(ids[i].serial, serial))
+      return probe_card(&ids[i], quiet);
+
+  return NULL;
+}
+
+/* The card being waited for, once its control device has appeared;
+ * its control events say when fcp-server has set it up
+ */
+struct watched_card {
+  struct card_id id;  // card_num -1 until found
+  snd_ctl_t     *ctl;
+};
+
+static void unwatch_card(struct watched_card *watch) {
+  if (watch->ctl)
+    snd_ctl_close(watch->ctl);
+  free(watch->id.serial);
+  watch->ctl = NULL;
+  watch->id.serial = NULL;
+  watch->id.card_num = -1;
+}
+
+/* A control device was created or changed; if it's for the device
+ * with this serial, watch its control events
+ */
+static void check_new_ctl(
+  const char          *name,
+  const char          *serial,
+  struct watched_card *watch
+) {
+  struct card_id id;
+  int card_num;
+  char alsa_name[32];
+
+  if (sscanf(name, "controlC%d", &card_num) != 1 ||
+      card_num == watch->id.card_num ||
+      !read_card_id(card_num, &id))
+    return;
+
+  if (strcmp(id.serial, serial)) {
+    free(id.serial);
+    return;
+  }
+
+  // Not openable until udev has set its permissions; that's another
+  // event
+  snprintf(alsa_name, sizeof(alsa_name), "hw:%d", card_num);
+  snd_ctl_t *ctl;
+  if (snd_ctl_open(&ctl, alsa_name, SND_CTL_NONBLOCK) < 0) {
+    free(id.serial);
+    return;
+  }
+
+  if (snd_ctl_subscribe_events(ctl, 1) < 0 ||
+      snd_ctl_poll_descriptors_count(ctl) > MAX_CTL_FDS) {
+    snd_ctl_close(ctl);
+    free(id.serial);
+    return;
+  }
+
+  unwatch_card(watch);
+  watch->id = id;
+  watch->ctl = ctl;
+}
+
+static void drain_inotify(
+  int                  fd,
+  const char          *serial,
+  struct watched_card *watch
+) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len; ) {
+      struct inotify_event *event = (struct inotify_event *)p;
+
+      if (event->len)
+        check_new_ctl(event->name, serial, watch);
+      p += sizeof(*event) + event->len;
     }
-    free(card_serial);
   }
+}
 
-  // Cleanup unmatched cards
-  for (int i = 0; i < count; i++)
-    if (cards[i])
-      free_sound_card(cards[i]);
-  free(cards);
+static void drain_ctl_events(snd_ctl_t *ctl) {
+  snd_ctl_event_t *event;
+  snd_ctl_event_alloca(&event);
 
-  return match;
+  while (snd_ctl_read(ctl, event) > 0)
+    ;
+}
+
+/* Wait for events rather than re-enumerating every card: inotify on
+ * /dev/snd says when the device's control appears, and then its
+ * control events say when fcp-server has added its controls and
+ * published its socket; only that card is probed
+ */
+static int wait_for_events(
+  int                 inotify_fd,
+  const char         *serial,
+  int                 timeout,
+  struct sound_card **card
+) {
+  struct watched_card watch = { .id.card_num = -1 };
+  long deadline = time(NULL) + timeout;
+  bool recheck = false;
+  int err = -1;
+
+  // The device may have come back before the watch was added
+  *card = find_by_serial(serial, true);
+  if (*card)
+    return 0;
+
+  while (time(NULL) < deadline) {
+    struct pollfd pfds[1 + MAX_CTL_FDS];
+    int count = 1;
+
+    pfds[0].fd = inotify_fd;
+    pfds[0].events = POLLIN;
+    if (watch.ctl)
+      count += snd_ctl_poll_descriptors(watch.ctl, pfds + 1, MAX_CTL_FDS);
+
+    int ret = poll(pfds, count, recheck ? RECHECK_MS : 1000);
+    if (ret < 0)
+      continue;
+
+    if (!ret && !recheck) {
+      printf(".");
+      continue;
+    }
+
+    if (ret && pfds[0].revents)
+      drain_inotify(inotify_fd, serial, &watch);
+
+    recheck = false;
+
+    if (watch.ctl) {
+      drain_ctl_events(watch.ctl);
+
+      *card = probe_card(&watch.id, true);
+      if (*card) {
+        err = 0;
+        break;
+      }
+
+      recheck = ret > 0;
+    }
+  }
+
+  unwatch_card(&watch);
+  return err;
 }
 
 int wait_for_device(
@@ -43,19 +194,37 @@ int wait_for_device(
   int                 timeout, // How long to wait in seconds
   struct sound_card **card     // Output: sound card
 ) {
-  long deadline = time(NULL) + timeout;
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-  while (time(NULL) < deadline) {
-    struct sound_card *match = find_by_serial(serial, true);
-    if (match) {
-      *card = match;
+  if (inotify_fd >= 0 &&
+      inotify_add_watch(inotify_fd, SND_DEV_DIR, IN_CREATE | IN_ATTRIB) >= 0) {
+    int err = wait_for_events(inotify_fd, serial, timeout, card);
+
+    close(inotify_fd);
+    if (!err)
       return 0;
-    }
 
-    // Wait a bit before retry
-    sleep(1);
+  // No inotify; check a few times a second
+  } else {
+    long deadline = time(NULL) + timeout;
+    int steps = 0;
+
+    if (inotify_fd >= 0)
+      close(inotify_fd);
 
-    printf(".");
+    while (time(NULL) < deadline) {
+      struct sound_card *match = find_by_serial(serial, true);
+      if (match) {
+        *card = match;
+        return 0;
+      }
+
+      // Only show each second passing
+      usleep(1000000 / WAIT_CHECKS_PER_SEC);
+
+      if (++steps % WAIT_CHECKS_PER_SEC == 0)
+        printf(".");
+    }
   }
 
   // Try one last time, but print error message if it fails
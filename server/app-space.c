@@ -0,0 +1,686 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app-space.h"
+#include "control-utils.h"
+#include "device.h"
+#include "event-loop.h"
+#include "fcp.h"
+#include "log.h"
+#include "stats.h"
+
+int get_control_data_ranges(
+  const struct control_props *props,
+  struct app_space_range     *ranges,
+  int                         max_ranges
+) {
+  if (!props->offset || max_ranges < 1)
+    return 0;
+
+  if (props->type == SND_CTL_ELEM_TYPE_BYTES) {
+    if (props->read_bytes_func != read_bytes_control)
+      return 0;
+    ranges[0].start = props->offset;
+    ranges[0].end = props->offset + props->size;
+    return 1;
+  }
+
+  if (props->read_func == read_bitmap_data_control) {
+    ranges[0].start = props->offset;
+    ranges[0].end = props->offset + data_type_width(props->data_type);
+    return 1;
+  }
+
+  if (props->read_func != read_data_control)
+    return 0;
+
+  if (!props->component_count) {
+    int width = data_type_width(props->data_type);
+
+    ranges[0].start = props->offset + props->array_index * width;
+    ranges[0].end = ranges[0].start + width;
+    return 1;
+  }
+
+  int count = 0;
+  for (int i = 0; i < props->component_count && count < max_ranges; i++) {
+    int width = data_type_width(props->data_types[i]);
+
+    ranges[count].start = props->offsets[i] + props->array_index * width;
+    ranges[count].end = ranges[count].start + width;
+    count++;
+  }
+  return count;
+}
+
+void get_control_decode(
+  const struct control_props *props,
+  struct control_hot         *hot
+) {
+  hot->decode = CONTROL_DECODE_NONE;
+
+  if (!props->offset ||
+      props->component_count ||
+      props->type == SND_CTL_ELEM_TYPE_BYTES)
+    return;
+
+  int width = data_type_width(props->data_type);
+  if (!width)
+    return;
+
+  hot->width = width;
+
+  if (props->read_func == read_bitmap_data_control) {
+    hot->decode = CONTROL_DECODE_BIT;
+    hot->data_offset = props->offset;
+    hot->bit = props->array_index;
+  } else if (props->read_func == read_data_control) {
+    hot->decode = (props->data_type & 1)
+      ? CONTROL_DECODE_SIGNED
+      : CONTROL_DECODE_UNSIGNED;
+    hot->data_offset = props->offset + props->array_index * width;
+  }
+}
+
+void app_space_init(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int size = 0;
+
+  /* Size the shadow to cover every control backed by APP_SPACE */
+  for (int i = 0; i < ctrl_mgr->range_count; i++)
+    if (ctrl_mgr->ranges[i].end > size)
+      size = ctrl_mgr->ranges[i].end;
+
+  free(shadow->data);
+  free(shadow->valid);
+  free(shadow->pending_data);
+  free(shadow->pending);
+  free(shadow->echo_data);
+  free(shadow->echo_expiry);
+
+  shadow->size = size;
+  shadow->data = calloc(1, size ? size : 1);
+  shadow->valid = calloc(1, size ? size : 1);
+  shadow->pending_data = calloc(1, size ? size : 1);
+  shadow->pending = calloc(1, size ? size : 1);
+  shadow->echo_data = calloc(1, size ? size : 1);
+  shadow->echo_expiry = calloc(size ? size : 1, sizeof(uint64_t));
+  if (!shadow->data || !shadow->valid ||
+      !shadow->pending_data || !shadow->pending ||
+      !shadow->echo_data || !shadow->echo_expiry) {
+    log_error("Cannot allocate memory for APP_SPACE shadow");
+    exit(1);
+  }
+
+  shadow->pending_start = 0;
+  shadow->pending_end = 0;
+  shadow->notify_count = 0;
+
+  const char *debounce = getenv("FCP_NOTIFY_DEBOUNCE_MS");
+  if (debounce)
+    shadow->notify_debounce_ms = atoi(debounce);
+
+  log_debug("APP_SPACE shadow size: %d", size);
+}
+
+void app_space_invalidate(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+
+  if (shadow->valid)
+    memset(shadow->valid, 0, shadow->size);
+}
+
+static int is_valid(const struct app_space *shadow, int offset, int size) {
+  if (!shadow->valid || offset < 0 || offset + size > shadow->size)
+    return 0;
+
+  for (int i = 0; i < size; i++)
+    if (!shadow->valid[offset + i])
+      return 0;
+
+  return 1;
+}
+
+/* Remember bytes just written to the device */
+static void record_echo(
+  struct app_space *shadow,
+  int               offset,
+  int               size,
+  const uint8_t    *data
+) {
+  if (!shadow->echo_data || offset < 0 || offset + size > shadow->size)
+    return;
+
+  uint64_t expiry = stats_time_us() + APP_SPACE_ECHO_MS * 1000;
+
+  memcpy(shadow->echo_data + offset, data, size);
+  for (int i = 0; i < size; i++)
+    shadow->echo_expiry[offset + i] = expiry;
+}
+
+/* Check if recently written bytes cover all of a range */
+static bool is_echo(
+  const struct app_space *shadow,
+  int                     start,
+  int                     end,
+  uint64_t                now
+) {
+  if (!shadow->echo_data)
+    return false;
+
+  for (int i = start; i < end; i++)
+    if (shadow->echo_expiry[i] <= now)
+      return false;
+
+  return true;
+}
+
+/* Fill a range of the shadow from the recently written bytes */
+static void use_echo(struct app_space *shadow, int start, int end) {
+  memcpy(shadow->data + start, shadow->echo_data + start, end - start);
+  memset(shadow->valid + start, 1, end - start);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+  const struct app_space_range *ra = a;
+  const struct app_space_range *rb = b;
+
+  return ra->start - rb->start;
+}
+
+/* Fetch one merged range, splitting it into APP_SPACE_READ_MAX
+ * sized reads
+ */
+static int fetch_range(struct fcp_device *device, int start, int end) {
+  struct app_space *shadow = &device->app_space;
+
+  while (start < end) {
+    int size = end - start;
+    if (size > APP_SPACE_READ_MAX)
+      size = APP_SPACE_READ_MAX;
+
+    int err = fcp_data_read_buf(
+      device->hwdep, start, size, shadow->data + start
+    );
+    if (err < 0)
+      return err;
+
+    memset(shadow->valid + start, 1, size);
+    start += size;
+  }
+
+  return 0;
+}
+
+int app_space_prefetch(
+  struct fcp_device *device,
+  const int         *control_indices,
+  int                count
+) {
+  struct app_space *shadow = &device->app_space;
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+
+  if (!shadow->size || !count)
+    return 0;
+
+  struct app_space_range *ranges = malloc(
+    count * MAX_CONTROL_RANGES * sizeof(*ranges)
+  );
+  if (!ranges) {
+    log_error("Cannot allocate memory for APP_SPACE ranges");
+    return -ENOMEM;
+  }
+
+  /* Collect the ranges of all the affected controls, skipping those
+   * which are outside the shadow or already valid
+   */
+  uint64_t now = stats_time_us();
+  int num_ranges = 0;
+  bool all_echoes = true;
+  for (int i = 0; i < count; i++) {
+    const struct control_hot *hot = &ctrl_mgr->hot[control_indices[i]];
+    const struct app_space_range *r = &ctrl_mgr->ranges[hot->range_first];
+
+    for (int j = 0; j < hot->range_count; j++, r++) {
+      if (r->end > shadow->size ||
+          is_valid(shadow, r->start, r->end - r->start))
+        continue;
+      if (all_echoes && !is_echo(shadow, r->start, r->end, now))
+        all_echoes = false;
+      ranges[num_ranges++] = *r;
+    }
+  }
+
+  /* Only skip the read-back if the notification is entirely for our
+   * own writes; otherwise the device may have changed any of it
+   */
+  if (num_ranges && all_echoes) {
+    for (int i = 0; i < num_ranges; i++)
+      use_echo(shadow, ranges[i].start, ranges[i].end);
+    log_debug("Notification only covers our own %d writes", num_ranges);
+    num_ranges = 0;
+  }
+
+  if (!num_ranges) {
+    free(ranges);
+    return 0;
+  }
+
+  /* Sort and merge ranges that overlap or are close together */
+  qsort(ranges, num_ranges, sizeof(*ranges), compare_ranges);
+
+  int start = ranges[0].start;
+  int end = ranges[0].end;
+  int reads = 0;
+  int err = 0;
+
+  for (int i = 1; i <= num_ranges; i++) {
+    if (i < num_ranges &&
+        ranges[i].start <= end + APP_SPACE_MERGE_GAP &&
+        (ranges[i].end <= end ||
+         ranges[i].end - start <= APP_SPACE_READ_MAX)) {
+      if (ranges[i].end > end)
+        end = ranges[i].end;
+      continue;
+    }
+
+    err = fetch_range(device, start, end);
+    if (err < 0)
+      break;
+    reads++;
+
+    if (i < num_ranges) {
+      start = ranges[i].start;
+      end = ranges[i].end;
+    }
+  }
+
+  log_debug(
+    "Prefetched %d APP_SPACE ranges for %d controls in %d reads",
+    num_ranges, count, reads
+  );
+
+  free(ranges);
+
+  /* On error, the remaining controls fall back to reading directly
+   * from the device
+   */
+  return err;
+}
+
+static int send_pending_writes(struct fcp_device *device);
+
+/* Check if any of the bytes are waiting to be written */
+static bool is_pending(const struct app_space *shadow, int offset, int size) {
+  int start = offset > shadow->pending_start ? offset : shadow->pending_start;
+  int end = offset + size < shadow->pending_end
+    ? offset + size
+    : shadow->pending_end;
+
+  for (int i = start; i < end; i++)
+    if (shadow->pending[i])
+      return true;
+
+  return false;
+}
+
+int app_space_read(
+  struct fcp_device *device,
+  int                offset,
+  int                width,
+  bool               is_signed,
+  int               *value
+) {
+  struct app_space *shadow = &device->app_space;
+
+  // Read-modify-writes in a batch need the device up to date
+  if (is_pending(shadow, offset, width)) {
+    int err = send_pending_writes(device);
+    if (err < 0)
+      return err;
+  }
+
+  if (!is_valid(shadow, offset, width))
+    return fcp_data_read(device->hwdep, offset, width, is_signed, value);
+
+  const uint8_t *p = shadow->data + offset;
+
+  if (width == 1) {
+    *value = is_signed ? (int8_t)p[0] : p[0];
+  } else if (width == 2) {
+    uint16_t v = p[0] | p[1] << 8;
+    *value = is_signed ? (int16_t)v : v;
+  } else if (width == 4) {
+    *value = (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+  } else {
+    log_error("Invalid data read width %d", width);
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+int app_space_decode(
+  struct fcp_device *device,
+  const int         *control_indices,
+  int                count,
+  int               *values,
+  bool              *decoded
+) {
+  const struct app_space *shadow = &device->app_space;
+  const struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int decoded_count = 0;
+
+  for (int i = 0; i < count; i++) {
+    const struct control_hot *hot = &ctrl_mgr->hot[control_indices[i]];
+    int offset = hot->data_offset;
+    int width = hot->width;
+
+    decoded[i] = false;
+
+    if (hot->decode == CONTROL_DECODE_NONE ||
+        !is_valid(shadow, offset, width))
+      continue;
+
+    const uint8_t *p = shadow->data + offset;
+    uint32_t raw = p[0];
+    if (width >= 2)
+      raw |= (uint32_t)p[1] << 8;
+    if (width == 4)
+      raw |= (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+
+    int value;
+    if (hot->decode == CONTROL_DECODE_BIT)
+      value = (raw >> hot->bit) & 1;
+    else if (hot->decode == CONTROL_DECODE_SIGNED)
+      value = width == 1 ? (int8_t)raw :
+              width == 2 ? (int16_t)raw : (int32_t)raw;
+    else
+      value = raw;
+
+    // Enum values are stored, but ALSA has the index
+    const struct control_props *props =
+      &ctrl_mgr->controls[control_indices[i]];
+    if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED && props->enum_values) {
+      value = enum_value_to_index(props, value);
+      if (value < 0)
+        continue;
+    }
+
+    values[i] = value;
+    decoded[i] = true;
+    decoded_count++;
+  }
+
+  return decoded_count;
+}
+
+int app_space_read_buf(
+  struct fcp_device *device,
+  int                offset,
+  int                size,
+  void              *buf
+) {
+  struct app_space *shadow = &device->app_space;
+
+  if (is_pending(shadow, offset, size)) {
+    int err = send_pending_writes(device);
+    if (err < 0)
+      return err;
+  }
+
+  if (!is_valid(shadow, offset, size))
+    return fcp_data_read_buf(device->hwdep, offset, size, buf);
+
+  memcpy(buf, shadow->data + offset, size);
+  return 0;
+}
+
+/* Update the shadow after a write, but only where it's already valid
+ * so that partially-known bytes are never treated as current
+ */
+static void update_shadow(
+  struct app_space *shadow,
+  int               offset,
+  int               size,
+  const uint8_t    *data
+) {
+  if (offset < 0 || offset + size > shadow->size)
+    return;
+
+  for (int i = 0; i < size; i++)
+    if (shadow->valid[offset + i])
+      shadow->data[offset + i] = data[i];
+}
+
+/* Hold a write back until the batch ends; returns false if it has
+ * to be sent now
+ */
+static bool queue_write(
+  struct fcp_device *device,
+  int                offset,
+  int                size,
+  const uint8_t     *data
+) {
+  struct app_space *shadow = &device->app_space;
+
+  if (!device->batch_depth ||
+      !shadow->pending ||
+      offset < 0 ||
+      offset + size > shadow->size)
+    return false;
+
+  memcpy(shadow->pending_data + offset, data, size);
+  memset(shadow->pending + offset, 1, size);
+
+  if (shadow->pending_start >= shadow->pending_end) {
+    shadow->pending_start = offset;
+    shadow->pending_end = offset + size;
+  } else {
+    if (offset < shadow->pending_start)
+      shadow->pending_start = offset;
+    if (offset + size > shadow->pending_end)
+      shadow->pending_end = offset + size;
+  }
+
+  update_shadow(shadow, offset, size, data);
+
+  return true;
+}
+
+int app_space_write(
+  struct fcp_device *device,
+  int                offset,
+  int                width,
+  int                value
+) {
+  uint8_t data[4] = {
+    value & 0xff,
+    (value >> 8) & 0xff,
+    (value >> 16) & 0xff,
+    (value >> 24) & 0xff
+  };
+
+  if (queue_write(device, offset, width, data))
+    return 0;
+
+  int err = fcp_data_write(device->hwdep, offset, width, value);
+  if (err < 0)
+    return err;
+
+  update_shadow(&device->app_space, offset, width, data);
+  record_echo(&device->app_space, offset, width, data);
+
+  return 0;
+}
+
+int app_space_write_buf(
+  struct fcp_device *device,
+  int                offset,
+  int                size,
+  const void        *buf
+) {
+  if (queue_write(device, offset, size, buf))
+    return 0;
+
+  int err = fcp_data_write_buf(device->hwdep, offset, size, buf);
+  if (err < 0)
+    return err;
+
+  update_shadow(&device->app_space, offset, size, buf);
+  record_echo(&device->app_space, offset, size, buf);
+
+  return 0;
+}
+
+/* Send each held back notification once, in the order they were
+ * first needed; the data they refer to has already been written
+ */
+static int send_pending_notify(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+  int count = shadow->notify_count;
+  int err = 0;
+
+  shadow->notify_count = 0;
+  shadow->notify_scheduled = false;
+
+  for (int i = 0; i < count && err >= 0; i++)
+    err = fcp_data_notify(device->hwdep, shadow->notify_events[i]);
+
+  if (count)
+    log_debug("Sent %d coalesced device notifications", count);
+
+  return err;
+}
+
+static void notify_timer_cb(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct fcp_device *device = data;
+
+  int err = send_pending_writes(device);
+  if (err >= 0)
+    err = send_pending_notify(device);
+  if (err < 0)
+    log_error("Cannot notify device: %s", snd_strerror(err));
+}
+
+int app_space_notify(struct fcp_device *device, int event) {
+  struct app_space *shadow = &device->app_space;
+
+  if (!device->batch_depth)
+    return fcp_data_notify(device->hwdep, event);
+
+  for (int i = 0; i < shadow->notify_count; i++)
+    if (shadow->notify_events[i] == event)
+      return 0;
+
+  if (shadow->notify_count == APP_SPACE_MAX_NOTIFY) {
+    int err = send_pending_writes(device);
+    if (err >= 0)
+      err = send_pending_notify(device);
+    if (err < 0)
+      return err;
+  }
+
+  shadow->notify_events[shadow->notify_count++] = event;
+
+  return 0;
+}
+
+static int send_pending_writes(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+  int start = shadow->pending_start;
+  int end = shadow->pending_end;
+  int writes = 0;
+  int err = 0;
+
+  shadow->pending_start = shadow->pending_end = 0;
+
+  /* Send each run of adjacent pending bytes with one write */
+  int i = start;
+  while (i < end) {
+    if (!shadow->pending[i]) {
+      i++;
+      continue;
+    }
+
+    int run_start = i;
+    while (i < end && shadow->pending[i] && i - run_start < APP_SPACE_READ_MAX)
+      i++;
+
+    memset(shadow->pending + run_start, 0, i - run_start);
+
+    if (err < 0)
+      continue;
+
+    err = fcp_data_write_buf(
+      device->hwdep, run_start, i - run_start,
+      shadow->pending_data + run_start
+    );
+    if (err >= 0)
+      record_echo(
+        shadow, run_start, i - run_start, shadow->pending_data + run_start
+      );
+    writes++;
+  }
+
+  if (writes)
+    log_debug("Sent pending APP_SPACE bytes with %d writes", writes);
+
+  return err;
+}
+
+int app_space_flush_writes(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+
+  int err = send_pending_writes(device);
+  if (err < 0 || !shadow->notify_count)
+    return err;
+
+  if (shadow->notify_debounce_ms <= 0)
+    return send_pending_notify(device);
+
+  // Already due; not restarted so that a long run of changes still
+  // notifies every notify_debounce_ms
+  if (shadow->notify_scheduled)
+    return 0;
+
+  if (!shadow->notify_timer) {
+    shadow->notify_timer = event_add_timer(notify_timer_cb, device);
+    if (!shadow->notify_timer)
+      return send_pending_notify(device);
+  }
+
+  err = event_timer_arm(shadow->notify_timer, shadow->notify_debounce_ms, 0);
+  if (err < 0)
+    return send_pending_notify(device);
+
+  shadow->notify_scheduled = true;
+  return 0;
+}
+
+int app_space_flush_notify(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+
+  if (shadow->notify_scheduled)
+    event_timer_arm(shadow->notify_timer, 0, 0);
+
+  return send_pending_notify(device);
+}
+
+void app_space_cleanup(struct fcp_device *device) {
+  struct app_space *shadow = &device->app_space;
+
+  event_remove(shadow->notify_timer);
+  shadow->notify_timer = NULL;
+  shadow->notify_scheduled = false;
+  shadow->notify_count = 0;
+}
@@ -0,0 +1,166 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct fcp_device;
+struct control_props;
+struct control_hot;
+struct event_source;
+
+/* Largest single FCP_OPCODE_DATA_READ used to fill the shadow */
+#define APP_SPACE_READ_MAX 1024
+
+/* Ranges closer together than this are fetched with one read */
+#define APP_SPACE_MERGE_GAP 16
+
+/* Maximum number of APP_SPACE ranges used by a single control */
+#define MAX_CONTROL_RANGES 8
+
+/* Maximum number of distinct device notifications held back during
+ * a batch
+ */
+#define APP_SPACE_MAX_NOTIFY 16
+
+/* How long the bytes the server has written are trusted when the
+ * device notifies that they've changed
+ */
+#define APP_SPACE_ECHO_MS 50
+
+/* Shadow copy of the device's APP_SPACE
+ *
+ * When a notification arrives, the ranges covered by the affected
+ * controls are fetched with a few large reads and the control read
+ * functions decode their values from here instead of each doing
+ * their own FCP_OPCODE_DATA_READ. Bytes are only used while marked
+ * valid; the shadow is invalidated once the notification has been
+ * handled.
+ *
+ * While a device batch is open, writes are held in pending_data and
+ * sent by app_space_flush_writes(), with adjacent writes combined
+ * into one FCP_OPCODE_DATA_WRITE and each device notification sent
+ * once after them. With FCP_NOTIFY_DEBOUNCE_MS set, the notifications
+ * are held for that long so that those of consecutive batches (as
+ * when a preset is restored) are combined too.
+ *
+ * Bytes written to the device are also kept in echo_data for
+ * APP_SPACE_ECHO_MS. The device usually notifies after a write; if
+ * every range the prefetch needs was just written by us, it takes
+ * them from here rather than reading back what was just written.
+ */
+struct app_space {
+  int      size;
+  uint8_t *data;
+  uint8_t *valid;
+  uint8_t *pending_data;
+  uint8_t *pending;
+  int      pending_start;  // Bounds of the pending bytes; empty if
+  int      pending_end;    // start >= end
+  int      notify_events[APP_SPACE_MAX_NOTIFY];
+  int      notify_count;
+  int      notify_debounce_ms;
+  bool     notify_scheduled;
+  struct event_source *notify_timer;
+  uint8_t *echo_data;
+  uint64_t *echo_expiry;  // stats_time_us() until which each byte is
+                          // known; 0 if never written
+};
+
+/* A half-open range [start, end) of APP_SPACE offsets */
+struct app_space_range {
+  int start;
+  int end;
+};
+
+void app_space_init(struct fcp_device *device);
+void app_space_invalidate(struct fcp_device *device);
+
+/* Get the APP_SPACE ranges that a control's value is stored in.
+ * Returns the number of ranges (0 if the control is not backed by
+ * APP_SPACE).
+ */
+int get_control_data_ranges(
+  const struct control_props *props,
+  struct app_space_range     *ranges,
+  int                         max_ranges
+);
+
+/* Fill in how the control's value can be decoded from the shadow */
+void get_control_decode(
+  const struct control_props *props,
+  struct control_hot         *hot
+);
+
+/* Decode the values of the given controls from the shadow in one
+ * pass. decoded[i] is cleared for controls which need their read
+ * function instead (not simply stored, not valid in the shadow, or
+ * an unknown enum value). Returns the number decoded.
+ */
+int app_space_decode(
+  struct fcp_device *device,
+  const int         *control_indices,
+  int                count,
+  int               *values,
+  bool              *decoded
+);
+
+/* Fetch the ranges used by the given controls into the shadow */
+int app_space_prefetch(
+  struct fcp_device *device,
+  const int         *control_indices,
+  int                count
+);
+
+/* Read a 1/2/4 byte value from the shadow if valid, otherwise from
+ * the device
+ */
+int app_space_read(
+  struct fcp_device *device,
+  int                offset,
+  int                width,
+  bool               is_signed,
+  int               *value
+);
+
+/* Read a buffer from the shadow if valid, otherwise from the device */
+int app_space_read_buf(
+  struct fcp_device *device,
+  int                offset,
+  int                size,
+  void              *buf
+);
+
+/* Write a 1/2/4 byte value to the device, keeping the shadow in sync */
+int app_space_write(
+  struct fcp_device *device,
+  int                offset,
+  int                width,
+  int                value
+);
+
+/* Write a buffer to the device, keeping the shadow in sync */
+int app_space_write_buf(
+  struct fcp_device *device,
+  int                offset,
+  int                size,
+  const void        *buf
+);
+
+/* Send a device notification, after the pending writes if a batch
+ * is open
+ */
+int app_space_notify(struct fcp_device *device, int event);
+
+/* Send the writes and notifications held back during a batch */
+int app_space_flush_writes(struct fcp_device *device);
+
+/* Send the held back notifications now rather than after the
+ * debounce delay, before values they affect are read back
+ */
+int app_space_flush_notify(struct fcp_device *device);
+
+/* Drop the notifications not yet sent, once the device has gone */
+void app_space_cleanup(struct fcp_device *device);
@@ -5,102 +5,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include "control-utils.h"
+#include "app-space.h"
 #include "fcp.h"
 #include "log.h"
 
 int find_member_by_path(
-  struct fcp_device   *device,
-  const char          *path,
-  struct json_object **found_member,
-  const char         **member_type,
-  int                 *total_offset,
-  bool                 allow_missing
-) {
-  return find_member_by_path_with_notify(
-    device, path, found_member, member_type, total_offset,
-    NULL, NULL, allow_missing
-  );
-}
-
-int find_member_by_path_with_notify(
-  struct fcp_device   *device,
-  const char          *path,
-  struct json_object **found_member,
-  const char         **member_type,
-  int                 *total_offset,
-  int                 *notify_device,
-  int                 *notify_client,
-  bool                 allow_missing
+  struct fcp_device    *device,
+  const char           *path,
+  struct devmap_member *member,
+  bool                  allow_missing
 ) {
-  struct json_object *structs, *current_struct, *current_members;
-  char *path_copy = strdup(path);
-  char *token, *saveptr;
-  const char *current_type = "APP_SPACE";
-  *total_offset = 0;
-
-  /* Track last non-null notify values */
-  int last_notify_device = 0;
-  int last_notify_client = 0;
-
-  if (!json_object_object_get_ex(device->devmap, "structs", &structs)) {
-    log_error("Cannot find structs in device map");
-    free(path_copy);
+  if (!device->devmap_index) {
+    log_error("No devmap index");
     return -1;
   }
 
-  /* Start with APP_SPACE */
-  if (!json_object_object_get_ex(structs, "APP_SPACE", &current_struct) ||
-      !json_object_object_get_ex(current_struct, "members", &current_members)) {
-    log_error("Cannot find APP_SPACE members");
-    free(path_copy);
+  if (devmap_index_lookup(device->devmap_index, path, member) < 0) {
+    if (!allow_missing)
+      log_error("Cannot find member %s", path);
     return -1;
   }
 
-  struct json_object *member = NULL;
-
-  /* Walk the dot-separated path */
-  token = strtok_r(path_copy, ".", &saveptr);
-  while (token != NULL) {
-    if (!json_object_object_get_ex(current_members, token, &member)) {
-      if (!allow_missing)
-        log_error("Cannot find member %s", token);
-      free(path_copy);
-      return -1;
-    }
-
-    /* Add this member's offset */
-    *total_offset += json_object_get_int(json_object_object_get(member, "offset"));
-
-    /* Track notify values - use this member's value if non-null */
-    struct json_object *nd = json_object_object_get(member, "notify-device");
-    struct json_object *nc = json_object_object_get(member, "notify-client");
-    if (nd && !json_object_is_type(nd, json_type_null))
-      last_notify_device = json_object_get_int(nd);
-    if (nc && !json_object_is_type(nc, json_type_null))
-      last_notify_client = json_object_get_int(nc);
-
-    /* Get the member's type */
-    current_type = json_object_get_string(json_object_object_get(member, "type"));
-
-    /* More path components? Look up next struct */
-    token = strtok_r(NULL, ".", &saveptr);
-    if (token != NULL) {
-      if (!json_object_object_get_ex(structs, current_type, &current_struct) ||
-          !json_object_object_get_ex(current_struct, "members", &current_members)) {
-        log_error("Cannot find struct '%s' members", current_type);
-        free(path_copy);
-        return -1;
-      }
-    }
-  }
-
-  free(path_copy);
-  *found_member = member;
-  *member_type = current_type;
-  if (notify_device)
-    *notify_device = last_notify_device;
-  if (notify_client)
-    *notify_client = last_notify_client;
   return 0;
 }
 
@@ -142,6 +67,78 @@ int devmap_type_to_data_type_with_width(const char *type, int width) {
   return ret;
 }
 
+/* Get the width in bytes of a data type, or 0 if invalid */
+int data_type_width(int data_type) {
+  switch (data_type) {
+    case DATA_TYPE_UINT8:
+    case DATA_TYPE_INT8:
+      return 1;
+    case DATA_TYPE_UINT16:
+    case DATA_TYPE_INT16:
+      return 2;
+    case DATA_TYPE_UINT32:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+/* Largest span of enum values mapped with a lookup table */
+#define ENUM_MAP_MAX_SIZE 256
+
+void build_enum_map(struct control_props *props) {
+  props->enum_map = NULL;
+  props->enum_map_size = 0;
+
+  if (!props->enum_values || !props->enum_count)
+    return;
+
+  int min = props->enum_values[0];
+  int max = props->enum_values[0];
+
+  for (int i = 1; i < props->enum_count; i++) {
+    if (props->enum_values[i] < min)
+      min = props->enum_values[i];
+    if (props->enum_values[i] > max)
+      max = props->enum_values[i];
+  }
+
+  // Widely spread values are looked up linearly instead
+  if ((long)max - min >= ENUM_MAP_MAX_SIZE)
+    return;
+
+  int size = max - min + 1;
+  props->enum_map = calloc(size, sizeof(int));
+  if (!props->enum_map) {
+    log_error("Cannot allocate memory for enum map");
+    exit(1);
+  }
+
+  // The first index wins if a value is repeated, as with a linear
+  // search
+  for (int i = props->enum_count - 1; i >= 0; i--)
+    props->enum_map[props->enum_values[i] - min] = i + 1;
+
+  props->enum_map_base = min;
+  props->enum_map_size = size;
+}
+
+int enum_value_to_index(const struct control_props *props, int value) {
+  if (props->enum_map) {
+    unsigned int i = (unsigned int)(value - props->enum_map_base);
+
+    return i < (unsigned int)props->enum_map_size
+      ? props->enum_map[i] - 1
+      : -1;
+  }
+
+  for (int i = 0; i < props->enum_count; i++)
+    if (props->enum_values[i] == value)
+      return i;
+
+  return -1;
+}
+
 static int read_single_data_control(
   struct fcp_device    *device,
   struct control_props *props,
@@ -150,24 +147,16 @@ static int read_single_data_control(
   int                   array_index,
   int                  *value
 ) {
-  int width;
-
-  if (data_type == DATA_TYPE_UINT8 ||
-      data_type == DATA_TYPE_INT8) {
-    width = 1;
-  } else if (data_type == DATA_TYPE_UINT16 ||
-             data_type == DATA_TYPE_INT16) {
-    width = 2;
-  } else if (data_type == DATA_TYPE_UINT32) {
-    width = 4;
-  } else {
+  int width = data_type_width(data_type);
+
+  if (!width) {
     log_error("Invalid data type %d for control %s", data_type, props->name);
     return -1;
   }
   bool is_signed = data_type & 1;
 
-  return fcp_data_read(
-    device->hwdep,
+  return app_space_read(
+    device,
     offset + props->array_index * width,
     width,
     is_signed,
@@ -192,12 +181,12 @@ int read_data_control(struct fcp_device *device, struct control_props *props, in
      * back to the index
      */
     if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED && props->enum_values) {
-      for (int i = 0; i < props->enum_count; i++) {
-        if (props->enum_values[i] == read_value) {
-          log_debug("Read %s as %s (%d)", props->name, props->enum_names[i], i);
-          *value = i;
-          return 0;
-        }
+      int i = enum_value_to_index(props, read_value);
+
+      if (i >= 0) {
+        log_debug("Read %s as %s (%d)", props->name, props->enum_names[i], i);
+        *value = i;
+        return 0;
       }
       log_error(
         "Invalid enumerated value %d for control %s",
@@ -227,8 +216,6 @@ int read_data_control(struct fcp_device *device, struct control_props *props, in
 }
 
 int write_data_control(struct fcp_device *device, struct control_props *props, int value) {
-  int width = 0;
-
   if (props->read_only) {
     log_error("Read-only control %s cannot be written", props->name);
     return -1;
@@ -256,22 +243,15 @@ int write_data_control(struct fcp_device *device, struct control_props *props, i
     value = props->enum_values[value];
   }
 
-  if (props->data_type == DATA_TYPE_UINT8 ||
-      props->data_type == DATA_TYPE_INT8) {
-    width = 1;
-  } else if (props->data_type == DATA_TYPE_UINT16 ||
-             props->data_type == DATA_TYPE_INT16) {
-    width = 2;
-  } else if (props->data_type == DATA_TYPE_UINT32) {
-    width = 4;
-  } else {
+  int width = data_type_width(props->data_type);
+  if (!width) {
     log_error("Invalid data type %d for control %s",
               props->data_type, props->name);
     return -1;
   }
 
   int offset = props->offset + props->array_index * width;
-  return fcp_data_write(device->hwdep, offset, width, value);
+  return app_space_write(device, offset, width, value);
 }
 
 int read_bitmap_data_control(
@@ -284,16 +264,8 @@ int read_bitmap_data_control(
     return -1;
   }
 
-  int width;
-  if (props->data_type == DATA_TYPE_UINT8 ||
-      props->data_type == DATA_TYPE_INT8) {
-    width = 1;
-  } else if (props->data_type == DATA_TYPE_UINT16 ||
-             props->data_type == DATA_TYPE_INT16) {
-    width = 2;
-  } else if (props->data_type == DATA_TYPE_UINT32) {
-    width = 4;
-  } else {
+  int width = data_type_width(props->data_type);
+  if (!width) {
     log_error("Invalid data type %d for control %s",
               props->data_type, props->name);
     return -1;
@@ -301,7 +273,7 @@ int read_bitmap_data_control(
 
   int read_value;
 
-  int err = fcp_data_read(device->hwdep, props->offset, width, false, &read_value);
+  int err = app_space_read(device, props->offset, width, false, &read_value);
   if (err < 0)
     return err;
 
@@ -325,16 +297,8 @@ int write_bitmap_data_control(
     return -1;
   }
 
-  int width;
-  if (props->data_type == DATA_TYPE_UINT8 ||
-      props->data_type == DATA_TYPE_INT8) {
-    width = 1;
-  } else if (props->data_type == DATA_TYPE_UINT16 ||
-             props->data_type == DATA_TYPE_INT16) {
-    width = 2;
-  } else if (props->data_type == DATA_TYPE_UINT32) {
-    width = 4;
-  } else {
+  int width = data_type_width(props->data_type);
+  if (!width) {
     log_error("Invalid data type %d for control %s",
               props->data_type, props->name);
     return -1;
@@ -342,7 +306,7 @@ int write_bitmap_data_control(
 
   int read_value;
 
-  int err = fcp_data_read(device->hwdep, props->offset, width, false, &read_value);
+  int err = app_space_read(device, props->offset, width, false, &read_value);
   if (err < 0)
     return err;
 
@@ -352,7 +316,7 @@ int write_bitmap_data_control(
   else
     read_value &= ~mask;
 
-  return fcp_data_write(device->hwdep, props->offset, width, read_value);
+  return app_space_write(device, props->offset, width, read_value);
 }
 
 int read_bytes_control(
@@ -374,7 +338,7 @@ int read_bytes_control(
     return -1;
   }
 
-  return fcp_data_read_buf(device->hwdep, props->offset, size, data);
+  return app_space_read_buf(device, props->offset, size, data);
 }
 
 int write_bytes_control(
@@ -401,5 +365,5 @@ int write_bytes_control(
     return -1;
   }
 
-  return fcp_data_write_buf(device->hwdep, props->offset, size, data);
+  return app_space_write_buf(device, props->offset, size, data);
 }
@@ -4,6 +4,7 @@
 #pragma once
 
 #include "device.h"
+#include "devmap-index.h"
 
 /* Common control read/write functions used by all control types */
 
@@ -31,27 +32,25 @@ int write_bitmap_data_control(
   int                   value
 );
 
+int data_type_width(int data_type);
+
+/* Precompute the value to index map of an enumerated control with
+ * explicit values, if the values are close enough together
+ */
+void build_enum_map(struct control_props *props);
+
+/* Get the index of an enumerated control's value; -1 if not found */
+int enum_value_to_index(const struct control_props *props, int value);
+
 int devmap_type_to_data_type(const char *type);
 int devmap_type_to_data_type_with_width(const char *type, int width);
 
+/* Look up an APP_SPACE member by its dot-separated path */
 int find_member_by_path(
-  struct fcp_device   *device,
-  const char          *path,
-  struct json_object **found_member,
-  const char         **member_type,
-  int                 *total_offset,
-  bool                 allow_missing
-);
-
-int find_member_by_path_with_notify(
-  struct fcp_device   *device,
-  const char          *path,
-  struct json_object **found_member,
-  const char         **member_type,
-  int                 *total_offset,
-  int                 *notify_device,
-  int                 *notify_client,
-  bool                 allow_missing
+  struct fcp_device    *device,
+  const char           *path,
+  struct devmap_member *member,
+  bool                  allow_missing
 );
 
 int read_bytes_control(
@@ -8,22 +8,40 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <json-c/json.h>
 
 #include "device-ops.h"
 #include "fcp.h"
+#include "fcp-io.h"
+#include "esp-dfu.h"
 #include "fcp-devmap.h"
+#include "app-space.h"
+#include "control-utils.h"
 #include "sync.h"
 #include "input-controls.h"
 #include "output-controls.h"
 #include "global-controls.h"
 #include "mix.h"
 #include "mux.h"
+#include "job.h"
+#include "event-loop.h"
+#include "fcp-socket.h"
 #include "meter.h"
+#include "poller.h"
+#include "startup.h"
+#include "stats.h"
+#include "strpool.h"
 #include "log.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+// Deferred control values are read in batches once the server is
+// running
+#define LAZY_LOAD_DELAY_MS    100
+#define LAZY_LOAD_INTERVAL_MS 5
+#define LAZY_LOAD_BATCH       32
+
 // Get USB IDs from procfs - format is "VID:PID"
 static void get_usb_ids(int card_num, uint16_t *vid, uint16_t *pid) {
   char *proc_path;
@@ -166,12 +184,100 @@ void init_control_manager(struct fcp_device *device) {
   struct control_manager *ctrl_mgr = &device->ctrl_mgr;
 
   ctrl_mgr->controls = calloc(initial_capacity, sizeof(struct control_props));
-  if (!ctrl_mgr->controls) {
+  ctrl_mgr->hot = calloc(initial_capacity, sizeof(struct control_hot));
+  if (!ctrl_mgr->controls || !ctrl_mgr->hot) {
     log_error("Cannot allocate memory for control manager");
     exit(1);
   }
   ctrl_mgr->capacity = initial_capacity;
   ctrl_mgr->num_controls = 0;
+  ctrl_mgr->range_count = 0;
+
+  // Most sessions never look at the mix matrix, so its values are
+  // read after startup
+  ctrl_mgr->lazy_categories = 1u << CATEGORY_MIX;
+  ctrl_mgr->lazy_next = 0;
+}
+
+/* FNV-1a hash of a control name */
+static unsigned int hash_name(const char *name) {
+  unsigned int hash = 2166136261u;
+
+  while (*name) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static unsigned int hash_numid(unsigned int numid) {
+  return numid * 2654435761u;
+}
+
+static void hash_table_insert(
+  int          *table,
+  int           size,
+  unsigned int  hash,
+  int           index
+) {
+  unsigned int mask = size - 1;
+  unsigned int slot = hash & mask;
+
+  while (table[slot])
+    slot = (slot + 1) & mask;
+  table[slot] = index + 1;
+}
+
+/* (Re)allocate the hash tables for at least min_controls controls */
+static void hash_resize(struct fcp_device *device, int min_controls) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int size = 16;
+
+  // Keep the load factor at or below 50%
+  while (size < min_controls * 2)
+    size *= 2;
+
+  free(ctrl_mgr->numid_hash);
+  free(ctrl_mgr->name_hash);
+  ctrl_mgr->numid_hash = calloc(size, sizeof(int));
+  ctrl_mgr->name_hash = calloc(size, sizeof(int));
+  if (!ctrl_mgr->numid_hash || !ctrl_mgr->name_hash) {
+    log_error("Cannot allocate memory for control hash");
+    exit(1);
+  }
+  ctrl_mgr->hash_size = size;
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++) {
+    struct control_props *props = &ctrl_mgr->controls[i];
+
+    ctrl_mgr->hot[i].numid = props->numid;
+    hash_table_insert(ctrl_mgr->name_hash, size, hash_name(props->name), i);
+    if (props->numid)
+      hash_table_insert(
+        ctrl_mgr->numid_hash, size, hash_numid(props->numid), i
+      );
+  }
+}
+
+static void hash_insert_control(struct fcp_device *device, int index) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  struct control_props *props = &ctrl_mgr->controls[index];
+
+  ctrl_mgr->hot[index].numid = props->numid;
+
+  if (ctrl_mgr->num_controls * 2 > ctrl_mgr->hash_size) {
+    hash_resize(device, ctrl_mgr->num_controls);
+    return;
+  }
+
+  hash_table_insert(
+    ctrl_mgr->name_hash, ctrl_mgr->hash_size, hash_name(props->name), index
+  );
+  if (props->numid)
+    hash_table_insert(
+      ctrl_mgr->numid_hash, ctrl_mgr->hash_size,
+      hash_numid(props->numid), index
+    );
 }
 
 int add_control(struct fcp_device *device, struct control_props *props) {
@@ -189,36 +295,206 @@ int add_control(struct fcp_device *device, struct control_props *props) {
       exit(1);
     }
     ctrl_mgr->controls = new_controls;
+
+    struct control_hot *new_hot = realloc(
+      ctrl_mgr->hot,
+      new_capacity * sizeof(struct control_hot)
+    );
+    if (!new_hot) {
+      log_error("Cannot reallocate memory for control manager");
+      exit(1);
+    }
+    ctrl_mgr->hot = new_hot;
     ctrl_mgr->capacity = new_capacity;
   }
 
+  // Make room for this control's APP_SPACE ranges
+  if (ctrl_mgr->range_count + MAX_CONTROL_RANGES > ctrl_mgr->range_alloc) {
+    int new_alloc = ctrl_mgr->range_alloc ? ctrl_mgr->range_alloc * 2 : 64;
+
+    struct app_space_range *new_ranges = realloc(
+      ctrl_mgr->ranges,
+      new_alloc * sizeof(struct app_space_range)
+    );
+    if (!new_ranges) {
+      log_error("Cannot reallocate memory for control ranges");
+      exit(1);
+    }
+    ctrl_mgr->ranges = new_ranges;
+    ctrl_mgr->range_alloc = new_alloc;
+  }
+
   struct control_props *new_props = &ctrl_mgr->controls[ctrl_mgr->num_controls];
   *new_props = *props;
-  new_props->name = strdup(props->name);
-  if (!new_props->name) {
-    log_error("Cannot allocate memory for control name");
-    exit(1);
-  }
-  if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED) {
-    new_props->enum_names = malloc(props->enum_count * sizeof(char *));
-    if (!new_props->enum_names) {
-      log_error("Cannot allocate memory for enum names");
+  new_props->name = strpool_intern(props->name);
+  if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED)
+    new_props->enum_names = strpool_intern_list(
+      props->enum_names, props->enum_count
+    );
+
+  // BYTES controls keep their value in bytes_value, which is
+  // allocated when the value is first read or written
+  new_props->value_pending =
+    (ctrl_mgr->lazy_categories & (1u << props->category)) != 0;
+
+  struct control_hot *hot = &ctrl_mgr->hot[ctrl_mgr->num_controls];
+  hot->notify_client = props->notify_client;
+  hot->numid = 0;
+  hot->range_first = ctrl_mgr->range_count;
+  hot->range_count = get_control_data_ranges(
+    new_props, &ctrl_mgr->ranges[ctrl_mgr->range_count], MAX_CONTROL_RANGES
+  );
+  ctrl_mgr->range_count += hot->range_count;
+  get_control_decode(new_props, hot);
+
+  if (props->type == SND_CTL_ELEM_TYPE_ENUMERATED)
+    build_enum_map(new_props);
+
+  ctrl_mgr->num_controls++;
+  ctrl_mgr->notify_index_dirty = true;
+
+  if (!ctrl_mgr->defer_create)
+    add_user_control(device, new_props);
+
+  hash_insert_control(device, ctrl_mgr->num_controls - 1);
+
+  return 0;
+}
+
+/* Create the ALSA elements of all the collected controls. Their
+ * initial values are decoded from one snapshot of APP_SPACE, fetched
+ * with a few large reads, rather than each control doing its own
+ * read.
+ */
+static void create_user_controls(struct fcp_device *device) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int count = ctrl_mgr->num_controls;
+
+  if (count) {
+    int *indices = malloc(count * sizeof(*indices));
+    if (!indices) {
+      log_error("Cannot allocate memory for control indices");
       exit(1);
     }
-    for (int i = 0; i < props->enum_count; i++) {
-      new_props->enum_names[i] = strdup(props->enum_names[i]);
-      if (!new_props->enum_names[i]) {
-        log_error("Cannot allocate memory for enum name");
-        exit(1);
-      }
+    for (int i = 0; i < count; i++)
+      indices[i] = i;
+
+    app_space_prefetch(device, indices, count);
+    free(indices);
+  }
+
+  for (int i = 0; i < count; i++)
+    add_user_control(device, &ctrl_mgr->controls[i]);
+
+  ctrl_mgr->defer_create = false;
+  app_space_invalidate(device);
+
+  // The numids are only known now the elements exist
+  hash_resize(device, count);
+
+  log_debug("Created %d controls", count);
+}
+
+/* Build the per-bit lists of controls subscribed to each
+ * notification bit
+ */
+static void build_notify_index(struct fcp_device *device) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int n = ctrl_mgr->num_controls;
+
+  for (int bit = 0; bit < NOTIFY_BUCKET_COUNT; bit++) {
+    uint32_t mask = 1u << bit;
+    int size = 0;
+
+    for (int i = 0; i < n; i++)
+      if (ctrl_mgr->hot[i].notify_client & mask)
+        size++;
+
+    free(ctrl_mgr->notify_buckets[bit]);
+    ctrl_mgr->notify_buckets[bit] = NULL;
+    ctrl_mgr->notify_bucket_size[bit] = size;
+    if (!size)
+      continue;
+
+    ctrl_mgr->notify_buckets[bit] = malloc(size * sizeof(int));
+    if (!ctrl_mgr->notify_buckets[bit]) {
+      log_error("Cannot allocate memory for notification index");
+      exit(1);
     }
+
+    size = 0;
+    for (int i = 0; i < n; i++)
+      if (ctrl_mgr->hot[i].notify_client & mask)
+        ctrl_mgr->notify_buckets[bit][size++] = i;
   }
 
-  ctrl_mgr->num_controls++;
+  free(ctrl_mgr->notify_indices);
+  free(ctrl_mgr->notify_values);
+  free(ctrl_mgr->notify_decoded);
+  free(ctrl_mgr->notify_seen);
+  ctrl_mgr->notify_indices = malloc((n ? n : 1) * sizeof(int));
+  ctrl_mgr->notify_values = malloc((n ? n : 1) * sizeof(int));
+  ctrl_mgr->notify_decoded = malloc((n ? n : 1) * sizeof(bool));
+  ctrl_mgr->notify_seen = calloc(n ? n : 1, sizeof(unsigned int));
+  if (!ctrl_mgr->notify_indices || !ctrl_mgr->notify_values ||
+      !ctrl_mgr->notify_decoded || !ctrl_mgr->notify_seen) {
+    log_error("Cannot allocate memory for notification index");
+    exit(1);
+  }
+  ctrl_mgr->notify_generation = 0;
+  ctrl_mgr->notify_index_dirty = false;
+}
+
+static int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
 
-  add_user_control(device, new_props);
+/* Get the indices (in control order) of the controls subscribed to
+ * any of the bits in the notification
+ */
+static int get_notify_controls(
+  struct fcp_device *device,
+  uint32_t           notification,
+  int              **indices
+) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
 
-  return 0;
+  if (ctrl_mgr->notify_index_dirty)
+    build_notify_index(device);
+
+  // Reset the seen markers when the generation counter wraps
+  if (++ctrl_mgr->notify_generation == 0) {
+    memset(
+      ctrl_mgr->notify_seen, 0,
+      ctrl_mgr->num_controls * sizeof(unsigned int)
+    );
+    ctrl_mgr->notify_generation = 1;
+  }
+  unsigned int gen = ctrl_mgr->notify_generation;
+
+  int count = 0;
+  int buckets_used = 0;
+  for (int bit = 0; bit < NOTIFY_BUCKET_COUNT; bit++) {
+    if (!(notification & (1u << bit)) || !ctrl_mgr->notify_bucket_size[bit])
+      continue;
+
+    buckets_used++;
+    for (int j = 0; j < ctrl_mgr->notify_bucket_size[bit]; j++) {
+      int idx = ctrl_mgr->notify_buckets[bit][j];
+
+      if (ctrl_mgr->notify_seen[idx] == gen)
+        continue;
+      ctrl_mgr->notify_seen[idx] = gen;
+      ctrl_mgr->notify_indices[count++] = idx;
+    }
+  }
+
+  // Controls from more than one bucket need putting back in order
+  if (buckets_used > 1)
+    qsort(ctrl_mgr->notify_indices, count, sizeof(int), compare_ints);
+
+  *indices = ctrl_mgr->notify_indices;
+  return count;
 }
 
 /* Find control by name */
@@ -228,9 +504,43 @@ struct control_props *find_control(
 ) {
   struct control_manager *ctrl_mgr = &device->ctrl_mgr;
 
-  for (int i = 0; i < ctrl_mgr->num_controls; i++)
-    if (!strcmp(ctrl_mgr->controls[i].name, name))
-      return &ctrl_mgr->controls[i];
+  if (!ctrl_mgr->hash_size)
+    return NULL;
+
+  unsigned int mask = ctrl_mgr->hash_size - 1;
+  unsigned int slot = hash_name(name) & mask;
+
+  while (ctrl_mgr->name_hash[slot]) {
+    struct control_props *props =
+      &ctrl_mgr->controls[ctrl_mgr->name_hash[slot] - 1];
+
+    if (!strcmp(props->name, name))
+      return props;
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+/* Find control by ALSA numid */
+struct control_props *find_control_by_numid(
+  struct fcp_device *device,
+  unsigned int       numid
+) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+
+  if (!ctrl_mgr->hash_size || !numid)
+    return NULL;
+
+  unsigned int mask = ctrl_mgr->hash_size - 1;
+  unsigned int slot = hash_numid(numid) & mask;
+
+  while (ctrl_mgr->numid_hash[slot]) {
+    int index = ctrl_mgr->numid_hash[slot] - 1;
+
+    if (ctrl_mgr->hot[index].numid == numid)
+      return &ctrl_mgr->controls[index];
+    slot = (slot + 1) & mask;
+  }
   return NULL;
 }
 
@@ -240,9 +550,13 @@ int device_init_controls(struct fcp_device *device) {
 
   init_control_manager(device);
 
+  // Collect all the controls, then create them together
+  device->ctrl_mgr.defer_create = true;
+
   // Check and initialise subsystems based on capabilities
   int err;
   int supported;
+  uint64_t start = stats_time_us();
 
   supported = fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_INIT);
   if (supported < 0 || !supported) {
@@ -255,50 +569,128 @@ int device_init_controls(struct fcp_device *device) {
     log_error("Device does not support required DATA category");
     return -EINVAL;
   }
+  startup_phase_end(device, STARTUP_DEVICE_INIT, &start);
 
   // Initialise optional subsystems
 
   if (fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_SYNC) > 0)
     add_sync_control(device);
+  startup_phase_end(device, STARTUP_SYNC, &start);
 
   if (fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_METER) > 0)
     add_meter_control(device);
+  startup_phase_end(device, STARTUP_METER, &start);
 
   if (fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_MIX) > 0)
     add_mix_controls(device);
+  startup_phase_end(device, STARTUP_MIX, &start);
 
   if (fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_MUX) > 0)
     add_mux_controls(device);
+  startup_phase_end(device, STARTUP_MUX, &start);
+
+  if (fcp_cap_read(device->hwdep, FCP_OPCODE_CATEGORY_ESP_DFU) > 0)
+    esp_dfu_init(device);
+  startup_phase_end(device, STARTUP_ESP_DFU, &start);
 
   // Initialise input, output, and global controls
 
   err = init_input_controls(device);
   if (err < 0)
     return err;
+  startup_phase_end(device, STARTUP_INPUT, &start);
 
   err = init_output_controls(device);
   if (err < 0)
     return err;
+  startup_phase_end(device, STARTUP_OUTPUT, &start);
 
   err = init_global_controls(device);
   if (err < 0)
     return err;
+  startup_phase_end(device, STARTUP_GLOBAL, &start);
+
+  app_space_init(device);
+  create_user_controls(device);
+  build_notify_index(device);
+  startup_phase_end(device, STARTUP_CREATE, &start);
 
   return 0;
 }
 
-void device_handle_notification(struct fcp_device *device, uint32_t notification) {
+/* Get a buffer for reading a BYTES control's value into */
+static void *get_bytes_scratch(struct fcp_device *device, int size) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+
+  if (size > ctrl_mgr->bytes_scratch_size) {
+    void *buf = realloc(ctrl_mgr->bytes_scratch, size);
+    if (!buf) {
+      log_error("Cannot allocate memory for bytes notification");
+      exit(1);
+    }
+    ctrl_mgr->bytes_scratch = buf;
+    ctrl_mgr->bytes_scratch_size = size;
+  }
+
+  return ctrl_mgr->bytes_scratch;
+}
 
+void device_handle_notification(struct fcp_device *device, uint32_t notification) {
   log_debug("Notification: 0x%08x", notification);
+  stats_count(&server_stats.notifications);
+
+  // The read-backs go after control changes but before background
+  // work
+  enum fcp_io_priority priority = fcp_io_set_priority(FCP_IO_NOTIFY);
+
+  // Mark the parts of the mix and mux caches which may have changed
+  mix_handle_notification(device, notification);
+  mux_handle_notification(device, notification);
+
+  // Wake any jobs waiting for this notification
+  job_handle_notification(device, notification);
+
+  // Find the controls affected by this notification
+  int *indices;
+  int count = get_notify_controls(device, notification, &indices);
 
-  // Check each control to see if it needs updating
-  for (int i = 0; i < device->ctrl_mgr.num_controls; i++) {
-    struct control_props *props = &device->ctrl_mgr.controls[i];
+  device_refresh_controls(device, indices, count);
 
-    if (!(notification & props->notify_client))
+  fcp_io_set_priority(priority);
+}
+
+void device_refresh_controls(
+  struct fcp_device *device,
+  const int         *indices,
+  int                count
+) {
+  uint64_t start_us = stats_time_us();
+  int rereads = 0;
+
+  // Fetch the APP_SPACE ranges they use into the shadow buffer with
+  // as few reads as possible
+  app_space_prefetch(device, indices, count);
+
+  // Decode the simply stored values together, so that the controls
+  // which haven't changed can be skipped without calling their read
+  // functions
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  app_space_decode(
+    device, indices, count, ctrl_mgr->notify_values, ctrl_mgr->notify_decoded
+  );
+
+  // Check each control to see if it needs updating, against the
+  // values last written to ALSA
+  for (int i = 0; i < count; i++) {
+    struct control_props *props = &ctrl_mgr->controls[indices[i]];
+
+    if (ctrl_mgr->notify_decoded[i] &&
+        !props->value_pending &&
+        ctrl_mgr->notify_values[i] == props->value)
       continue;
 
-    // Get current ALSA value
+    rereads++;
+
     snd_ctl_elem_value_t *alsa_value;
     snd_ctl_elem_id_t *id;
     snd_ctl_elem_value_alloca(&alsa_value);
@@ -308,25 +700,11 @@ void device_handle_notification(struct fcp_device *device, uint32_t notification
     snd_ctl_elem_id_set_name(id, props->name);
     snd_ctl_elem_value_set_id(alsa_value, id);
 
-    int err = snd_ctl_elem_read(device->ctl, alsa_value);
-    if (err < 0) {
-      log_error(
-        "Failed to read value for control %s: %s",
-        props->name,
-        snd_strerror(err)
-      );
-      continue;
-    }
-
-    bool changed = false;
+    int err;
 
     if (props->type == SND_CTL_ELEM_TYPE_BYTES) {
       // Handle BYTES controls
-      unsigned char *new_buf = calloc(1, props->size);
-      if (!new_buf) {
-        log_error("Cannot allocate memory for bytes notification");
-        continue;
-      }
+      unsigned char *new_buf = get_bytes_scratch(device, props->size);
 
       err = props->read_bytes_func(device, props, new_buf, props->size);
       if (err < 0) {
@@ -335,21 +713,30 @@ void device_handle_notification(struct fcp_device *device, uint32_t notification
           props->name,
           snd_strerror(err)
         );
-        free(new_buf);
         continue;
       }
 
-      const unsigned char *old_buf = snd_ctl_elem_value_get_bytes(alsa_value);
-      if (memcmp(old_buf, new_buf, props->size) != 0) {
-        changed = true;
-        snd_ctl_elem_set_bytes(alsa_value, new_buf, props->size);
-        log_debug("Control %s bytes changed at device", props->name);
-
-        // Update stored value
-        memcpy(props->bytes_value, new_buf, props->size);
+      // No value yet if reading it failed at startup
+      if (!props->bytes_value) {
+        props->bytes_value = calloc(1, props->size);
+        if (!props->bytes_value) {
+          log_error("Cannot allocate memory for control %s", props->name);
+          exit(1);
+        }
+      } else if (!props->value_pending &&
+                 !memcmp(props->bytes_value, new_buf, props->size)) {
+        continue;
       }
 
-      free(new_buf);
+      log_debug("Control %s bytes changed at device", props->name);
+
+      snd_ctl_elem_set_bytes(alsa_value, new_buf, props->size);
+      memcpy(props->bytes_value, new_buf, props->size);
+      props->value_pending = false;
+
+      fcp_socket_add_change(
+        device, props->numid, FCP_CONTROL_CHANGE_BYTES, new_buf, props->size
+      );
 
     } else {
       // Handle INTEGER, BOOLEAN, ENUMERATED controls
@@ -366,26 +753,35 @@ void device_handle_notification(struct fcp_device *device, uint32_t notification
         continue;
       }
 
-      for (int j = 0; j < count; j++) {
-        int old_value = snd_ctl_elem_value_get_integer(alsa_value, j);
-        if (values[j] != old_value) {
-          changed = true;
-          snd_ctl_elem_value_set_integer(alsa_value, j, values[j]);
-
-          log_debug(
-            "Control %s value changed at device from %d to %d",
-            props->name,
-            old_value,
-            values[j]
-          );
-        }
+      int *cached = props->component_count
+        ? props->component_values
+        : &props->value;
+
+      if (cached && !props->value_pending &&
+          !memcmp(cached, values, count * sizeof(int)))
+        continue;
+
+      if (!props->component_count) {
+        log_debug(
+          "Control %s value changed at device from %d to %d",
+          props->name,
+          props->value,
+          values[0]
+        );
+      } else {
+        log_debug("Control %s values changed at device", props->name);
       }
-    }
 
-    if (!changed)
-      continue;
+      store_control_values(props, values, count);
+
+      for (int j = 0; j < count; j++)
+        snd_ctl_elem_value_set_integer(alsa_value, j, values[j]);
+
+      fcp_socket_add_change(
+        device, props->numid, FCP_CONTROL_CHANGE_VALUES, values, count
+      );
+    }
 
-    // Update if changed
     err = snd_ctl_elem_write(device->ctl, alsa_value);
     if (err < 0) {
       log_error(
@@ -393,8 +789,46 @@ void device_handle_notification(struct fcp_device *device, uint32_t notification
         props->name,
         snd_strerror(err)
       );
+      continue;
     }
+
+    stats_record(&server_stats.notify_to_alsa, stats_time_us() - start_us);
   }
+
+  stats_record(&server_stats.notify_rereads, rereads);
+
+  // The shadow is only current while handling this notification
+  app_space_invalidate(device);
+
+  // Push the changes to subscribed socket clients
+  fcp_socket_flush_changes(device);
+}
+
+/* Put a BYTES control's ALSA element back to the stored value after
+ * the new value couldn't be written to the device
+ */
+static void restore_bytes_value(
+  struct fcp_device          *device,
+  struct control_props       *props,
+  const snd_ctl_elem_id_t    *control_id
+) {
+  snd_ctl_elem_value_t *value;
+  snd_ctl_elem_value_alloca(&value);
+
+  // Nothing to go back to until the value has been read
+  if (!props->bytes_value || props->value_pending)
+    return;
+
+  snd_ctl_elem_value_set_id(value, control_id);
+  snd_ctl_elem_set_bytes(value, props->bytes_value, props->size);
+
+  int err = snd_ctl_elem_write(device->ctl, value);
+  if (err < 0)
+    log_error(
+      "Failed to set value for %s: %s",
+      props->name,
+      snd_strerror(err)
+    );
 }
 
 int device_handle_control_change(
@@ -402,8 +836,13 @@ int device_handle_control_change(
   const snd_ctl_elem_id_t    *control_id,
   const snd_ctl_elem_value_t *new_value
 ) {
-  const char *name = snd_ctl_elem_id_get_name(control_id);
-  struct control_props *props = find_control(device, name);
+  // Look up by numid, falling back to the name if the event didn't
+  // have one
+  struct control_props *props = find_control_by_numid(
+    device, snd_ctl_elem_id_get_numid(control_id)
+  );
+  if (!props)
+    props = find_control(device, snd_ctl_elem_id_get_name(control_id));
 
   if (!props)
     return 0;  // Not one of our controls
@@ -423,8 +862,10 @@ int device_handle_control_change(
 
     const unsigned char *new_buf = snd_ctl_elem_value_get_bytes(new_value);
 
-    // Check if the data has actually changed
-    if (memcmp(props->bytes_value, new_buf, props->size) == 0) {
+    // Check if the data has actually changed; until a deferred
+    // value has been read, any write is a change
+    if (props->bytes_value && !props->value_pending &&
+        memcmp(props->bytes_value, new_buf, props->size) == 0) {
       return 0;  // No change
     }
 
@@ -437,17 +878,27 @@ int device_handle_control_change(
         props->name,
         snd_strerror(err)
       );
+      restore_bytes_value(device, props, control_id);
       return err;
     }
 
     // Update stored value after successful write
+    if (!props->bytes_value) {
+      props->bytes_value = calloc(1, props->size);
+      if (!props->bytes_value) {
+        log_error("Cannot allocate memory for control %s", props->name);
+        exit(1);
+      }
+    }
     memcpy(props->bytes_value, new_buf, props->size);
+    props->value_pending = false;
 
   } else {
     // Handle INTEGER, BOOLEAN, ENUMERATED controls
     int new_val = snd_ctl_elem_value_get_integer(new_value, 0);
 
-    if (new_val == props->value)
+    // Until a deferred value has been read, any write is a change
+    if (new_val == props->value && !props->value_pending)
       return 0;  // No change
 
     log_debug(
@@ -464,6 +915,7 @@ int device_handle_control_change(
 
     // Update value and notify device
     props->value = new_val;
+    props->value_pending = false;
     err = props->write_func(device, props, new_val);
     if (err < 0) {
       log_error(
@@ -476,16 +928,128 @@ int device_handle_control_change(
   }
 
   if (props->notify_device) {
-    err = fcp_data_notify(device->hwdep, props->notify_device);
+    err = app_space_notify(device, props->notify_device);
     if (err < 0) {
       log_error("Cannot notify device: %s", snd_strerror(err));
       return err;
     }
   }
 
+  device->batch_changes++;
+  stats_count(&server_stats.control_changes);
+
   return 0;
 }
 
+void device_batch_begin(struct fcp_device *device) {
+  if (!device->batch_depth++) {
+    device->batch_start_us = stats_time_us();
+    device->batch_changes = 0;
+  }
+}
+
+int device_batch_end(struct fcp_device *device) {
+  if (!device->batch_depth || --device->batch_depth)
+    return 0;
+
+  int err = app_space_flush_writes(device);
+  int mux_err = flush_mux_cache(device);
+  int mix_err = schedule_mix_flush(device);
+
+  refresh_mix_row_controls(device);
+
+  if (err >= 0)
+    err = mux_err < 0 ? mux_err : mix_err;
+
+  // Mix writes may still be waiting for their debounce delay
+  if (device->batch_changes)
+    stats_record(
+      &server_stats.alsa_to_device, stats_time_us() - device->batch_start_us
+    );
+
+  // Re-read the controls whose writes were held back, once the
+  // device has been told about them
+  uint32_t notification = device->batch_notification;
+  device->batch_notification = 0;
+  if (notification) {
+    int notify_err = app_space_flush_notify(device);
+    if (err >= 0)
+      err = notify_err;
+    device_handle_notification(device, notification);
+  }
+
+  return err;
+}
+
+static void handle_lazy_load_timer(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct fcp_device *device = data;
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int loaded = 0;
+
+  for (; ctrl_mgr->lazy_next < ctrl_mgr->num_controls &&
+         loaded < LAZY_LOAD_BATCH;
+       ctrl_mgr->lazy_next++) {
+    struct control_props *props = &ctrl_mgr->controls[ctrl_mgr->lazy_next];
+
+    // Already read because of a notification or written through ALSA
+    if (!props->value_pending)
+      continue;
+
+    // On failure, the value is read at the next notification
+    init_user_control_value(device, props);
+    loaded++;
+  }
+
+  if (ctrl_mgr->lazy_next < ctrl_mgr->num_controls)
+    return;
+
+  log_debug("Deferred control values loaded");
+  event_remove(ctrl_mgr->lazy_timer);
+  ctrl_mgr->lazy_timer = NULL;
+}
+
+int device_start_lazy_load(struct fcp_device *device) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int pending = 0;
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++)
+    if (ctrl_mgr->controls[i].value_pending)
+      pending++;
+
+  if (!pending)
+    return 0;
+
+  log_debug("Reading %d deferred control values", pending);
+
+  ctrl_mgr->lazy_next = 0;
+  ctrl_mgr->lazy_timer = event_add_timer(handle_lazy_load_timer, device);
+  if (!ctrl_mgr->lazy_timer)
+    return -1;
+
+  return event_timer_arm(
+    ctrl_mgr->lazy_timer, LAZY_LOAD_DELAY_MS, LAZY_LOAD_INTERVAL_MS
+  );
+}
+
+void device_close(struct fcp_device *device) {
+  free_mix_cache(device);
+  app_space_cleanup(device);
+  event_remove(device->ctrl_mgr.lazy_timer);
+  device->ctrl_mgr.lazy_timer = NULL;
+  poller_stop(device);
+
+  if (device->hwdep)
+    snd_hwdep_close(device->hwdep);
+  if (device->ctl)
+    snd_ctl_close(device->ctl);
+  device->hwdep = NULL;
+  device->ctl = NULL;
+}
+
 void device_get_fds(struct fcp_device *device, int *ctl_fd, int *hwdep_fd) {
   *ctl_fd = device->ctl_fd;
   *hwdep_fd = device->hwdep_fd;
@@ -504,11 +1068,160 @@ static json_object *try_load_json(const char *dir, const char *filename) {
   return obj;
 }
 
-int device_load_config(struct fcp_device *device) {
+void device_release_config(struct fcp_device *device) {
+  json_object_put(device->devmap);
+  device->devmap = NULL;
+  json_object_put(device->fam);
+  device->fam = NULL;
+}
+
+/* The devmap, FCP ALSA map, and member index are never modified once
+ * loaded, so devices of the same model running the same firmware
+ * share them rather than each loading (and indexing) its own.
+ *
+ * Devices are brought up in parallel; while one is loading the
+ * configuration for a model, the others of that model wait for it
+ * rather than loading the same maps at the same time. The JSON
+ * objects are reference counted, and the registry's references are
+ * dropped by device_release_shared_config().
+ */
+struct shared_config {
+  uint16_t              usb_vid;
+  uint16_t              usb_pid;
+  uint32_t              devmap_version;
+  bool                  loading;
+  json_object          *devmap;  // NULL if it couldn't be loaded
+  json_object          *fam;
+  struct devmap_index  *devmap_index;
+  struct shared_config *next;
+};
+
+static struct shared_config *shared_configs;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shared_loaded = PTHREAD_COND_INITIALIZER;
+
+/* Use a loaded configuration if one matches the device, or return a
+ * new entry in *pending for the caller to load and then pass to
+ * finish_shared_config()
+ *
+ * Reading the firmware version is a USB round trip, so it's done with
+ * the lock dropped, once, using the version offset from the first
+ * loaded devmap for the model. Entries are only freed after every
+ * device has been set up, so the registry is just rescanned after.
+ */
+static int use_shared_config(
+  struct fcp_device     *device,
+  struct shared_config **pending
+) {
+  uint32_t version = 0;
+  bool     have_version = false;
+
+  pthread_mutex_lock(&shared_lock);
+
+restart:
+  for (struct shared_config *c = shared_configs; c; c = c->next) {
+    if (c->usb_vid != device->usb_vid || c->usb_pid != device->usb_pid)
+      continue;
+
+    if (c->loading) {
+      pthread_cond_wait(&shared_loaded, &shared_lock);
+      goto restart;
+    }
+
+    if (!c->devmap)
+      continue;
+
+    if (!have_version) {
+      json_object *devmap = json_object_get(c->devmap);
+
+      pthread_mutex_unlock(&shared_lock);
+      int err = fcp_devmap_read_version(device, devmap, &version);
+      json_object_put(devmap);
+      pthread_mutex_lock(&shared_lock);
+
+      if (err < 0)
+        break;
+
+      have_version = true;
+      goto restart;
+    }
+
+    if (version != c->devmap_version)
+      continue;
+
+    device->devmap = json_object_get(c->devmap);
+    device->fam = json_object_get(c->fam);
+    device->devmap_index = c->devmap_index;
+    device->devmap_version = version;
+
+    log_info(
+      "Card %d: sharing configuration for %04x:%04x firmware %u",
+      device->card_num, device->usb_vid, device->usb_pid, version
+    );
+    pthread_mutex_unlock(&shared_lock);
+    return 0;
+  }
+
+  struct shared_config *c = calloc(1, sizeof(*c));
+  if (!c) {
+    log_error("Cannot allocate memory for shared configuration");
+    exit(1);
+  }
+
+  c->usb_vid = device->usb_vid;
+  c->usb_pid = device->usb_pid;
+  c->loading = true;
+  c->next = shared_configs;
+  shared_configs = c;
+  *pending = c;
+
+  pthread_mutex_unlock(&shared_lock);
+  return -ENOENT;
+}
+
+static void finish_shared_config(
+  struct fcp_device    *device,
+  struct shared_config *c,
+  bool                  loaded
+) {
+  pthread_mutex_lock(&shared_lock);
+
+  // The firmware version must be known to tell if another device
+  // can use the same maps
+  if (loaded && device->devmap_version) {
+    c->devmap_version = device->devmap_version;
+    c->devmap = json_object_get(device->devmap);
+    c->fam = json_object_get(device->fam);
+    c->devmap_index = device->devmap_index;
+  }
+
+  c->loading = false;
+  pthread_cond_broadcast(&shared_loaded);
+  pthread_mutex_unlock(&shared_lock);
+}
+
+void device_release_shared_config(void) {
+  pthread_mutex_lock(&shared_lock);
+
+  while (shared_configs) {
+    struct shared_config *c = shared_configs;
+
+    shared_configs = c->next;
+    json_object_put(c->devmap);
+    json_object_put(c->fam);
+    free(c);
+  }
+
+  pthread_mutex_unlock(&shared_lock);
+}
+
+static int load_config(struct fcp_device *device) {
+  uint64_t start = stats_time_us();
   int err;
 
   // Read device map
   err = fcp_devmap_read_json(device);
+  startup_phase_end(device, STARTUP_DEVMAP, &start);
   if (err < 0) {
     log_error("Cannot read device map: %s", snd_strerror(err));
     return err;
@@ -531,6 +1244,7 @@ int device_load_config(struct fcp_device *device) {
   for (size_t i = 0; i < ARRAY_SIZE(search_dirs); i++) {
     device->fam = try_load_json(search_dirs[i], filename);
     if (device->fam) {
+      startup_phase_end(device, STARTUP_FAM, &start);
       if (search_dirs[i])
         log_info("Loaded FCP ALSA map from %s/%s", search_dirs[i], filename);
       else
@@ -547,3 +1261,18 @@ int device_load_config(struct fcp_device *device) {
   );
   return -ENOENT;
 }
+
+int device_load_config(struct fcp_device *device) {
+  struct shared_config *pending;
+  uint64_t start = stats_time_us();
+
+  if (use_shared_config(device, &pending) == 0) {
+    startup_phase_end(device, STARTUP_DEVMAP, &start);
+    return 0;
+  }
+
+  int err = load_config(device);
+  finish_shared_config(device, pending, err == 0);
+
+  return err;
+}
@@ -15,12 +15,38 @@ int device_init_controls(struct fcp_device *device);
 
 void device_handle_notification(struct fcp_device *device, uint32_t notification);
 
+/* Re-read the given controls (indices into the control manager) and
+ * update the ALSA elements and subscribed clients of those which
+ * have changed
+ */
+void device_refresh_controls(
+  struct fcp_device *device,
+  const int         *indices,
+  int                count
+);
+
 int device_handle_control_change(
   struct fcp_device          *device,
   const snd_ctl_elem_id_t    *control_id,
   const snd_ctl_elem_value_t *new_value
 );
 
+/* Group a set of control changes; writes which can be combined are
+ * deferred until the outermost device_batch_end()
+ */
+void device_batch_begin(struct fcp_device *device);
+int device_batch_end(struct fcp_device *device);
+
+/* Read the values of the controls created without one, a batch at
+ * a time from the event loop
+ */
+int device_start_lazy_load(struct fcp_device *device);
+
+/* Release the device's timers and close its ALSA handles, once it
+ * has gone away
+ */
+void device_close(struct fcp_device *device);
+
 void device_get_fds(
   struct fcp_device *device,
   int               *ctl_fd,
@@ -29,9 +55,24 @@ void device_get_fds(
 
 int device_load_config(struct fcp_device *device);
 
+/* Free the devmap and FCP ALSA map JSON once the controls have been
+ * created; member lookups after that use device->devmap_index
+ */
+void device_release_config(struct fcp_device *device);
+
+/* Drop the configuration kept for sharing between devices, once all
+ * the devices have been set up
+ */
+void device_release_shared_config(void);
+
 int add_control(struct fcp_device *device, struct control_props *props);
 
 struct control_props *find_control(
   struct fcp_device *device,
   const char        *name
 );
+
+struct control_props *find_control_by_numid(
+  struct fcp_device *device,
+  unsigned int       numid
+);
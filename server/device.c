@@ -42,31 +42,138 @@ void remove_all_user_controls(struct fcp_device *device) {
     return;
   }
 
-  /* Remove each mixer control */
+  /* Remove each user control; the kernel refuses to remove driver
+   * controls (EINVAL), so there's no need to get the info of each
+   * element first. Removing one element of a set removes the whole
+   * set, so the rest of it is then gone (ENOENT).
+   */
   for (i = 0; i < count; i++) {
     snd_ctl_elem_list_get_id(list, i, id);
 
-    snd_ctl_elem_info_t *info;
-    snd_ctl_elem_info_alloca(&info);
+    err = snd_ctl_elem_remove(device->ctl, id);
+    if (err < 0 && err != -EINVAL && err != -ENOENT) {
+      log_error("Cannot remove control '%s': %s",
+                snd_ctl_elem_id_get_name(id), snd_strerror(err));
+    }
+  }
+
+  snd_ctl_elem_list_free_space(list);
+}
+
+void store_control_values(
+  struct control_props *props,
+  const int            *values,
+  int                   count
+) {
+  props->value_pending = false;
+
+  if (!props->component_count) {
+    props->value = values[0];
+    return;
+  }
+
+  if (!props->component_values) {
+    props->component_values = calloc(count, sizeof(int));
+    if (!props->component_values) {
+      log_error("Cannot allocate memory for control values");
+      exit(1);
+    }
+  }
+  memcpy(props->component_values, values, count * sizeof(int));
+}
+
+/* Read a control's value from the device and set its ALSA element */
+int init_user_control_value(
+  struct fcp_device    *device,
+  struct control_props *props
+) {
+  snd_ctl_elem_id_t    *id;
+  snd_ctl_elem_value_t *elem_value;
+  int err;
+
+  snd_ctl_elem_id_alloca(&id);
+  snd_ctl_elem_id_set_interface(id, props->interface);
+  snd_ctl_elem_id_set_name(id, props->name);
+
+  snd_ctl_elem_value_alloca(&elem_value);
+  snd_ctl_elem_value_set_id(elem_value, id);
+
+  if (props->type == SND_CTL_ELEM_TYPE_BYTES) {
+    /* Handle BYTES controls */
+    if (!props->bytes_value)
+      props->bytes_value = calloc(1, props->size);
+    if (!props->bytes_value) {
+      log_error("Cannot allocate memory for bytes control");
+      return -ENOMEM;
+    }
+
+    err = props->read_bytes_func(device, props, props->bytes_value, props->size);
+    if (err < 0) {
+      log_error(
+        "Cannot get initial value for control '%s': %s",
+        props->name,
+        snd_strerror(err)
+      );
+      free(props->bytes_value);
+      props->bytes_value = NULL;
+      return err;
+    }
+
+    props->value_pending = false;
+    snd_ctl_elem_set_bytes(elem_value, props->bytes_value, props->size);
 
-    snd_ctl_elem_info_set_id(info, id);
+  } else {
+    /* Handle INTEGER, BOOLEAN, ENUMERATED controls */
+    int count = props->component_count ? props->component_count : 1;
+    int values[count];
 
-    err = snd_ctl_elem_info(device->ctl, info);
+    err = props->read_func(device, props, values);
     if (err < 0) {
-      log_error("Cannot get control info: %s", snd_strerror(err));
-      continue;
+      log_error(
+        "Cannot get initial value for control '%s': %s",
+        props->name,
+        snd_strerror(err)
+      );
+      return err;
     }
 
-    if (snd_ctl_elem_info_is_user(info)) {
-      err = snd_ctl_elem_remove(device->ctl, id);
-      if (err < 0) {
-        log_error("Cannot remove control '%s': %s",
-                  snd_ctl_elem_id_get_name(id), snd_strerror(err));
+    /* Validate values are in range */
+    for (int i = 0; i < count; i++) {
+      if (values[i] < props->min || values[i] > props->max) {
+        log_error(
+          "Initial value %d for %s is out of range [%d, %d]",
+          values[i],
+          props->name,
+          props->min,
+          props->max
+        );
+        values[i] = values[i] < props->min ? props->min : props->max;
       }
     }
+
+    /* Save the initial value for comparing against when
+     * notifications arrive
+     */
+    store_control_values(props, values, count);
+
+    for (int i = 0; i < count; i++)
+      snd_ctl_elem_value_set_integer(elem_value, i, values[i]);
   }
 
-  snd_ctl_elem_list_free_space(list);
+  err = snd_ctl_elem_write(device->ctl, elem_value);
+  if (err < 0) {
+    log_error(
+      "Cannot set %s: %s",
+      props->name,
+      snd_strerror(err)
+    );
+
+    // The ALSA element doesn't have the saved value
+    props->value_pending = true;
+    return err;
+  }
+
+  return 0;
 }
 
 int add_user_control(struct fcp_device *device, struct control_props *props) {
@@ -85,8 +192,11 @@ int add_user_control(struct fcp_device *device, struct control_props *props) {
   /* Set up control info */
   snd_ctl_elem_info_set_id(info, id);
 
-  /* Try to remove if exists */
-  snd_ctl_elem_remove(ctl, id);
+  /* Try to remove if exists; when the controls are created together
+   * remove_all_user_controls() has already done this
+   */
+  if (!device->ctrl_mgr.defer_create)
+    snd_ctl_elem_remove(ctl, id);
 
   if (props->component_count) {
     if (props->type != SND_CTL_ELEM_TYPE_INTEGER) {
@@ -139,6 +249,11 @@ int add_user_control(struct fcp_device *device, struct control_props *props) {
     return err;
   }
 
+  /* Save the numid for looking the control up when events arrive */
+  props->numid = snd_ctl_elem_info_get_numid(info);
+  if (!props->numid && snd_ctl_elem_info(ctl, info) >= 0)
+    props->numid = snd_ctl_elem_info_get_numid(info);
+
   /* Set the TLV */
   if (props->tlv) {
     err = snd_ctl_elem_tlv_write(ctl, id, props->tlv);
@@ -152,81 +267,11 @@ int add_user_control(struct fcp_device *device, struct control_props *props) {
     }
   }
 
-  /* Get the initial value */
-  snd_ctl_elem_value_t *elem_value;
-  snd_ctl_elem_value_alloca(&elem_value);
-  snd_ctl_elem_value_set_id(elem_value, id);
-
-  if (props->type == SND_CTL_ELEM_TYPE_BYTES) {
-    /* Handle BYTES controls */
-    props->bytes_value = calloc(1, props->size);
-    if (!props->bytes_value) {
-      log_error("Cannot allocate memory for bytes control");
-      return -ENOMEM;
-    }
-
-    err = props->read_bytes_func(device, props, props->bytes_value, props->size);
-    if (err < 0) {
-      log_error(
-        "Cannot get initial value for control '%s': %s",
-        props->name,
-        snd_strerror(err)
-      );
-      free(props->bytes_value);
-      props->bytes_value = NULL;
-      return err;
-    }
-
-    snd_ctl_elem_set_bytes(elem_value, props->bytes_value, props->size);
-
-  } else {
-    /* Handle INTEGER, BOOLEAN, ENUMERATED controls */
-    int count = props->component_count ? props->component_count : 1;
-    int values[count];
-
-    err = props->read_func(device, props, values);
-    if (err < 0) {
-      log_error(
-        "Cannot get initial value for control '%s': %s",
-        props->name,
-        snd_strerror(err)
-      );
+  /* Get the initial value, unless that's deferred */
+  if (!props->value_pending) {
+    err = init_user_control_value(device, props);
+    if (err < 0)
       return err;
-    }
-
-    /* Validate values are in range */
-    for (int i = 0; i < count; i++) {
-      if (values[i] < props->min || values[i] > props->max) {
-        log_error(
-          "Initial value %d for %s is out of range [%d, %d]",
-          values[i],
-          props->name,
-          props->min,
-          props->max
-        );
-        values[i] = values[i] < props->min ? props->min : props->max;
-      }
-    }
-
-    /* Save the initial value (writing is not supported for
-     * multi-component controls so we don't need to keep the
-     * value)
-     */
-    if (!props->component_count)
-      props->value = values[0];
-
-    for (int i = 0; i < count; i++)
-      snd_ctl_elem_value_set_integer(elem_value, i, values[i]);
-  }
-
-  err = snd_ctl_elem_write(ctl, elem_value);
-  if (err < 0) {
-    log_error(
-      "Cannot set %s: %s",
-      props->name,
-      snd_strerror(err)
-    );
-    return err;
   }
 
   /* Unlock the control if it's not read-only.
@@ -6,8 +6,18 @@
 #include <alsa/asoundlib.h>
 #include <json-c/json.h>
 
+#include "app-space.h"
 #include "mix.h"
 #include "mux.h"
+#include "startup.h"
+
+struct event_source;
+struct devmap_index;
+struct esp_dfu_config;
+struct meter_stream;
+struct control_poller;
+struct socket_server;
+struct fcp_io;
 
 #define CATEGORY_DATA  0x01
 #define CATEGORY_SYNC  0x02
@@ -21,10 +31,77 @@
 #define DATA_TYPE_INT16  0x05
 #define DATA_TYPE_UINT32 0x08
 
+/* One bucket per notification bit */
+#define NOTIFY_BUCKET_COUNT 32
+
+/* How a control's value can be decoded straight from the APP_SPACE
+ * shadow, without calling its read function
+ */
+#define CONTROL_DECODE_NONE     0
+#define CONTROL_DECODE_UNSIGNED 1
+#define CONTROL_DECODE_SIGNED   2
+#define CONTROL_DECODE_BIT      3
+
+/* The per-control fields used on every notification, kept in an
+ * array parallel to the control_props so that the dispatch and
+ * prefetch loops don't pull the rest of each control into the cache
+ */
+struct control_hot {
+  uint32_t     notify_client;
+  unsigned int numid;
+  int          range_first;  // Index of the first of its APP_SPACE ranges
+  int          range_count;  // 0 if not backed by APP_SPACE
+  int          data_offset;  // Where a decodable value is stored
+  uint8_t      decode;       // CONTROL_DECODE_*
+  uint8_t      width;
+  uint8_t      bit;          // For CONTROL_DECODE_BIT
+};
+
 struct control_manager {
   struct control_props *controls;
+  struct control_hot   *hot;
   int                  num_controls;
   int                  capacity;
+
+  /* APP_SPACE ranges of all the controls, packed in control order */
+  struct app_space_range *ranges;
+  int                  range_count;
+  int                  range_alloc;
+
+  /* Indices of the controls subscribed to each notification bit,
+   * rebuilt after controls are added
+   */
+  int                 *notify_buckets[NOTIFY_BUCKET_COUNT];
+  int                  notify_bucket_size[NOTIFY_BUCKET_COUNT];
+  bool                 notify_index_dirty;
+
+  /* Open-addressed hash tables of control index + 1 (0 = empty)
+   * keyed by ALSA numid and by name
+   */
+  int                 *numid_hash;
+  int                 *name_hash;
+  int                  hash_size;
+
+  /* Scratch space for notification dispatch */
+  int                 *notify_indices;
+  int                 *notify_values;
+  bool                *notify_decoded;
+  unsigned int        *notify_seen;
+  unsigned int         notify_generation;
+  void                *bytes_scratch;
+  int                  bytes_scratch_size;
+
+  /* Set while controls are being collected; their ALSA elements are
+   * created together once they are all known
+   */
+  bool                 defer_create;
+
+  /* Categories whose initial values are read after startup, from
+   * lazy_timer, rather than while the controls are created
+   */
+  uint32_t             lazy_categories;
+  struct event_source *lazy_timer;
+  int                  lazy_next;
 };
 
 struct fcp_device {
@@ -34,6 +111,8 @@ struct fcp_device {
   snd_ctl_t              *ctl;
   snd_hwdep_t            *hwdep;
   json_object            *devmap;
+  uint32_t                devmap_version;
+  struct devmap_index    *devmap_index;
   json_object            *fam;
   int                     ctl_fd;
   int                     hwdep_fd;
@@ -42,12 +121,30 @@ struct fcp_device {
   int                     mix_output_count;
   int                     mix_input_control_count;
   struct mix_cache_entry *mix_cache;
+  struct event_source    *mix_flush_timer;
+  int                     mix_debounce_ms;
+  uint32_t                mix_notify_mask;
+  bool                    mix_flush_scheduled;
   struct mux_cache       *mux_cache;
   struct control_manager  ctrl_mgr;
+  struct app_space        app_space;
+  int                     batch_depth;
+  uint32_t                batch_notification;  // Re-read after the batch
+  uint64_t                batch_start_us;
+  int                     batch_changes;
+  uint32_t                startup_us[STARTUP_PHASE_COUNT];
+
+  // Per-device state of the modules which serve it (NULL if unused)
+  struct esp_dfu_config  *esp_dfu;
+  struct meter_stream    *meter_stream;
+  struct control_poller  *poller;
+  struct socket_server   *socket_server;
+  struct fcp_io          *io;
 };
 
 struct control_props {
-  char  *name;
+  const char *name;        // Interned (see strpool.h)
+  unsigned int numid;      // ALSA numid, set once the element is added
   int    array_index;
   int    interface;
   int    type;
@@ -58,9 +155,12 @@ struct control_props {
   int    step;
   int    link;
   const unsigned int *tlv;
-  char **enum_names;
+  const char **enum_names; // Interned list, shared between controls
   int   *enum_values;
   int    enum_count;
+  int   *enum_map;         // Index + 1 of each value from enum_map_base
+  int    enum_map_base;
+  int    enum_map_size;
   int    read_only;
   int    notify_client;
   int    notify_device;
@@ -70,7 +170,10 @@ struct control_props {
   int   *data_types;       // types of each component
   int    size;             // for BYTES controls
   int    value;
+  int   *component_values; // for multi-component controls
   void  *bytes_value;      // for BYTES controls - stores current value
+  bool   value_pending;    // Initial value not read from the device yet
+  bool   poll;             // Re-read by the poller (see poller.h)
   int    (*read_func)(struct fcp_device *, struct control_props *, int *);
   int    (*write_func)(struct fcp_device *, struct control_props *, int);
   int    (*read_bytes_func)(struct fcp_device *, struct control_props *, void *, size_t);
@@ -79,3 +182,16 @@ struct control_props {
 
 void remove_all_user_controls(struct fcp_device *device);
 int add_user_control(struct fcp_device *device, struct control_props *props);
+/* Save the values last written to a control's ALSA element; these
+ * are what notifications are compared against
+ */
+void store_control_values(
+  struct control_props *props,
+  const int            *values,
+  int                   count
+);
+
+int init_user_control_value(
+  struct fcp_device    *device,
+  struct control_props *props
+);
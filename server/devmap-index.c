@@ -0,0 +1,350 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "devmap-index.h"
+#include "log.h"
+
+/* Structs nested deeper than this are not indexed */
+#define MAX_STRUCT_DEPTH 16
+
+struct index_builder {
+  struct devmap_index_entry *entries;
+  int                        entry_count;
+  int                        entry_alloc;
+  char                      *strings;
+  size_t                     strings_size;
+  size_t                     strings_alloc;
+};
+
+/* FNV-1a */
+static uint32_t hash_path(const char *path) {
+  uint32_t hash = 2166136261u;
+
+  while (*path) {
+    hash ^= (uint8_t)*path++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static uint32_t add_string(struct index_builder *b, const char *s) {
+  size_t len = strlen(s) + 1;
+
+  if (b->strings_size + len > b->strings_alloc) {
+    size_t new_alloc = b->strings_alloc ? b->strings_alloc * 2 : 4096;
+
+    while (new_alloc < b->strings_size + len)
+      new_alloc *= 2;
+
+    b->strings = realloc(b->strings, new_alloc);
+    if (!b->strings) {
+      log_error("Cannot allocate memory for devmap index strings");
+      exit(1);
+    }
+    b->strings_alloc = new_alloc;
+  }
+
+  uint32_t offset = b->strings_size;
+  memcpy(b->strings + offset, s, len);
+  b->strings_size += len;
+
+  return offset;
+}
+
+static struct devmap_index_entry *add_entry(struct index_builder *b) {
+  if (b->entry_count == b->entry_alloc) {
+    b->entry_alloc = b->entry_alloc ? b->entry_alloc * 2 : 256;
+    b->entries = realloc(b->entries, b->entry_alloc * sizeof(*b->entries));
+    if (!b->entries) {
+      log_error("Cannot allocate memory for devmap index entries");
+      exit(1);
+    }
+  }
+
+  struct devmap_index_entry *entry = &b->entries[b->entry_count++];
+  memset(entry, 0, sizeof(*entry));
+  return entry;
+}
+
+/* Get an int member which may be null or missing */
+static bool get_optional_int(
+  struct json_object *obj,
+  const char         *key,
+  int                *value
+) {
+  struct json_object *v;
+
+  if (!json_object_object_get_ex(obj, key, &v) ||
+      json_object_is_type(v, json_type_null))
+    return false;
+
+  *value = json_object_get_int(v);
+  return true;
+}
+
+static void add_struct_members(
+  struct index_builder *b,
+  struct json_object   *structs,
+  struct json_object   *members,
+  const char           *prefix,
+  int                   base_offset,
+  int                   path_notify_device,
+  int                   path_notify_client,
+  int                   depth
+) {
+  json_object_object_foreach(members, name, member) {
+    char *path;
+
+    if (prefix) {
+      if (asprintf(&path, "%s.%s", prefix, name) < 0) {
+        log_error("Cannot allocate memory for member path");
+        exit(1);
+      }
+    } else {
+      path = strdup(name);
+      if (!path) {
+        log_error("Cannot allocate memory for member path");
+        exit(1);
+      }
+    }
+
+    const char *type = json_object_get_string(
+      json_object_object_get(member, "type")
+    );
+    int offset = base_offset + json_object_get_int(
+      json_object_object_get(member, "offset")
+    );
+    int notify_device = 0, notify_client = 0;
+    int path_device = path_notify_device, path_client = path_notify_client;
+
+    if (get_optional_int(member, "notify-device", &notify_device))
+      path_device = notify_device;
+    if (get_optional_int(member, "notify-client", &notify_client))
+      path_client = notify_client;
+
+    struct devmap_index_entry *entry = add_entry(b);
+    entry->hash = hash_path(path);
+    entry->path = add_string(b, path);
+    entry->type = add_string(b, type ? type : "");
+    entry->offset = offset;
+    entry->size = json_object_get_int(json_object_object_get(member, "size"));
+    entry->notify_device = notify_device;
+    entry->notify_client = notify_client;
+    entry->path_notify_device = path_device;
+    entry->path_notify_client = path_client;
+
+    /* Index the members of nested structs */
+    struct json_object *child_struct, *child_members;
+
+    if (type && depth < MAX_STRUCT_DEPTH &&
+        json_object_object_get_ex(structs, type, &child_struct) &&
+        json_object_object_get_ex(child_struct, "members", &child_members))
+      add_struct_members(
+        b, structs, child_members, path, offset,
+        path_device, path_client, depth + 1
+      );
+
+    free(path);
+  }
+}
+
+/* Set the section pointers from the base of a packed index */
+static int set_sections(struct devmap_index *index) {
+  const struct devmap_index_header *header = index->base;
+
+  if (index->size < sizeof(*header) ||
+      header->magic != DEVMAP_INDEX_MAGIC ||
+      header->version != DEVMAP_INDEX_VERSION ||
+      !header->bucket_count ||
+      (header->bucket_count & (header->bucket_count - 1)))
+    return -1;
+
+  size_t buckets_size = (size_t)header->bucket_count * sizeof(uint32_t);
+  size_t entries_size =
+    (size_t)header->entry_count * sizeof(struct devmap_index_entry);
+
+  if (index->size !=
+        sizeof(*header) + buckets_size + entries_size + header->strings_size)
+    return -1;
+
+  index->header = header;
+  index->buckets = (const uint32_t *)(header + 1);
+  index->entries = (const struct devmap_index_entry *)
+    ((const char *)index->buckets + buckets_size);
+  index->strings = (const char *)index->entries + entries_size;
+
+  /* The string table must be terminated so that lookups can't run
+   * off the end
+   */
+  if (header->strings_size &&
+      index->strings[header->strings_size - 1] != '\0')
+    return -1;
+
+  /* Chains always point to earlier entries, so a valid index can't
+   * loop
+   */
+  for (uint32_t i = 0; i < header->entry_count; i++) {
+    const struct devmap_index_entry *entry = &index->entries[i];
+
+    if (entry->path >= header->strings_size ||
+        entry->type >= header->strings_size ||
+        entry->next > i)
+      return -1;
+  }
+  for (uint32_t i = 0; i < header->bucket_count; i++)
+    if (index->buckets[i] > header->entry_count)
+      return -1;
+
+  return 0;
+}
+
+struct devmap_index *devmap_index_build(struct json_object *devmap) {
+  struct json_object *structs, *app_space, *members;
+
+  if (!json_object_object_get_ex(devmap, "structs", &structs) ||
+      !json_object_object_get_ex(structs, "APP_SPACE", &app_space) ||
+      !json_object_object_get_ex(app_space, "members", &members)) {
+    log_error("Cannot find APP_SPACE members");
+    return NULL;
+  }
+
+  struct index_builder b = { 0 };
+
+  add_struct_members(&b, structs, members, NULL, 0, 0, 0, 0);
+
+  /* Keep the load factor at or below 50% */
+  uint32_t bucket_count = 16;
+  while (bucket_count < (uint32_t)b.entry_count * 2)
+    bucket_count *= 2;
+
+  size_t buckets_size = bucket_count * sizeof(uint32_t);
+  size_t entries_size = b.entry_count * sizeof(struct devmap_index_entry);
+  size_t size = sizeof(struct devmap_index_header) +
+                buckets_size + entries_size + b.strings_size;
+
+  struct devmap_index *index = calloc(1, sizeof(*index));
+  void *base = calloc(1, size);
+  if (!index || !base) {
+    log_error("Cannot allocate memory for devmap index");
+    exit(1);
+  }
+
+  struct devmap_index_header *header = base;
+  header->magic = DEVMAP_INDEX_MAGIC;
+  header->version = DEVMAP_INDEX_VERSION;
+  header->entry_count = b.entry_count;
+  header->bucket_count = bucket_count;
+  header->strings_size = b.strings_size;
+
+  uint32_t *buckets = (uint32_t *)(header + 1);
+  struct devmap_index_entry *entries =
+    (struct devmap_index_entry *)((char *)buckets + buckets_size);
+
+  /* Chain the entries into their buckets */
+  for (int i = 0; i < b.entry_count; i++) {
+    uint32_t bucket = b.entries[i].hash & (bucket_count - 1);
+
+    entries[i] = b.entries[i];
+    entries[i].next = buckets[bucket];
+    buckets[bucket] = i + 1;
+  }
+  if (b.strings_size)
+    memcpy((char *)entries + entries_size, b.strings, b.strings_size);
+
+  free(b.entries);
+  free(b.strings);
+
+  index->base = base;
+  index->size = size;
+  index->mapped = false;
+  set_sections(index);
+
+  log_debug("Built devmap index with %d members", header->entry_count);
+
+  return index;
+}
+
+struct devmap_index *devmap_index_load(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  struct devmap_index *index = calloc(1, sizeof(*index));
+  if (!index) {
+    log_error("Cannot allocate memory for devmap index");
+    exit(1);
+  }
+
+  index->base = base;
+  index->size = st.st_size;
+  index->mapped = true;
+
+  if (set_sections(index) < 0) {
+    log_warning("Ignoring invalid devmap index %s", path);
+    devmap_index_free(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+void devmap_index_free(struct devmap_index *index) {
+  if (!index)
+    return;
+
+  if (index->mapped)
+    munmap(index->base, index->size);
+  else
+    free(index->base);
+  free(index);
+}
+
+int devmap_index_lookup(
+  const struct devmap_index *index,
+  const char                *path,
+  struct devmap_member      *member
+) {
+  uint32_t hash = hash_path(path);
+  uint32_t i = index->buckets[hash & (index->header->bucket_count - 1)];
+
+  while (i) {
+    const struct devmap_index_entry *entry = &index->entries[i - 1];
+
+    if (entry->hash == hash && !strcmp(index->strings + entry->path, path)) {
+      member->type               = index->strings + entry->type;
+      member->offset             = entry->offset;
+      member->size               = entry->size;
+      member->notify_device      = entry->notify_device;
+      member->notify_client      = entry->notify_client;
+      member->path_notify_device = entry->path_notify_device;
+      member->path_notify_client = entry->path_notify_client;
+      return 0;
+    }
+
+    i = entry->next;
+  }
+
+  return -1;
+}
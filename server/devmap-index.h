@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <json-c/json.h>
+
+/* Compiled index of the APP_SPACE members in a device map
+ *
+ * Every dot-separated member path (e.g. "outputGroup.volume") is
+ * flattened with its absolute offset so that it can be looked up
+ * with one hash probe instead of walking the JSON structs. The index
+ * is one contiguous block (header, hash buckets, entries, string
+ * table) so that it can be saved to and mmap()ed from the cache.
+ */
+
+#define DEVMAP_INDEX_MAGIC   0x49504346 /* "FCPI" */
+#define DEVMAP_INDEX_VERSION 1
+
+struct devmap_index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t bucket_count;  /* power of 2 */
+  uint32_t strings_size;
+};
+
+/* Entries in each bucket are chained through next (index + 1, or 0
+ * for the end of the chain); path and type are string table offsets
+ */
+struct devmap_index_entry {
+  uint32_t hash;
+  uint32_t next;
+  uint32_t path;
+  uint32_t type;
+  int32_t  offset;
+  int32_t  size;
+  int32_t  notify_device;
+  int32_t  notify_client;
+  int32_t  path_notify_device;
+  int32_t  path_notify_client;
+};
+
+struct devmap_index {
+  void                             *base;
+  size_t                            size;
+  bool                              mapped;
+  const struct devmap_index_header *header;
+  const uint32_t                   *buckets;
+  const struct devmap_index_entry  *entries;
+  const char                       *strings;
+};
+
+/* A resolved member
+ *
+ * notify_device/notify_client: the member's own values (0 if null)
+ * path_notify_device/path_notify_client: the last non-null values
+ *   along the path to the member
+ */
+struct devmap_member {
+  const char *type;
+  int         offset;
+  int         size;
+  int         notify_device;
+  int         notify_client;
+  int         path_notify_device;
+  int         path_notify_client;
+};
+
+/* Build an index from the devmap JSON */
+struct devmap_index *devmap_index_build(struct json_object *devmap);
+
+/* Map an index previously saved from base/size; NULL if missing or
+ * invalid
+ */
+struct devmap_index *devmap_index_load(const char *path);
+
+void devmap_index_free(struct devmap_index *index);
+
+/* Look up a member path; returns 0 on success or -1 if not found */
+int devmap_index_lookup(
+  const struct devmap_index *index,
+  const char                *path,
+  struct devmap_member      *member
+);
@@ -2,6 +2,9 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
 #include <json-c/json.h>
 
 #include "device.h"
@@ -9,10 +12,15 @@
 #include "fcp-socket.h"
 #include "esp-dfu.h"
 #include "hash.h"
+#include "job.h"
 #include "log.h"
 
 #define ESP_FLASH_BLOCK_SIZE 1024
 
+/* Upper limits for FCP_ESP_DFU_BLOCK_SIZE and FCP_ESP_DFU_WINDOW */
+#define ESP_DFU_MAX_BLOCK_SIZE 32768
+#define ESP_DFU_MAX_WINDOW     8
+
 /* Structure to hold all ESP DFU related values from devmap */
 struct esp_dfu_config {
   /* State values from eSuperState enum */
@@ -46,7 +54,7 @@ struct esp_dfu_config {
   struct {
     uint32_t esp_boot_mode;
   } notify_device;
-} config;
+};
 
 /* Get enum value from devmap */
 static int get_enum_value(
@@ -84,23 +92,26 @@ static int get_enum_value(
 /* Get all ESP DFU configuration from devmap
  * Returns 0 on success, -1 on failure
  */
-static int get_esp_dfu_config(struct json_object *devmap) {
+static int get_esp_dfu_config(
+  struct json_object    *devmap,
+  struct esp_dfu_config *config
+) {
   int err;
 
   /* Get state values */
-  err = get_enum_value(devmap, "eSuperState", "eSuperOff", &config.states.off) ||
-        get_enum_value(devmap, "eSuperState", "eSuperDFU", &config.states.dfu) ||
-        get_enum_value(devmap, "eSuperState", "eSuperNormal", &config.states.normal);
+  err = get_enum_value(devmap, "eSuperState", "eSuperOff", &config->states.off) ||
+        get_enum_value(devmap, "eSuperState", "eSuperDFU", &config->states.dfu) ||
+        get_enum_value(devmap, "eSuperState", "eSuperNormal", &config->states.normal);
   if (err) {
     log_error("Failed to get state values from devmap");
     return -1;
   }
 
   /* Get notification values */
-  err = get_enum_value(devmap, "eDFU_NOTIFICATION", "eClear", &config.dfu_notifications.clear) ||
-        get_enum_value(devmap, "eDFU_NOTIFICATION", "eNextblock", &config.dfu_notifications.next_block) ||
-        get_enum_value(devmap, "eDFU_NOTIFICATION", "eFinish", &config.dfu_notifications.finish) ||
-        get_enum_value(devmap, "eDFU_NOTIFICATION", "eError", &config.dfu_notifications.error);
+  err = get_enum_value(devmap, "eDFU_NOTIFICATION", "eClear", &config->dfu_notifications.clear) ||
+        get_enum_value(devmap, "eDFU_NOTIFICATION", "eNextblock", &config->dfu_notifications.next_block) ||
+        get_enum_value(devmap, "eDFU_NOTIFICATION", "eFinish", &config->dfu_notifications.finish) ||
+        get_enum_value(devmap, "eDFU_NOTIFICATION", "eError", &config->dfu_notifications.error);
   if (err) {
     log_error("Failed to get notification values from devmap");
     return -1;
@@ -116,7 +127,7 @@ static int get_esp_dfu_config(struct json_object *devmap) {
     log_error("Cannot find DFU notification type");
     return -1;
   }
-  config.notify_client.dfu_change = json_object_get_int(dfu_change);
+  config->notify_client.dfu_change = json_object_get_int(dfu_change);
 
   /* Get offsets */
   struct json_object *structs, *app_space, *members;
@@ -163,7 +174,7 @@ static int get_esp_dfu_config(struct json_object *devmap) {
     log_error("Cannot find ESPBootMode offset/notify-device");
     return -1;
   }
-  config.notify_device.esp_boot_mode = json_object_get_int(boot_mode_notify);
+  config->notify_device.esp_boot_mode = json_object_get_int(boot_mode_notify);
 
   if (!json_object_object_get_ex(esp_members, "DFU_NOTIFY", &dfu_notify) ||
       !json_object_object_get_ex(dfu_notify, "offset", &dfu_notify)) {
@@ -172,9 +183,9 @@ static int get_esp_dfu_config(struct json_object *devmap) {
   }
 
   /* Calculate final offsets */
-  config.offsets.state = esp_base + json_object_get_int(super_state);
-  config.offsets.esp_boot_mode = json_object_get_int(boot_mode_offset);
-  config.offsets.dfu_notify = esp_base + json_object_get_int(dfu_notify);
+  config->offsets.state = esp_base + json_object_get_int(super_state);
+  config->offsets.esp_boot_mode = json_object_get_int(boot_mode_offset);
+  config->offsets.dfu_notify = esp_base + json_object_get_int(dfu_notify);
 
   return 0;
 }
@@ -182,8 +193,11 @@ static int get_esp_dfu_config(struct json_object *devmap) {
 /* Read ESP state
  * Returns 0 on success, FCP_SOCKET_ERR_FCP on failure
  */
-int fcp_esp_get_state(snd_hwdep_t *hwdep, int *state) {
-  int err = fcp_data_read(hwdep, config.offsets.state, 1, false, state);
+static int fcp_esp_get_state(struct fcp_device *device, int *state) {
+  const struct esp_dfu_config *config = device->esp_dfu;
+  snd_hwdep_t *hwdep = device->hwdep;
+
+  int err = fcp_data_read(hwdep, config->offsets.state, 1, false, state);
 
   if (err < 0)
     log_error("Cannot get ESP state: %s", snd_strerror(err));
@@ -194,14 +208,17 @@ int fcp_esp_get_state(snd_hwdep_t *hwdep, int *state) {
 /* Set ESP boot mode
  * Returns 0 on success, FCP_SOCKET_ERR_FCP on failure
  */
-int fcp_esp_set_boot_mode(snd_hwdep_t *hwdep, int mode) {
-  int err = fcp_data_write(hwdep, config.offsets.esp_boot_mode, 1, mode);
+static int fcp_esp_set_boot_mode(struct fcp_device *device, int mode) {
+  const struct esp_dfu_config *config = device->esp_dfu;
+  snd_hwdep_t *hwdep = device->hwdep;
+
+  int err = fcp_data_write(hwdep, config->offsets.esp_boot_mode, 1, mode);
   if (err < 0) {
     log_error("Cannot set ESP boot mode: %s", snd_strerror(err));
     return FCP_SOCKET_ERR_FCP;
   }
 
-  err = fcp_data_notify(hwdep, config.notify_device.esp_boot_mode);
+  err = fcp_data_notify(hwdep, config->notify_device.esp_boot_mode);
   if (err < 0) {
     log_error("Cannot notify ESP boot mode: %s", snd_strerror(err));
     return FCP_SOCKET_ERR_FCP;
@@ -213,8 +230,11 @@ int fcp_esp_set_boot_mode(snd_hwdep_t *hwdep, int mode) {
 /* Get the ESP DFU notification
  * Returns 0 on success, FCP_SOCKET_ERR_FCP on failure
  */
-int fcp_esp_get_dfu_notify(snd_hwdep_t *hwdep, int *notify) {
-  int err = fcp_data_read(hwdep, config.offsets.dfu_notify, 1, false, notify);
+static int fcp_esp_get_dfu_notify(struct fcp_device *device, int *notify) {
+  const struct esp_dfu_config *config = device->esp_dfu;
+  snd_hwdep_t *hwdep = device->hwdep;
+
+  int err = fcp_data_read(hwdep, config->offsets.dfu_notify, 1, false, notify);
 
   if (err < 0)
     log_error("Cannot get ESP DFU notify: %s", snd_strerror(err));
@@ -225,8 +245,11 @@ int fcp_esp_get_dfu_notify(snd_hwdep_t *hwdep, int *notify) {
 /* Clear the ESP DFU notification
  * Returns 0 on success, FCP_SOCKET_ERR_FCP on failure
  */
-int fcp_esp_clear_dfu_notify(snd_hwdep_t *hwdep) {
-  int err = fcp_data_write(hwdep, config.offsets.dfu_notify, 1, config.dfu_notifications.clear);
+static int fcp_esp_clear_dfu_notify(struct fcp_device *device) {
+  const struct esp_dfu_config *config = device->esp_dfu;
+  snd_hwdep_t *hwdep = device->hwdep;
+
+  int err = fcp_data_write(hwdep, config->offsets.dfu_notify, 1, config->dfu_notifications.clear);
 
   if (err < 0)
     log_error("Cannot clear ESP DFU notify: %s", snd_strerror(err));
@@ -234,179 +257,483 @@ int fcp_esp_clear_dfu_notify(snd_hwdep_t *hwdep) {
   return err < 0 ? FCP_SOCKET_ERR_FCP : 0;
 }
 
-/* Wait for a DFU change notification from the ESP
- * Returns 0 on success (notification received), FCP_SOCKET_ERR_FCP or
- * FCP_SOCKET_ERR_TIMEOUT on failure
- */
-static int wait_for_esp_notification(struct fcp_device *device, const char *msg) {
-  int fd = device->hwdep_fd;
-  fd_set rfds;
-  struct timeval tv;
-  time_t start_time = time(NULL);
-
-  log_debug("Waiting for ESP notification: %s", msg);
-
-  // Wait up to 10 seconds
-  while (difftime(time(NULL), start_time) < 10) {
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
-
-    tv.tv_sec = 10 - difftime(time(NULL), start_time);
-    tv.tv_usec = 0;
+#define ESP_NOTIFY_TIMEOUT_MS 10000
+#define ESP_RETRY_MS          100
+#define ESP_RETRIES           5
 
-    int ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+/* The update is a state machine run by the event loop; each state
+ * either moves straight on to the next or waits for a notification
+ * or retry delay
+ */
+enum esp_dfu_state {
+  ESP_DFU_CHECK,        // Check the ESP is running and turn it off
+  ESP_DFU_SET_STATE,    // Set the boot mode to target_state
+  ESP_DFU_WAIT_STATE,   // Wait for the boot mode change notification
+  ESP_DFU_CHECK_STATE,  // Check the ESP state is target_state
+  ESP_DFU_START,        // Start DFU
+  ESP_DFU_WAIT_DFU,     // Wait for the ESP to enter DFU mode
+  ESP_DFU_FIRST_BLOCK,  // Wait for the first next block notification
+  ESP_DFU_WAIT_NOTIFY,  // Wait for the expected_notify DFU notification
+  ESP_DFU_WRITE,        // Write the next batch of blocks
+  ESP_DFU_ACKED,        // The batch has been acknowledged
+  ESP_DFU_FINISH,       // Write the final empty block
+  ESP_DFU_OFF,          // Turn the ESP off
+  ESP_DFU_ON,           // Turn the ESP back on
+  ESP_DFU_DONE
+};
+
+/* Returned by a state to run the next state immediately */
+#define ESP_DFU_NEXT -2
+
+struct esp_dfu_job {
+  struct job               job;
+  void                    *msg;
+  struct firmware_payload *payload;
+  enum esp_dfu_state       state;
+  enum esp_dfu_state       next;           // State after a sub-step
+  uint8_t                  target_state;   // For SET/CHECK_STATE
+  uint8_t                  expected_notify; // For WAIT_NOTIFY
+  const char              *notify_msg;
+  int                      attempts;
+  bool                     waiting;
+  size_t                   offset;
+  int                      last_progress;
+  bool                     send_stats;
+
+  // Transfer engine
+  size_t                   block_size;
+  int                      window;          // Blocks per batch
+  int                      max_window;
+  int                      batch_blocks;    // Written, not yet acked
+  size_t                   acked;
+  struct timespec          start_time;
+  struct timespec          batch_time;
+  uint32_t                 block_latency_us;  // Smoothed per block
+  uint32_t                 best_latency_us;
+};
+
+static uint64_t elapsed_us(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000000LL +
+         (now.tv_nsec - since->tv_nsec) / 1000;
+}
 
-    // Timeout
-    if (!ret)
-      break;
+/* Get an integer tuning value from the environment, clamped to
+ * [min, max]
+ */
+static int get_env_int(const char *name, int def, int min, int max) {
+  const char *s = getenv(name);
+  if (!s || !*s)
+    return def;
+
+  char *end;
+  long value = strtol(s, &end, 10);
+  if (*end || value < min || value > max) {
+    log_warning("Ignoring invalid %s=%s (%d-%d)", name, s, min, max);
+    return def;
+  }
 
-    // Error
-    if (ret < 0) {
-      if (errno == EINTR) {
-        log_debug("Select interrupted, retrying");
-        continue;
-      }
-      log_error("Select failed waiting for %s: %s", msg, strerror(errno));
-      return FCP_SOCKET_ERR_FCP;
-    }
+  return value;
+}
 
-    // Check for data
-    if (!FD_ISSET(fd, &rfds))
-      continue;
-
-    // Read notification
-    uint32_t notification;
-    int err = snd_hwdep_read(device->hwdep, &notification, sizeof(notification));
-    if (err < 0) {
-      log_error(
-        "Failed to read notification for %s: %s",
-        msg,
-        snd_strerror(err)
+/* One next block notification acknowledges the whole batch (the ESP
+ * reports readiness through a single DFU_NOTIFY value, so
+ * notifications for separate blocks can't be told apart). The batch
+ * grows by one block each time that lowers the per-block latency,
+ * up to max_window, and shrinks if the latency doubles.
+ */
+static void update_transfer_engine(struct esp_dfu_job *esp) {
+  uint64_t batch_us = elapsed_us(&esp->batch_time);
+  uint32_t per_block = batch_us / esp->batch_blocks;
+
+  esp->block_latency_us = esp->block_latency_us
+    ? (esp->block_latency_us * 7 + per_block) / 8
+    : per_block;
+
+  if (!esp->best_latency_us || per_block < esp->best_latency_us) {
+    esp->best_latency_us = per_block;
+    if (esp->window < esp->max_window) {
+      esp->window++;
+      log_debug(
+        "ESP DFU: %u us/block, window now %d", per_block, esp->window
       );
-      return FCP_SOCKET_ERR_FCP;
     }
+  } else if (per_block > esp->best_latency_us * 2 && esp->window > 1) {
+    esp->window--;
     log_debug(
-      "Received notification 0x%08x while waiting for %s",
-      notification,
-      msg
+      "ESP DFU: %u us/block, window now %d", per_block, esp->window
     );
-
-    // Check for DFU change notification and return if found
-    if (notification & config.notify_client.dfu_change)
-      return 0;
   }
-
-  log_error("Timeout waiting for %s", msg);
-  return FCP_SOCKET_ERR_TIMEOUT;
 }
 
-/* Check that the ESP state matches the expected state and wait up to
- * 500ms for it to change if it doesn't
- * Returns 0 on success, FCP_SOCKET_ERR_FCP or FCP_SOCKET_ERR_INVALID_STATE on failure
+/* Send progress, and the transfer statistics if asked for; called
+ * on the event loop thread with the progress from job_progress()
  */
-static int check_esp_state(struct fcp_device *device, int expected_state) {
-  int esp_state;
+static void report_esp_progress(struct job *job, int progress) {
+  struct esp_dfu_job *esp = (struct esp_dfu_job *)job;
 
-  for (int i = 0; i < 5; i++) {
-    int err = fcp_esp_get_state(device->hwdep, &esp_state);
-    if (err < 0)
-      return err;
+  send_progress(job->client_fd, progress);
 
-    log_debug("ESP state: %d, expected: %d", esp_state, expected_state);
+  if (!esp->send_stats)
+    return;
 
-    if (esp_state == expected_state)
-      return 0;
+  uint64_t us = elapsed_us(&esp->start_time);
+  struct transfer_stats stats = {
+    .percent          = progress,
+    .bytes_done       = esp->acked,
+    .bytes_per_sec    = us ? esp->acked * 1000000ULL / us : 0,
+    .block_latency_us = esp->block_latency_us,
+    .block_size       = esp->block_size,
+    .window           = esp->window
+  };
+
+  send_transfer_stats(job->client_fd, &stats);
+}
 
-    log_debug("Wait to see if ESP state changes");
-    usleep(100 * 1000);
+/* Wait for a DFU change notification from the ESP
+ * Returns 0 once received, JOB_PENDING while waiting, or
+ * FCP_SOCKET_ERR_TIMEOUT
+ */
+static int wait_for_esp_notification(struct esp_dfu_job *esp, const char *msg) {
+  struct job *job = &esp->job;
+  uint32_t mask = job->device->esp_dfu->notify_client.dfu_change;
+
+  if (job->notifications & mask) {
+    job->notifications &= ~mask;
+    esp->waiting = false;
+    return 0;
   }
 
-  log_error(
-    "ESP state change timeout; expected %d, got %d",
-    expected_state,
-    esp_state
-  );
+  // Woken without the notification, so the wait timed out
+  if (esp->waiting) {
+    esp->waiting = false;
+    log_error("Timeout waiting for %s", msg);
+    return FCP_SOCKET_ERR_TIMEOUT;
+  }
 
-  return FCP_SOCKET_ERR_INVALID_STATE;
+  log_debug("Waiting for ESP notification: %s", msg);
+
+  esp->waiting = true;
+  job_wait(job, ESP_NOTIFY_TIMEOUT_MS, mask);
+
+  return JOB_PENDING;
 }
 
-/* Wait for a particular ESP DFU notification and clear it
- * Returns 0 on success, FCP_SOCKET_ERR_FCP or FCP_SOCKET_ERR_TIMEOUT on failure
+/* Set the ESP state to target_state, then continue with next */
+static int set_esp_state(
+  struct esp_dfu_job *esp,
+  uint8_t             target_state,
+  enum esp_dfu_state  next
+) {
+  esp->target_state = target_state;
+  esp->next = next;
+  esp->state = ESP_DFU_SET_STATE;
+
+  return ESP_DFU_NEXT;
+}
+
+/* Check that the ESP state is target_state, waiting up to 500ms for
+ * it to change, then continue with next
+ */
+static int check_esp_state(
+  struct esp_dfu_job *esp,
+  uint8_t             target_state,
+  enum esp_dfu_state  next
+) {
+  esp->target_state = target_state;
+  esp->next = next;
+  esp->attempts = 0;
+  esp->state = ESP_DFU_CHECK_STATE;
+
+  return ESP_DFU_NEXT;
+}
+
+/* Wait for a particular ESP DFU notification and clear it, then
+ * continue with next
  */
 static int wait_for_esp_dfu_notify(
-  struct fcp_device *device,
-  uint8_t            expected_notify,
-  const char        *msg
+  struct esp_dfu_job *esp,
+  uint8_t             expected_notify,
+  const char         *msg,
+  enum esp_dfu_state  next
 ) {
+  esp->expected_notify = expected_notify;
+  esp->notify_msg = msg;
+  esp->next = next;
+  esp->attempts = 0;
+  esp->state = ESP_DFU_WAIT_NOTIFY;
+
+  return ESP_DFU_NEXT;
+}
+
+static int esp_dfu_run_state(struct esp_dfu_job *esp) {
+  struct job *job = &esp->job;
+  struct fcp_device *device = job->device;
+  const struct esp_dfu_config *config = device->esp_dfu;
+  snd_hwdep_t *hwdep = device->hwdep;
+  struct firmware_payload *payload = esp->payload;
+  int esp_state, dfu_notify;
   int err;
-  int dfu_notify;
 
-  // Check up to 5 times
-  for (int i = 0; i < 5; i++) {
+  switch (esp->state) {
 
-    // Wait for notification; if it times out, return
-    err = wait_for_esp_notification(device, msg);
-    if (err < 0)
-      return err;
+    case ESP_DFU_CHECK:
 
-    // Get the notification
-    err = fcp_esp_get_dfu_notify(device->hwdep, &dfu_notify);
-    if (err < 0)
-      return FCP_SOCKET_ERR_FCP;
+      // Send 0% progress
+      clock_gettime(CLOCK_MONOTONIC, &esp->start_time);
+      job_progress(&esp->job, 0);
 
-    // Clear the notification
-    err = fcp_esp_clear_dfu_notify(device->hwdep);
-    if (err < 0)
-      return FCP_SOCKET_ERR_FCP;
+      err = fcp_esp_get_state(device, &esp_state);
+      if (err)
+        return err;
 
-    // Return if it's the expected notification
-    if (dfu_notify == expected_notify)
-      return 0;
+      // ESP state zero is not listed in eSuperState; probably not
+      // running leapfrog firmware
+      if (!esp_state) {
+        log_error("ESP state (0) invalid (not running leapfrog firmware?)");
+        return FCP_SOCKET_ERR_NOT_LEAPFROG;
+      }
+
+      // Turn off ESP if it's on
+      if (esp_state == config->states.normal)
+        return set_esp_state(esp, config->states.off, ESP_DFU_START);
+
+      // If it's not off, we can't update the firmware
+      if (esp_state != config->states.off) {
+        log_error(
+          "ESP is not off (state is %d), cannot update firmware", esp_state
+        );
+        return FCP_SOCKET_ERR_INVALID_STATE;
+      }
+
+      esp->state = ESP_DFU_START;
+      return ESP_DFU_NEXT;
+
+    case ESP_DFU_SET_STATE:
+      log_debug("Setting ESP state to %d", esp->target_state);
+
+      err = fcp_esp_set_boot_mode(device, esp->target_state);
+      if (err)
+        return err;
+
+      log_debug("Waiting for ESP boot mode change");
+
+      esp->state = ESP_DFU_WAIT_STATE;
+      return ESP_DFU_NEXT;
+
+    case ESP_DFU_WAIT_STATE:
+      err = wait_for_esp_notification(esp, "ESP state change");
+      if (err)
+        return err;
+
+      return check_esp_state(esp, esp->target_state, esp->next);
+
+    case ESP_DFU_CHECK_STATE:
+      err = fcp_esp_get_state(device, &esp_state);
+      if (err)
+        return err;
+
+      log_debug("ESP state: %d, expected: %d", esp_state, esp->target_state);
+
+      if (esp_state == esp->target_state) {
+        esp->state = esp->next;
+        return ESP_DFU_NEXT;
+      }
+
+      if (++esp->attempts >= ESP_RETRIES) {
+        log_error(
+          "ESP state change timeout; expected %d, got %d",
+          esp->target_state,
+          esp_state
+        );
+        return FCP_SOCKET_ERR_INVALID_STATE;
+      }
+
+      log_debug("Wait to see if ESP state changes");
+      job_wait(job, ESP_RETRY_MS, 0);
+      return JOB_PENDING;
+
+    case ESP_DFU_START:
+      err = fcp_esp_dfu_start(hwdep, payload->size, payload->md5);
+      if (err < 0)
+        return FCP_SOCKET_ERR_FCP;
+
+      esp->state = ESP_DFU_WAIT_DFU;
+      return ESP_DFU_NEXT;
+
+    case ESP_DFU_WAIT_DFU:
+      err = wait_for_esp_notification(esp, "ESP to enter DFU mode");
+      if (err)
+        return err;
+
+      return check_esp_state(esp, config->states.dfu, ESP_DFU_FIRST_BLOCK);
+
+    case ESP_DFU_FIRST_BLOCK:
+      return wait_for_esp_dfu_notify(
+        esp, config->dfu_notifications.next_block, "next block", ESP_DFU_WRITE
+      );
+
+    case ESP_DFU_WAIT_NOTIFY:
+      err = wait_for_esp_notification(esp, esp->notify_msg);
+      if (err)
+        return err;
+
+      // Get the notification
+      err = fcp_esp_get_dfu_notify(device, &dfu_notify);
+      if (err)
+        return err;
+
+      // Clear the notification
+      err = fcp_esp_clear_dfu_notify(device);
+      if (err)
+        return err;
+
+      // Continue if it's the expected notification
+      if (dfu_notify == esp->expected_notify) {
+        esp->state = esp->next;
+        return ESP_DFU_NEXT;
+      }
+
+      if (++esp->attempts >= ESP_RETRIES) {
+        log_error("ESP DFU notify timeout waiting for %s", esp->notify_msg);
+        return FCP_SOCKET_ERR_TIMEOUT;
+      }
+
+      // Wait 100ms before retrying
+      job_wait(job, ESP_RETRY_MS, 0);
+      return JOB_PENDING;
+
+    case ESP_DFU_WRITE:
+      if (esp->offset >= payload->size) {
+        esp->state = ESP_DFU_FINISH;
+        return ESP_DFU_NEXT;
+      }
+
+      // Write up to window blocks before waiting for the ack
+      clock_gettime(CLOCK_MONOTONIC, &esp->batch_time);
+      esp->batch_blocks = 0;
+
+      while (esp->batch_blocks < esp->window && esp->offset < payload->size) {
+        size_t block_size = payload->size - esp->offset;
+        if (block_size > esp->block_size)
+          block_size = esp->block_size;
+
+        err = fcp_esp_dfu_write(
+          hwdep, payload->data + esp->offset, block_size
+        );
+        if (err < 0) {
+          log_error("Error writing block at offset %zu", esp->offset);
+          return FCP_SOCKET_ERR_WRITE;
+        }
+        esp->offset += block_size;
+        esp->batch_blocks++;
+      }
+
+      // Wait for next block notification
+      return wait_for_esp_dfu_notify(
+        esp, config->dfu_notifications.next_block, "next block", ESP_DFU_ACKED
+      );
+
+    case ESP_DFU_ACKED: {
+      update_transfer_engine(esp);
+      esp->acked = esp->offset;
+
+      // Send progress
+      int progress = esp->acked * 100 / payload->size;
+      if (progress != esp->last_progress) {
+        esp->last_progress = progress;
+        job_progress(&esp->job, progress);
+      }
+
+      esp->state = ESP_DFU_WRITE;
+      return ESP_DFU_NEXT;
+    }
 
-    // Wait 100ms before retrying
-    usleep(100 * 1000);
+    case ESP_DFU_FINISH:
+
+      // Send final empty write to complete
+      err = fcp_esp_dfu_write(hwdep, NULL, 0);
+      if (err < 0) {
+        log_error("Error writing final block");
+        return FCP_SOCKET_ERR_WRITE;
+      }
+
+      return wait_for_esp_dfu_notify(
+        esp, config->dfu_notifications.finish, "finish", ESP_DFU_OFF
+      );
+
+    case ESP_DFU_OFF:
+      return set_esp_state(esp, config->states.off, ESP_DFU_ON);
+
+    case ESP_DFU_ON:
+      return set_esp_state(esp, config->states.normal, ESP_DFU_DONE);
+
+    case ESP_DFU_DONE:
+
+      // Send 100% progress
+      if (esp->last_progress != 100)
+        job_progress(&esp->job, 100);
+
+      return 0;
   }
 
-  log_error("ESP DFU notify timeout waiting for %s", msg);
-  return FCP_SOCKET_ERR_TIMEOUT;
+  return FCP_SOCKET_ERR_INVALID_STATE;
 }
 
-/* Set the ESP state to the target state
- * Returns 0 on success, FCP_SOCKET_ERR_FCP or FCP_SOCKET_ERR_TIMEOUT on failure
- */
-static int set_esp_state(struct fcp_device *device, uint8_t target_state) {
-  log_debug("Setting ESP state to %d", target_state);
+static int esp_dfu_step(struct job *job) {
+  struct esp_dfu_job *esp = (struct esp_dfu_job *)job;
+  int ret;
 
-  int err = fcp_esp_set_boot_mode(device->hwdep, target_state);
-  if (err < 0)
-    return err;
+  do {
+    ret = esp_dfu_run_state(esp);
+  } while (ret == ESP_DFU_NEXT);
 
-  log_debug("Waiting for ESP boot mode change");
+  return ret;
+}
 
-  // Wait for state change
-  err = wait_for_esp_notification(device, "ESP state change");
-  if (err < 0)
-    return err;
+static void esp_dfu_destroy(struct job *job) {
+  struct esp_dfu_job *esp = (struct esp_dfu_job *)job;
 
-  return check_esp_state(device, target_state);
+  free_client_message(esp->msg);
+  free(esp);
 }
 
-/* Update ESP firmware
- * Returns 0 on success, FCP_SOCKET_ERR_* on failure
- */
-int handle_esp_firmware_update(
+int esp_dfu_init(struct fcp_device *device) {
+  struct esp_dfu_config *config = calloc(1, sizeof(*config));
+  if (!config) {
+    log_error("Cannot allocate memory for ESP DFU config");
+    exit(1);
+  }
+
+  if (get_esp_dfu_config(device->devmap, config) < 0) {
+    free(config);
+    return -1;
+  }
+
+  device->esp_dfu = config;
+  return 0;
+}
+
+int esp_dfu_check(
   struct fcp_device                  *device,
-  int                                 client_fd,
   const struct fcp_socket_msg_header *header
 ) {
-  int err;
-  int last_progress = -1;
-
-  err = get_esp_dfu_config(device->devmap);
-  if (err < 0)
+  if (!device->esp_dfu) {
+    log_error("No ESP DFU configuration for this device");
     return FCP_SOCKET_ERR_CONFIG;
+  }
 
-  struct firmware_payload *payload = (struct firmware_payload *)(header + 1);
+  const struct firmware_payload *payload =
+    (const struct firmware_payload *)(header + 1);
+
+  if (header->payload_length < sizeof(*payload) ||
+      header->payload_length - sizeof(*payload) < payload->size) {
+    log_error("Invalid ESP firmware payload length");
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  }
 
   // Check USB ID
   if (payload->usb_vid != device->usb_vid ||
@@ -422,112 +749,47 @@ int handle_esp_firmware_update(
   }
 
   // Verify SHA256
-  if (!verify_sha256(payload->data, payload->size, payload->sha256)) {
+  if (!verify_sha256(payload->data, payload->size, payload->sha256))
     return FCP_SOCKET_ERR_INVALID_HASH;
-  }
-
-  // Send 0% progress
-  send_progress(client_fd, 0);
-
-  // Turn ESP off if it's on
-  int esp_state;
-  err = fcp_esp_get_state(device->hwdep, &esp_state);
-  if (err < 0)
-    return err;
-
-  // ESP state zero is not listed in eSuperState; probably not running
-  // leapfrog firmware
-  if (!esp_state) {
-    log_error("ESP state (0) invalid (not running leapfrog firmware?)");
-    return FCP_SOCKET_ERR_NOT_LEAPFROG;
-  }
-
-  // Turn off ESP if it's on
-  if (esp_state == config.states.normal) {
-    err = set_esp_state(device, config.states.off);
-    if (err < 0)
-      return err;
-
-  // If it's not off, we can't update the firmware
-  } else if (esp_state != config.states.off) {
-    log_error("ESP is not off (state is %d), cannot update firmware", esp_state);
-    return FCP_SOCKET_ERR_INVALID_STATE;
-  }
-
-  // Start DFU
-  err = fcp_esp_dfu_start(device->hwdep, payload->size, payload->md5);
-  if (err < 0)
-    return FCP_SOCKET_ERR_FCP;
-
-  // Wait for ESP to enter DFU mode
-  err = wait_for_esp_notification(device, "ESP to enter DFU mode");
-  if (err < 0)
-    return err;
-
-  err = check_esp_state(device, config.states.dfu);
-  if (err < 0)
-    return err;
-
-  // Wait for next block notification
-  err = wait_for_esp_dfu_notify(device, config.dfu_notifications.next_block, "next block");
-  if (err < 0)
-    return err;
-
-  // Write firmware blocks
-  for (size_t offset = 0; offset < payload->size; offset += ESP_FLASH_BLOCK_SIZE) {
-    size_t block_size = payload->size - offset;
-    if (block_size > ESP_FLASH_BLOCK_SIZE)
-      block_size = ESP_FLASH_BLOCK_SIZE;
-
-    err = fcp_esp_dfu_write(device->hwdep, payload->data + offset, block_size);
-    if (err < 0) {
-      log_error("Error writing block at offset %zu", offset);
-      return FCP_SOCKET_ERR_WRITE;
-    }
-
-    // Wait for next block notification
-    err = wait_for_esp_dfu_notify(device, config.dfu_notifications.next_block, "next block");
-    if (err < 0) {
-      log_error("Error waiting for next block notification");
-      return err;
-    }
-
-    // Send progress
-    int progress = (offset + block_size) * 100 / payload->size;
-    if (progress != last_progress) {
-      last_progress = progress;
-      send_progress(client_fd, progress);
-    }
 
-    drain_pending_connections();
-  }
+  return 0;
+}
 
-  // Send final empty write to complete
-  err = fcp_esp_dfu_write(device->hwdep, NULL, 0);
-  if (err < 0) {
-    log_error("Error writing final block");
-    return FCP_SOCKET_ERR_WRITE;
+struct job *esp_dfu_new_job(struct fcp_device *device, void *msg) {
+  struct esp_dfu_job *esp = calloc(1, sizeof(*esp));
+  if (!esp) {
+    log_error("Cannot allocate memory for ESP DFU job");
+    exit(1);
   }
 
-  // Wait for finish notification
-  err = wait_for_esp_dfu_notify(device, config.dfu_notifications.finish, "finish");
-  if (err < 0)
-    return err;
-
-  // Turn ESP off
-  err = set_esp_state(device, config.states.off);
-  if (err < 0)
-    return err;
-
-  // Turn ESP back on
-  err = set_esp_state(device, config.states.normal);
-  if (err < 0) {
-    return err;
-  }
+  esp->job.step = esp_dfu_step;
+  esp->job.destroy = esp_dfu_destroy;
+  esp->job.report = report_esp_progress;
+  esp->job.device = device;
+  esp->job.client_fd = -1;
+  esp->msg = msg;
+  esp->payload = (struct firmware_payload *)
+    ((struct fcp_socket_msg_header *)msg + 1);
+  esp->state = ESP_DFU_CHECK;
+  esp->last_progress = -1;
+  esp->send_stats =
+    ((struct fcp_socket_msg_header *)msg)->msg_type ==
+      FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS;
+
+  // The defaults give one ESP_FLASH_BLOCK_SIZE block per notification
+  esp->block_size = get_env_int(
+    "FCP_ESP_DFU_BLOCK_SIZE",
+    ESP_FLASH_BLOCK_SIZE, ESP_FLASH_BLOCK_SIZE, ESP_DFU_MAX_BLOCK_SIZE
+  );
+  esp->max_window = get_env_int(
+    "FCP_ESP_DFU_WINDOW", 1, 1, ESP_DFU_MAX_WINDOW
+  );
+  esp->window = 1;
 
-  // Send 100% progress
-  if (last_progress != 100)
-    send_progress(client_fd, 100);
+  log_debug(
+    "ESP DFU block size %zu, window up to %d",
+    esp->block_size, esp->max_window
+  );
 
-  return 0;
+  return &esp->job;
 }
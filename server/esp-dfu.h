@@ -4,10 +4,24 @@
 #pragma once
 
 #include "device.h"
+#include "job.h"
 #include "../shared/fcp-shared.h"
 
-int handle_esp_firmware_update(
+/* Load the ESP DFU configuration from the devmap; must be called
+ * before the devmap JSON is released
+ */
+int esp_dfu_init(struct fcp_device *device);
+
+/* Check an ESP firmware update request before starting it
+ * Returns 0 if valid, FCP_SOCKET_ERR_* otherwise
+ */
+int esp_dfu_check(
   struct fcp_device                  *device,
-  int                                 client_fd,
   const struct fcp_socket_msg_header *header
 );
+
+/* Create a job to update the ESP firmware; the job takes ownership
+ * of msg (the header followed by the firmware payload) and frees it
+ * with free_client_message()
+ */
+struct job *esp_dfu_new_job(struct fcp_device *device, void *msg);
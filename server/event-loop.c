@@ -0,0 +1,210 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event-loop.h"
+#include "log.h"
+
+#define MAX_EVENTS 16
+
+struct event_source {
+  int                  fd;
+  bool                 is_timer;
+  bool                 removed;
+  event_callback       callback;
+  void                *data;
+  struct event_source *next_removed;
+};
+
+static int epoll_fd = -1;
+static bool running;
+static int stop_err;
+
+/* Sources removed while dispatching are freed after the batch so
+ * that pending events for them can be skipped
+ */
+static struct event_source *removed_sources;
+
+int event_loop_init(void) {
+  if (epoll_fd >= 0)
+    return 0;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    log_error("Cannot create epoll instance: %s", strerror(errno));
+    return -errno;
+  }
+
+  return 0;
+}
+
+static struct event_source *add_source(
+  int             fd,
+  uint32_t        events,
+  bool            is_timer,
+  event_callback  callback,
+  void           *data
+) {
+  if (event_loop_init() < 0)
+    return NULL;
+
+  struct event_source *source = calloc(1, sizeof(*source));
+  if (!source) {
+    log_error("Cannot allocate memory for event source");
+    exit(1);
+  }
+
+  source->fd = fd;
+  source->is_timer = is_timer;
+  source->callback = callback;
+  source->data = data;
+
+  struct epoll_event ev = {
+    .events = events,
+    .data.ptr = source
+  };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_error("Cannot add fd %d to epoll: %s", fd, strerror(errno));
+    free(source);
+    return NULL;
+  }
+
+  return source;
+}
+
+struct event_source *event_add_fd(
+  int             fd,
+  uint32_t        events,
+  event_callback  callback,
+  void           *data
+) {
+  return add_source(fd, events, false, callback, data);
+}
+
+int event_modify_fd(struct event_source *source, uint32_t events) {
+  struct epoll_event ev = {
+    .events = events,
+    .data.ptr = source
+  };
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev) < 0) {
+    log_error("Cannot modify fd %d in epoll: %s", source->fd, strerror(errno));
+    return -errno;
+  }
+
+  return 0;
+}
+
+struct event_source *event_add_timer(event_callback callback, void *data) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    log_error("Cannot create timer: %s", strerror(errno));
+    return NULL;
+  }
+
+  struct event_source *source = add_source(fd, EPOLLIN, true, callback, data);
+  if (!source)
+    close(fd);
+
+  return source;
+}
+
+static void ms_to_timespec(int ms, struct timespec *ts) {
+  ts->tv_sec = ms / 1000;
+  ts->tv_nsec = (long)(ms % 1000) * 1000000;
+}
+
+int event_timer_arm(
+  struct event_source *source,
+  int                  initial_ms,
+  int                  interval_ms
+) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  ms_to_timespec(initial_ms, &its.it_value);
+  ms_to_timespec(interval_ms, &its.it_interval);
+
+  if (timerfd_settime(source->fd, 0, &its, NULL) < 0) {
+    log_error("Cannot set timer: %s", strerror(errno));
+    return -errno;
+  }
+
+  return 0;
+}
+
+void event_remove(struct event_source *source) {
+  if (!source || source->removed)
+    return;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+  if (source->is_timer)
+    close(source->fd);
+
+  source->removed = true;
+  source->next_removed = removed_sources;
+  removed_sources = source;
+}
+
+static void free_removed_sources(void) {
+  while (removed_sources) {
+    struct event_source *next = removed_sources->next_removed;
+
+    free(removed_sources);
+    removed_sources = next;
+  }
+}
+
+int event_loop_run(void) {
+  struct epoll_event events[MAX_EVENTS];
+
+  if (event_loop_init() < 0)
+    return -1;
+
+  running = true;
+  stop_err = 0;
+
+  while (running) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_error("epoll_wait failed: %s", strerror(errno));
+      return -errno;
+    }
+
+    for (int i = 0; i < n && running; i++) {
+      struct event_source *source = events[i].data.ptr;
+
+      if (source->removed)
+        continue;
+
+      // Consume the timer expiry count
+      if (source->is_timer) {
+        uint64_t expirations;
+
+        if (read(source->fd, &expirations, sizeof(expirations)) < 0)
+          continue;
+      }
+
+      source->callback(source, events[i].events, source->data);
+    }
+
+    free_removed_sources();
+  }
+
+  return stop_err;
+}
+
+void event_loop_stop(int err) {
+  running = false;
+  stop_err = err;
+}
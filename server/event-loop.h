@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* epoll-based main loop
+ *
+ * File descriptors and timers are registered as event sources with
+ * a callback which is called when the source is ready. Sources may
+ * be added and removed from within callbacks.
+ */
+
+struct event_source;
+
+typedef void (*event_callback)(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+);
+
+int event_loop_init(void);
+
+/* Watch fd for the given epoll events (EPOLLIN, etc.) */
+struct event_source *event_add_fd(
+  int             fd,
+  uint32_t        events,
+  event_callback  callback,
+  void           *data
+);
+
+/* Change the events watched for on an fd source */
+int event_modify_fd(struct event_source *source, uint32_t events);
+
+/* Create a timer (initially disarmed) */
+struct event_source *event_add_timer(event_callback callback, void *data);
+
+/* Arm a timer to fire after initial_ms and then every interval_ms
+ * (0 for one-shot); initial_ms 0 disarms the timer
+ */
+int event_timer_arm(
+  struct event_source *source,
+  int                  initial_ms,
+  int                  interval_ms
+);
+
+/* Remove a source; timer fds are closed, other fds are not */
+void event_remove(struct event_source *source);
+
+/* Run until event_loop_stop() is called; returns the value passed
+ * to it
+ */
+int event_loop_run(void);
+void event_loop_stop(int err);
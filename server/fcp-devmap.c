@@ -8,12 +8,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <endian.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <alsa/asoundlib.h>
 #include <openssl/evp.h>
 #include <zlib.h>
 
 #include "fcp.h"
 #include "fcp-devmap.h"
+#include "devmap-index.h"
 #include "log.h"
 
 static json_object *try_load_devmap_json(const char *dir, const char *filename) {
@@ -55,148 +58,555 @@ static int fcp_devmap_read_from_file(struct fcp_device *device) {
   return -ENOENT;
 }
 
-static int fcp_devmap_read_from_device(struct fcp_device *device) {
-  snd_hwdep_t *hwdep = device->hwdep;
-  char *encoded_buf;
+/* Get the offset of versionStageRelease in APP_SPACE */
+static int get_version_offset(struct json_object *devmap, int *offset) {
+  struct json_object *structs, *app_space, *members, *version_obj;
+  struct json_object *offset_obj, *type_obj;
 
-  /* Read the device map */
-  int encoded_size = fcp_devmap_read(hwdep, &encoded_buf);
-  if (encoded_size < 0) {
-    return encoded_size;
-  }
+  if (!json_object_object_get_ex(devmap, "structs", &structs) ||
+      !json_object_object_get_ex(structs, "APP_SPACE", &app_space) ||
+      !json_object_object_get_ex(app_space, "members", &members) ||
+      !json_object_object_get_ex(members, "versionStageRelease", &version_obj) ||
+      !json_object_object_get_ex(version_obj, "offset", &offset_obj) ||
+      !json_object_object_get_ex(version_obj, "type", &type_obj))
+    return -ENOENT;
+
+  /* verify the type is uint32 as expected */
+  if (strcmp(json_object_get_string(type_obj), "uint32") != 0)
+    return -EINVAL;
 
-  /* base64 decode */
-  uint8_t *decoded_buf = malloc(EVP_DECODE_LENGTH(encoded_size));
-  if (!decoded_buf) {
-    free(encoded_buf);
+  *offset = json_object_get_int(offset_obj);
+  return 0;
+}
+
+/* Create a directory and any missing parents */
+static int mkdir_p(const char *path) {
+  char *copy = strdup(path);
+  if (!copy)
     return -ENOMEM;
+
+  for (char *p = copy + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = 0;
+    mkdir(copy, 0755);
+    *p = '/';
+  }
+
+  int err = mkdir(copy, 0755) < 0 && errno != EEXIST ? -errno : 0;
+  free(copy);
+  return err;
+}
+
+/* Get the directory to cache device maps in: $STATE_DIRECTORY (set
+ * by systemd), $XDG_STATE_HOME/fcp-server, or
+ * ~/.local/state/fcp-server. Returns NULL if none are usable.
+ */
+static char *get_cache_dir(void) {
+  const char *state_dir = getenv("STATE_DIRECTORY");
+  char *dir = NULL;
+
+  if (state_dir) {
+    /* systemd may pass a colon-separated list */
+    dir = strndup(state_dir, strcspn(state_dir, ":"));
+    return dir;
+  }
+
+  const char *xdg_state = getenv("XDG_STATE_HOME");
+  const char *home = getenv("HOME");
+  int ret;
+
+  if (xdg_state && *xdg_state)
+    ret = asprintf(&dir, "%s/fcp-server", xdg_state);
+  else if (home && *home)
+    ret = asprintf(&dir, "%s/.local/state/fcp-server", home);
+  else
+    return NULL;
+
+  if (ret < 0)
+    return NULL;
+
+  if (mkdir_p(dir) < 0) {
+    log_debug("Cannot create cache directory %s", dir);
+    free(dir);
+    return NULL;
   }
 
-  EVP_ENCODE_CTX *ctx = EVP_ENCODE_CTX_new();
-  if (!ctx) {
-    free(encoded_buf);
-    free(decoded_buf);
+  return dir;
+}
+
+/* Write a file in the cache directory atomically */
+static int write_cache_file(
+  const char *dir,
+  const char *name,
+  const void *data,
+  size_t      len
+) {
+  char *path, *tmp_path;
+
+  if (asprintf(&path, "%s/%s", dir, name) < 0)
+    return -ENOMEM;
+  if (asprintf(&tmp_path, "%s.tmp.%d", path, getpid()) < 0) {
+    free(path);
     return -ENOMEM;
   }
 
-  int outl;
-  int decoded_size = 0;
-  EVP_DecodeInit(ctx);
-  EVP_DecodeUpdate(
-    ctx,
-    decoded_buf,
-    &outl,
-    (unsigned char *)encoded_buf,
-    encoded_size
-  );
-  decoded_size += outl;
-  EVP_DecodeFinal(ctx, decoded_buf + decoded_size, &outl);
-  decoded_size += outl;
-  EVP_ENCODE_CTX_free(ctx);
-  free(encoded_buf);
-
-  if (decoded_size <= 0) {
-    free(decoded_buf);
+  int err = 0;
+  FILE *f = fopen(tmp_path, "w");
+  if (!f || fwrite(data, 1, len, f) != len) {
+    err = -errno;
+    if (f)
+      fclose(f);
+    unlink(tmp_path);
+  } else if (fclose(f) != 0 || rename(tmp_path, path) < 0) {
+    err = -errno;
+    unlink(tmp_path);
+  }
+
+  if (err < 0)
+    log_debug("Cannot write %s: %s", path, strerror(-err));
+
+  free(tmp_path);
+  free(path);
+  return err;
+}
+
+/* Move the devmap JSON copy into the cache, keyed by VID:PID and
+ * firmware version, and save the offset of the version so that it can
+ * be checked without the devmap
+ */
+static void write_cache(
+  struct fcp_device *device,
+  const char        *cache_dir,
+  int                version_offset,
+  uint32_t           firmware_version,
+  const char        *json_path
+) {
+  char *path;
+
+  if (asprintf(&path, "%s/devmap-%04x-%04x-%u.json",
+               cache_dir, device->usb_vid, device->usb_pid,
+               firmware_version) < 0)
+    return;
+
+  if (rename(json_path, path) < 0) {
+    log_debug("Cannot write %s: %s", path, strerror(errno));
+    unlink(json_path);
+    free(path);
+    return;
+  }
+  log_info("Saved device map to %s", path);
+  free(path);
+
+  char offset_str[16];
+  int len = snprintf(offset_str, sizeof(offset_str), "%d\n", version_offset);
+  char *name;
+
+  if (asprintf(&name, "devmap-%04x-%04x.version-offset",
+               device->usb_vid, device->usb_pid) < 0)
+    return;
+  write_cache_file(cache_dir, name, offset_str, len);
+  free(name);
+}
+
+/* Load the devmap from the cache if the firmware version matches;
+ * this only needs a 4-byte read from the device
+ */
+static int fcp_devmap_read_from_cache(struct fcp_device *device) {
+  char *cache_dir = get_cache_dir();
+  char *path = NULL;
+  int version_offset = -1;
+  int err = -ENOENT;
+
+  if (!cache_dir)
+    return -ENOENT;
+
+  /* Get the offset of the firmware version */
+  if (asprintf(&path, "%s/devmap-%04x-%04x.version-offset",
+               cache_dir, device->usb_vid, device->usb_pid) < 0)
+    goto done;
+
+  FILE *f = fopen(path, "r");
+  free(path);
+  path = NULL;
+  if (!f)
+    goto done;
+  if (fscanf(f, "%d", &version_offset) != 1)
+    version_offset = -1;
+  fclose(f);
+  if (version_offset < 0)
+    goto done;
+
+  /* Read the firmware version */
+  int version_value;
+  if (fcp_data_read(device->hwdep, version_offset, 4, false, &version_value) < 0)
+    goto done;
+
+  if (asprintf(&path, "%s/devmap-%04x-%04x-%u.json",
+               cache_dir, device->usb_vid, device->usb_pid,
+               (uint32_t)version_value) < 0)
+    goto done;
+
+  device->devmap = json_object_from_file(path);
+  if (!device->devmap) {
+    log_debug("No cached device map for firmware version %u",
+              (uint32_t)version_value);
+    goto done;
+  }
+
+  /* Check the cached devmap agrees about where the version is */
+  int check_offset;
+  if (get_version_offset(device->devmap, &check_offset) < 0 ||
+      check_offset != version_offset) {
+    log_warning("Ignoring inconsistent cached device map %s", path);
+    json_object_put(device->devmap);
+    device->devmap = NULL;
+    goto done;
+  }
+
+  log_info("Loaded device map from %s", path);
+  device->devmap_version = version_value;
+  err = 0;
+
+done:
+  free(path);
+  free(cache_dir);
+  return err;
+}
+
+/* Size of the buffer the devmap is inflated into a piece at a time */
+#define DEVMAP_INFLATE_CHUNK 16384
+
+/* State for decoding the devmap as fcp_devmap_read() returns it:
+ * each block is base64 decoded, inflated, and fed to the JSON
+ * tokener, so only one block and one inflated chunk are held at a
+ * time. The inflated JSON is also written to copy, to be cached.
+ */
+struct devmap_stream {
+  EVP_ENCODE_CTX *b64;
+  z_stream        zlib;
+  bool            zlib_end;  // Z_STREAM_END seen
+  json_tokener   *tok;
+  json_object    *devmap;    // Set once the tokener completes it
+  FILE           *copy;      // NULL if there's nowhere to write one
+  bool            copy_err;
+};
+
+static int devmap_stream_parse(
+  struct devmap_stream *stream,
+  const uint8_t        *json,
+  int                   len
+) {
+  if (stream->copy && !stream->copy_err &&
+      fwrite(json, 1, len, stream->copy) != (size_t)len)
+    stream->copy_err = true;
+
+  // Anything after the top-level object is ignored
+  if (stream->devmap)
+    return 0;
+
+  stream->devmap = json_tokener_parse_ex(stream->tok, (const char *)json, len);
+  if (stream->devmap)
+    return 0;
+
+  enum json_tokener_error jerr = json_tokener_get_error(stream->tok);
+  if (jerr != json_tokener_continue) {
+    log_error("Cannot parse device map: %s", json_tokener_error_desc(jerr));
     return -EINVAL;
   }
 
-  /* zlib decode */
-  z_stream strm;
-  memset(&strm, 0, sizeof(strm));
-  if (inflateInit(&strm) != Z_OK) {
-    free(decoded_buf);
+  return 0;
+}
+
+static int devmap_stream_inflate(
+  struct devmap_stream *stream,
+  const uint8_t        *data,
+  int                   len
+) {
+  uint8_t json[DEVMAP_INFLATE_CHUNK];
+  z_stream *zlib = &stream->zlib;
+
+  if (stream->zlib_end)
+    return 0;
+
+  zlib->next_in = (uint8_t *)data;
+  zlib->avail_in = len;
+
+  do {
+    zlib->next_out = json;
+    zlib->avail_out = sizeof(json);
+
+    int ret = inflate(zlib, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      stream->zlib_end = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      log_error("Cannot inflate device map: %s", zlib->msg ? zlib->msg : "");
+      return -EINVAL;
+    }
+
+    int json_len = sizeof(json) - zlib->avail_out;
+    if (json_len) {
+      int err = devmap_stream_parse(stream, json, json_len);
+      if (err < 0)
+        return err;
+    }
+  } while (zlib->avail_out == 0 && !stream->zlib_end);
+
+  return 0;
+}
+
+static int devmap_stream_block(void *data, const void *block, int size) {
+  struct devmap_stream *stream = data;
+  uint8_t decoded[EVP_DECODE_LENGTH(FCP_DEVMAP_BLOCK_SIZE)];
+  int outl;
+
+  if (EVP_DecodeUpdate(stream->b64, decoded, &outl, block, size) < 0) {
+    log_error("Cannot decode device map");
     return -EINVAL;
   }
 
-  strm.next_in = decoded_buf;
-  strm.avail_in = decoded_size;
+  return devmap_stream_inflate(stream, decoded, outl);
+}
 
-  /* create a buffer big enough to hold the uncompressed data */
-  size_t json_size = decoded_size * 16;
-  uint8_t *json_buf = malloc(json_size);
-  if (!json_buf) {
-    free(decoded_buf);
-    return -ENOMEM;
+/* Finish decoding once all blocks have been read */
+static int devmap_stream_finish(struct devmap_stream *stream) {
+  uint8_t decoded[EVP_DECODE_LENGTH(FCP_DEVMAP_BLOCK_SIZE)];
+  int outl;
+
+  if (EVP_DecodeFinal(stream->b64, decoded, &outl) < 0) {
+    log_error("Cannot decode device map");
+    return -EINVAL;
   }
 
-  strm.next_out = json_buf;
-  strm.avail_out = json_size;
+  int err = devmap_stream_inflate(stream, decoded, outl);
+  if (err < 0)
+    return err;
 
-  int ret = inflate(&strm, Z_FINISH);
-  if (ret != Z_STREAM_END) {
-    free(decoded_buf);
-    free(json_buf);
-    inflateEnd(&strm);
+  if (!stream->zlib_end || !stream->devmap) {
+    log_error("Device map is truncated");
     return -EINVAL;
   }
 
-  size_t json_len = json_size - strm.avail_out;
+  return 0;
+}
 
-  inflateEnd(&strm);
-  free(decoded_buf);
+/* Open a temporary file in dir for the copy of the devmap JSON */
+static FILE *open_devmap_copy(const char *dir, char **path) {
+  if (asprintf(path, "%s/.devmap-XXXXXX", dir) < 0) {
+    *path = NULL;
+    return NULL;
+  }
 
-  json_buf[json_len] = '\0';
+  // mkstemp() creates the file 0600; it's readable like the others
+  int fd = mkstemp(*path);
+  FILE *f = fd < 0 || fchmod(fd, 0644) < 0 ? NULL : fdopen(fd, "w");
+  if (!f) {
+    log_debug("Cannot create %s: %s", *path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(*path);
+    }
+    free(*path);
+    *path = NULL;
+  }
 
-  /* parse json first to extract version information */
-  device->devmap = json_tokener_parse((char *)json_buf);
-  if (!device->devmap) {
-    free(json_buf);
-    return -EINVAL;
+  return f;
+}
+
+static int fcp_devmap_read_from_device(struct fcp_device *device) {
+  snd_hwdep_t *hwdep = device->hwdep;
+  struct devmap_stream stream = { 0 };
+  char *cache_dir = get_cache_dir();
+  const char *copy_dir = cache_dir ? cache_dir : "/tmp";
+  char *copy_path = NULL;
+  int err;
+
+  stream.b64 = EVP_ENCODE_CTX_new();
+  stream.tok = json_tokener_new();
+  if (!stream.b64 || !stream.tok) {
+    log_error("Cannot allocate memory for device map decoder");
+    exit(1);
   }
+  EVP_DecodeInit(stream.b64);
+
+  if (inflateInit(&stream.zlib) != Z_OK) {
+    err = -EINVAL;
+    goto done;
+  }
+
+  /* save in the cache for next time, or for debugging (in /tmp if
+   * there's no cache directory)
+   */
+  stream.copy = open_devmap_copy(copy_dir, &copy_path);
+
+  /* Read the device map, decoding each block as it arrives */
+  err = fcp_devmap_read(hwdep, devmap_stream_block, &stream);
+  if (err >= 0)
+    err = devmap_stream_finish(&stream);
+  inflateEnd(&stream.zlib);
+  if (err < 0)
+    goto done;
+
+  device->devmap = stream.devmap;
+  stream.devmap = NULL;
 
   /* extract version information and read actual version from device */
   uint32_t firmware_version = 0;
-  struct json_object *structs, *app_space, *members, *version_obj;
-  struct json_object *offset_obj, *type_obj;
+  int version_offset;
 
-  if (json_object_object_get_ex(device->devmap, "structs", &structs) &&
-      json_object_object_get_ex(structs, "APP_SPACE", &app_space) &&
-      json_object_object_get_ex(app_space, "members", &members) &&
-      json_object_object_get_ex(members, "versionStageRelease", &version_obj) &&
-      json_object_object_get_ex(version_obj, "offset", &offset_obj) &&
-      json_object_object_get_ex(version_obj, "type", &type_obj)) {
-
-    int offset = json_object_get_int(offset_obj);
-    const char *type_str = json_object_get_string(type_obj);
-
-    /* verify the type is uint32 as expected */
-    if (strcmp(type_str, "uint32") == 0) {
-      /* read the actual firmware version from the device */
-      int version_value;
-      int err = fcp_data_read(hwdep, offset, 4, false, &version_value);
-      if (err >= 0) {
-        firmware_version = (uint32_t)version_value;
-      }
-    }
+  if (get_version_offset(device->devmap, &version_offset) == 0) {
+    int version_value;
+    int err = fcp_data_read(hwdep, version_offset, 4, false, &version_value);
+    if (err >= 0)
+      firmware_version = (uint32_t)version_value;
+  }
+  device->devmap_version = firmware_version;
+
+  if (!stream.copy)
+    goto done;
+
+  if (fclose(stream.copy) != 0)
+    stream.copy_err = true;
+  stream.copy = NULL;
+  if (stream.copy_err) {
+    log_debug("Cannot write %s", copy_path);
+    unlink(copy_path);
+    goto done;
+  }
+
+  if (cache_dir && firmware_version > 0) {
+    write_cache(device, cache_dir, version_offset, firmware_version,
+                copy_path);
+    goto done;
   }
 
-  /* write the json to a file for debugging */
+  /* otherwise keep it for debugging next to where it was written, as
+   * rename() can't move it to another filesystem
+   */
   char *fn;
   if (firmware_version > 0) {
-    if (asprintf(&fn, "/tmp/fcp-devmap-%04x-%d.json", device->usb_pid, firmware_version) < 0) {
+    if (asprintf(&fn, "%s/fcp-devmap-%04x-%d.json", copy_dir, device->usb_pid, firmware_version) < 0) {
       log_error("Failed to allocate memory for filename");
       exit(1);
     }
   } else {
-    if (asprintf(&fn, "/tmp/fcp-devmap-%04x.json", device->usb_pid) < 0) {
+    if (asprintf(&fn, "%s/fcp-devmap-%04x.json", copy_dir, device->usb_pid) < 0) {
       log_error("Failed to allocate memory for filename");
       exit(1);
     }
   }
 
-  FILE *f = fopen(fn, "w");
-  if (f) {
-    fwrite(json_buf, 1, json_len, f);
-    fclose(f);
+  if (rename(copy_path, fn) < 0) {
+    log_debug("Cannot write %s: %s", fn, strerror(errno));
+    unlink(copy_path);
   }
+  free(fn);
 
-  return 0;
+done:
+  if (stream.copy) {
+    fclose(stream.copy);
+    unlink(copy_path);
+  }
+  if (stream.devmap)
+    json_object_put(stream.devmap);
+  json_tokener_free(stream.tok);
+  EVP_ENCODE_CTX_free(stream.b64);
+  free(copy_path);
+  free(cache_dir);
+
+  return err < 0 ? err : 0;
+}
+
+/* Load the compiled member index for this firmware version from the
+ * cache, or build it from the devmap JSON (and cache it if the
+ * version is known)
+ */
+static int open_devmap_index(struct fcp_device *device) {
+  char *cache_dir = NULL;
+  char *name = NULL;
+
+  if (device->devmap_version) {
+    cache_dir = get_cache_dir();
+    if (cache_dir &&
+        asprintf(&name, "devmap-%04x-%04x-%u.idx",
+                 device->usb_vid, device->usb_pid,
+                 device->devmap_version) < 0)
+      name = NULL;
+  }
+
+  if (name) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s", cache_dir, name) >= 0) {
+      device->devmap_index = devmap_index_load(path);
+      if (device->devmap_index)
+        log_debug("Loaded devmap index from %s", path);
+      free(path);
+    }
+  }
+
+  if (!device->devmap_index) {
+    device->devmap_index = devmap_index_build(device->devmap);
+
+    if (device->devmap_index && name)
+      write_cache_file(
+        cache_dir, name,
+        device->devmap_index->base, device->devmap_index->size
+      );
+  }
+
+  free(name);
+  free(cache_dir);
+
+  return device->devmap_index ? 0 : -EINVAL;
 }
 
 int fcp_devmap_read_json(struct fcp_device *device) {
   int err = fcp_devmap_read_from_file(device);
+  if (err == -ENOENT)
+    err = fcp_devmap_read_from_cache(device);
   if (err == -ENOENT)
     err = fcp_devmap_read_from_device(device);
+  if (err < 0)
+    return err;
 
-  return err;
+  return open_devmap_index(device);
+}
+
+int fcp_devmap_read_version(
+  struct fcp_device  *device,
+  struct json_object *devmap,
+  uint32_t           *version
+) {
+  int offset, value;
+
+  int err = get_version_offset(devmap, &offset);
+  if (err < 0)
+    return err;
+
+  err = fcp_data_read(device->hwdep, offset, 4, false, &value);
+  if (err < 0)
+    return err;
+
+  *version = value;
+  return 0;
+}
+
+uint32_t fcp_devmap_notify_mask(struct fcp_device *device, const char *match) {
+  struct json_object *enums, *notify_types, *enumerators;
+  uint32_t mask = 0;
+
+  if (!json_object_object_get_ex(device->devmap, "enums", &enums) ||
+      !json_object_object_get_ex(
+        enums, "eDEV_FCP_NOTIFY_MESSAGE_TYPE", &notify_types
+      ) ||
+      !json_object_object_get_ex(notify_types, "enumerators", &enumerators))
+    return 0;
+
+  json_object_object_foreach(enumerators, name, value) {
+    if (strstr(name, match))
+      mask |= json_object_get_int(value);
+  }
+
+  return mask;
 }
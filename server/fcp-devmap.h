@@ -9,3 +9,17 @@
 #include "device.h"
 
 int fcp_devmap_read_json(struct fcp_device *device);
+
+/* Read the firmware version from the device at the offset given by
+ * a devmap; returns 0 or a negative error code
+ */
+int fcp_devmap_read_version(
+  struct fcp_device  *device,
+  struct json_object *devmap,
+  uint32_t           *version
+);
+
+/* Get the mask of the eDEV_FCP_NOTIFY_MESSAGE_TYPE notifications
+ * whose names contain the given string (0 if none)
+ */
+uint32_t fcp_devmap_notify_mask(struct fcp_device *device, const char *match);
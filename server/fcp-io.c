@@ -0,0 +1,379 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "fcp-io.h"
+#include "device.h"
+#include "event-loop.h"
+#include "fcp.h"
+#include "log.h"
+
+#define FCP_IO_MAX_DEVICES 16
+
+struct fcp_io_item {
+  fcp_io_work_fn      work;
+  fcp_io_done_fn      done;      // NULL for a synchronous call
+  void               *data;
+  int                 result;
+  bool                finished;  // Synchronous calls only
+  struct fcp_io_item *next;
+};
+
+struct fcp_io {
+  snd_hwdep_t         *hwdep;
+  pthread_t            thread;
+  pthread_mutex_t      lock;
+  pthread_cond_t       work_cond;  // Work queued, or stopping
+  pthread_cond_t       call_cond;  // A synchronous call finished
+  bool                 stopping;
+
+  // Queued work, first in first out at each priority
+  struct fcp_io_item  *head[FCP_IO_PRIORITY_COUNT];
+  struct fcp_io_item **tail[FCP_IO_PRIORITY_COUNT];
+
+  // Finished asynchronous work, for the event loop
+  struct fcp_io_item  *done_head;
+  struct fcp_io_item **done_tail;
+  int                  event_fd;
+  struct event_source *source;
+
+  // Set while done functions are being called, which might stop the
+  // I/O; freeing it is then left until they return
+  bool                 delivering;
+  bool                 stopped;
+};
+
+// I/O threads by hwdep; only changed and searched from the event
+// loop thread
+static struct fcp_io *ios[FCP_IO_MAX_DEVICES];
+
+// The I/O this thread is serving, if it's an I/O thread
+static __thread struct fcp_io *current_io;
+
+// Priority of this thread's synchronous calls
+static __thread enum fcp_io_priority current_priority = FCP_IO_CONTROL;
+
+// On an I/O thread, the priority of the work being done
+static __thread int running_priority = FCP_IO_PRIORITY_COUNT;
+
+static struct fcp_io *find_io(snd_hwdep_t *hwdep) {
+  for (int i = 0; i < FCP_IO_MAX_DEVICES; i++)
+    if (ios[i] && ios[i]->hwdep == hwdep)
+      return ios[i];
+
+  return NULL;
+}
+
+/* Take the first item at the highest priority above below; called
+ * with the lock held
+ */
+static struct fcp_io_item *next_item(
+  struct fcp_io *io,
+  int            below,
+  int           *priority
+) {
+  for (int i = 0; i < below; i++) {
+    struct fcp_io_item *item = io->head[i];
+
+    if (!item)
+      continue;
+
+    io->head[i] = item->next;
+    if (!io->head[i])
+      io->tail[i] = &io->head[i];
+    *priority = i;
+    return item;
+  }
+
+  return NULL;
+}
+
+static void queue_item(
+  struct fcp_io        *io,
+  enum fcp_io_priority  priority,
+  struct fcp_io_item   *item
+) {
+  item->next = NULL;
+  *io->tail[priority] = item;
+  io->tail[priority] = &item->next;
+  pthread_cond_signal(&io->work_cond);
+}
+
+/* Do the work and hand back the result; called with the lock held */
+static void run_item(struct fcp_io *io, struct fcp_io_item *item, int priority) {
+  int prev = running_priority;
+
+  running_priority = priority;
+  pthread_mutex_unlock(&io->lock);
+  item->result = item->work(item->data);
+  pthread_mutex_lock(&io->lock);
+  running_priority = prev;
+
+  if (!item->done) {
+    item->finished = true;
+    pthread_cond_broadcast(&io->call_cond);
+    return;
+  }
+
+  item->next = NULL;
+  *io->done_tail = item;
+  io->done_tail = &item->next;
+
+  uint64_t one = 1;
+  if (write(io->event_fd, &one, sizeof(one)) < 0)
+    log_error("Cannot signal FCP I/O completion");
+}
+
+static void *io_thread(void *data) {
+  struct fcp_io *io = data;
+
+  current_io = io;
+
+  pthread_mutex_lock(&io->lock);
+
+  while (!io->stopping) {
+    int priority;
+    struct fcp_io_item *item = next_item(io, FCP_IO_PRIORITY_COUNT, &priority);
+
+    if (!item) {
+      pthread_cond_wait(&io->work_cond, &io->lock);
+      continue;
+    }
+
+    run_item(io, item, priority);
+  }
+
+  pthread_mutex_unlock(&io->lock);
+  fcp_cmd_buf_free();
+
+  return NULL;
+}
+
+void fcp_io_yield(void) {
+  struct fcp_io *io = current_io;
+  struct fcp_io_item *item;
+  int priority;
+
+  if (!io)
+    return;
+
+  pthread_mutex_lock(&io->lock);
+  while ((item = next_item(io, running_priority, &priority)))
+    run_item(io, item, priority);
+  pthread_mutex_unlock(&io->lock);
+}
+
+static void free_io(struct fcp_io *io) {
+  pthread_cond_destroy(&io->call_cond);
+  pthread_cond_destroy(&io->work_cond);
+  pthread_mutex_destroy(&io->lock);
+  free(io);
+}
+
+/* Deliver the finished work to the event loop */
+static void handle_io_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct fcp_io *io = data;
+  uint64_t count;
+
+  if (read(io->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    log_error("Cannot read FCP I/O completions");
+
+  io->delivering = true;
+
+  while (!io->stopped) {
+    pthread_mutex_lock(&io->lock);
+    struct fcp_io_item *item = io->done_head;
+    if (item) {
+      io->done_head = item->next;
+      if (!io->done_head)
+        io->done_tail = &io->done_head;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    if (!item)
+      break;
+
+    item->done(item->data, item->result);
+    free(item);
+  }
+
+  io->delivering = false;
+  if (io->stopped)
+    free_io(io);
+}
+
+int fcp_io_start(struct fcp_device *device) {
+  int slot;
+
+  for (slot = 0; slot < FCP_IO_MAX_DEVICES; slot++)
+    if (!ios[slot])
+      break;
+  if (slot == FCP_IO_MAX_DEVICES) {
+    log_error("Too many devices for FCP I/O threads");
+    return -1;
+  }
+
+  struct fcp_io *io = calloc(1, sizeof(*io));
+  if (!io) {
+    log_error("Cannot allocate memory for FCP I/O");
+    exit(1);
+  }
+
+  io->hwdep = device->hwdep;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->work_cond, NULL);
+  pthread_cond_init(&io->call_cond, NULL);
+  for (int i = 0; i < FCP_IO_PRIORITY_COUNT; i++)
+    io->tail[i] = &io->head[i];
+  io->done_tail = &io->done_head;
+
+  io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->event_fd < 0) {
+    log_error("Cannot create FCP I/O eventfd: %s", strerror(errno));
+    goto fail;
+  }
+
+  io->source = event_add_fd(io->event_fd, EPOLLIN, handle_io_event, io);
+  if (!io->source)
+    goto fail;
+
+  if (pthread_create(&io->thread, NULL, io_thread, io) != 0) {
+    log_error("Cannot start FCP I/O thread");
+    event_remove(io->source);
+    goto fail;
+  }
+
+  ios[slot] = io;
+  device->io = io;
+
+  return 0;
+
+fail:
+  if (io->event_fd >= 0)
+    close(io->event_fd);
+  free_io(io);
+  return -1;
+}
+
+static void free_items(struct fcp_io_item *item) {
+  while (item) {
+    struct fcp_io_item *next = item->next;
+
+    free(item);
+    item = next;
+  }
+}
+
+void fcp_io_stop(struct fcp_device *device) {
+  struct fcp_io *io = device->io;
+
+  if (!io)
+    return;
+
+  pthread_mutex_lock(&io->lock);
+  io->stopping = true;
+  pthread_cond_signal(&io->work_cond);
+  pthread_mutex_unlock(&io->lock);
+  pthread_join(io->thread, NULL);
+
+  // Only asynchronous work is left; the event loop thread is the
+  // only one which makes synchronous calls
+  for (int i = 0; i < FCP_IO_PRIORITY_COUNT; i++)
+    free_items(io->head[i]);
+  free_items(io->done_head);
+  io->done_head = NULL;
+
+  for (int i = 0; i < FCP_IO_MAX_DEVICES; i++)
+    if (ios[i] == io)
+      ios[i] = NULL;
+
+  event_remove(io->source);
+  close(io->event_fd);
+  device->io = NULL;
+
+  if (io->delivering)
+    io->stopped = true;
+  else
+    free_io(io);
+}
+
+bool fcp_io_active(struct fcp_device *device) {
+  return device->io != NULL;
+}
+
+int fcp_io_submit(
+  struct fcp_device    *device,
+  enum fcp_io_priority  priority,
+  fcp_io_work_fn        work,
+  fcp_io_done_fn        done,
+  void                 *data
+) {
+  struct fcp_io *io = device->io;
+
+  if (!io)
+    return -1;
+
+  struct fcp_io_item *item = calloc(1, sizeof(*item));
+  if (!item) {
+    log_error("Cannot allocate memory for FCP I/O");
+    exit(1);
+  }
+
+  item->work = work;
+  item->done = done;
+  item->data = data;
+
+  pthread_mutex_lock(&io->lock);
+  queue_item(io, priority, item);
+  pthread_mutex_unlock(&io->lock);
+
+  return 0;
+}
+
+enum fcp_io_priority fcp_io_set_priority(enum fcp_io_priority priority) {
+  enum fcp_io_priority prev = current_priority;
+
+  current_priority = priority;
+  return prev;
+}
+
+bool fcp_io_call(
+  snd_hwdep_t    *hwdep,
+  fcp_io_work_fn  work,
+  void           *data,
+  int            *result
+) {
+  if (current_io)
+    return false;
+
+  struct fcp_io *io = find_io(hwdep);
+  if (!io)
+    return false;
+
+  struct fcp_io_item item = {
+    .work = work,
+    .data = data
+  };
+
+  pthread_mutex_lock(&io->lock);
+  queue_item(io, current_priority, &item);
+  while (!item.finished)
+    pthread_cond_wait(&io->call_cond, &io->lock);
+  pthread_mutex_unlock(&io->lock);
+
+  *result = item.result;
+  return true;
+}
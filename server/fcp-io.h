@@ -0,0 +1,86 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <alsa/asoundlib.h>
+
+struct fcp_device;
+
+/* Per-device I/O thread
+ *
+ * Once a device is being served, its FCP commands are sent by its
+ * own thread, which takes work from a queue in priority order. Work
+ * from the event loop thread (control writes, notification
+ * read-backs) is sent synchronously at the priority set with
+ * fcp_io_set_priority(); background work (metering, flash and DFU
+ * jobs) is submitted with fcp_io_submit() and completes back on the
+ * event loop, so the loop isn't held up by it. Higher priority work
+ * is also done between the commands of lower priority work, so a
+ * control change only ever waits for the one command in progress.
+ */
+
+enum fcp_io_priority {
+  FCP_IO_CONTROL,     // Interactive control changes
+  FCP_IO_NOTIFY,      // Reading back values after a notification
+  FCP_IO_METER,
+  FCP_IO_BACKGROUND,  // Flash and DFU jobs
+  FCP_IO_PRIORITY_COUNT
+};
+
+/* Run on the I/O thread; any FCP commands it sends are sent
+ * directly. Returns a result for the done function.
+ */
+typedef int (*fcp_io_work_fn)(void *data);
+
+/* Called on the event loop thread once the work has run */
+typedef void (*fcp_io_done_fn)(void *data, int result);
+
+/* Start the device's I/O thread; call from the event loop thread
+ * once the event loop is initialised. Returns 0 or -1.
+ */
+int fcp_io_start(struct fcp_device *device);
+
+/* Finish the work in progress and stop the thread; queued work and
+ * completions which haven't been delivered are dropped
+ */
+void fcp_io_stop(struct fcp_device *device);
+
+/* Check if the device's commands are being sent by its I/O thread */
+bool fcp_io_active(struct fcp_device *device);
+
+/* Queue work for the I/O thread. Returns 0, or -1 if the thread
+ * isn't running (and the work should be done directly).
+ */
+int fcp_io_submit(
+  struct fcp_device    *device,
+  enum fcp_io_priority  priority,
+  fcp_io_work_fn        work,
+  fcp_io_done_fn        done,
+  void                 *data
+);
+
+/* Set the priority of the commands this thread sends synchronously;
+ * returns the previous priority
+ */
+enum fcp_io_priority fcp_io_set_priority(enum fcp_io_priority priority);
+
+/* Used by fcp.c before building each command: on an I/O thread, do
+ * any work of higher priority than the current work which has been
+ * queued since, so that e.g. a control change waits for one command
+ * of a flash job step rather than the whole step
+ */
+void fcp_io_yield(void);
+
+/* Used by fcp.c: run work on the I/O thread serving hwdep at this
+ * thread's priority, and wait for its result. Returns false if
+ * there's no I/O thread for hwdep or this is it, so that the caller
+ * sends the command itself.
+ */
+bool fcp_io_call(
+  snd_hwdep_t    *hwdep,
+  fcp_io_work_fn  work,
+  void           *data,
+  int            *result
+);
@@ -9,7 +9,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <endian.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <linux/limits.h>
@@ -18,66 +20,229 @@
 #include "fcp-socket.h"
 #include "fcp.h"
 #include "esp-dfu.h"
+#include "event-loop.h"
+#include "job.h"
+#include "meter.h"
+#include "mux.h"
 #include "hash.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "log.h"
 
 #define FLASH_BLOCK_SIZE 4096
 
-static int server_sock = -1;
-static struct fcp_device *device = NULL;
+// Client buffer size while streaming firmware to flash
+#define STREAM_BUFFER_SIZE 65536
 
-static int have_flash_info = false;
-static int upgrade_segment_num = -1;
-static int upgrade_segment_size = -1;
-static int settings_segment_num = -1;
-static int settings_segment_size = -1;
-static int disk_segment_num = -1;
-static int disk_segment_size = -1;
-static int env_segment_num = -1;
-static int env_segment_size = -1;
+// Most firmware data to read (and so write to flash) per event so
+// that other events aren't held up
+#define STREAM_READ_MAX (8 * FCP_FLASH_WRITE_MAX)
 
-// Track current client state
+// Flash erase progress polling interval
+#define ERASE_POLL_MS 50
+
+// Blocks compared or written per step of a differential update
+#define DIFF_BLOCKS_PER_STEP 16
+
+// Largest request accepted through a file descriptor
+#define MAX_FD_MESSAGE_SIZE (64 * 1024 * 1024)
+
+struct socket_server;
+
+// App firmware being written to flash as it is received
+struct app_update {
+  struct socket_server   *server;
+  bool                    active;
+  bool                    verify;
+  int                     error;          // Once set, remaining data is discarded
+  struct firmware_payload payload;        // Payload header (without data)
+  EVP_MD_CTX             *sha256;
+  uint32_t                received;       // Firmware bytes consumed so far
+  int                     last_progress;
+
+  // Last chunk written, to be read back after the next write
+  uint8_t                 prev_chunk[FCP_FLASH_WRITE_MAX];
+  int                     prev_offset;
+  int                     prev_size;
+};
+
+// Most clients connected at once
+#define MAX_CLIENTS 16
+
+// State for each connected client
 struct client_state {
-  int     fd;            // Client socket fd, -1 if none
+  int     fd;            // Client socket fd
+  struct event_source *source;
   void   *buffer;        // Current message buffer
   size_t  size;          // Current buffer size
   size_t  bytes_read;    // How much we've read so far
   size_t  total_size;    // Total message size (once known)
+  bool    streaming;     // Current message is an app firmware update
+  struct app_update update;
+  struct job *job;       // Job whose response is pending
+  unsigned queued;       // Queue position while waiting for the device
+  int     pending_fd;    // Last fd received with SCM_RIGHTS, or -1
+  bool    subscribed;    // Send CONTROL_CHANGES responses
+  int     meter_interval; // Send METER_LEVELS this often (ms), or 0
+  int     meter_elapsed;  // Time covered by readings not sent (ms)
+  struct socket_server *server;
+  struct client_state *next;
 };
 
-static struct client_state client = {
-  .fd = -1,
-  .buffer = NULL,
-  .size = 0,
-  .bytes_read = 0,
-  .total_size = 0
+// Socket server state for each device
+struct socket_server {
+  struct fcp_device   *device;
+  int                  sock;
+  struct event_source *listen_source;
+
+  // Flash segments, read from the device when first needed
+  bool                 have_flash_info;
+  int                  upgrade_segment_num;
+  int                  upgrade_segment_size;
+  int                  settings_segment_num;
+  int                  settings_segment_size;
+  int                  disk_segment_num;
+  int                  disk_segment_size;
+  int                  env_segment_num;
+  int                  env_segment_size;
+
+  struct client_state *clients;
+  int                  client_count;
+  int                  subscriber_count;
+
+  // Interval the meter stream is running at (ms), or 0
+  int                  meter_interval;
+
+  // Control changes waiting to be sent to subscribers
+  uint8_t             *changes;
+  size_t               changes_size;
+  size_t               changes_alloc;
+
+  // Client streaming an app firmware update, if any
+  struct client_state *update_owner;
+
+  // Queue of clients waiting to make exclusive requests
+  unsigned             queue_seq;
+  struct event_source *resume_timer;
 };
 
-static void cleanup_client(void) {
-  if (client.fd >= 0) {
-    close(client.fd);
-    client.fd = -1;
+static void start_background_erase(struct socket_server *server);
+static int process_client_messages(struct client_state *client);
+static void update_meter_stream(struct socket_server *server);
+
+// Flash erase/update, DFU, reboot, and bulk restore requests need
+// the device to themselves; anything else (including request types
+// added later, unless they're listed here) can run alongside them
+static bool is_exclusive_request(uint8_t msg_type) {
+  switch (msg_type) {
+    case FCP_SOCKET_REQUEST_REBOOT:
+    case FCP_SOCKET_REQUEST_CONFIG_ERASE:
+    case FCP_SOCKET_REQUEST_APP_FIRMWARE_ERASE:
+    case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE:
+    case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE:
+    case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY:
+    case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF:
+    case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS:
+    case FCP_SOCKET_REQUEST_FIRMWARE_FD:
+    case FCP_SOCKET_REQUEST_RESTORE:
+    case FCP_SOCKET_REQUEST_MUX_ROUTING_WRITE:
+      return true;
   }
-  free(client.buffer);
-  client.buffer = NULL;
-  client.size = 0;
-  client.bytes_read = 0;
-  client.total_size = 0;
+
+  return false;
 }
 
-// Reject any pending connections in the accept queue. Call this
-// periodically during long-running operations to prevent new clients
-// from blocking.
-void drain_pending_connections(void) {
-  if (server_sock < 0)
+static bool device_locked(struct client_state *client) {
+  struct socket_server *server = client->server;
+
+  return job_device_busy(server->device) ||
+         (server->update_owner && server->update_owner != client);
+}
+
+// Park a client until the device is free; its input is paused so
+// that later messages stay queued behind this one
+static void queue_client(struct client_state *client) {
+  if (client->queued)
     return;
 
-  while (1) {
-    int tmp_fd = accept(server_sock, NULL, NULL);
-    if (tmp_fd < 0)
+  log_debug("Client request queued until the device is free");
+  client->queued = ++client->server->queue_seq;
+  event_modify_fd(client->source, 0);
+}
+
+// Resume queued clients (in order) once the device is free
+static void schedule_resume(struct socket_server *server) {
+  if (server->resume_timer)
+    event_timer_arm(server->resume_timer, 1, 0);
+}
+
+static void cleanup_client(struct client_state *client) {
+  struct socket_server *server = client->server;
+
+  for (struct client_state **p = &server->clients; *p; p = &(*p)->next) {
+    if (*p == client) {
+      *p = client->next;
       break;
-    log_debug("Rejected additional client connection");
-    close(tmp_fd);
+    }
+  }
+  server->client_count--;
+
+  if (client->subscribed)
+    server->subscriber_count--;
+  if (client->meter_interval) {
+    client->meter_interval = 0;
+    update_meter_stream(server);
+  }
+
+  event_remove(client->source);
+  job_detach_client(client->fd);
+  close(client->fd);
+  if (client->pending_fd >= 0)
+    close(client->pending_fd);
+
+  // Don't leave a partial image behind if the client went away
+  // during an update
+  if (client->update.active) {
+    if (client->update.received) {
+      log_warning("Client disconnected during firmware update; erasing");
+      start_background_erase(server);
+    }
+    EVP_MD_CTX_free(client->update.sha256);
+  }
+
+  if (server->update_owner == client) {
+    server->update_owner = NULL;
+    schedule_resume(server);
+  }
+
+  free(client->buffer);
+  free(client);
+}
+
+static void resume_queued_clients(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct socket_server *server = data;
+
+  while (1) {
+    struct client_state *next = NULL;
+
+    for (struct client_state *c = server->clients; c; c = c->next)
+      if (c->queued && (!next || c->queued < next->queued))
+        next = c;
+
+    if (!next || device_locked(next))
+      return;
+
+    next->queued = 0;
+    event_modify_fd(next->source, EPOLLIN);
+
+    if (process_client_messages(next) < 0) {
+      log_debug("Client connection closed");
+      cleanup_client(next);
+    }
   }
 }
 
@@ -119,17 +284,282 @@ static void send_error(int client_fd, int16_t code) {
 }
 
 void send_progress(int client_fd, uint8_t percent) {
+  if (client_fd < 0)
+    return;
+
   send_response(client_fd, FCP_SOCKET_RESPONSE_PROGRESS, &percent, sizeof(percent));
 }
 
-static int get_segment_nums(snd_hwdep_t *device) {
+void send_transfer_stats(int client_fd, const struct transfer_stats *stats) {
+  if (client_fd < 0)
+    return;
+
+  send_response(
+    client_fd, FCP_SOCKET_RESPONSE_TRANSFER_STATS, stats, sizeof(*stats)
+  );
+}
+
+// Send an unsolicited message (header, then data) to a client. A
+// client which can't take it all without blocking would get a
+// partial message, so it's disconnected instead (via the hangup
+// event).
+static void send_push(
+  struct client_state *client,
+  const void          *header,
+  const void          *data,
+  size_t               data_size
+) {
+  const struct fcp_socket_msg_header *h = header;
+  size_t header_size = sizeof(*h) + h->payload_length - data_size;
+  struct iovec iov[] = {
+    { (void *)header, header_size },
+    { (void *)data,   data_size   }
+  };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+  ssize_t ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (ret == (ssize_t)(header_size + data_size))
+    return;
+
+  log_warning("Dropping subscriber which isn't reading");
+  if (client->subscribed) {
+    client->subscribed = false;
+    client->server->subscriber_count--;
+  }
+  if (client->meter_interval) {
+    client->meter_interval = 0;
+    update_meter_stream(client->server);
+  }
+  shutdown(client->fd, SHUT_RDWR);
+}
+
+void fcp_socket_add_change(
+  struct fcp_device *device,
+  unsigned int       numid,
+  int                kind,
+  const void        *values,
+  int                length
+) {
+  struct socket_server *server = device->socket_server;
+
+  if (!server || !server->subscriber_count)
+    return;
+
+  size_t data_size =
+    kind == FCP_CONTROL_CHANGE_VALUES ? length * sizeof(int32_t) : length;
+  size_t size = sizeof(struct control_change) + data_size;
+
+  if (server->changes_size + size > server->changes_alloc) {
+    size_t new_alloc = server->changes_alloc ? server->changes_alloc * 2 : 1024;
+
+    while (new_alloc < server->changes_size + size)
+      new_alloc *= 2;
+
+    server->changes = realloc(server->changes, new_alloc);
+    if (!server->changes) {
+      log_error("Cannot allocate memory for control changes");
+      exit(1);
+    }
+    server->changes_alloc = new_alloc;
+  }
+
+  struct control_change *change =
+    (void *)(server->changes + server->changes_size);
+  change->numid = numid;
+  change->kind = kind;
+  change->length = length;
+
+  if (kind == FCP_CONTROL_CHANGE_VALUES) {
+    const int *v = values;
+    for (int i = 0; i < length; i++) {
+      int32_t value = v[i];
+      memcpy(change->data + i * sizeof(value), &value, sizeof(value));
+    }
+  } else {
+    memcpy(change->data, values, length);
+  }
+
+  server->changes_size += size;
+}
+
+void fcp_socket_flush_changes(struct fcp_device *device) {
+  struct socket_server *server = device->socket_server;
+
+  if (!server || !server->changes_size)
+    return;
+
+  struct fcp_socket_msg_header header = {
+    .magic          = FCP_SOCKET_MAGIC_RESPONSE,
+    .msg_type       = FCP_SOCKET_RESPONSE_CONTROL_CHANGES,
+    .payload_length = server->changes_size
+  };
+
+  for (struct client_state *c = server->clients; c; c = c->next)
+    if (c->subscribed)
+      send_push(c, &header, server->changes, server->changes_size);
+
+  server->changes_size = 0;
+}
+
+static void publish_meters(
+  struct fcp_device *device,
+  const uint32_t    *levels,
+  int                count,
+  uint32_t           seq
+) {
+  struct socket_server *server = device->socket_server;
+  struct {
+    struct fcp_socket_msg_header header;
+    struct meter_levels          meters;
+  } __attribute__((packed)) msg = {
+    .header = {
+      .magic          = FCP_SOCKET_MAGIC_RESPONSE,
+      .msg_type       = FCP_SOCKET_RESPONSE_METER_LEVELS,
+      .payload_length = sizeof(struct meter_levels) + count * sizeof(*levels)
+    },
+    .meters = {
+      .seq   = seq,
+      .count = count
+    }
+  };
+
+  for (struct client_state *c = server->clients; c; c = c->next) {
+
+    if (!c->meter_interval)
+      continue;
+
+    // Clients asking for a slower rate get a reading each time their
+    // interval has passed, which needn't be a multiple of the stream's
+    c->meter_elapsed += server->meter_interval;
+    if (c->meter_elapsed < c->meter_interval)
+      continue;
+    c->meter_elapsed -= c->meter_interval;
+
+    send_push(c, &msg, levels, count * sizeof(*levels));
+  }
+}
+
+// Run the meter stream at the fastest rate any client wants
+static void update_meter_stream(struct socket_server *server) {
+  int interval = 0;
+
+  for (struct client_state *c = server->clients; c; c = c->next)
+    if (c->meter_interval && (!interval || c->meter_interval < interval))
+      interval = c->meter_interval;
+
+  if (interval == server->meter_interval)
+    return;
+
+  if (meter_stream_set_interval(server->device, interval, publish_meters) < 0)
+    interval = 0;
+  server->meter_interval = interval;
+}
+
+static int handle_meter_subscribe(
+  struct client_state                *client,
+  const struct fcp_socket_msg_header *header
+) {
+  uint16_t interval;
+
+  if (header->payload_length != sizeof(interval))
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+
+  memcpy(&interval, header + 1, sizeof(interval));
+
+  if (interval &&
+      (interval < FCP_METER_INTERVAL_MIN || interval > FCP_METER_INTERVAL_MAX))
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+
+  // The first reading is sent straight away
+  client->meter_interval = interval;
+  client->meter_elapsed = interval;
+  update_meter_stream(client->server);
+
+  if (interval && !client->server->meter_interval) {
+    client->meter_interval = 0;
+    log_error("No meters to stream");
+    return FCP_SOCKET_ERR_CONFIG;
+  }
+
+  return 0;
+}
+
+static int handle_mux_routing_read(struct client_state *client) {
+  struct fcp_device *device = client->server->device;
+  struct mux_cache *cache = device->mux_cache;
+
+  if (!cache || !cache->output_count)
+    return FCP_SOCKET_ERR_CONFIG;
+
+  size_t size = sizeof(struct fcp_mux_routing_header) +
+                cache->output_count * sizeof(uint16_t);
+  uint8_t *resp = malloc(size);
+  if (!resp) {
+    log_error("Cannot allocate memory for mux routing");
+    exit(1);
+  }
+
+  struct fcp_mux_routing_header *routing = (void *)resp;
+  uint16_t *inputs = (void *)(routing + 1);
+
+  if (mux_read_routing(device, inputs) < 0) {
+    free(resp);
+    return FCP_SOCKET_ERR_FCP;
+  }
+
+  routing->output_count = htole16(cache->output_count);
+  routing->input_count = htole16(cache->input_count);
+  for (int i = 0; i < cache->output_count; i++)
+    inputs[i] = htole16(inputs[i]);
+
+  send_response(client->fd, FCP_SOCKET_RESPONSE_DATA, resp, size);
+  free(resp);
+  return 0;
+}
+
+static int handle_mux_routing_write(
+  struct client_state                *client,
+  const struct fcp_socket_msg_header *header
+) {
+  struct fcp_device *device = client->server->device;
+  struct mux_cache *cache = device->mux_cache;
+  const struct fcp_mux_routing_header *routing = (const void *)(header + 1);
+
+  if (!cache || !cache->output_count)
+    return FCP_SOCKET_ERR_CONFIG;
+
+  if (header->payload_length != sizeof(*routing) +
+                                cache->output_count * sizeof(uint16_t))
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+
+  if (le16toh(routing->output_count) != cache->output_count ||
+      le16toh(routing->input_count) != cache->input_count)
+    return FCP_SOCKET_ERR_MUX_ROUTING;
+
+  const uint16_t *p = (const uint16_t *)(routing + 1);
+  uint16_t inputs[cache->output_count];
+
+  for (int i = 0; i < cache->output_count; i++)
+    inputs[i] = le16toh(p[i]);
+
+  int ret = mux_write_routing(device, inputs);
+  if (ret == -EINVAL)
+    return FCP_SOCKET_ERR_MUX_ROUTING;
+  if (ret < 0)
+    return FCP_SOCKET_ERR_FCP;
+
+  return 0;
+}
 
-  if (have_flash_info) {
+static int get_segment_nums(struct socket_server *server) {
+  snd_hwdep_t *hwdep = server->device->hwdep;
+
+  if (server->have_flash_info) {
     return 0;
   }
 
   int size, count;
-  int ret = fcp_flash_info(device, &size, &count);
+  int ret = fcp_flash_info(hwdep, &size, &count);
   if (ret != 0) {
     log_error("Failed to get flash info from device");
     return -1;
@@ -150,7 +580,7 @@ static int get_segment_nums(snd_hwdep_t *device) {
     uint32_t flags;
     char *name;
 
-    ret = fcp_flash_segment_info(device, i, &segment_size, &flags, &name);
+    ret = fcp_flash_segment_info(hwdep, i, &segment_size, &flags, &name);
     if (ret != 0) {
       log_error("Failed to get segment info for segment %d", i);
       return -1;
@@ -161,48 +591,112 @@ static int get_segment_nums(snd_hwdep_t *device) {
     log_debug("  Name: %s", name);
 
     if (!strcmp(name, "App_Upgrade")) {
-      upgrade_segment_num = i;
-      upgrade_segment_size = segment_size;
+      server->upgrade_segment_num = i;
+      server->upgrade_segment_size = segment_size;
     } else if (!strcmp(name, "App_Settings")) {
-      settings_segment_num = i;
-      settings_segment_size = segment_size;
+      server->settings_segment_num = i;
+      server->settings_segment_size = segment_size;
     } else if (!strcmp(name, "App_Disk")) {
-      disk_segment_num = i;
-      disk_segment_size = segment_size;
+      server->disk_segment_num = i;
+      server->disk_segment_size = segment_size;
     } else if (!strcmp(name, "App_Env")) {
-      env_segment_num = i;
-      env_segment_size = segment_size;
+      server->env_segment_num = i;
+      server->env_segment_size = segment_size;
     }
   }
 
-  if (upgrade_segment_num == 0) {
-    log_error("Invalid upgrade segment number %d", upgrade_segment_num);
+  if (server->upgrade_segment_num == 0) {
+    log_error("Invalid upgrade segment number %d", server->upgrade_segment_num);
     return -1;
-  } else if (settings_segment_num == 0) {
-    log_error("Invalid settings segment number %d", settings_segment_num);
+  } else if (server->settings_segment_num == 0) {
+    log_error("Invalid settings segment number %d", server->settings_segment_num);
     return -1;
-  } else if (disk_segment_num == 0) {
-    log_error("Invalid disk segment number %d", disk_segment_num);
+  } else if (server->disk_segment_num == 0) {
+    log_error("Invalid disk segment number %d", server->disk_segment_num);
     return -1;
-  } else if (env_segment_num == 0) {
-    log_error("Invalid env segment number %d", env_segment_num);
+  } else if (server->env_segment_num == 0) {
+    log_error("Invalid env segment number %d", server->env_segment_num);
     return -1;
   }
 
   log_debug("Flash info:");
-  log_debug("  Upgrade segment: %d", upgrade_segment_num);
-  log_debug("  Settings segment: %d", settings_segment_num);
-  log_debug("  Disk segment: %d", disk_segment_num);
-  log_debug("  Env segment: %d", env_segment_num);
+  log_debug("  Upgrade segment: %d", server->upgrade_segment_num);
+  log_debug("  Settings segment: %d", server->settings_segment_num);
+  log_debug("  Disk segment: %d", server->disk_segment_num);
+  log_debug("  Env segment: %d", server->env_segment_num);
 
-  have_flash_info = true;
+  server->have_flash_info = true;
 
   return 0;
 }
 
-static int erase_flash_segment(int client_fd, int segment_num, int num_blocks) {
-  static int last_progress = -1;
+// Send the response to the job's client and carry on with any
+// messages which arrived while it was running
+static void client_job_complete(struct job *job, int result) {
+  struct socket_server *server = job->device->socket_server;
+  struct client_state *client = NULL;
+
+  // The device is free again for queued clients
+  schedule_resume(server);
+
+  if (job->client_fd >= 0)
+    for (client = server->clients; client; client = client->next)
+      if (client->job == job)
+        break;
+
+  if (!client) {
+    if (result)
+      log_error("Operation failed with no client connected: %d", result);
+    return;
+  }
+
+  if (result)
+    send_error(client->fd, result);
+  else
+    send_response(client->fd, FCP_SOCKET_RESPONSE_SUCCESS, NULL, 0);
+
+  client->job = NULL;
+  event_modify_fd(client->source, EPOLLIN);
+
+  if (process_client_messages(client) < 0) {
+    log_debug("Client connection closed");
+    cleanup_client(client);
+  }
+}
+
+static void free_job(struct job *job) {
+  free(job);
+}
+
+// Start a job for a client; no more of its messages are processed
+// until the job completes. Returns JOB_PENDING, or FCP_SOCKET_ERR_*
+// if the job couldn't be started.
+static int start_client_job(struct client_state *client, struct job *job) {
+  job->device = client->server->device;
+  job->client_fd = client->fd;
+  job->complete = client_job_complete;
+
+  if (job_start(job) < 0) {
+    if (job->destroy)
+      job->destroy(job);
+    return FCP_SOCKET_ERR_CONFIG;
+  }
+
+  client->job = job;
+  event_modify_fd(client->source, 0);
 
+  return JOB_PENDING;
+}
+
+// Flash erase, polled from a timer
+struct erase_state {
+  int  segment_num;
+  int  num_blocks;
+  int  last_progress;
+  bool started;
+};
+
+static int erase_init(struct erase_state *erase, int segment_num, int num_blocks) {
   if (segment_num < 1 || segment_num > 15) {
     log_error("Invalid segment number %d for erase", segment_num);
     return FCP_SOCKET_ERR_READ;
@@ -213,160 +707,908 @@ static int erase_flash_segment(int client_fd, int segment_num, int num_blocks) {
     return FCP_SOCKET_ERR_READ;
   }
 
-  log_debug("Erasing segment %d", segment_num);
+  erase->segment_num = segment_num;
+  erase->num_blocks = num_blocks;
+  erase->last_progress = -1;
+  erase->started = false;
+
+  return 0;
+}
+
+// Returns JOB_PENDING until the erase has finished
+static int erase_step(struct job *job, struct erase_state *erase) {
+  struct fcp_device *device = job->device;
+
+  if (!erase->started) {
+    log_debug("Erasing segment %d", erase->segment_num);
+
+    int ret = fcp_flash_erase(device->hwdep, erase->segment_num);
+    if (ret != 0) {
+      log_error(
+        "Error erasing flash segment %d: %d", erase->segment_num, ret
+      );
+      return FCP_SOCKET_ERR_WRITE;
+    }
+    erase->started = true;
+  }
+
+  int ret = fcp_flash_erase_progress(device->hwdep, erase->segment_num);
+  if (ret < 0) {
+    log_error("Error getting flash erase progress: %d", ret);
+    return FCP_SOCKET_ERR_READ;
+  }
+
+  if (ret == 255) {
+    if (erase->last_progress != 100)
+      job_progress(job, 100);
+    return 0;
+  }
+
+  int progress = ret * 100 / erase->num_blocks;
+
+  if (progress != erase->last_progress) {
+    job_progress(job, progress);
+    erase->last_progress = progress;
+  }
+
+  job_wait(job, ERASE_POLL_MS, 0);
+  return JOB_PENDING;
+}
+
+struct erase_job {
+  struct job         job;
+  struct erase_state erase;
+  int                result;  // Reported once the erase has finished
+};
+
+static int erase_job_step(struct job *job) {
+  struct erase_job *erase_job = (struct erase_job *)job;
+
+  int ret = erase_step(job, &erase_job->erase);
+  if (ret == 0)
+    return erase_job->result;
+
+  return ret;
+}
+
+static struct erase_job *new_erase_job(int segment_num, int segment_size, int *err) {
+  struct erase_job *erase_job = calloc(1, sizeof(*erase_job));
+  if (!erase_job) {
+    log_error("Cannot allocate memory for erase job");
+    exit(1);
+  }
+
+  *err = erase_init(
+    &erase_job->erase, segment_num, segment_size / FLASH_BLOCK_SIZE
+  );
+  if (*err) {
+    free(erase_job);
+    return NULL;
+  }
+
+  erase_job->job.step = erase_job_step;
+  erase_job->job.destroy = free_job;
+
+  return erase_job;
+}
+
+// Erase a segment for a client, reporting result (rather than
+// success) if the erase works
+static int start_erase(
+  struct client_state *client,
+  int                  segment_num,
+  int                  segment_size,
+  int                  result
+) {
+  if (job_device_busy(client->server->device))
+    return FCP_SOCKET_ERR_BUSY;
+
+  int err;
+  struct erase_job *erase_job = new_erase_job(segment_num, segment_size, &err);
+  if (!erase_job)
+    return err;
+
+  erase_job->result = result;
+
+  return start_client_job(client, &erase_job->job);
+}
+
+static int erase_config(struct client_state *client) {
+  struct socket_server *server = client->server;
+
+  int ret = get_segment_nums(server);
+  if (ret < 0) {
+    log_error("Error getting segment numbers");
+    return FCP_SOCKET_ERR_READ;
+  }
+
+  return start_erase(
+    client, server->settings_segment_num, server->settings_segment_size, 0
+  );
+}
+
+static int erase_app_firmware(struct client_state *client) {
+  struct socket_server *server = client->server;
+
+  int ret = get_segment_nums(server);
+  if (ret < 0) {
+    log_error("Error getting segment numbers");
+    return FCP_SOCKET_ERR_READ;
+  }
+
+  return start_erase(
+    client, server->upgrade_segment_num, server->upgrade_segment_size, 0
+  );
+}
+
+// Erase the upgrade segment with no client to report to
+static void start_background_erase(struct socket_server *server) {
+  int err;
+  struct erase_job *erase_job = new_erase_job(
+    server->upgrade_segment_num, server->upgrade_segment_size, &err
+  );
+  if (!erase_job)
+    return;
+
+  erase_job->job.device = server->device;
+  erase_job->job.client_fd = -1;
+  erase_job->job.complete = client_job_complete;
+
+  if (job_start(&erase_job->job) < 0)
+    free(erase_job);
+}
+
+static bool is_app_update_request(uint8_t msg_type) {
+  return msg_type == FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE ||
+         msg_type == FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY;
+}
+
+// Check the size and USB ID of an app firmware image
+static int check_app_firmware(
+  struct socket_server          *server,
+  const struct firmware_payload *payload
+) {
+  struct fcp_device *device = server->device;
+
+  int ret = get_segment_nums(server);
+  if (ret < 0) {
+    log_error("Error getting segment numbers");
+    return FCP_SOCKET_ERR_READ;
+  }
+
+  if (payload->size < 65536) {
+    log_error("Firmware data too small: %d", payload->size);
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  } else if (payload->size > server->upgrade_segment_size) {
+    log_error(
+      "Firmware data too large: %d > %d",
+      payload->size, server->upgrade_segment_size
+    );
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  }
+
+  // Verify PID
+  if (payload->usb_vid != device->usb_vid ||
+      payload->usb_pid != device->usb_pid) {
+    log_error("Expected VID:PID %04x:%04x, got %04x:%04x",
+              device->usb_vid, device->usb_pid,
+              payload->usb_vid, payload->usb_pid);
+    return FCP_SOCKET_ERR_INVALID_USB_ID;
+  }
+
+  return 0;
+}
+
+// Check the firmware payload header and get ready to write the
+// image as it arrives. Returns 0 or FCP_SOCKET_ERR_*.
+static int app_update_begin(
+  struct socket_server          *server,
+  struct app_update             *update,
+  const struct firmware_payload *payload,
+  bool                           verify
+) {
+  update->server = server;
+  update->payload = *payload;
+  update->verify = verify;
+  update->error = 0;
+  update->received = 0;
+  update->last_progress = -1;
+  update->prev_size = 0;
+  update->sha256 = NULL;
+
+  if (job_device_busy(server->device))
+    return FCP_SOCKET_ERR_BUSY;
+
+  int ret = check_app_firmware(server, payload);
+  if (ret)
+    return ret;
+
+  // The hash can only be checked once all the data has arrived
+  update->sha256 = sha256_stream_begin();
+  if (!update->sha256)
+    return FCP_SOCKET_ERR_INVALID_HASH;
+
+  log_debug(
+    "Writing firmware (length %d)%s",
+    payload->size, verify ? " with read-back verification" : ""
+  );
+
+  return 0;
+}
+
+static int verify_flash_chunk(
+  struct socket_server *server,
+  int                   offset,
+  const uint8_t        *data,
+  int                   size
+) {
+  uint8_t buf[FCP_FLASH_WRITE_MAX];
+
+  int ret = fcp_flash_read(
+    server->device->hwdep, server->upgrade_segment_num, offset, size, buf
+  );
+  if (ret < 0) {
+    log_error("Error reading back flash at offset %d", offset);
+    return FCP_SOCKET_ERR_READ;
+  }
+
+  if (memcmp(buf, data, size)) {
+    log_error("Flash verification failed at offset %d", offset);
+    return FCP_SOCKET_ERR_VERIFY;
+  }
 
-  int ret = fcp_flash_erase(device->hwdep, segment_num);
+  return 0;
+}
+
+// Write one chunk, then read back the previous one, so that
+// verification is interleaved with the writes rather than being a
+// second pass over the whole segment
+static int app_update_write_chunk(
+  int                client_fd,
+  struct app_update *update,
+  const uint8_t     *data,
+  int                size
+) {
+  struct socket_server *server = update->server;
+  int offset = update->received;
+
+  int ret = fcp_flash_write(
+    server->device->hwdep, server->upgrade_segment_num, offset, size, data
+  );
   if (ret != 0) {
-    log_error("Error erasing flash segment %d: %d", segment_num, ret);
+    log_error("Error writing flash segment");
     return FCP_SOCKET_ERR_WRITE;
   }
 
-  while (1) {
-    int ret = fcp_flash_erase_progress(device->hwdep, segment_num);
+  if (update->verify) {
+    if (update->prev_size) {
+      ret = verify_flash_chunk(
+        server, update->prev_offset, update->prev_chunk, update->prev_size
+      );
+      if (ret)
+        return ret;
+    }
+    memcpy(update->prev_chunk, data, size);
+    update->prev_offset = offset;
+    update->prev_size = size;
+  }
+
+  int progress = (int64_t)offset * 100 / update->payload.size;
+  if (progress != update->last_progress) {
+    send_progress(client_fd, progress);
+    update->last_progress = progress;
+  }
+
+  return 0;
+}
+
+// Consume received firmware data, writing each complete chunk (and
+// the final partial chunk). Returns the number of bytes used.
+static size_t app_update_feed(
+  int                client_fd,
+  struct app_update *update,
+  const uint8_t     *data,
+  size_t             len
+) {
+  size_t remaining = update->payload.size - update->received;
+  size_t used = 0;
+
+  if (len > remaining)
+    len = remaining;
+
+  while (len - used >= FCP_FLASH_WRITE_MAX ||
+         (used < len && len == remaining)) {
+    int size = len - used;
+    if (size > FCP_FLASH_WRITE_MAX)
+      size = FCP_FLASH_WRITE_MAX;
+
+    if (!update->error) {
+      sha256_stream_update(update->sha256, data + used, size);
+      update->error = app_update_write_chunk(
+        client_fd, update, data + used, size
+      );
+    }
+
+    used += size;
+    update->received += size;
+  }
+
+  return used;
+}
+
+// All the data has been received; check the last chunk and the
+// hash. Returns JOB_PENDING if the image is being erased.
+static int app_update_end(struct app_update *update, bool *hash_ok) {
+  int ret = update->error;
+
+  if (!ret && update->verify && update->prev_size)
+    ret = verify_flash_chunk(
+      update->server,
+      update->prev_offset, update->prev_chunk, update->prev_size
+    );
+
+  *hash_ok = sha256_stream_verify(update->sha256, update->payload.sha256);
+  update->sha256 = NULL;
+  update->active = false;
+
+  return ret;
+}
+
+static int app_update_finish(struct client_state *client) {
+  struct socket_server *server = client->server;
+  struct app_update *update = &client->update;
+  bool hash_ok;
+  int ret = app_update_end(update, &hash_ok);
+
+  // Don't leave a partly written or wrong image behind; the error is
+  // reported once it has been erased
+  if (ret || !hash_ok) {
+    if (ret)
+      log_error("Firmware update failed; erasing the written image");
+    else
+      log_error("Firmware hash mismatch; erasing the written image");
+    return start_erase(
+      client, server->upgrade_segment_num, server->upgrade_segment_size,
+      ret ? ret : FCP_SOCKET_ERR_INVALID_HASH
+    );
+  }
+
+  if (!ret && update->last_progress != 100)
+    send_progress(client->fd, 100);
+
+  return ret;
+}
+
+static bool is_blank(const uint8_t *data, int size) {
+  for (int i = 0; i < size; i++)
+    if (data[i] != 0xff)
+      return false;
+  return true;
+}
+
+enum diff_block_action {
+  DIFF_BLOCK_SKIP,
+  DIFF_BLOCK_WRITE
+};
+
+enum diff_state {
+  DIFF_COMPARE,
+  DIFF_ERASE,
+  DIFF_WRITE
+};
+
+struct diff_job {
+  struct job          job;
+  void               *msg;          // Request message (owned)
+  struct firmware_payload *payload; // Within msg
+  enum diff_state     state;
+  int                 block_count;
+  int                 compare_count; // Blocks to the end of the segment
+  uint8_t            *actions;
+  int                 block;        // Next block to compare or write
+  int                 write_count;
+  int                 written;
+  bool                need_erase;
+  int                 last_progress;
+  struct erase_state  erase;
+};
+
+static int diff_block_size(struct diff_job *diff, int block) {
+  int size = diff->payload->size - block * FCP_FLASH_WRITE_MAX;
+
+  return size > FCP_FLASH_WRITE_MAX ? FCP_FLASH_WRITE_MAX : size;
+}
+
+static void diff_progress(struct diff_job *diff, int progress) {
+  if (progress != diff->last_progress) {
+    job_progress(&diff->job, progress);
+    diff->last_progress = progress;
+  }
+}
+
+// Compare the next few blocks with what's already there; past the
+// end of the new image, the old one must be blank
+static int diff_compare_step(struct diff_job *diff) {
+  struct socket_server *server = diff->job.device->socket_server;
+  uint8_t buf[FCP_FLASH_WRITE_MAX];
+
+  for (int n = 0;
+       n < DIFF_BLOCKS_PER_STEP && diff->block < diff->compare_count;
+       n++, diff->block++) {
+    int offset = diff->block * FCP_FLASH_WRITE_MAX;
+    bool tail = diff->block >= diff->block_count;
+    int size = tail
+      ? server->upgrade_segment_size - offset
+      : diff_block_size(diff, diff->block);
+
+    if (size > FCP_FLASH_WRITE_MAX)
+      size = FCP_FLASH_WRITE_MAX;
+
+    int ret = fcp_flash_read(
+      server->device->hwdep, server->upgrade_segment_num, offset, size, buf
+    );
     if (ret < 0) {
-      log_error("Error getting flash erase progress: %d", ret);
+      log_error("Error reading flash at offset %d", offset);
       return FCP_SOCKET_ERR_READ;
     }
 
-    if (ret == 255)
+    if (tail) {
+      if (!is_blank(buf, size))
+        diff->need_erase = true;
+    } else if (memcmp(buf, diff->payload->data + offset, size)) {
+      diff->actions[diff->block] = DIFF_BLOCK_WRITE;
+      diff->write_count++;
+      if (!is_blank(buf, size))
+        diff->need_erase = true;
+    }
+
+    diff_progress(diff, diff->block * 100 / diff->compare_count);
+
+    // Once an erase is needed, the rest of the tail can't matter
+    if (tail && diff->need_erase)
+      diff->block = diff->compare_count - 1;
+  }
+
+  if (diff->block < diff->compare_count)
+    return JOB_PENDING;
+
+  // After an erase, every block which isn't blank needs writing
+  if (diff->need_erase) {
+    diff->write_count = 0;
+    for (int i = 0; i < diff->block_count; i++) {
+      int offset = i * FCP_FLASH_WRITE_MAX;
+
+      diff->actions[i] =
+        is_blank(diff->payload->data + offset, diff_block_size(diff, i)) ?
+          DIFF_BLOCK_SKIP : DIFF_BLOCK_WRITE;
+      if (diff->actions[i] == DIFF_BLOCK_WRITE)
+        diff->write_count++;
+    }
+  }
+
+  log_info(
+    "Differential update: writing %d of %d blocks%s",
+    diff->write_count, diff->block_count,
+    diff->need_erase ? " after erase" : ""
+  );
+
+  diff->block = 0;
+  diff->last_progress = -1;
+  diff->state = diff->need_erase ? DIFF_ERASE : DIFF_WRITE;
+
+  if (diff->need_erase) {
+    int ret = erase_init(
+      &diff->erase, server->upgrade_segment_num,
+      server->upgrade_segment_size / FLASH_BLOCK_SIZE
+    );
+    if (ret)
+      return ret;
+  }
+
+  return JOB_PENDING;
+}
+
+// Write and check the next few blocks which need it
+static int diff_write_step(struct diff_job *diff) {
+  struct socket_server *server = diff->job.device->socket_server;
+
+  for (int n = 0;
+       n < DIFF_BLOCKS_PER_STEP && diff->block < diff->block_count;
+       diff->block++) {
+    if (diff->actions[diff->block] != DIFF_BLOCK_WRITE)
+      continue;
+
+    int offset = diff->block * FCP_FLASH_WRITE_MAX;
+    int size = diff_block_size(diff, diff->block);
+
+    int ret = fcp_flash_write(
+      server->device->hwdep, server->upgrade_segment_num, offset, size,
+      diff->payload->data + offset
+    );
+    if (ret != 0) {
+      log_error("Error writing flash segment");
+      return FCP_SOCKET_ERR_WRITE;
+    }
+
+    ret = verify_flash_chunk(
+      server, offset, diff->payload->data + offset, size
+    );
+    if (ret)
+      return ret;
+
+    diff_progress(diff, diff->written++ * 100 / diff->write_count);
+    n++;
+  }
+
+  if (diff->block < diff->block_count)
+    return JOB_PENDING;
+
+  diff_progress(diff, 100);
+  return 0;
+}
+
+static int diff_job_step(struct job *job) {
+  struct diff_job *diff = (struct diff_job *)job;
+  int ret;
+
+  switch (diff->state) {
+    case DIFF_COMPARE:
+      ret = diff_compare_step(diff);
+      break;
+
+    case DIFF_ERASE:
+      ret = erase_step(job, &diff->erase);
+      if (ret == JOB_PENDING)
+        return ret;  // erase_step() has set the poll timer
+      if (ret == 0) {
+        diff->state = DIFF_WRITE;
+        ret = JOB_PENDING;
+      }
+      break;
+
+    case DIFF_WRITE:
+      ret = diff_write_step(diff);
       break;
 
-    int progress = ret * 100 / num_blocks;
+    default:
+      ret = FCP_SOCKET_ERR_INVALID_STATE;
+  }
+
+  if (ret == JOB_PENDING)
+    job_wait(job, 0, 0);
+
+  return ret;
+}
+
+static void diff_job_destroy(struct job *job) {
+  struct diff_job *diff = (struct diff_job *)job;
+
+  free(diff->actions);
+  free_client_message(diff->msg);
+  free(diff);
+}
+
+// Differential app firmware update: read back the upgrade segment
+// and write only the blocks which differ from the new image.
+//
+// Flash can only be erased a segment at a time, and erased flash
+// reads as 0xff. If every changed block is still blank it is
+// written in place; otherwise the segment is erased and only the
+// blocks of the new image which aren't blank are written. The rest
+// of the segment, past the end of the new image, must be blank too,
+// or the segment is erased. Written blocks are always read back and
+// checked.
+static struct job *new_diff_job(
+  struct socket_server *server,
+  void                 *msg,
+  int                  *err
+) {
+  struct firmware_payload *payload = (struct firmware_payload *)
+    ((struct fcp_socket_msg_header *)msg + 1);
+
+  *err = check_app_firmware(server, payload);
+  if (*err)
+    return NULL;
+
+  if (!verify_sha256(payload->data, payload->size, payload->sha256)) {
+    *err = FCP_SOCKET_ERR_INVALID_HASH;
+    return NULL;
+  }
+
+  struct diff_job *diff = calloc(1, sizeof(*diff));
+  if (!diff) {
+    log_error("Cannot allocate memory for differential update");
+    exit(1);
+  }
+
+  diff->block_count =
+    (payload->size + FCP_FLASH_WRITE_MAX - 1) / FCP_FLASH_WRITE_MAX;
+  diff->compare_count =
+    (server->upgrade_segment_size + FCP_FLASH_WRITE_MAX - 1) /
+    FCP_FLASH_WRITE_MAX;
+  diff->actions = calloc(diff->block_count, 1);
+  if (!diff->actions) {
+    log_error("Cannot allocate memory for block list");
+    exit(1);
+  }
+
+  diff->msg = msg;
+  diff->payload = payload;
+  diff->state = DIFF_COMPARE;
+  diff->last_progress = -1;
+  diff->job.step = diff_job_step;
+  diff->job.destroy = diff_job_destroy;
+
+  return &diff->job;
+}
+
+// App firmware update from a request passed as a file descriptor;
+// the image is already complete, so it is written in steps from
+// there rather than streamed
+struct app_job {
+  struct job               job;
+  void                    *msg;
+  struct firmware_payload *payload;  // Within msg
+  struct app_update        update;
+
+  // Set if the image is being erased after a failed write
+  bool                     erasing;
+  struct erase_state       erase;
+  int                      result;   // Reported once it's erased
+};
+
+static int app_job_step(struct job *job) {
+  struct app_job *app = (struct app_job *)job;
+  struct app_update *update = &app->update;
+  size_t remaining = update->payload.size - update->received;
+
+  if (app->erasing) {
+    int ret = erase_step(job, &app->erase);
+    return ret == 0 ? app->result : ret;
+  }
+
+  // Progress goes through the job rather than straight to the client
+  if (!update->error) {
+    app_update_feed(
+      -1, update,
+      app->payload->data + update->received,
+      remaining > STREAM_READ_MAX ? STREAM_READ_MAX : remaining
+    );
+    if (update->last_progress >= 0)
+      job_progress(job, update->last_progress);
+  }
+
+  if (!update->error && update->received < update->payload.size) {
+    job_wait(job, 0, 0);
+    return JOB_PENDING;
+  }
+
+  // The hash was checked before writing, so this can't fail
+  bool hash_ok;
+  int ret = app_update_end(update, &hash_ok);
+  if (!ret && !hash_ok)
+    ret = FCP_SOCKET_ERR_INVALID_HASH;
+
+  // Don't leave a partly written image behind
+  if (ret && update->received) {
+    struct socket_server *server = update->server;
+
+    log_error("Firmware update failed; erasing the written image");
+    if (erase_init(
+          &app->erase, server->upgrade_segment_num,
+          server->upgrade_segment_size / FLASH_BLOCK_SIZE
+        ))
+      return ret;
+    app->erasing = true;
+    app->result = ret;
+    job_wait(job, 0, 0);
+    return JOB_PENDING;
+  }
+
+  if (!ret && update->last_progress != 100)
+    job_progress(job, 100);
+
+  return ret;
+}
+
+static void app_job_destroy(struct job *job) {
+  struct app_job *app = (struct app_job *)job;
+
+  EVP_MD_CTX_free(app->update.sha256);
+  free_client_message(app->msg);
+  free(app);
+}
+
+static struct job *new_app_job(
+  struct socket_server *server,
+  void                 *msg,
+  int                  *err
+) {
+  struct fcp_socket_msg_header *header = msg;
+  struct firmware_payload *payload = (struct firmware_payload *)(header + 1);
 
-    if (progress != last_progress) {
-      send_progress(client_fd, progress);
-      last_progress = progress;
-    }
+  // Check the hash first so that a bad image is never written
+  if (!verify_sha256(payload->data, payload->size, payload->sha256)) {
+    *err = FCP_SOCKET_ERR_INVALID_HASH;
+    return NULL;
+  }
 
-    // wait 50ms
-    usleep(50000);
+  struct app_job *app = calloc(1, sizeof(*app));
+  if (!app) {
+    log_error("Cannot allocate memory for firmware update");
+    exit(1);
+  }
 
-    drain_pending_connections();
+  *err = app_update_begin(
+    server, &app->update, payload,
+    header->msg_type == FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY
+  );
+  if (*err) {
+    EVP_MD_CTX_free(app->update.sha256);
+    free(app);
+    return NULL;
   }
 
-  if (last_progress != 100)
-    send_progress(client_fd, 100);
+  app->msg = msg;
+  app->payload = payload;
+  app->update.active = true;
+  app->job.step = app_job_step;
+  app->job.destroy = app_job_destroy;
 
-  return 0;
+  return &app->job;
 }
 
-static int erase_config(int client_fd) {
-  int ret = get_segment_nums(device->hwdep);
-  if (ret < 0) {
-    log_error("Error getting segment numbers");
-    return FCP_SOCKET_ERR_READ;
+// Start a firmware update from a complete request message; msg is
+// always taken (and freed with free_client_message())
+static int start_firmware_job(struct client_state *client, void *msg) {
+  struct socket_server *server = client->server;
+  struct fcp_device *device = server->device;
+  struct fcp_socket_msg_header *header = msg;
+  struct firmware_payload *payload = (struct firmware_payload *)(header + 1);
+  struct job *job = NULL;
+  int ret;
+
+  if (job_device_busy(device)) {
+    ret = FCP_SOCKET_ERR_BUSY;
+  } else if (header->payload_length < sizeof(*payload) ||
+             header->payload_length != sizeof(*payload) + payload->size) {
+    log_error("Firmware payload length mismatch");
+    ret = FCP_SOCKET_ERR_INVALID_LENGTH;
+  } else {
+    switch (header->msg_type) {
+      case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE:
+      case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY:
+        job = new_app_job(server, msg, &ret);
+        break;
+
+      case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF:
+        job = new_diff_job(server, msg, &ret);
+        break;
+
+      case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE:
+      case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS:
+        ret = esp_dfu_check(device, header);
+        if (!ret)
+          job = esp_dfu_new_job(device, msg);
+        break;
+
+      default:
+        ret = FCP_SOCKET_ERR_INVALID_COMMAND;
+    }
   }
 
-  return erase_flash_segment(
-    client_fd,
-    settings_segment_num,
-    settings_segment_size / FLASH_BLOCK_SIZE
-  );
+  if (!job) {
+    free_client_message(msg);
+    return ret;
+  }
+
+  return start_client_job(client, job);
 }
 
-static int erase_app_firmware(int client_fd) {
-  int ret = get_segment_nums(device->hwdep);
-  if (ret < 0) {
-    log_error("Error getting segment numbers");
-    return FCP_SOCKET_ERR_READ;
+// Mapped request messages, so that free_client_message() knows how
+// to release them
+struct mapped_msg {
+  void              *addr;
+  size_t             size;
+  struct mapped_msg *next;
+};
+
+static struct mapped_msg *mapped_msgs = NULL;
+
+void free_client_message(void *msg) {
+  for (struct mapped_msg **p = &mapped_msgs; *p; p = &(*p)->next) {
+    struct mapped_msg *m = *p;
+
+    if (m->addr == msg) {
+      munmap(m->addr, m->size);
+      *p = m->next;
+      free(m);
+      return;
+    }
   }
 
-  return erase_flash_segment(
-    client_fd,
-    upgrade_segment_num,
-    upgrade_segment_size / FLASH_BLOCK_SIZE
-  );
+  free(msg);
 }
 
-static int handle_app_firmware_update(
-  int client_fd, const struct fcp_socket_msg_header *header
-) {
-  struct firmware_payload *payload = (struct firmware_payload *) (header + 1);
-  int last_progress = -1;
+// Get a request message from a file descriptor. Only sealed memfds
+// are accepted, so that the message can be mapped rather than read
+// in on the event loop, and can't change while it's in use.
+static int load_fd_message(int fd, void **msg, size_t *msg_size) {
+  struct stat st;
 
-  int ret = get_segment_nums(device->hwdep);
-  if (ret < 0) {
-    log_error("Error getting segment numbers");
+  if (fstat(fd, &st) < 0) {
+    log_error("Cannot stat request fd: %s", strerror(errno));
     return FCP_SOCKET_ERR_READ;
   }
 
-  if (payload->size < 65536) {
-    log_error("Firmware data too small: %d", payload->size);
-    send_error(client_fd, FCP_SOCKET_ERR_INVALID_LENGTH);
-    return FCP_SOCKET_ERR_INVALID_LENGTH;
-  } else if (payload->size > upgrade_segment_size) {
-    log_error(
-      "Firmware data too large: %d > %d", payload->size, upgrade_segment_size
-    );
-    send_error(client_fd, FCP_SOCKET_ERR_INVALID_LENGTH);
+  size_t size = st.st_size;
+  *msg_size = size;
+  if (size < sizeof(struct fcp_socket_msg_header) ||
+      size > MAX_FD_MESSAGE_SIZE) {
+    log_error("Invalid request fd size %zu", size);
     return FCP_SOCKET_ERR_INVALID_LENGTH;
   }
 
-  // Verify hash
-  if (!verify_sha256(payload->data, payload->size, payload->sha256)) {
-    send_error(client_fd, FCP_SOCKET_ERR_INVALID_HASH);
-    return FCP_SOCKET_ERR_INVALID_HASH;
+  const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+  int fd_seals = fcntl(fd, F_GET_SEALS);
+
+  if (fd_seals < 0 || (fd_seals & seals) != seals) {
+    log_error("Request fd is not a sealed memfd");
+    return FCP_SOCKET_ERR_READ;
   }
 
-  // Verify PID
-  if (payload->usb_vid != device->usb_vid ||
-      payload->usb_pid != device->usb_pid) {
-    log_error("Expected VID:PID %04x:%04x, got %04x:%04x",
-              device->usb_vid, device->usb_pid,
-              payload->usb_vid, payload->usb_pid);
-    send_error(client_fd, FCP_SOCKET_ERR_INVALID_USB_ID);
-    return FCP_SOCKET_ERR_INVALID_USB_ID;
+  void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    log_error("Cannot map request fd: %s", strerror(errno));
+    return FCP_SOCKET_ERR_READ;
   }
 
-  // display first/last 16 bytes of firmware data
-  {
-    char s[256] = "";
-    char *p = s;
+  struct mapped_msg *m = malloc(sizeof(*m));
+  if (!m) {
+    log_error("Cannot allocate memory for mapped request");
+    exit(1);
+  }
+  m->addr = addr;
+  m->size = size;
+  m->next = mapped_msgs;
+  mapped_msgs = m;
 
-    p += snprintf(
-      p,
-      sizeof(s) - (p - s),
-      "Firmware data (length %d):",
-      payload->size
-    );
-    for (int i = 0; i < 16; i++)
-      p += snprintf(p, sizeof(s) - (p - s), " %02x", payload->data[i]);
-    p += snprintf(p, sizeof(s) - (p - s), " ...");
-    for (int i = payload->size - 16; i < payload->size; i++)
-      p += snprintf(p, sizeof(s) - (p - s), " %02x", payload->data[i]);
-    log_debug("%s", s);
+  *msg = addr;
+  return 0;
+}
+
+// Handle a request whose message (header and payload, as it would
+// have been sent on the socket) is in the fd passed with it
+static int handle_fd_request(struct client_state *client) {
+  int fd = client->pending_fd;
+  client->pending_fd = -1;
+
+  if (fd < 0) {
+    log_error("No file descriptor received with request");
+    return FCP_SOCKET_ERR_READ;
   }
 
-  for (int i = 0; i < payload->size; i += FCP_FLASH_WRITE_MAX) {
-    int size = payload->size - i;
-    if (size > FCP_FLASH_WRITE_MAX) {
-      size = FCP_FLASH_WRITE_MAX;
-    }
-    int ret = fcp_flash_write(
-      device->hwdep,
-      upgrade_segment_num,
-      i,
-      size,
-      payload->data + i
-    );
-    if (ret != 0) {
-      log_error("Error writing flash segment");
-      return FCP_SOCKET_ERR_WRITE;
-    }
+  void *msg;
+  size_t size;
+  int ret = load_fd_message(fd, &msg, &size);
+  close(fd);
+  if (ret)
+    return ret;
 
-    int progress = i * 100 / payload->size;
-    if (progress != last_progress) {
-      send_progress(client_fd, progress);
-      last_progress = progress;
-    }
+  struct fcp_socket_msg_header *header = msg;
 
-    drain_pending_connections();
+  if (header->magic != FCP_SOCKET_MAGIC_REQUEST) {
+    free_client_message(msg);
+    return FCP_SOCKET_ERR_INVALID_MAGIC;
   }
 
-  if (last_progress != 100)
-    send_progress(client_fd, 100);
+  if (size != sizeof(*header) + header->payload_length) {
+    log_error("Request fd size doesn't match its header");
+    free_client_message(msg);
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  }
 
-  return 0;
+  return start_firmware_job(client, msg);
 }
 
 static void log_hex(const char *prefix, const void *data, size_t size) {
@@ -384,7 +1626,7 @@ static void log_hex(const char *prefix, const void *data, size_t size) {
 }
 
 static int handle_fcp_cmd(
-  int client_fd,
+  struct client_state                *client,
   const struct fcp_socket_msg_header *header
 ) {
   if (!getenv("FCP_DEBUG")) {
@@ -409,7 +1651,7 @@ static int handle_fcp_cmd(
   }
 
   int ret = fcp_cmd(
-    device->hwdep,
+    client->server->device->hwdep,
     req->opcode,
     req->req_data,
     req_data_size,
@@ -426,50 +1668,209 @@ static int handle_fcp_cmd(
   if (req->resp_size > 0)
     log_hex("  resp:", resp_buf, req->resp_size);
 
-  send_response(client_fd, FCP_SOCKET_RESPONSE_DATA, resp_buf, req->resp_size);
+  send_response(client->fd, FCP_SOCKET_RESPONSE_DATA, resp_buf, req->resp_size);
   free(resp_buf);
   return 0;
 }
 
+// Run a batch of FCP commands and send all the results in one DATA
+// response; a failed command is reported in its result rather than
+// failing the batch
+static int handle_fcp_cmd_batch(
+  struct client_state                *client,
+  const struct fcp_socket_msg_header *header
+) {
+  if (!getenv("FCP_DEBUG")) {
+    return FCP_SOCKET_ERR_DEBUG_DISABLED;
+  }
+
+  const uint8_t *p = (const uint8_t *)(header + 1);
+  const uint8_t *end = p + header->payload_length;
+  const struct fcp_cmd_batch_header *batch = (const void *)p;
+
+  if (header->payload_length < sizeof(*batch) ||
+      batch->count > FCP_CMD_BATCH_MAX) {
+    log_error("Invalid FCP command batch");
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  }
+
+  // Check the framing and size the response before running anything
+  size_t resp_size = sizeof(struct fcp_cmd_batch_header);
+  const uint8_t *q = p + sizeof(*batch);
+
+  for (uint32_t i = 0; i < batch->count; i++) {
+    const struct fcp_cmd_batch_request *req = (const void *)q;
+
+    if (end - q < (ssize_t)sizeof(*req) ||
+        end - q - sizeof(*req) < req->req_size) {
+      log_error("FCP command batch entry %u truncated", i);
+      return FCP_SOCKET_ERR_INVALID_LENGTH;
+    }
+
+    q += sizeof(*req) + req->req_size;
+    resp_size += sizeof(struct fcp_cmd_batch_result) + req->resp_size;
+  }
+
+  if (q != end || resp_size > MAX_PAYLOAD_LENGTH) {
+    log_error("Invalid FCP command batch length");
+    return FCP_SOCKET_ERR_INVALID_LENGTH;
+  }
+
+  uint8_t *resp = malloc(resp_size);
+  if (!resp) {
+    log_error("Cannot allocate response buffer");
+    return FCP_SOCKET_ERR_FCP;
+  }
+
+  ((struct fcp_cmd_batch_header *)resp)->count = batch->count;
+
+  uint8_t *r = resp + sizeof(struct fcp_cmd_batch_header);
+  q = p + sizeof(*batch);
+
+  for (uint32_t i = 0; i < batch->count; i++) {
+    const struct fcp_cmd_batch_request *req = (const void *)q;
+    struct fcp_cmd_batch_result *result = (void *)r;
+
+    int ret = fcp_cmd(
+      client->server->device->hwdep,
+      req->opcode,
+      req->req_data,
+      req->req_size,
+      result->resp_data,
+      req->resp_size
+    );
+
+    log_debug(
+      "fcp_cmd batch %u: opcode=0x%06x req_size=%u resp_size=%u: %d",
+      i, req->opcode, req->req_size, req->resp_size, ret
+    );
+
+    // Results keep their full size so that the response layout
+    // doesn't depend on which commands failed
+    result->error = ret < 0 ? ret : 0;
+    result->resp_size = req->resp_size;
+    if (ret < 0)
+      memset(result->resp_data, 0, req->resp_size);
+
+    q += sizeof(*req) + req->req_size;
+    r += sizeof(*result) + req->resp_size;
+  }
+
+  send_response(client->fd, FCP_SOCKET_RESPONSE_DATA, resp, resp_size);
+  free(resp);
+  return 0;
+}
+
+static void *take_client_message(struct client_state *client);
+
 static void handle_client_command(
-  int client_fd,
+  struct client_state                *client,
   const struct fcp_socket_msg_header *header
 ) {
+  int client_fd = client->fd;
   int ret = 0;
 
   switch (header->msg_type) {
     case FCP_SOCKET_REQUEST_REBOOT:
       log_debug("Reboot requested");
-      ret = fcp_reboot(device->hwdep);
+      ret = fcp_reboot(client->server->device->hwdep);
       break;
 
     case FCP_SOCKET_REQUEST_CONFIG_ERASE:
-      ret = erase_config(client_fd);
+      ret = erase_config(client);
       break;
 
     case FCP_SOCKET_REQUEST_APP_FIRMWARE_ERASE:
-      ret = erase_app_firmware(client_fd);
+      ret = erase_app_firmware(client);
       break;
 
-    case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE:
-      ret = handle_app_firmware_update(client_fd, header);
+    // The job keeps the message buffer
+    case FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF:
+    case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE:
+    case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS:
+      ret = start_firmware_job(client, take_client_message(client));
       break;
 
-    case FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE:
-      ret = handle_esp_firmware_update(device, client_fd, header);
+    case FCP_SOCKET_REQUEST_FIRMWARE_FD:
+      ret = handle_fd_request(client);
       break;
 
     case FCP_SOCKET_REQUEST_FCP_CMD:
-      ret = handle_fcp_cmd(client_fd, header);
+      ret = handle_fcp_cmd(client, header);
+      if (ret == 0)
+        return;  // Response already sent
+      break;
+
+    case FCP_SOCKET_REQUEST_FCP_CMD_BATCH:
+      ret = handle_fcp_cmd_batch(client, header);
+      if (ret == 0)
+        return;  // Response already sent
+      break;
+
+    case FCP_SOCKET_REQUEST_METER_SUBSCRIBE:
+      ret = handle_meter_subscribe(client, header);
+      break;
+
+    case FCP_SOCKET_REQUEST_SUBSCRIBE:
+      if (!client->subscribed) {
+        client->subscribed = true;
+        client->server->subscriber_count++;
+      }
+      log_debug("Client subscribed to control changes");
+      break;
+
+    case FCP_SOCKET_REQUEST_STATS: {
+      struct fcp_stats stats;
+
+      stats_snapshot(&stats);
+      send_response(client_fd, FCP_SOCKET_RESPONSE_DATA, &stats, sizeof(stats));
+      return;
+    }
+
+    case FCP_SOCKET_REQUEST_SNAPSHOT: {
+      uint8_t *data;
+      size_t size;
+
+      if (snapshot_capture(client->server->device, &data, &size) < 0) {
+        ret = FCP_SOCKET_ERR_FCP;
+        break;
+      }
+      send_response(client_fd, FCP_SOCKET_RESPONSE_DATA, data, size);
+      free(data);
+      return;
+    }
+
+    case FCP_SOCKET_REQUEST_RESTORE:
+      ret = snapshot_restore(
+        client->server->device,
+        (const uint8_t *)(header + 1),
+        header->payload_length
+      );
+      if (ret == -EINVAL)
+        ret = FCP_SOCKET_ERR_SNAPSHOT;
+      else if (ret < 0)
+        ret = FCP_SOCKET_ERR_FCP;
+      break;
+
+    case FCP_SOCKET_REQUEST_MUX_ROUTING_READ:
+      ret = handle_mux_routing_read(client);
       if (ret == 0)
         return;  // Response already sent
       break;
 
+    case FCP_SOCKET_REQUEST_MUX_ROUTING_WRITE:
+      ret = handle_mux_routing_write(client, header);
+      break;
+
     default:
       send_error(client_fd, FCP_SOCKET_ERR_INVALID_COMMAND);
       return;
   }
 
+  // The response will be sent when the job completes
+  if (ret == JOB_PENDING)
+    return;
+
   if (ret != 0) {
     send_error(client_fd, ret);
   } else {
@@ -477,113 +1878,315 @@ static void handle_client_command(
   }
 }
 
+// Remove processed bytes from the start of the client buffer
+static void consume_client_data(struct client_state *client, size_t count) {
+  memmove(client->buffer, client->buffer + count, client->bytes_read - count);
+  client->bytes_read -= count;
+}
+
+// Hand the buffer holding the current message over to a job,
+// keeping any data which follows it
+static void *take_client_message(struct client_state *client) {
+  void *msg = client->buffer;
+  size_t extra = client->bytes_read - client->total_size;
+
+  client->size = extra > 4096 ? extra : 4096;
+  client->buffer = malloc(client->size);
+  if (!client->buffer) {
+    log_error("Cannot allocate client buffer: %s", strerror(errno));
+    exit(1);
+  }
+  memcpy(client->buffer, msg + client->total_size, extra);
+  client->bytes_read = extra;
+  client->total_size = 0;
+
+  return msg;
+}
+
+// Pass buffered app firmware data to the flash writer
 // Returns:
-//  0 on sucess
+//  1 when the message is complete
+//  0 if more data is needed
 // -1 on error
-static int process_client_data(void) {
-  ssize_t n;
-
-  // First allocation if needed
-  if (!client.buffer) {
-    client.size = 4096;  // Initial buffer size
-    client.buffer = malloc(client.size);
-    if (!client.buffer) {
-      log_error("Cannot allocate client buffer: %s", strerror(errno));
+static int process_stream_data(struct client_state *client) {
+  const size_t start =
+    sizeof(struct fcp_socket_msg_header) + sizeof(struct firmware_payload);
+  struct app_update *update = &client->update;
+
+  if (!update->active) {
+    if (client->bytes_read < start)
+      return 0;
+
+    struct fcp_socket_msg_header *header = client->buffer;
+    struct firmware_payload *payload = (struct firmware_payload *)(header + 1);
+
+    if (header->payload_length !=
+          sizeof(struct firmware_payload) + payload->size) {
+      log_error("Firmware payload length mismatch");
+      send_error(client->fd, FCP_SOCKET_ERR_INVALID_LENGTH);
       return -1;
     }
+
+    update->active = true;
+    update->error = app_update_begin(
+      client->server, update, payload,
+      header->msg_type == FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY
+    );
+    consume_client_data(client, start);
   }
 
-  // Read what we can
-  n = read(
-    client.fd,
-    client.buffer + client.bytes_read,
-    client.size - client.bytes_read
+  size_t used = app_update_feed(
+    client->fd, update, client->buffer, client->bytes_read
   );
+  consume_client_data(client, used);
 
-  if (n < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      return 0;  // Try again later
+  if (update->received < update->payload.size)
+    return 0;
+
+  client->streaming = false;
+  client->total_size = 0;
+
+  client->server->update_owner = NULL;
+  schedule_resume(client->server);
+
+  int ret = app_update_finish(client);
+  if (ret == JOB_PENDING)
+    return 1;  // Response sent when the job completes
+  if (ret != 0)
+    send_error(client->fd, ret);
+  else
+    send_response(client->fd, FCP_SOCKET_RESPONSE_SUCCESS, NULL, 0);
+
+  return 1;
+}
+
+// Handle each complete message in the client buffer
+// Returns:
+//  0 on success
+// -1 on error
+static int process_client_messages(struct client_state *client) {
+  while (1) {
+
+    // Wait until the current job has completed
+    if (client->job)
+      return 0;
+
+    if (client->streaming) {
+      int ret = process_stream_data(client);
+      if (ret <= 0)
+        return ret;
+      continue;
     }
-    return -1;   // Error
-  }
-  if (n == 0) {
-    return -1;   // EOF
-  }
 
-  client.bytes_read += n;
+    // If we don't have the header yet, wait for more
+    if (client->bytes_read < sizeof(struct fcp_socket_msg_header))
+      return 0;
 
-  // If we don't have the header yet, wait for more
-  if (client.bytes_read < sizeof(struct fcp_socket_msg_header)) {
-    return 0;
-  }
+    struct fcp_socket_msg_header *header = client->buffer;
 
-  // Once we have the header, calculate total size
-  if (client.total_size == 0) {
-    struct fcp_socket_msg_header *header = client.buffer;
-    client.total_size = sizeof(struct fcp_socket_msg_header) + header->payload_length;
+    // Once we have the header, calculate total size
+    if (client->total_size == 0) {
+      client->total_size =
+        sizeof(struct fcp_socket_msg_header) + header->payload_length;
 
-    // Validate magic number
-    if (header->magic != FCP_SOCKET_MAGIC_REQUEST) {
-      send_error(client.fd, FCP_SOCKET_ERR_INVALID_MAGIC);
-      return -1;
+      // Validate magic number
+      if (header->magic != FCP_SOCKET_MAGIC_REQUEST) {
+        send_error(client->fd, FCP_SOCKET_ERR_INVALID_MAGIC);
+        return -1;
+      }
+
+      // Validate size
+      if (header->payload_length > MAX_PAYLOAD_LENGTH) {
+        send_error(client->fd, FCP_SOCKET_ERR_INVALID_LENGTH);
+        return -1;
+      }
     }
 
-    // Validate size
-    if (header->payload_length > MAX_PAYLOAD_LENGTH) {
-      send_error(client.fd, FCP_SOCKET_ERR_INVALID_LENGTH);
-      return -1;
+    // Exclusive requests wait (with any following messages) until
+    // the device is free
+    if (is_exclusive_request(header->msg_type) && device_locked(client)) {
+      queue_client(client);
+      return 0;
+    }
+
+    // App firmware is written to flash as it arrives rather than
+    // being buffered
+    if (is_app_update_request(header->msg_type) &&
+        header->payload_length >= sizeof(struct firmware_payload)) {
+      if (client->size < STREAM_BUFFER_SIZE) {
+        void *new_buf = realloc(client->buffer, STREAM_BUFFER_SIZE);
+        if (!new_buf) {
+          log_error("Cannot reallocate client buffer: %s", strerror(errno));
+          return -1;
+        }
+        client->buffer = new_buf;
+        client->size = STREAM_BUFFER_SIZE;
+      }
+      client->streaming = true;
+      client->server->update_owner = client;
+      continue;
     }
 
     // Resize buffer if needed
-    if (client.total_size > client.size) {
-      void *new_buf = realloc(client.buffer, client.total_size);
+    if (client->total_size > client->size) {
+      void *new_buf = realloc(client->buffer, client->total_size);
       if (!new_buf) {
         log_error("Cannot reallocate client buffer: %s", strerror(errno));
         return -1;
       }
-      client.buffer = new_buf;
-      client.size = client.total_size;
+      client->buffer = new_buf;
+      client->size = client->total_size;
+      header = client->buffer;
+    }
+
+    // Wait for the complete message
+    if (client->bytes_read < client->total_size)
+      return 0;
+
+    handle_client_command(client, header);
+
+    // Keep any following message (unless a job has taken the
+    // buffer)
+    if (client->total_size) {
+      consume_client_data(client, client->total_size);
+      client->total_size = 0;
+    }
+  }
+}
+
+// Returns:
+//  0 on sucess
+// -1 on error
+static int process_client_data(struct client_state *client) {
+  ssize_t n;
+
+  // First allocation if needed
+  if (!client->buffer) {
+    client->size = 4096;  // Initial buffer size
+    client->buffer = malloc(client->size);
+    if (!client->buffer) {
+      log_error("Cannot allocate client buffer: %s", strerror(errno));
+      return -1;
     }
   }
 
-  // Return 1 if we have the complete message
-  if (client.bytes_read >= client.total_size) {
-    struct fcp_socket_msg_header *header = client.buffer;
+  // Read what we can
+  size_t space = client->size - client->bytes_read;
+  if (client->streaming && space > STREAM_READ_MAX)
+    space = STREAM_READ_MAX;
+
+  // Receive with room for a file descriptor (FIRMWARE_FD requests)
+  struct iovec iov = {
+    .iov_base = client->buffer + client->bytes_read,
+    .iov_len  = space
+  };
+  union {
+    char           buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+
+  n = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
 
-    // Process message
-    handle_client_command(client.fd, header);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+       n > 0 && cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
 
-    // Reset state
-    client.bytes_read = 0;
-    client.total_size = 0;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    if (client->pending_fd >= 0)
+      close(client->pending_fd);
+    client->pending_fd = fd;
+  }
 
-    return 1;  // Message complete
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;  // Try again later
+    }
+    return -1;   // Error
+  }
+  if (n == 0) {
+    return -1;   // EOF
   }
 
-  return 0;  // Need more data
+  client->bytes_read += n;
+
+  return process_client_messages(client);
 }
 
-void fcp_socket_handle_client(void) {
-  if (client.fd < 0) {
-    // Accept new client if we don't have one
-    client.fd = accept(server_sock, NULL, NULL);
-    if (client.fd < 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK)
-        log_error("Error accepting client connection: %s", strerror(errno));
-      return;
-    }
-    fcntl(client.fd, F_SETFL, O_NONBLOCK);
+static void handle_client_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct client_state *client = data;
+
+  // Input is paused while a job runs or the client is queued, so
+  // only a hangup or error can be reported then
+  int result = client->job || client->queued ?
+    -1 : process_client_data(client);
+  if (result < 0) {
+    log_debug("Client connection closed");
+    cleanup_client(client);
+  }
+}
+
+static void handle_listen_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct socket_server *server = data;
+
+  int fd = accept(server->sock, NULL, NULL);
+  if (fd < 0) {
+    log_error("Error accepting client connection: %s", strerror(errno));
     return;
   }
 
-  // Process data
-  int ret = process_client_data();
+  if (server->client_count >= MAX_CLIENTS) {
+    log_warning("Rejected client connection; too many clients");
+    close(fd);
+    return;
+  }
 
-  // Error or complete message
-  if (ret != 0) {
-    log_debug("Client connection closed");
-    cleanup_client();
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+    log_error("Cannot set client socket to non-blocking: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+
+  struct client_state *client = calloc(1, sizeof(*client));
+  if (!client) {
+    log_error("Cannot allocate memory for client");
+    exit(1);
   }
+  client->fd = fd;
+  client->pending_fd = -1;
+  client->server = server;
+
+  client->source = event_add_fd(fd, EPOLLIN, handle_client_event, client);
+  if (!client->source) {
+    close(fd);
+    free(client);
+    return;
+  }
+
+  client->next = server->clients;
+  server->clients = client;
+  server->client_count++;
+
+  log_debug(
+    "Card %d client connected (%d connected)",
+    server->device->card_num, server->client_count
+  );
 }
 
 static int set_socket_path_tlv(struct fcp_device *device, const char *path) {
@@ -629,10 +2232,25 @@ static int set_socket_path_tlv(struct fcp_device *device, const char *path) {
   return err;
 }
 
-int fcp_socket_init(struct fcp_device *dev) {
+int fcp_socket_init(struct fcp_device *device) {
   struct sockaddr_un addr;
 
-  device = dev;
+  struct socket_server *server = calloc(1, sizeof(*server));
+  if (!server) {
+    log_error("Cannot allocate memory for socket server");
+    exit(1);
+  }
+
+  server->device = device;
+  server->sock = -1;
+  server->upgrade_segment_num = -1;
+  server->upgrade_segment_size = -1;
+  server->settings_segment_num = -1;
+  server->settings_segment_size = -1;
+  server->disk_segment_num = -1;
+  server->disk_segment_size = -1;
+  server->env_segment_num = -1;
+  server->env_segment_size = -1;
 
   // Choose socket path
   const char *runtime_dir = getenv("RUNTIME_DIRECTORY");
@@ -655,18 +2273,21 @@ int fcp_socket_init(struct fcp_device *dev) {
 
   log_debug("Using socket path: %s", socket_path);
 
+  int err = 0;
+
   // Create socket
-  server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (server_sock < 0) {
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
     log_error("Cannot create socket: %s", strerror(errno));
-    return -errno;
+    err = -errno;
+    goto fail;
   }
 
   // Set socket to non-blocking
-  if (fcntl(server_sock, F_SETFL, O_NONBLOCK) < 0) {
+  if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
     log_error("Cannot set socket to non-blocking: %s", strerror(errno));
-    close(server_sock);
-    return -errno;
+    err = -errno;
+    goto fail;
   }
 
   // Bind socket
@@ -674,26 +2295,42 @@ int fcp_socket_init(struct fcp_device *dev) {
   addr.sun_family = AF_UNIX;
   if (strlen(socket_path) >= sizeof(addr.sun_path)) {
     log_error("Socket path too long: %s", socket_path);
-    close(server_sock);
-    return -ENAMETOOLONG;
+    err = -ENAMETOOLONG;
+    goto fail;
   }
   strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
 
   unlink(socket_path);
 
-  if (bind(server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
     log_error("Cannot bind to %s: %s", socket_path, strerror(errno));
-    close(server_sock);
-    return -errno;
+    err = -errno;
+    goto fail;
   }
 
   // Listen for connections
-  if (listen(server_sock, 1) < 0) {
+  if (listen(sock, MAX_CLIENTS) < 0) {
     log_error("Cannot listen on socket %s: %s", socket_path, strerror(errno));
-    close(server_sock);
-    return -errno;
+    err = -errno;
+    goto fail;
+  }
+
+  server->sock = sock;
+  server->listen_source =
+    event_add_fd(sock, EPOLLIN, handle_listen_event, server);
+  if (!server->listen_source) {
+    err = -1;
+    goto fail;
+  }
+
+  server->resume_timer = event_add_timer(resume_queued_clients, server);
+  if (!server->resume_timer) {
+    err = -1;
+    goto fail;
   }
 
+  device->socket_server = server;
+
   // Set socket path TLV
   int ret = set_socket_path_tlv(device, socket_path);
   if (ret == 0) {
@@ -701,59 +2338,29 @@ int fcp_socket_init(struct fcp_device *dev) {
   }
 
   return 0;
-}
-
-// Add client fd to select() set
-void fcp_socket_update_sets(fd_set *rfds, int *max_fd) {
-  // Always add listening fd
-  if (server_sock >= 0) {
-    FD_SET(server_sock, rfds);
-    if (server_sock > *max_fd) {
-      *max_fd = server_sock;
-    }
-  }
 
-  // Add client fd if we have one
-  if (client.fd >= 0) {
-    FD_SET(client.fd, rfds);
-    if (client.fd > *max_fd) {
-      *max_fd = client.fd;
-    }
-  }
+fail:
+  event_remove(server->listen_source);
+  if (sock >= 0)
+    close(sock);
+  free(server);
+  return err;
 }
 
-void fcp_socket_handle_events(fd_set *rfds) {
+void fcp_socket_cleanup(struct fcp_device *device) {
+  struct socket_server *server = device->socket_server;
 
-  // Check for new connections
-  if (server_sock >= 0 && FD_ISSET(server_sock, rfds)) {
+  if (!server)
+    return;
 
-    // Only accept if we don't have a client
-    if (client.fd < 0) {
+  while (server->clients)
+    cleanup_client(server->clients);
 
-      // Accept new client
-      client.fd = accept(server_sock, NULL, NULL);
-      if (client.fd < 0) {
-        log_error("Error accepting client connection: %s", strerror(errno));
-      } else {
-        if (fcntl(client.fd, F_SETFL, O_NONBLOCK) < 0) {
-          log_error("Cannot set client socket to non-blocking: %s", strerror(errno));
-          close(client.fd);
-          client.fd = -1;
-        } else {
-          log_debug("Client connected");
-        }
-      }
-    } else {
-      drain_pending_connections();
-    }
-  }
+  event_remove(server->resume_timer);
+  event_remove(server->listen_source);
+  close(server->sock);
+  free(server->changes);
+  free(server);
 
-  // Process client data
-  if (client.fd >= 0 && FD_ISSET(client.fd, rfds)) {
-    int result = process_client_data();
-    if (result < 0) {
-      log_debug("Client connection closed");
-      cleanup_client();
-    }
-  }
+  device->socket_server = NULL;
 }
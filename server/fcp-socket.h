@@ -4,12 +4,29 @@
 #pragma once
 
 #include "device.h"
+#include "../shared/fcp-shared.h"
 
 int fcp_socket_init(struct fcp_device *device);
-void fcp_socket_cleanup(void);
 
-void fcp_socket_update_sets(fd_set *rfds, int *max_fd);
-void fcp_socket_handle_events(fd_set *rfds);
+/* Disconnect the device's clients and close its socket */
+void fcp_socket_cleanup(struct fcp_device *device);
 
 void send_progress(int client_fd, uint8_t percent);
-void drain_pending_connections(void);
+void send_transfer_stats(int client_fd, const struct transfer_stats *stats);
+
+/* Queue a control change for subscribed clients; values is an int
+ * array for FCP_CONTROL_CHANGE_VALUES or the data for _BYTES
+ */
+void fcp_socket_add_change(
+  struct fcp_device *device,
+  unsigned int       numid,
+  int                kind,
+  const void        *values,
+  int                length
+);
+
+/* Send the queued changes to subscribed clients as one message */
+void fcp_socket_flush_changes(struct fcp_device *device);
+
+/* Free a request message handed over to a job */
+void free_client_message(void *msg);
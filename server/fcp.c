@@ -10,42 +10,21 @@
 #include <json-c/json.h>
 
 #include "fcp.h"
+#include "fcp-io.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "uapi-fcp.h"
 
-#define FCP_OPCODE_INIT_1               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x000)
-#define FCP_OPCODE_CAP_READ             (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x001)
-#define FCP_OPCODE_INIT_2               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x002)
-#define FCP_OPCODE_REBOOT               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x003)
-#define FCP_OPCODE_METER_INFO           (FCP_OPCODE_CATEGORY_METER   << 12 | 0x000)
-#define FCP_OPCODE_METER_READ           (FCP_OPCODE_CATEGORY_METER   << 12 | 0x001)
-#define FCP_OPCODE_MIX_INFO             (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x000)
-#define FCP_OPCODE_MIX_READ             (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x001)
-#define FCP_OPCODE_MIX_WRITE            (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x002)
-#define FCP_OPCODE_MUX_INFO             (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x000)
-#define FCP_OPCODE_MUX_READ             (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x001)
-#define FCP_OPCODE_MUX_WRITE            (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x002)
-#define FCP_OPCODE_FLASH_INFO           (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x000)
-#define FCP_OPCODE_FLASH_SEGMENT_INFO   (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x001)
-#define FCP_OPCODE_FLASH_ERASE          (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x002)
-#define FCP_OPCODE_FLASH_ERASE_PROGRESS (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x003)
-#define FCP_OPCODE_FLASH_WRITE          (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x004)
-#define FCP_OPCODE_FLASH_READ           (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x005)
-#define FCP_OPCODE_SYNC_READ            (FCP_OPCODE_CATEGORY_SYNC    << 12 | 0x004)
-#define FCP_OPCODE_ESP_DFU_START        (FCP_OPCODE_CATEGORY_ESP_DFU << 12 | 0x000)
-#define FCP_OPCODE_ESP_DFU_WRITE        (FCP_OPCODE_CATEGORY_ESP_DFU << 12 | 0x001)
-#define FCP_OPCODE_DATA_READ            (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x000)
-#define FCP_OPCODE_DATA_WRITE           (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x001)
-#define FCP_OPCODE_DATA_NOTIFY          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x002)
-#define FCP_OPCODE_DEVMAP_INFO          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x00c)
-#define FCP_OPCODE_DEVMAP_READ          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x00d)
-
 #define FCP_CMD_CONFIG_SAVE 6
 
 #define FCP_STEP0_SIZE 24
 #define FCP_STEP2_SIZE 84
 
+/* req_size and resp_size in struct fcp_cmd are 16-bit */
+#define FCP_CMD_DATA_MAX 0xffff
+
 /* Initialise the device */
 void fcp_init(snd_hwdep_t *hwdep) {
   int err;
@@ -123,6 +102,113 @@ void fcp_init(snd_hwdep_t *hwdep) {
   log_debug("Firmware version: %d", firmware_version);
 }
 
+/* Command buffer, allocated once per thread at the largest size a
+ * request or response can be, so that commands don't need to
+ * allocate memory and requests can be built directly in the buffer
+ * passed to the ioctl
+ */
+static __thread struct fcp_cmd *cmd_buf;
+
+/* Copy of the request for the trace record, as the response
+ * overwrites it; allocated once on each thread which runs commands
+ * while tracing
+ */
+static __thread uint8_t *trace_req_buf;
+
+void fcp_cmd_buf_free(void) {
+  free(cmd_buf);
+  cmd_buf = NULL;
+  free(trace_req_buf);
+  trace_req_buf = NULL;
+}
+
+/* Prepare the command buffer; the request is built in, and the
+ * response returned in, cmd->data
+ */
+static struct fcp_cmd *fcp_cmd_prepare(
+  uint32_t opcode,
+  size_t   req_size,
+  size_t   resp_size
+) {
+  if (req_size > FCP_CMD_DATA_MAX || resp_size > FCP_CMD_DATA_MAX) {
+    log_error(
+      "FCP command 0x%x too large (req %zu, resp %zu)",
+      opcode, req_size, resp_size
+    );
+    return NULL;
+  }
+
+  // Work on the I/O thread which preempts this command uses the same
+  // buffer, so it's done before the command is built
+  fcp_io_yield();
+
+  if (!cmd_buf) {
+    cmd_buf = malloc(sizeof(struct fcp_cmd) + FCP_CMD_DATA_MAX);
+    if (!cmd_buf) {
+      log_error("Cannot allocate memory for FCP command");
+      exit(1);
+    }
+  }
+
+  size_t buf_size = req_size > resp_size ? req_size : resp_size;
+
+  cmd_buf->opcode = opcode;
+  cmd_buf->req_size = req_size;
+  cmd_buf->resp_size = resp_size;
+  memset(cmd_buf->data, 0, buf_size);
+
+  return cmd_buf;
+}
+
+struct cmd_exec {
+  snd_hwdep_t    *hwdep;
+  struct fcp_cmd *cmd;
+};
+
+static int cmd_exec(snd_hwdep_t *hwdep, struct fcp_cmd *cmd) {
+  uint64_t start = stats_time_us();
+  struct trace_cmd trace;
+
+  if (!trace_req_buf && trace_enabled()) {
+    trace_req_buf = malloc(FCP_CMD_DATA_MAX);
+    if (!trace_req_buf) {
+      log_error("Cannot allocate memory for trace record");
+      exit(1);
+    }
+  }
+
+  trace_cmd_begin(
+    &trace, hwdep, cmd->opcode, cmd->data, cmd->req_size, cmd->resp_size,
+    trace_req_buf
+  );
+
+  int err = snd_hwdep_ioctl(hwdep, FCP_IOCTL_CMD, cmd);
+
+  trace_cmd_end(&trace, err, cmd->data);
+  stats_record(stats_fcp_cmd(cmd->opcode), stats_time_us() - start);
+  if (err < 0)
+    stats_count(&server_stats.fcp_cmd_errors);
+
+  return err;
+}
+
+static int cmd_exec_work(void *data) {
+  struct cmd_exec *exec = data;
+
+  return cmd_exec(exec->hwdep, exec->cmd);
+}
+
+/* Send a command, through the device's I/O thread if it has one */
+static int fcp_cmd_exec(snd_hwdep_t *hwdep, struct fcp_cmd *cmd) {
+  struct cmd_exec exec = { hwdep, cmd };
+  int err;
+
+  if (fcp_io_call(hwdep, cmd_exec_work, &exec, &err))
+    return err;
+
+  return cmd_exec(hwdep, cmd);
+}
+
 int fcp_cmd(
   snd_hwdep_t *hwdep,
   uint32_t     opcode,
@@ -131,28 +217,17 @@ int fcp_cmd(
   void        *resp,
   size_t       resp_size
 ) {
-  int buf_size = req_size > resp_size ? req_size : resp_size;
-  int total_size = sizeof(struct fcp_cmd) + buf_size;
-  struct fcp_cmd *cmd = calloc(1, total_size);
-
-  if (!cmd) {
-    log_error("Cannot allocate memory for FCP command");
-    exit(1);
-  }
-
-  cmd->opcode = opcode;
-  cmd->req_size = req_size;
-  cmd->resp_size = resp_size;
+  struct fcp_cmd *cmd = fcp_cmd_prepare(opcode, req_size, resp_size);
+  if (!cmd)
+    return -EINVAL;
 
   if (req)
     memcpy(cmd->data, req, req_size);
 
-  int err = snd_hwdep_ioctl(hwdep, FCP_IOCTL_CMD, cmd);
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err >= 0 && resp)
     memcpy(resp, cmd->data, resp_size);
 
-  free(cmd);
-
   return err;
 }
 
@@ -210,37 +285,28 @@ int fcp_meter_read(snd_hwdep_t *hwdep, int count, int *value) {
     uint16_t offset;
     uint16_t count;
     uint32_t pad;
-  } __attribute__((packed)) req;
-  int resp_size = sizeof(uint32_t) * count;
-  uint32_t *resp = calloc(1, resp_size);
+  } __attribute__((packed)) *req;
 
-  if (!resp) {
-    log_error("Cannot allocate memory for meter read");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_METER_READ, sizeof(*req), sizeof(uint32_t) * count
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
-  req.offset = 0;
-  req.count = htole16(count);
-  req.pad = 0;
-
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_METER_READ,
-    &req, sizeof(req),
-    resp, resp_size
-  );
+  req = (void *)cmd->data;
+  req->count = htole16(count);
 
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0) {
     log_error("Get meter failed: %s", snd_strerror(err));
-    goto done;
+    return err;
   }
 
+  const uint32_t *resp = (const uint32_t *)cmd->data;
   for (int i = 0; i < count; i++)
     value[i] = le32toh(resp[i]);
 
-done:
-  free(resp);
   return err;
 }
 
@@ -279,69 +345,56 @@ int fcp_mix_read(snd_hwdep_t *hwdep, int mix_num, int count, int *values) {
   struct {
     uint16_t mix_num;
     uint16_t count;
-  } __attribute__((packed)) req;
-  int resp_size = sizeof(uint16_t) * count;
-  uint16_t *resp = calloc(1, resp_size);
+  } __attribute__((packed)) *req;
 
-  if (!resp) {
-    log_error("Cannot allocate memory for mix read");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_MIX_READ, sizeof(*req), sizeof(uint16_t) * count
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
-  req.mix_num = htole16(mix_num);
-  req.count = htole16(count);
-
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_MIX_READ,
-    &req, sizeof(req),
-    resp, resp_size
-  );
+  req = (void *)cmd->data;
+  req->mix_num = htole16(mix_num);
+  req->count = htole16(count);
 
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0) {
     log_error("Get mix failed: %s", snd_strerror(err));
-    free(resp);
     return err;
   }
 
+  const uint16_t *resp = (const uint16_t *)cmd->data;
   for (int i = 0; i < count; i++) {
     values[i] = le16toh(resp[i]);
   }
 
-  free(resp);
   return 0;
 }
 
 /* Write mix data */
 int fcp_mix_write(snd_hwdep_t *hwdep, int mix_num, int count, int *values) {
-  int req_size = sizeof(uint16_t) * (count + 1);
   struct {
     uint16_t mix_num;
     uint16_t values[];
-  } __attribute__((packed)) *req = calloc(1, req_size);
+  } __attribute__((packed)) *req;
 
-  if (!req) {
-    log_error("Cannot allocate memory for mix write");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_MIX_WRITE, sizeof(uint16_t) * (count + 1), 0
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
+  req = (void *)cmd->data;
   req->mix_num = htole16(mix_num);
   for (int i = 0; i < count; i++)
     req->values[i] = htole16(values[i]);
 
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_MIX_WRITE,
-    req, req_size,
-    NULL, 0
-  );
-
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0)
     log_error("Set mix failed: %s", snd_strerror(err));
 
-  free(req);
   return err;
 }
 
@@ -387,40 +440,31 @@ int fcp_mux_read(
     uint8_t pad;
     uint8_t count;
     uint8_t mux_num;
-  } __attribute__((packed)) req;
+  } __attribute__((packed)) *req;
 
-  /* Allocate response buffer */
-  size_t resp_size = sizeof(uint32_t) * count;
-  uint32_t *resp = calloc(count, sizeof(uint32_t));
-  if (!resp) {
-    log_error("Cannot allocate memory for mux read");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_MUX_READ, sizeof(*req), sizeof(uint32_t) * count
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
-  req.offset = 0;
-  req.pad = 0;
-  req.count = htole16(count);
-  req.mux_num = htole16(mux_num);
+  req = (void *)cmd->data;
+  req->count = htole16(count);
+  req->mux_num = htole16(mux_num);
 
   /* Send command */
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_MUX_READ,
-    &req, sizeof(req),
-    resp, resp_size
-  );
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0) {
     log_error("Get mux failed: %s", snd_strerror(err));
-    free(resp);
     return err;
   }
 
   /* Convert endianness */
+  const uint32_t *resp = (const uint32_t *)cmd->data;
   for (int i = 0; i < count; i++)
     values[i] = le32toh(resp[i]);
 
-  free(resp);
   return 0;
 }
 
@@ -431,36 +475,29 @@ int fcp_mux_write(
   int          count,
   uint32_t    *values
 ) {
-  int req_size = sizeof(uint16_t) * 2 + sizeof(uint32_t) * count;
   struct {
     uint16_t pad;
     uint16_t mux_num;
     uint32_t values[];
-  } __attribute__((packed)) *req = calloc(1, req_size);
+  } __attribute__((packed)) *req;
 
-  if (!req) {
-    log_error("Cannot allocate memory for mux write");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_MUX_WRITE, sizeof(uint16_t) * 2 + sizeof(uint32_t) * count, 0
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
-  req->pad = 0;
+  req = (void *)cmd->data;
   req->mux_num = htole16(mux_num);
   for (int i = 0; i < count; i++) {
     req->values[i] = htole32(values[i]);
   }
 
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_MUX_WRITE,
-    req, req_size,
-    NULL, 0
-  );
-
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0)
     log_error("Set mux failed: %s", snd_strerror(err));
 
-  free(req);
   return err;
 }
 
@@ -628,35 +665,29 @@ int fcp_flash_write(
     return -EINVAL;
   }
 
-  int req_size = sizeof(uint32_t) * 3 + size;
   struct {
     uint32_t segment_num;
     uint32_t offset;
     uint32_t pad;
     uint8_t  data[];
-  } __attribute__((packed)) *req = calloc(1, req_size);
+  } __attribute__((packed)) *req;
 
-  if (!req) {
-    log_error("Cannot allocate memory for flash write");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_FLASH_WRITE, sizeof(uint32_t) * 3 + size, 0
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
+  req = (void *)cmd->data;
   req->segment_num = htole32(segment_num);
   req->offset = htole32(offset);
   memcpy(req->data, data, size);
 
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_FLASH_WRITE,
-    req, req_size,
-    NULL, 0
-  );
-
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0)
     log_error("Flash write failed: %s", snd_strerror(err));
 
-  free(req);
   return err;
 }
 
@@ -869,19 +900,20 @@ int fcp_data_write_buf(
   int          size,
   const void  *buf
 ) {
-  int req_size = sizeof(uint32_t) * 2 + size;
   struct {
     uint32_t offset;
     uint32_t size;
     uint8_t  data[];
-  } __attribute__((packed)) *req = calloc(1, req_size);
+  } __attribute__((packed)) *req;
 
-  if (!req) {
-    log_error("Cannot allocate memory for data write buffer");
-    return -ENOMEM;
-  }
+  struct fcp_cmd *cmd = fcp_cmd_prepare(
+    FCP_OPCODE_DATA_WRITE, sizeof(uint32_t) * 2 + size, 0
+  );
+  if (!cmd)
+    return -EINVAL;
 
   /* Prepare request data */
+  req = (void *)cmd->data;
   req->offset = htole32(offset);
   req->size = htole32(size);
   memcpy(req->data, buf, size);
@@ -892,17 +924,11 @@ int fcp_data_write_buf(
   );
 
   /* Send command */
-  int err = fcp_cmd(
-    hwdep,
-    FCP_OPCODE_DATA_WRITE,
-    req, req_size,
-    NULL, 0
-  );
+  int err = fcp_cmd_exec(hwdep, cmd);
   if (err < 0) {
     log_error("Set data buffer failed at offset %d: %s", offset, snd_strerror(err));
   }
 
-  free(req);
   return err;
 }
 
@@ -923,8 +949,8 @@ int fcp_data_notify(snd_hwdep_t *hwdep, int event) {
   );
 }
 
-/* Read the device map */
-int fcp_devmap_read(snd_hwdep_t *hwdep, char **buf) {
+/* Read the device map, passing each block to fn as it arrives */
+int fcp_devmap_read(snd_hwdep_t *hwdep, fcp_devmap_block_fn fn, void *data) {
 
   /* Get device map info */
   uint16_t info_resp[2] = {0};
@@ -943,37 +969,31 @@ int fcp_devmap_read(snd_hwdep_t *hwdep, char **buf) {
 
   int size = le16toh(info_resp[1]);
 
-  /* Allocate buffer */
-  *buf = calloc(size, 1);
-  if (!*buf) {
-    log_error("Cannot allocate memory for device map");
-    return -ENOMEM;
-  }
-
   /* Read device map */
-  char data[FCP_DEVMAP_BLOCK_SIZE] = {0};
-  uint32_t req_block_num;
-
   for (int offset = 0; offset < size; offset += FCP_DEVMAP_BLOCK_SIZE) {
-    req_block_num = htole32(offset / FCP_DEVMAP_BLOCK_SIZE);
     size_t resp_size = FCP_DEVMAP_BLOCK_SIZE;
     if (offset + FCP_DEVMAP_BLOCK_SIZE > size)
       resp_size = size - offset;
 
-    err = fcp_cmd(
-      hwdep,
-      FCP_OPCODE_DEVMAP_READ,
-      &req_block_num, sizeof(req_block_num),
-      data, resp_size
+    struct fcp_cmd *cmd = fcp_cmd_prepare(
+      FCP_OPCODE_DEVMAP_READ, sizeof(uint32_t), resp_size
     );
+    if (!cmd)
+      err = -EINVAL;
+    else {
+      uint32_t req_block_num = htole32(offset / FCP_DEVMAP_BLOCK_SIZE);
+
+      memcpy(cmd->data, &req_block_num, sizeof(req_block_num));
+      err = fcp_cmd_exec(hwdep, cmd);
+    }
     if (err < 0) {
       log_error("Read device map failed: %s", snd_strerror(err));
-      free(*buf);
-      *buf = NULL;
       return err;
     }
 
-    memcpy(*buf + offset, data, resp_size);
+    err = fn(data, cmd->data, resp_size);
+    if (err < 0)
+      return err;
   }
 
   return size;
@@ -17,6 +17,33 @@
 
 #define FCP_OPCODE_CATEGORY_DATA    0x800
 
+#define FCP_OPCODE_INIT_1               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x000)
+#define FCP_OPCODE_CAP_READ             (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x001)
+#define FCP_OPCODE_INIT_2               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x002)
+#define FCP_OPCODE_REBOOT               (FCP_OPCODE_CATEGORY_INIT    << 12 | 0x003)
+#define FCP_OPCODE_METER_INFO           (FCP_OPCODE_CATEGORY_METER   << 12 | 0x000)
+#define FCP_OPCODE_METER_READ           (FCP_OPCODE_CATEGORY_METER   << 12 | 0x001)
+#define FCP_OPCODE_MIX_INFO             (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x000)
+#define FCP_OPCODE_MIX_READ             (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x001)
+#define FCP_OPCODE_MIX_WRITE            (FCP_OPCODE_CATEGORY_MIX     << 12 | 0x002)
+#define FCP_OPCODE_MUX_INFO             (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x000)
+#define FCP_OPCODE_MUX_READ             (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x001)
+#define FCP_OPCODE_MUX_WRITE            (FCP_OPCODE_CATEGORY_MUX     << 12 | 0x002)
+#define FCP_OPCODE_FLASH_INFO           (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x000)
+#define FCP_OPCODE_FLASH_SEGMENT_INFO   (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x001)
+#define FCP_OPCODE_FLASH_ERASE          (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x002)
+#define FCP_OPCODE_FLASH_ERASE_PROGRESS (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x003)
+#define FCP_OPCODE_FLASH_WRITE          (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x004)
+#define FCP_OPCODE_FLASH_READ           (FCP_OPCODE_CATEGORY_FLASH   << 12 | 0x005)
+#define FCP_OPCODE_SYNC_READ            (FCP_OPCODE_CATEGORY_SYNC    << 12 | 0x004)
+#define FCP_OPCODE_ESP_DFU_START        (FCP_OPCODE_CATEGORY_ESP_DFU << 12 | 0x000)
+#define FCP_OPCODE_ESP_DFU_WRITE        (FCP_OPCODE_CATEGORY_ESP_DFU << 12 | 0x001)
+#define FCP_OPCODE_DATA_READ            (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x000)
+#define FCP_OPCODE_DATA_WRITE           (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x001)
+#define FCP_OPCODE_DATA_NOTIFY          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x002)
+#define FCP_OPCODE_DEVMAP_INFO          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x00c)
+#define FCP_OPCODE_DEVMAP_READ          (FCP_OPCODE_CATEGORY_DATA    << 12 | 0x00d)
+
 #define FCP_DEVMAP_BLOCK_SIZE 1024
 #define FCP_FLASH_WRITE_MAX (1024 - 3 * sizeof(uint32_t))
 #define FCP_FLASH_SEGMENT_SIZE 0x10000
@@ -31,6 +58,10 @@ int fcp_cmd(
   size_t       resp_size
 );
 void fcp_init(snd_hwdep_t *hwdep);
+
+/* Free the calling thread's command buffer before the thread exits */
+void fcp_cmd_buf_free(void);
+
 int fcp_cap_read(snd_hwdep_t *hwdep, int opcode_category);
 int fcp_reboot(snd_hwdep_t *hwdep);
 int fcp_meter_info(snd_hwdep_t *hwdep, int *num_meter_slots);
@@ -56,4 +87,11 @@ int fcp_data_read_buf(snd_hwdep_t *hwdep, int offset, int size, void *buf);
 int fcp_data_write_buf(snd_hwdep_t *hwdep, int offset, int size, const void *buf);
 int fcp_data_notify(snd_hwdep_t *hwdep, int event);
 int fcp_devmap_info(snd_hwdep_t *hwdep);
-int fcp_devmap_read(snd_hwdep_t *hwdep, char **buf);
+
+/* Called by fcp_devmap_read() with each block of the (base64
+ * encoded) device map; the block is only valid during the call,
+ * which must not send FCP commands. Return < 0 to stop reading.
+ */
+typedef int (*fcp_devmap_block_fn)(void *data, const void *block, int size);
+
+int fcp_devmap_read(snd_hwdep_t *hwdep, fcp_devmap_block_fn fn, void *data);
@@ -7,12 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
-#include <alsa/sound/tlv.h>
 #include <json-c/json.h>
 
 #include "global-controls.h"
 #include "control-utils.h"
 #include "device-ops.h"
+#include "strpool.h"
+#include "tlv.h"
 #include "log.h"
 
 static int parse_component_path(
@@ -44,12 +45,11 @@ static int parse_component_path(
 }
 
 static int get_component_info(
-  struct fcp_device   *device,
-  const char          *component_spec,
-  struct json_object **member,
-  const char         **member_type,
-  int                 *offset,
-  int                 *width
+  struct fcp_device    *device,
+  const char           *component_spec,
+  struct devmap_member *member,
+  int                  *offset,
+  int                  *width
 ) {
   char *path;
   int offset_adjust;
@@ -58,18 +58,18 @@ static int get_component_info(
   if (ret < 0)
     return ret;
 
-  ret = find_member_by_path(device, path, member, member_type, offset, true);
+  ret = find_member_by_path(device, path, member, true);
   free(path);
 
   // Component doesn't exist in this devmap version? Ignore it
   if (ret < 0)
     return 1;
 
-  *offset += offset_adjust;
+  *offset = member->offset + offset_adjust;
 
   // If width wasn't specified in component_spec, get it from devmap
   if (*width == 0)
-    *width = json_object_get_int(json_object_object_get(*member, "size"));
+    *width = member->size;
 
   return 0;
 }
@@ -80,13 +80,9 @@ static int create_bool_mixer_outputs_controls(
   const char         *member_path,
   struct json_object *control_config
 ) {
-  struct json_object *member;
-  const char *member_type;
-  int offset;
+  struct devmap_member member;
 
-  int err = find_member_by_path(
-    device, member_path, &member, &member_type, &offset, false
-  );
+  int err = find_member_by_path(device, member_path, &member, false);
   if (err < 0) {
     log_error("Cannot find member %s", member_path);
     return -1;
@@ -110,12 +106,12 @@ static int create_bool_mixer_outputs_controls(
       .value         = 0,
       .read_func     = read_bitmap_data_control,
       .write_func    = write_bitmap_data_control,
-      .offset        = offset,
-      .data_type     = devmap_type_to_data_type(member_type),
+      .offset        = member.offset,
+      .data_type     = devmap_type_to_data_type(member.type),
       .data_types    = NULL,
       .component_count = 0,
-      .notify_client = json_object_get_int(json_object_object_get(member, "notify-client")),
-      .notify_device = json_object_get_int(json_object_object_get(member, "notify-device")),
+      .notify_client = member.notify_client,
+      .notify_device = member.notify_device,
       .type          = SND_CTL_ELEM_TYPE_BOOLEAN,
       .min           = 0,
       .max           = 1
@@ -139,8 +135,8 @@ static int create_global_control(
   struct json_object *enums
 ) {
   struct json_object *fcp_notify, *fcp_notify_enums;
-  struct json_object *name, *type, *components, *member;
-  const char *member_type;
+  struct json_object *name, *type, *components;
+  struct devmap_member member;
 
   if (!json_object_object_get_ex(
         enums, "eDEV_FCP_USER_MESSAGE_TYPE", &fcp_notify
@@ -170,7 +166,7 @@ static int create_global_control(
   }
 
   struct control_props props = {
-    .name          = strdup(name_str),
+    .name          = name_str,
     .array_index   = 0,
     .interface     = SND_CTL_ELEM_IFACE_MIXER,
     .category      = CATEGORY_DATA,
@@ -206,13 +202,12 @@ static int create_global_control(
     int valid_count = 0;
 
     for (int i = 0; i < max_count; i++) {
-      struct json_object *component_member;
-      const char *component_member_type;
+      struct devmap_member component_member;
       int offset, width;
       const char *spec = json_object_get_string(json_object_array_get_idx(components, i));
 
       int err = get_component_info(
-        device, spec, &component_member, &component_member_type, &offset, &width
+        device, spec, &component_member, &offset, &width
       );
 
       // Skip components that don't exist
@@ -221,14 +216,12 @@ static int create_global_control(
 
       props.offsets[valid_count] = offset;
       props.data_types[valid_count] = devmap_type_to_data_type_with_width(
-        component_member_type, width
+        component_member.type, width
       );
       valid_count++;
 
-      if (valid_count == 1) {
+      if (valid_count == 1)
         member = component_member;
-        member_type = component_member_type;
-      }
     }
 
     if (!valid_count) {
@@ -247,22 +240,17 @@ static int create_global_control(
 
   /* Single-component control */
   } else {
-    int err = find_member_by_path(
-      device, member_path, &member, &member_type, &props.offset, false
-    );
+    int err = find_member_by_path(device, member_path, &member, false);
     if (err < 0) {
       log_error("Cannot find member %s", member_path);
       return -1;
     }
+    props.offset = member.offset;
   }
 
-  props.data_type = devmap_type_to_data_type(member_type);
-  props.notify_client = json_object_get_int(
-    json_object_object_get(member, "notify-client")
-  );
-  props.notify_device = json_object_get_int(
-    json_object_object_get(member, "notify-device")
-  );
+  props.data_type = devmap_type_to_data_type(member.type);
+  props.notify_client = member.notify_client;
+  props.notify_device = member.notify_device;
 
   struct json_object *save;
   if (json_object_object_get_ex(control_config, "save", &save) &&
@@ -305,16 +293,11 @@ static int create_global_control(
       /* Check first element to determine format */
       struct json_object *first = json_object_array_get_idx(values, 0);
       if (json_object_get_type(first) == json_type_string) {
-        /* Simple string array */
-        for (int i = 0; i < props.enum_count; i++) {
-          props.enum_names[i] = strdup(
-            json_object_get_string(json_object_array_get_idx(values, i))
+        /* Simple string array; add_control() keeps interned copies */
+        for (int i = 0; i < props.enum_count; i++)
+          props.enum_names[i] = json_object_get_string(
+            json_object_array_get_idx(values, i)
           );
-          if (!props.enum_names[i]) {
-            log_error("Cannot allocate memory for enum name");
-            exit(1);
-          }
-        }
       } else {
         /* Array of objects with name/value pairs */
         props.enum_values = calloc(props.enum_count, sizeof(int));
@@ -326,11 +309,7 @@ static int create_global_control(
             log_error("Cannot find name in enum value %d", i);
             exit(1);
           }
-          props.enum_names[i] = strdup(json_object_get_string(name));
-          if (!props.enum_names[i]) {
-            log_error("Cannot allocate memory for enum name");
-            exit(1);
-          }
+          props.enum_names[i] = json_object_get_string(name);
 
           if (json_object_object_get_ex(value, "value", &val)) {
             props.enum_values[i] = json_object_get_int(val);
@@ -368,10 +347,14 @@ static int create_global_control(
       }
 
       for (int i = 0; i < props.enum_count; i++) {
-        if (asprintf(&props.enum_names[i], format, i + 1) < 0) {
+        char *label;
+
+        if (asprintf(&label, format, i + 1) < 0) {
           log_error("Cannot allocate memory for enum name");
           exit(1);
         }
+        props.enum_names[i] = strpool_intern(label);
+        free(label);
       }
 
     } else {
@@ -386,7 +369,7 @@ static int create_global_control(
 
   } else if (!strcmp(type_str, "bytes")) {
     props.type = SND_CTL_ELEM_TYPE_BYTES;
-    props.size = json_object_get_int(json_object_object_get(member, "size"));
+    props.size = member.size;
     props.read_bytes_func = read_bytes_control;
     props.write_bytes_func = write_bytes_control;
 
@@ -426,12 +409,10 @@ static int create_global_control(
     if (json_object_object_get_ex(control_config, "db-min", &db_min) &&
         json_object_object_get_ex(control_config, "db-max", &db_max)) {
 
-      unsigned int *tlv = calloc(4, sizeof(unsigned int));
-      tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
-      tlv[1] = 2 * sizeof(unsigned int);
-      tlv[2] = json_object_get_int(db_min) * 100;
-      tlv[3] = json_object_get_int(db_max) * 100;
-      props.tlv = tlv;
+      props.tlv = tlv_db_minmax(
+        json_object_get_int(db_min),
+        json_object_get_int(db_max)
+      );
     }
 
     if (json_object_object_get_ex(control_config, "interface", &interface)) {
@@ -462,7 +443,10 @@ static int create_global_control(
     return -1;
   }
 
-  return add_control(device, &props);
+  int err = add_control(device, &props);
+  free(props.enum_names);
+
+  return err;
 }
 
 int init_global_controls(struct fcp_device *device) {
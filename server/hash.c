@@ -1,10 +1,12 @@
 // SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/sha.h>
 
 #include "hash.h"
+#include "log.h"
 
 int verify_sha256(
   const unsigned char *data,
@@ -15,3 +17,38 @@ int verify_sha256(
   SHA256(data, length, computed_hash);
   return memcmp(computed_hash, expected_hash, SHA256_DIGEST_LENGTH) == 0;
 }
+
+EVP_MD_CTX *sha256_stream_begin(void) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx) {
+    log_error("Cannot allocate memory for SHA-256 context");
+    exit(1);
+  }
+
+  if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+    log_error("Cannot initialise SHA-256");
+    EVP_MD_CTX_free(ctx);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+void sha256_stream_update(EVP_MD_CTX *ctx, const void *data, size_t length) {
+  if (ctx)
+    EVP_DigestUpdate(ctx, data, length);
+}
+
+bool sha256_stream_verify(EVP_MD_CTX *ctx, const unsigned char *expected_hash) {
+  unsigned char computed_hash[SHA256_DIGEST_LENGTH];
+  unsigned int length = 0;
+
+  if (!ctx)
+    return false;
+
+  int ok = EVP_DigestFinal_ex(ctx, computed_hash, &length);
+  EVP_MD_CTX_free(ctx);
+
+  return ok && length == SHA256_DIGEST_LENGTH &&
+         memcmp(computed_hash, expected_hash, SHA256_DIGEST_LENGTH) == 0;
+}
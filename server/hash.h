@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 int verify_sha256(
@@ -10,3 +12,12 @@ int verify_sha256(
   size_t               length,
   const unsigned char *expected_hash
 );
+
+/* Incremental SHA-256 for data which arrives in pieces */
+EVP_MD_CTX *sha256_stream_begin(void);
+void sha256_stream_update(EVP_MD_CTX *ctx, const void *data, size_t length);
+
+/* Finish the hash, compare it, and free the context; false if ctx is
+ * NULL or the hash doesn't match
+ */
+bool sha256_stream_verify(EVP_MD_CTX *ctx, const unsigned char *expected_hash);
@@ -5,12 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
-#include <alsa/sound/tlv.h>
 #include <json-c/json.h>
 
 #include "input-controls.h"
 #include "control-utils.h"
 #include "device-ops.h"
+#include "tlv.h"
 #include "log.h"
 
 static int create_input_control(
@@ -62,6 +62,7 @@ static int create_input_control(
                      ),
     .step          = 1,
     .read_only     = 0,
+    .poll          = !strncmp(control_type, "auto-gain", 9),
     .notify_client = notify_client ? json_object_get_int(notify_client) : 0,
     .notify_device = notify_device ? json_object_get_int(notify_device) : 0,
     .offset        = json_object_get_int(offset),
@@ -96,13 +97,10 @@ static int create_input_control(
     if (json_object_object_get_ex(control_config, "db-min", &db_min) &&
         json_object_object_get_ex(control_config, "db-max", &db_max)) {
 
-      unsigned int *tlv = calloc(4, sizeof(unsigned int));
-      tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
-      tlv[1] = 2 * sizeof(unsigned int);
-      tlv[2] = json_object_get_int(db_min) * 100;
-      tlv[3] = json_object_get_int(db_max) * 100;
-
-      props.tlv = tlv;
+      props.tlv = tlv_db_minmax(
+        json_object_get_int(db_min),
+        json_object_get_int(db_max)
+      );
     }
 
   } else if (!strcmp(type_str, "enum")) {
@@ -128,17 +126,11 @@ static int create_input_control(
       return -1;
     }
 
+    // add_control() keeps interned copies
     for (int i = 0; i < num_values; i++) {
       struct json_object *value = json_object_array_get_idx(values, i);
 
-      props.enum_names[i] = strdup(json_object_get_string(value));
-      if (!props.enum_names[i]) {
-        log_error("Cannot allocate memory for enum name");
-        for (int j = 0; j < i; j++)
-          free(props.enum_names[j]);
-        free(props.enum_names);
-        return -1;
-      }
+      props.enum_names[i] = json_object_get_string(value);
     }
 
   } else {
@@ -146,7 +138,10 @@ static int create_input_control(
     return -1;
   }
 
-  return add_control(device, &props);
+  int err = add_control(device, &props);
+  free(props.enum_names);
+
+  return err;
 }
 
 /* Create input controls */
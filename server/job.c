@@ -0,0 +1,184 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "job.h"
+#include "event-loop.h"
+#include "fcp-io.h"
+#include "fcp-socket.h"
+#include "log.h"
+
+static struct job *jobs;
+
+static void unlink_job(struct job *job) {
+  for (struct job **p = &jobs; *p; p = &(*p)->next) {
+    if (*p == job) {
+      *p = job->next;
+      return;
+    }
+  }
+}
+
+static void finish_step(struct job *job, int ret) {
+  if (job->progress >= 0 && job->progress != job->sent_progress) {
+    job->sent_progress = job->progress;
+    if (job->report)
+      job->report(job, job->progress);
+    else
+      send_progress(job->client_fd, job->progress);
+  }
+
+  if (ret == JOB_PENDING) {
+    uint32_t pending = job->pending;
+
+    // Wake straight away for a notification which arrived while the
+    // step was on the I/O thread
+    job->notifications |= pending;
+    job->pending = 0;
+
+    if (pending & job->wake_mask) {
+      job->wake_mask = 0;
+      event_timer_arm(job->timer, 1, 0);
+    } else if (job->wait_ms >= 0) {
+      // A zero delay would disarm the timer
+      event_timer_arm(job->timer, job->wait_ms > 0 ? job->wait_ms : 1, 0);
+    }
+    return;
+  }
+
+  unlink_job(job);
+  event_remove(job->timer);
+  job->timer = NULL;
+
+  if (job->complete)
+    job->complete(job, ret);
+  if (job->destroy)
+    job->destroy(job);
+}
+
+static int step_work(void *data) {
+  struct job *job = data;
+
+  return job->step(job);
+}
+
+static void step_done(void *data, int ret) {
+  struct job *job = data;
+
+  job->running = false;
+  finish_step(job, ret);
+}
+
+static void run_step(struct job *job) {
+  job->wait_ms = -1;
+
+  if (fcp_io_submit(
+        job->device, FCP_IO_BACKGROUND, step_work, step_done, job
+      ) == 0) {
+    job->running = true;
+    return;
+  }
+
+  finish_step(job, job->step(job));
+}
+
+static void handle_job_timer(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct job *job = data;
+
+  if (job->running)
+    return;
+
+  job->wake_mask = 0;
+  run_step(job);
+}
+
+int job_start(struct job *job) {
+  job->timer = event_add_timer(handle_job_timer, job);
+  if (!job->timer)
+    return -1;
+
+  job->notifications = 0;
+  job->pending = 0;
+  job->progress = -1;
+  job->sent_progress = -1;
+  job->running = false;
+  job->next = jobs;
+  jobs = job;
+
+  event_timer_arm(job->timer, 1, 0);
+
+  return 0;
+}
+
+void job_wait(struct job *job, int delay_ms, uint32_t wake_mask) {
+  job->wake_mask = wake_mask;
+  job->wait_ms = delay_ms;
+}
+
+void job_progress(struct job *job, int percent) {
+  job->progress = percent;
+}
+
+void job_handle_notification(struct fcp_device *device, uint32_t notification) {
+  struct job *job = jobs;
+
+  while (job) {
+    struct job *next = job->next;
+
+    if (job->device == device) {
+
+      // Kept until the step on the I/O thread has returned
+      if (job->running) {
+        job->pending |= notification;
+      } else {
+        job->notifications |= notification;
+
+        if (notification & job->wake_mask) {
+          job->wake_mask = 0;
+          event_timer_arm(job->timer, 0, 0);
+          run_step(job);
+        }
+      }
+    }
+
+    job = next;
+  }
+}
+
+bool job_device_busy(struct fcp_device *device) {
+  for (struct job *job = jobs; job; job = job->next)
+    if (job->device == device)
+      return true;
+
+  return false;
+}
+
+void job_detach_client(int client_fd) {
+  for (struct job *job = jobs; job; job = job->next)
+    if (job->client_fd == client_fd)
+      job->client_fd = -1;
+}
+
+void job_cancel_device(struct fcp_device *device) {
+  struct job **p = &jobs;
+
+  while (*p) {
+    struct job *job = *p;
+
+    if (job->device != device) {
+      p = &job->next;
+      continue;
+    }
+
+    *p = job->next;
+    event_remove(job->timer);
+    if (job->destroy)
+      job->destroy(job);
+  }
+}
@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "device.h"
+
+/* Long-running device operations (flash erase and write, ESP DFU)
+ * run as state machines driven by the event loop, so that control
+ * changes and notifications are still handled while they are in
+ * progress.
+ *
+ * step() is called shortly after job_start(), when the delay given
+ * to job_wait() expires, and when a notification in the wake mask
+ * arrives. It returns JOB_PENDING to be called again, 0 when the job
+ * has finished, or an FCP_SOCKET_ERR_* code. After that, complete()
+ * is called with the result and then destroy() to free the job.
+ *
+ * Once the device has an I/O thread (see fcp-io.h), step() runs
+ * there at background priority, so it must only use the job's own
+ * state: progress is reported with job_progress() and sent to the
+ * client from the event loop once the step returns. The other
+ * functions are called on the event loop thread.
+ */
+
+#define JOB_PENDING -1
+
+struct job {
+  int                (*step)(struct job *job);
+  void               (*destroy)(struct job *job);
+  void               (*complete)(struct job *job, int result);
+  struct fcp_device   *device;
+  int                  client_fd;     // For progress; -1 if none
+  struct event_source *timer;
+  uint32_t             wake_mask;
+  uint32_t             notifications; // Received since last cleared
+
+  /* Send progress to the client; send_progress() to client_fd if
+   * not set
+   */
+  void               (*report)(struct job *job, int percent);
+
+  // Private to job.c
+  int                  wait_ms;       // From job_wait(); -1 if not called
+  int                  progress;      // From job_progress(); -1 if none
+  int                  sent_progress;
+  bool                 running;       // On the I/O thread
+  uint32_t             pending;       // Notifications received meanwhile
+  struct job          *next;
+};
+
+/* Register the job and schedule its first step; returns 0 or -1 */
+int job_start(struct job *job);
+
+/* Call step() again after delay_ms, or sooner if a notification in
+ * wake_mask arrives; called from step()
+ */
+void job_wait(struct job *job, int delay_ms, uint32_t wake_mask);
+
+/* Report progress from step(); only the latest is sent */
+void job_progress(struct job *job, int percent);
+
+/* Record a device notification for the device's jobs and wake any
+ * which are waiting for it
+ */
+void job_handle_notification(struct fcp_device *device, uint32_t notification);
+
+/* Check if a job is running on the device; flash and DFU operations
+ * can't overlap
+ */
+bool job_device_busy(struct fcp_device *device);
+
+/* Stop sending progress to a client which has gone away */
+void job_detach_client(int client_fd);
+
+/* Drop the device's jobs without completing them, once the device
+ * has gone away
+ */
+void job_cancel_device(struct fcp_device *device);
@@ -7,14 +7,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <systemd/sd-journal.h>
 
 #include "log.h"
 
+// Number of messages which can be waiting to be written; a power of
+// 2. Large enough for the debug logging of a device's bring-up.
+#define LOG_RING_SIZE 2048
+
+// Longest message; longer ones are truncated
+#define LOG_MSG_MAX 1024
+
+/* A ring slot; seq is the ring position it can next be claimed at
+ * by a producer, or that position + 1 once it holds a message
+ * (bounded MPMC queue, with one consumer)
+ */
+struct log_slot {
+  unsigned int seq;
+  log_level_t  level;
+  char         msg[LOG_MSG_MAX];
+};
+
 // Global state
 static bool use_systemd = false;
-static log_level_t current_level = LOG_LEVEL_INFO;
+log_level_t log_current_level = LOG_LEVEL_INFO;
+
+static struct log_slot ring[LOG_RING_SIZE];
+static unsigned int ring_head;     // Next position to claim
+static unsigned int ring_tail;     // Next position to write (writer only)
+static unsigned int ring_dropped;  // Debug messages lost with the ring full
+static unsigned int writer_sleeping;  // futex word
+static bool writer_stopping;
+static bool writer_running;
+static pthread_t writer_thread;
+
+static void log_start_writer(void);
 
 static bool check_journal_stream(void) {
   const char *env = getenv("JOURNAL_STREAM");
@@ -34,25 +66,17 @@ void log_init(void) {
 
   const char *env = getenv("LOG_LEVEL");
   if (env) {
-    if (!strcmp(env, "error")) current_level = LOG_LEVEL_ERROR;
-    else if (!strcmp(env, "warning")) current_level = LOG_LEVEL_WARNING;
-    else if (!strcmp(env, "info")) current_level = LOG_LEVEL_INFO;
-    else if (!strcmp(env, "debug")) current_level = LOG_LEVEL_DEBUG;
+    if (!strcmp(env, "error")) log_current_level = LOG_LEVEL_ERROR;
+    else if (!strcmp(env, "warning")) log_current_level = LOG_LEVEL_WARNING;
+    else if (!strcmp(env, "info")) log_current_level = LOG_LEVEL_INFO;
+    else if (!strcmp(env, "debug")) log_current_level = LOG_LEVEL_DEBUG;
   }
-}
 
-void log_msg(log_level_t level, const char *fmt, ...) {
-  if (level > current_level) {
-    return;
-  }
-
-  va_list args;
-  va_start(args, fmt);
+  log_start_writer();
+}
 
+static void emit(log_level_t level, const char *msg) {
   if (use_systemd) {
-    char buf[1024];
-    vsnprintf(buf, sizeof(buf), fmt, args);
-
     int priority = LOG_INFO;
     switch (level) {
       case LOG_LEVEL_ERROR: priority = LOG_ERR; break;
@@ -61,20 +85,157 @@ void log_msg(log_level_t level, const char *fmt, ...) {
       case LOG_LEVEL_DEBUG: priority = LOG_DEBUG; break;
     }
 
-    sd_journal_print(priority, "%s", buf);
+    sd_journal_print(priority, "%s", msg);
   } else {
     FILE *out = level <= LOG_LEVEL_WARNING ? stderr : stdout;
-    vfprintf(out, fmt, args);
-    fprintf(out, "\n");
+
+    // Keep lines whole if written before the writer thread starts
+    flockfile(out);
+    fputs(msg, out);
+    fputc('\n', out);
+    funlockfile(out);
+  }
+}
+
+static void wake_writer(void) {
+  if (__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &writer_sleeping, FUTEX_WAKE_PRIVATE, 1,
+            NULL, NULL, 0);
+}
+
+/* Write out the waiting messages; returns false if there were none */
+static bool drain_ring(void) {
+  bool found = false;
+
+  while (1) {
+    struct log_slot *slot = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+      break;
+
+    emit(slot->level, slot->msg);
+    __atomic_store_n(&slot->seq, ring_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    ring_tail++;
+    found = true;
   }
 
+  unsigned int dropped = __atomic_exchange_n(&ring_dropped, 0,
+                                             __ATOMIC_RELAXED);
+  if (dropped) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%u debug messages dropped", dropped);
+    emit(LOG_LEVEL_WARNING, msg);
+  }
+
+  if (found && !use_systemd) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+
+  return found;
+}
+
+static void *writer_main(void *arg) {
+  while (1) {
+    if (drain_ring())
+      continue;
+
+    if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE))
+      break;
+
+    // Check again after saying we're sleeping, so a message added in
+    // between isn't missed
+    __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+    if (drain_ring()) {
+      __atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE))
+      break;
+
+    syscall(SYS_futex, &writer_sleeping, FUTEX_WAIT_PRIVATE, 1,
+            NULL, NULL, 0);
+  }
+
+  drain_ring();
+  return NULL;
+}
+
+static void stop_writer(void) {
+  __atomic_store_n(&writer_stopping, true, __ATOMIC_RELEASE);
+  __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+  wake_writer();
+  pthread_join(writer_thread, NULL);
+  __atomic_store_n(&writer_running, false, __ATOMIC_RELEASE);
+}
+
+static void log_start_writer(void) {
+  for (unsigned int i = 0; i < LOG_RING_SIZE; i++)
+    ring[i].seq = i;
+
+  // Messages are written directly if the thread can't be started
+  if (pthread_create(&writer_thread, NULL, writer_main, NULL))
+    return;
+
+  __atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+  atexit(stop_writer);
+}
+
+void log_msg(log_level_t level, const char *fmt, ...) {
+  if (level > log_current_level) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+
+  if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+    char buf[LOG_MSG_MAX];
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    emit(level, buf);
+    return;
+  }
+
+  // Claim the slot at the head, unless the writer hasn't emptied it;
+  // only debug messages are dropped if the ring is full
+  unsigned int pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+  struct log_slot *slot;
+
+  while (1) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+
+    int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0 && level == LOG_LEVEL_DEBUG) {
+      __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+      va_end(args);
+      return;
+    } else if (diff < 0) {
+      wake_writer();
+      sched_yield();
+      pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->level = level;
+  vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
   va_end(args);
+
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  wake_writer();
 }
 
 // Format bytes data for debug logging
 // Returns ASCII string if all printable, otherwise hex
 const char *format_bytes_debug(const unsigned char *data, size_t size) {
-  static char buf[512];
+  static __thread char buf[512];
   size_t i;
 
   // Find the length of printable ASCII content
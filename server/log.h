@@ -11,14 +11,28 @@ typedef enum {
   LOG_LEVEL_DEBUG = 7    // Debug messages
 } log_level_t;
 
+extern log_level_t log_current_level;
+
+/* Messages are formatted by the caller into a lock-free ring and
+ * written to the journal or stdout/stderr by a background thread,
+ * so logging doesn't wait on I/O. The ring is drained at exit.
+ */
 void log_init(void);
-void log_msg(log_level_t level, const char *fmt, ...);
+void log_msg(log_level_t level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static inline int log_level_enabled(log_level_t level) {
+  return level <= log_current_level;
+}
 
 // Format bytes data for debug logging (returns ASCII or hex)
 const char *format_bytes_debug(const unsigned char *data, size_t size);
 
-// Convenience macros
-#define log_error(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
-#define log_warning(...) log_msg(LOG_LEVEL_WARNING, __VA_ARGS__)
-#define log_info(...) log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
-#define log_debug(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+// Convenience macros; the arguments aren't evaluated if the level
+// is filtered, so they can be expensive (e.g. format_bytes_debug())
+#define log_at(level, ...) \
+  (log_level_enabled(level) ? log_msg(level, __VA_ARGS__) : (void)0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_at(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
@@ -7,49 +7,311 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
-#include <sys/param.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <alsa/asoundlib.h>
+#include <systemd/sd-daemon.h>
 
 #include "device-ops.h"
+#include "event-loop.h"
+#include "fcp.h"
+#include "fcp-io.h"
 #include "fcp-socket.h"
+#include "job.h"
+#include "poller.h"
+#include "startup.h"
+#include "stats.h"
+#include "trace.h"
 #include "log.h"
 
 static void usage(const char *argv0) {
-  log_error("Usage: %s <card-number>", argv0);
+  log_error("Usage: %s <card-number> [<card-number>...]", argv0);
 }
 
-static int process_control_event(struct fcp_device *device) {
-  snd_ctl_event_t *event;
-  snd_ctl_elem_id_t *event_id;
-  snd_ctl_elem_value_t *value;
+/* Each card has its own event sources, so one card going away (or
+ * failing) doesn't affect the others; the server exits once none
+ * are left
+ */
+struct managed_device {
+  struct fcp_device    device;
+  const char          *arg;         // Card number argument
+  int                  setup_result;
+  struct event_source *ctl_source;
+  struct event_source *hwdep_source;
+  bool                 configured;  // Controls have been created
+  bool                 active;      // Events are being handled
+};
+
+static int active_devices;
+
+/* Tell systemd (if it started us) how many cards are being served,
+ * and that startup is complete if ready
+ */
+static void notify_status(bool ready) {
+  sd_notifyf(0, "%sSTATUS=Serving %d card%s",
+             ready ? "READY=1\n" : "",
+             active_devices, active_devices == 1 ? "" : "s");
+}
+
+static void remove_device(struct managed_device *md, int err) {
+  struct fcp_device *device = &md->device;
+
+  if (!md->active)
+    return;
+  md->active = false;
+
+  event_remove(md->ctl_source);
+  event_remove(md->hwdep_source);
+  md->ctl_source = NULL;
+  md->hwdep_source = NULL;
+
+  // Background work may refer to the socket server and jobs
+  fcp_io_stop(device);
+  fcp_socket_cleanup(device);
+  job_cancel_device(device);
+  device_close(device);
+
+  log_info("Card %d removed", device->card_num);
+
+  if (--active_devices == 0) {
+    sd_notify(0, "STOPPING=1");
+    event_loop_stop(err);
+  } else {
+    notify_status(false);
+  }
+}
+
+/* SIGTERM and SIGINT are blocked in every thread (so before any are
+ * started) and read from a signalfd, so that the event loop returns
+ * and the queued log messages and trace records are written at exit
+ */
+static sigset_t stop_signals;
+static int signal_fd = -1;
+
+static void block_stop_signals(void) {
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGTERM);
+  sigaddset(&stop_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+}
+
+static void handle_stop_signal(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct signalfd_siginfo info;
+
+  if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+    return;
+
+  log_info("Stopping on %s", strsignal(info.ssi_signo));
+  sd_notify(0, "STOPPING=1");
+  event_loop_stop(0);
+}
+
+static int add_stop_signal_source(void) {
+  signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd >= 0 &&
+      event_add_fd(signal_fd, EPOLLIN, handle_stop_signal, NULL))
+    return 0;
+
+  // Let the signals stop the server as they would otherwise
+  log_error("Cannot handle stop signals: %s", strerror(errno));
+  if (signal_fd >= 0)
+    close(signal_fd);
+  signal_fd = -1;
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+  return -1;
+}
+
+/* Control elements which have changed since the last batch, in the
+ * order they first changed
+ */
+static snd_ctl_elem_id_t **pending_ids;
+static int pending_count;
+static int pending_capacity;
+
+static void add_pending_event(const snd_ctl_event_t *event) {
+  unsigned int numid = snd_ctl_event_elem_get_numid(event);
+
+  // Only keep the first event for each element; the value is read
+  // when the batch is processed so it will be the latest
+  for (int i = 0; i < pending_count; i++)
+    if (snd_ctl_elem_id_get_numid(pending_ids[i]) == numid)
+      return;
+
+  if (pending_count == pending_capacity) {
+    int new_capacity = pending_capacity ? pending_capacity * 2 : 16;
+
+    snd_ctl_elem_id_t **new_ids = realloc(
+      pending_ids, new_capacity * sizeof(*pending_ids)
+    );
+    if (!new_ids) {
+      log_error("Cannot allocate memory for pending events");
+      exit(1);
+    }
+    for (int i = pending_capacity; i < new_capacity; i++) {
+      if (snd_ctl_elem_id_malloc(&new_ids[i]) < 0) {
+        log_error("Cannot allocate memory for pending events");
+        exit(1);
+      }
+    }
+    pending_ids = new_ids;
+    pending_capacity = new_capacity;
+  }
+
+  snd_ctl_event_elem_get_id(event, pending_ids[pending_count++]);
+}
 
+/* Read all pending control events without blocking */
+static int drain_control_events(struct fcp_device *device) {
+  snd_ctl_event_t *event;
   snd_ctl_event_alloca(&event);
-  snd_ctl_elem_id_alloca(&event_id);
+
+  while (1) {
+    int err = snd_ctl_read(device->ctl, event);
+    if (err == -EAGAIN || err == 0)
+      return 0;
+    if (err < 0)
+      return err;
+
+    // Only handle element events
+    if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+      continue;
+
+    add_pending_event(event);
+  }
+}
+
+/* Apply the latest value of each changed element */
+static int process_control_events(struct fcp_device *device) {
+  snd_ctl_elem_value_t *value;
   snd_ctl_elem_value_alloca(&value);
 
-  // Read the event
-  int err = snd_ctl_read(device->ctl, event);
-  if (err < 0)
-    return err;
+  int count = pending_count;
+  pending_count = 0;
 
-  // Only handle element events
-  if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
-    return 0;
+  if (count > 1)
+    log_debug("Processing %d control events", count);
+
+  int err = 0;
+
+  device_batch_begin(device);
+
+  for (int i = 0; i < count; i++) {
+    snd_ctl_elem_value_set_id(value, pending_ids[i]);
+
+    // The element may have gone (e.g. a user control being replaced);
+    // that's no reason to drop the rest of the batch
+    int read_err = snd_ctl_elem_read(device->ctl, value);
+    if (read_err < 0) {
+      log_error(
+        "Cannot read control %s: %s",
+        snd_ctl_elem_id_get_name(pending_ids[i]), snd_strerror(read_err)
+      );
+      continue;
+    }
+
+    err = device_handle_control_change(device, pending_ids[i], value);
+    if (err < 0)
+      break;
+  }
+
+  int end_err = device_batch_end(device);
+
+  return err < 0 ? err : end_err;
+}
+
+/* Maximum number of notifications read in one batch */
+#define MAX_NOTIFICATION_BATCH 64
+
+/* Read all pending notifications and combine them into one mask */
+static int drain_notifications(
+  struct fcp_device *device,
+  int                hwdep_fd,
+  uint32_t          *mask
+) {
+  *mask = 0;
 
-  snd_ctl_event_elem_get_id(event, event_id);
-  snd_ctl_elem_value_set_id(value, event_id);
+  for (int i = 0; i < MAX_NOTIFICATION_BATCH; i++) {
+    uint32_t notification;
 
-  err = snd_ctl_elem_read(device->ctl, value);
+    // The first read is known to be ready; check before reading more
+    if (i) {
+      struct pollfd pfd = { .fd = hwdep_fd, .events = POLLIN };
+
+      if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+        break;
+    }
+
+    int err = snd_hwdep_read(device->hwdep, &notification,
+                             sizeof(notification));
+    if (err < 0)
+      return err;
+
+    trace_notification(device->hwdep, notification);
+
+    *mask |= notification;
+  }
+
+  return 0;
+}
+
+static void handle_ctl_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct managed_device *md = data;
+  struct fcp_device *device = &md->device;
+
+  // Handle control events; only the latest value of each element is
+  // applied
+  int err = drain_control_events(device);
+  if (!err)
+    err = process_control_events(device);
+  if (err == -ENODEV) {
+    log_debug("Card %d control interface closed", device->card_num);
+    remove_device(md, 0);
+    return;
+  }
   if (err < 0) {
-    log_error("Cannot read control value: %s", snd_strerror(err));
-    return err;
+    log_error("Control event processing failed: %s", snd_strerror(err));
+    remove_device(md, err);
   }
+}
 
-  return device_handle_control_change(device, event_id, value);
+static void handle_hwdep_event(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct managed_device *md = data;
+  struct fcp_device *device = &md->device;
+  uint32_t notification;
+
+  // Handle device notifications; all pending notifications are
+  // handled together
+  int err = drain_notifications(device, device->hwdep_fd, &notification);
+  if (err == -ENODEV) {
+    log_debug("Card %d hwdep interface closed", device->card_num);
+    remove_device(md, 0);
+    return;
+  }
+  if (err < 0) {
+    log_error("Cannot read notification: %s", snd_strerror(err));
+    remove_device(md, err);
+    return;
+  }
+  device_handle_notification(device, notification);
 }
 
-static int run(struct fcp_device *device) {
+// Start handling a card's control events and notifications
+static int start_device(struct managed_device *md) {
+  struct fcp_device *device = &md->device;
   int ctl_fd, hwdep_fd;
   int err;
 
@@ -63,112 +325,208 @@ static int run(struct fcp_device *device) {
     return err;
   }
 
-  // Main event loop
-  while (1) {
-    fd_set rfds;
-    int nfds = -1;
-
-    FD_ZERO(&rfds);
-    FD_SET(ctl_fd, &rfds);
-    FD_SET(hwdep_fd, &rfds);
-    nfds = MAX(nfds, MAX(ctl_fd, hwdep_fd));
+  // Control events are drained without blocking
+  err = snd_ctl_nonblock(device->ctl, 1);
+  if (err < 0) {
+    log_error("Cannot set control non-blocking: %s", snd_strerror(err));
+    return err;
+  }
 
-    // Add socket fds
-    fcp_socket_update_sets(&rfds, &nfds);
-    nfds++;
+  md->ctl_source = event_add_fd(ctl_fd, EPOLLIN, handle_ctl_event, md);
+  md->hwdep_source = event_add_fd(hwdep_fd, EPOLLIN, handle_hwdep_event, md);
+  if (!md->ctl_source || !md->hwdep_source)
+    return -1;
 
-    err = select(nfds, &rfds, NULL, NULL, NULL);
-    if (err < 0) {
-      if (errno == EINTR)
-        continue;
-      log_error("Select failed: %s", strerror(errno));
-      break;
-    }
+  md->active = true;
+  active_devices++;
 
-    // Handle control events
-    if (FD_ISSET(ctl_fd, &rfds)) {
-      err = process_control_event(device);
-      if (err == -ENODEV) {
-        err = 0;
-        log_debug("Control interface closed");
-        break;
-      }
-      if (err < 0) {
-        log_error("Control event processing failed: %s", snd_strerror(err));
-        break;
-      }
-    }
+  // From here the commands are sent by the device's own thread
+  if (fcp_io_start(device) < 0)
+    log_warning("Card %d: no I/O thread; background work will delay "
+                "control changes", device->card_num);
 
-    // Handle device notifications
-    if (FD_ISSET(hwdep_fd, &rfds)) {
-      uint32_t notification;
-      err = snd_hwdep_read(device->hwdep, &notification,
-                sizeof(notification));
-      if (err < 0) {
-        log_error("Cannot read notification: %s", snd_strerror(err));
-        break;
-      }
-      device_handle_notification(device, notification);
-    }
+  // Fill in the control values which weren't read at startup
+  if (device_start_lazy_load(device) < 0)
+    log_warning("Card %d: deferred control values not loaded",
+                device->card_num);
 
-    // Handle socket events
-    fcp_socket_handle_events(&rfds);
-  }
+  if (poller_start(device) < 0)
+    log_warning("Card %d: status controls not polled", device->card_num);
 
-  return err;
+  return 0;
 }
 
-int main(int argc, char *argv[]) {
-  struct fcp_device device;
+// Open a card and create its controls
+// Returns 0 on success, 1 if the card doesn't support FCP, or a
+// negative error code
+static int setup_device(struct managed_device *md, const char *arg) {
+  struct fcp_device *device = &md->device;
   int card_num;
   int err;
 
-  log_init();
-
-  // Parse command line
-  if (argc != 2) {
-    usage(argv[0]);
-    return 1;
-  }
-
   errno = 0;
-  card_num = strtol(argv[1], NULL, 10);
+  card_num = strtol(arg, NULL, 10);
   if (errno || card_num < 0) {
-    log_error("Invalid card number: %s", argv[1]);
-    return 1;
+    log_error("Invalid card number: %s", arg);
+    return -EINVAL;
   }
 
   // Initialise device
-  err = device_init(card_num, &device);
+  uint64_t start = stats_time_us();
+  err = device_init(card_num, device);
+  startup_phase_end(device, STARTUP_DEVICE_INIT, &start);
   if (err < 0) {
 
     // Quietly ignore if FCP is not supported
     if (err == -ENOPROTOOPT)
-      return 0;
+      return 1;
 
     log_error("Device initialisation failed: %s", snd_strerror(err));
-    return 1;
+    return err;
   }
 
   // Load device configuration
-  err = device_load_config(&device);
+  err = device_load_config(device);
   if (err < 0)
-    return 1;
+    return err;
 
   // Initialise controls
-  err = device_init_controls(&device);
-  if (err < 0)
+  return device_init_controls(device);
+}
+
+// Bring-up is mostly waiting for USB round trips, so each card is
+// set up in its own thread
+static void *setup_device_thread(void *data) {
+  struct managed_device *md = data;
+
+  md->setup_result = setup_device(md, md->arg);
+  fcp_cmd_buf_free();
+
+  return NULL;
+}
+
+// Set up all the devices, in parallel if there's more than one
+static void setup_devices(struct managed_device *devices, int count) {
+  pthread_t threads[count];
+  bool started[count];
+
+  for (int i = 0; i < count; i++) {
+    started[i] = count > 1 &&
+      pthread_create(&threads[i], NULL, setup_device_thread, &devices[i]) == 0;
+
+    // Fall back to setting the device up here
+    if (!started[i])
+      devices[i].setup_result = setup_device(&devices[i], devices[i].arg);
+  }
+
+  for (int i = 0; i < count; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+}
+
+int main(int argc, char *argv[]) {
+  int err;
+
+  block_stop_signals();
+  log_init();
+  stats_init();
+  trace_init();
+
+  // Parse command line; each argument is a card to serve
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  sd_notify(0, "STATUS=Setting up");
+
+  int device_count = argc - 1;
+  struct managed_device *devices = calloc(device_count, sizeof(*devices));
+  if (!devices) {
+    log_error("Cannot allocate memory for devices");
+    return 1;
+  }
+
+  // Initialise each device; in supervisor mode (more than one card)
+  // a card which can't be set up is skipped rather than stopping the
+  // others
+  int configured_count = 0;
+  int failed_count = 0;
+
+  for (int i = 0; i < device_count; i++)
+    devices[i].arg = argv[i + 1];
+
+  setup_devices(devices, device_count);
+
+  for (int i = 0; i < device_count; i++) {
+    err = devices[i].setup_result;
+    if (err < 0)
+      failed_count++;
+    else if (err == 0) {
+      devices[i].configured = true;
+      configured_count++;
+    }
+  }
+
+  // Everything needed from the JSON maps has been extracted
+  for (int i = 0; i < device_count; i++)
+    if (devices[i].configured)
+      device_release_config(&devices[i].device);
+  device_release_shared_config();
+
+  if (device_count == 1 && failed_count)
     return 1;
+  if (!configured_count)
+    return failed_count ? 1 : 0;
 
-  // Initialise socket interface
-  err = fcp_socket_init(&device);
+  // Initialise the event loop, and the socket interface and event
+  // sources for each device
+  err = event_loop_init();
   if (err < 0)
     return 1;
+  add_stop_signal_source();
+
+  // Write out the commands sent during setup, then keep writing
+  trace_flush();
+  if (trace_start_flush_timer() < 0)
+    log_warning("Trace records will only be written at exit");
+
+  for (int i = 0; i < device_count; i++) {
+    if (!devices[i].configured)
+      continue;
+
+    struct fcp_device *device = &devices[i].device;
+    uint64_t start = stats_time_us();
+
+    err = fcp_socket_init(device);
+    startup_phase_end(device, STARTUP_SOCKET, &start);
+    if (err == 0)
+      err = start_device(&devices[i]);
+    if (err < 0) {
+      if (device_count == 1)
+        return 1;
+      log_error("Cannot serve card %d", device->card_num);
+      fcp_socket_cleanup(device);
+      event_remove(devices[i].ctl_source);
+      event_remove(devices[i].hwdep_source);
+      continue;
+    }
+
+    startup_report(device);
+  }
+
+  if (!active_devices)
+    return 1;
+
+  log_info("fcp-server %s ready (%d card%s)",
+           VERSION, active_devices, active_devices == 1 ? "" : "s");
 
-  log_info("fcp-server %s ready", VERSION);
+  // The controls and sockets all exist now, so systemd can start
+  // the units which depend on them
+  notify_status(true);
 
-  // Run main event loop
-  err = run(&device);
+  // Run main event loop; each module registers its own sources
+  err = event_loop_run();
 
   // Cleanup handled by OS
   return err < 0 ? 1 : 0;
@@ -10,9 +10,132 @@
 
 #include "uapi-fcp.h"
 #include "fcp.h"
+#include "fcp-io.h"
 #include "meter.h"
+#include "event-loop.h"
 #include "log.h"
 
+// Meter stream state, one per device; the buffers are allocated
+// once when the meter map is set up so that each tick only does the
+// FCP read
+struct meter_stream {
+  struct fcp_device   *device;
+  int                  num_slots;
+  int                  map_size;
+  int16_t             *map;
+  int                 *raw;     // Values of all the device slots
+  uint32_t            *levels;  // Mapped values
+  struct event_source *timer;
+  int                  interval_ms;
+  uint32_t             seq;
+  meter_publish_func   publish;
+  bool                 reading;  // On the I/O thread, into raw
+};
+
+static int read_meters(void *data) {
+  struct meter_stream *stream = data;
+
+  return fcp_meter_read(stream->device->hwdep, stream->num_slots, stream->raw);
+}
+
+static void publish_levels(void *data, int result) {
+  struct meter_stream *stream = data;
+
+  stream->reading = false;
+  if (result < 0)
+    return;
+
+  for (int i = 0; i < stream->map_size; i++)
+    stream->levels[i] = stream->raw[stream->map[i]];
+
+  stream->publish(
+    stream->device, stream->levels, stream->map_size, stream->seq++
+  );
+}
+
+static void handle_meter_timer(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct meter_stream *stream = data;
+
+  // Ticks are skipped while the last read is still waiting behind
+  // higher priority commands
+  if (stream->reading)
+    return;
+
+  if (fcp_io_submit(
+        stream->device, FCP_IO_METER, read_meters, publish_levels, stream
+      ) == 0) {
+    stream->reading = true;
+    return;
+  }
+
+  publish_levels(stream, read_meters(stream));
+}
+
+int meter_stream_set_interval(
+  struct fcp_device  *device,
+  int                 interval_ms,
+  meter_publish_func  publish
+) {
+  struct meter_stream *stream = device->meter_stream;
+
+  if (!stream)
+    return -1;
+
+  if (!stream->timer) {
+    stream->timer = event_add_timer(handle_meter_timer, stream);
+    if (!stream->timer)
+      return -1;
+  }
+
+  if (interval_ms != stream->interval_ms)
+    log_debug("Meter stream interval %dms", interval_ms);
+
+  stream->publish = publish;
+  stream->interval_ms = interval_ms;
+
+  return event_timer_arm(stream->timer, interval_ms, interval_ms);
+}
+
+// Keep the meter map for the device's stream
+static void set_stream_map(
+  struct fcp_device *device,
+  int                num_slots,
+  const int16_t     *map,
+  int                map_size
+) {
+  struct meter_stream *stream = device->meter_stream;
+
+  if (!stream) {
+    stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+      log_error("Cannot allocate meter stream");
+      exit(1);
+    }
+    stream->device = device;
+    device->meter_stream = stream;
+  }
+
+  free(stream->map);
+  free(stream->raw);
+  free(stream->levels);
+
+  stream->num_slots = num_slots;
+  stream->map_size = map_size;
+  stream->map = malloc(map_size * sizeof(*stream->map));
+  stream->raw = calloc(num_slots, sizeof(*stream->raw));
+  stream->levels = calloc(map_size, sizeof(*stream->levels));
+  if (!stream->map || !stream->raw || !stream->levels) {
+    log_error("Cannot allocate meter stream buffers");
+    exit(1);
+  }
+
+  memcpy(stream->map, map, map_size * sizeof(*stream->map));
+}
+
 static int add_meter_mapping_info(struct fcp_device *device, int map_size, char **labels) {
   struct fcp_meter_labels *fcp_labels;
 
@@ -216,6 +339,8 @@ void add_meter_control(struct fcp_device *device) {
   if (err < 0)
     log_error("Cannot set meter map: %s", snd_strerror(err));
 
+  set_stream_map(device, num_meter_slots, meter_map, meter_idx);
+
   /* Add mapping info control */
   err = add_meter_mapping_info(device, meter_idx, labels);
   if (err < 0)
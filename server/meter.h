@@ -6,3 +6,23 @@
 #include "device.h"
 
 void add_meter_control(struct fcp_device *device);
+
+/* Levels are published in meter map order (as in the ALSA meter
+ * control), with a sequence number which counts timer ticks
+ */
+typedef void (*meter_publish_func)(
+  struct fcp_device *device,
+  const uint32_t    *levels,
+  int                count,
+  uint32_t           seq
+);
+
+/* Read all the meters every interval_ms and pass them to publish;
+ * an interval of 0 stops the stream
+ * Returns 0 on success, -1 if the device has no meters
+ */
+int meter_stream_set_interval(
+  struct fcp_device  *device,
+  int                 interval_ms,
+  meter_publish_func  publish
+);
@@ -3,23 +3,45 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <endian.h>
 #include <alsa/asoundlib.h>
-#include <alsa/sound/tlv.h>
 #include <json-c/json.h>
 
 #include "mix.h"
 #include "fcp-devmap.h"
 #include "device-ops.h"
+#include "event-loop.h"
+#include "tlv.h"
 #include "log.h"
 
-void invalidate_mix_cache(struct fcp_device *device) {
+static void invalidate_mix_row(struct fcp_device *device, int mix_output) {
   struct mix_cache_entry *cache = device->mix_cache;
 
-  if (!cache)
+  if (!cache || mix_output < 0 || mix_output >= device->mix_output_count)
+    return;
+
+  // Values not yet written are newer than the device's
+  if (cache[mix_output].pending)
     return;
 
+  cache[mix_output].dirty = true;
+}
+
+void invalidate_mix_cache(struct fcp_device *device) {
   for (int i = 0; i < device->mix_output_count; i++)
-    cache[i].dirty = true;
+    invalidate_mix_row(device, i);
+}
+
+void mix_handle_notification(
+  struct fcp_device *device,
+  uint32_t           notification
+) {
+  if (!(notification & device->mix_notify_mask))
+    return;
+
+  // The notification doesn't say which row changed; rows are only
+  // re-read when one of their controls is next read
+  invalidate_mix_cache(device);
 }
 
 static void init_mix_cache(struct fcp_device *device) {
@@ -41,9 +63,17 @@ static void init_mix_cache(struct fcp_device *device) {
       log_error("Cannot allocate memory for mix cache values");
       exit(1);
     }
+    cache[i].control = -1;
   }
 
   invalidate_mix_cache(device);
+
+  // Notifications which indicate that the mix has changed
+  device->mix_notify_mask = fcp_devmap_notify_mask(device, "MIX");
+
+  const char *debounce = getenv("FCP_MIX_DEBOUNCE_MS");
+  if (debounce)
+    device->mix_debounce_ms = atoi(debounce);
 }
 
 void free_mix_cache(struct fcp_device *device) {
@@ -57,10 +87,12 @@ void free_mix_cache(struct fcp_device *device) {
 
   free(cache);
   device->mix_cache = NULL;
+
+  event_remove(device->mix_flush_timer);
+  device->mix_flush_timer = NULL;
 }
 
-/* Get cached mix values, reading from the device first if necessary */
-static int get_cached_mix_values(
+int get_cached_mix_values(
   struct fcp_device  *device,
   int                 mix_output,
   int               **values
@@ -108,6 +140,85 @@ static int read_mix_control(
   return 0;
 }
 
+int flush_mix_cache(struct fcp_device *device) {
+  struct mix_cache_entry *cache = device->mix_cache;
+  int ret = 0;
+
+  if (!cache)
+    return 0;
+
+  device->mix_flush_scheduled = false;
+
+  for (int i = 0; i < device->mix_output_count; i++) {
+    if (!cache[i].pending)
+      continue;
+
+    cache[i].pending = false;
+
+    int err = fcp_mix_write(
+      device->hwdep, i, device->mix_input_count, cache[i].values
+    );
+    if (err < 0) {
+      log_error(
+        "Failed to write mix for output %d: %s",
+        i,
+        snd_strerror(err)
+      );
+
+      // Re-read the row next time
+      cache[i].dirty = true;
+      ret = err;
+    }
+  }
+
+  return ret;
+}
+
+static void mix_flush_timer_cb(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  flush_mix_cache(data);
+}
+
+static bool mix_flush_pending(struct fcp_device *device) {
+  for (int i = 0; i < device->mix_output_count; i++)
+    if (device->mix_cache[i].pending)
+      return true;
+  return false;
+}
+
+int schedule_mix_flush(struct fcp_device *device) {
+  if (!device->mix_cache || !mix_flush_pending(device))
+    return 0;
+
+  if (device->mix_debounce_ms <= 0)
+    return flush_mix_cache(device);
+
+  // Already due to be written; the timer is not restarted so that a
+  // continuous sweep is still written every mix_debounce_ms
+  if (device->mix_flush_scheduled)
+    return 0;
+
+  if (!device->mix_flush_timer) {
+    device->mix_flush_timer = event_add_timer(mix_flush_timer_cb, device);
+    if (!device->mix_flush_timer)
+      return flush_mix_cache(device);
+  }
+
+  // Writes within the delay are combined into one write per row
+  int err = event_timer_arm(device->mix_flush_timer, device->mix_debounce_ms, 0);
+  if (err < 0)
+    return flush_mix_cache(device);
+
+  device->mix_flush_scheduled = true;
+  return 0;
+}
+
+/* Update the cached row; it is written once at the end of the
+ * batch, or after the debounce delay
+ */
 static int write_mix_control(
   struct fcp_device    *device,
   struct control_props *props,
@@ -127,23 +238,131 @@ static int write_mix_control(
     return err;
   }
 
+  if (values[mix_input] == value)
+    return 0;
+
   values[mix_input] = value;
+  device->mix_cache[mix_output].pending = true;
 
-  err = fcp_mix_write(
-    device->hwdep, mix_output, device->mix_input_count, values
-  );
+  if (!device->batch_depth)
+    err = schedule_mix_flush(device);
+
+  // The row control reads from the cache; during a batch, it's
+  // updated once at the end rather than for every cell
+  int control = device->mix_cache[mix_output].control;
+  if (err < 0 || control < 0)
+    return err;
+
+  if (device->batch_depth)
+    device->mix_cache[mix_output].refresh = true;
+  else
+    device_refresh_controls(device, &control, 1);
+
+  return err;
+}
+
+void refresh_mix_row_controls(struct fcp_device *device) {
+  struct mix_cache_entry *cache = device->mix_cache;
+
+  if (!cache)
+    return;
+
+  int indices[device->mix_output_count];
+  int count = 0;
+
+  for (int i = 0; i < device->mix_output_count; i++) {
+    if (!cache[i].refresh)
+      continue;
+
+    cache[i].refresh = false;
+    if (cache[i].control >= 0)
+      indices[count++] = cache[i].control;
+  }
+
+  if (count)
+    device_refresh_controls(device, indices, count);
+}
+
+/* The whole row of a mix output, as the little-endian uint16_t gain
+ * of each mix input (as sent by fcp_mix_read())
+ */
+static int read_mix_row_control(
+  struct fcp_device    *device,
+  struct control_props *props,
+  void                 *buf,
+  size_t                size
+) {
+  int mix_output = props->offset / device->mix_input_count;
+
+  int *values;
+  int err = get_cached_mix_values(device, mix_output, &values);
   if (err < 0) {
     log_error(
-      "Failed to write mix for output %d: %s",
+      "Failed to read mix for output %d: %s",
       mix_output,
       snd_strerror(err)
     );
+    return err;
   }
 
-  return err;
+  uint16_t *p = buf;
+  for (int i = 0; i < device->mix_input_count; i++)
+    p[i] = htole16(values[i]);
+
+  return 0;
 }
 
-static const SNDRV_CTL_TLVD_DECLARE_DB_LINEAR(mix_tlv, SNDRV_CTL_TLVD_DB_GAIN_MUTE, 1200);
+/* Replace the cached row, as write_mix_control() does one value,
+ * then update the row's per-input controls
+ */
+static int write_mix_row_control(
+  struct fcp_device    *device,
+  struct control_props *props,
+  const void           *buf,
+  size_t                size
+) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int mix_output = props->offset / device->mix_input_count;
+  struct mix_cache_entry *entry = &device->mix_cache[mix_output];
+  const uint16_t *p = buf;
+
+  for (int i = 0; i < device->mix_input_count; i++)
+    if (le16toh(p[i]) > FCP_MIX_GAIN_MAX) {
+      log_error("Invalid mix value %d for %s", le16toh(p[i]), props->name);
+      return -EINVAL;
+    }
+
+  // Every value is replaced, so a stale row needn't be read first
+  for (int i = 0; i < device->mix_input_count; i++) {
+    int value = le16toh(p[i]);
+
+    if (!entry->dirty && entry->values[i] == value)
+      continue;
+
+    entry->values[i] = value;
+    entry->pending = true;
+  }
+  entry->dirty = false;
+
+  int err = device->batch_depth ? 0 : schedule_mix_flush(device);
+
+  int indices[device->mix_input_count + 1];
+  int count = 0;
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++) {
+    struct control_props *cell = &ctrl_mgr->controls[i];
+
+    if (cell->category == CATEGORY_MIX &&
+        cell->type != SND_CTL_ELEM_TYPE_BYTES &&
+        cell->offset / device->mix_input_count == mix_output &&
+        count < device->mix_input_count)
+      indices[count++] = i;
+  }
+
+  device_refresh_controls(device, indices, count);
+
+  return err;
+}
 
 static struct json_object *find_destination_by_name(
   struct json_object *destinations,
@@ -289,14 +508,14 @@ void add_mix_controls(struct fcp_device *device) {
       );
 
       struct control_props props = {
-        .name          = strdup(control_name),
+        .name          = control_name,
         .interface     = SND_CTL_ELEM_IFACE_MIXER,
         .type          = SND_CTL_ELEM_TYPE_INTEGER,
         .category      = CATEGORY_MIX,
         .min           = 0,
-        .max           = 32613,
+        .max           = FCP_MIX_GAIN_MAX,
         .step          = 1,
-        .tlv           = mix_tlv,
+        .tlv           = tlv_mix_gain,
         .read_only     = 0,
         .notify_client = 0,
         .notify_device = 0,
@@ -310,6 +529,27 @@ void add_mix_controls(struct fcp_device *device) {
       if (err < 0)
         return;
     }
+
+    /* And one for the whole row, to read or write in one go */
+    char control_name[64];
+    snprintf(control_name, sizeof(control_name), "Mix %c Gains", 'A' + i);
+
+    struct control_props props = {
+      .name             = control_name,
+      .interface        = SND_CTL_ELEM_IFACE_MIXER,
+      .type             = SND_CTL_ELEM_TYPE_BYTES,
+      .category         = CATEGORY_MIX,
+      .size             = num_inputs * sizeof(uint16_t),
+      .offset           = i * num_inputs,
+      .read_bytes_func  = read_mix_row_control,
+      .write_bytes_func = write_mix_row_control
+    };
+
+    int index = device->ctrl_mgr.num_controls;
+
+    if (add_control(device, &props) < 0)
+      return;
+    device->mix_cache[i].control = index;
   }
 }
 
@@ -15,14 +15,52 @@
         ((FCP_MIXER_MAX_DB - FCP_MIXER_MIN_DB) * 2)
 #define FCP_MIXER_VALUE_COUNT (FCP_MIXER_MAX_VALUE + 1)
 
+/* Mix values are linear gains; 8192 is 0dB and this is +12dB */
+#define FCP_MIX_GAIN_MAX 32613
+
 struct fcp_device;
 
-/* Array of interface values (not ALSA dB values) for one mix output */
+/* Array of interface values (not ALSA dB values) for one mix output
+ *
+ * dirty: values need reading from the device
+ * pending: values have been changed but not yet written
+ * control: index of the row's BYTES control, or -1
+ * refresh: the row control needs updating at the end of the batch
+ */
 struct mix_cache_entry {
   int  *values;
   bool  dirty;
+  bool  pending;
+  int   control;
+  bool  refresh;
 };
 
 void free_mix_cache(struct fcp_device *device);
+
+/* Mark every row without unwritten changes as needing to be re-read */
 void invalidate_mix_cache(struct fcp_device *device);
+
+/* Invalidate the mix if a notification says it changed; the
+ * notification doesn't say which rows, so that's all of them
+ */
+void mix_handle_notification(struct fcp_device *device, uint32_t notification);
+
+/* Get cached mix values, reading from the device first if necessary */
+int get_cached_mix_values(
+  struct fcp_device  *device,
+  int                 mix_output,
+  int               **values
+);
+
+/* Write each row with pending changes to the device */
+int flush_mix_cache(struct fcp_device *device);
+
+/* Flush pending rows now, or after the debounce delay
+ * (FCP_MIX_DEBOUNCE_MS) if one is configured
+ */
+int schedule_mix_flush(struct fcp_device *device);
+
+/* Update the row controls of the rows changed during the batch */
+void refresh_mix_row_controls(struct fcp_device *device);
+
 void add_mix_controls(struct fcp_device *device);
@@ -5,21 +5,46 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <endian.h>
 #include <alsa/asoundlib.h>
 #include <json-c/json.h>
 
 #include "device-ops.h"
 #include "mix.h"
 #include "fcp-devmap.h"
+#include "strpool.h"
 #include "log.h"
 
+static void invalidate_mux_rate(struct fcp_device *device, int rate) {
+  struct mux_cache *cache = device->mux_cache;
+
+  if (!cache || rate < 0 || rate >= 3)
+    return;
+
+  // Changes not yet written are newer than the device's
+  if (cache->rate_changed[rate])
+    return;
+
+  cache->dirty[rate] = true;
+}
+
 void invalidate_mux_cache(struct fcp_device *device) {
+  for (int rate = 0; rate < 3; rate++)
+    invalidate_mux_rate(device, rate);
+}
+
+void mux_handle_notification(
+  struct fcp_device *device,
+  uint32_t           notification
+) {
   struct mux_cache *cache = device->mux_cache;
 
-  if (!cache)
+  if (!cache || !(notification & cache->notify_mask))
     return;
 
-  cache->dirty = true;
+  // Tables are only re-read when next needed; the controls only read
+  // the base rate table
+  invalidate_mux_cache(device);
 }
 
 static void add_input_name(
@@ -45,8 +70,15 @@ static void add_input_name(
     exit(1);
   }
 
-  cache->input_names[cache->input_count] = name;
+  cache->input_names[cache->input_count] = strpool_intern(name);
   cache->input_router_pin[cache->input_count] = router_pin;
+
+  // The first input with a pin is the one it reads back as; pin 0
+  // always reads back as Off
+  if (router_pin > 0 && router_pin < MUX_ROUTER_PINS &&
+      !cache->pin_to_input[router_pin])
+    cache->pin_to_input[router_pin] = cache->input_count;
+
   cache->input_count++;
 }
 
@@ -72,10 +104,25 @@ static void init_mux_cache(struct fcp_device *device) {
       cache->mux_size[i],
       sizeof(uint32_t)
     );
+    cache->slot_changed[i] = calloc(cache->mux_size[i], 1);
+    if (!cache->values[i] || !cache->slot_changed[i]) {
+      log_error("Cannot allocate memory for mux cache values");
+      exit(1);
+    }
   }
 
+  cache->pin_to_input = calloc(MUX_ROUTER_PINS, sizeof(int16_t));
+  if (!cache->pin_to_input) {
+    log_error("Cannot allocate memory for mux pin lookup");
+    exit(1);
+  }
+  cache->routing_control = -1;
+
   invalidate_mux_cache(device);
 
+  cache->notify_mask = fcp_devmap_notify_mask(device, "ROUT") |
+                       fcp_devmap_notify_mask(device, "MUX");
+
   add_input_name(cache, "Off", 0);
 
   /* List of sources in the control config */
@@ -154,16 +201,18 @@ void free_mux_cache(struct fcp_device *device) {
   if (!cache)
     return;
 
-  for (int i = 0; i < 3; i++)
+  for (int i = 0; i < 3; i++) {
     free(cache->values[i]);
+    free(cache->slot_changed[i]);
+  }
 
+  free(cache->pin_to_input);
   free(cache);
 
   device->mux_cache = NULL;
 }
 
-/* Get cached mux values, reading from the device first if necessary */
-static int get_cached_mux_values(
+int get_cached_mux_values(
   struct fcp_device  *device,
   int                 mux_num,
   uint32_t          **values
@@ -173,15 +222,13 @@ static int get_cached_mux_values(
   if (!cache)
     return -EINVAL;
 
-  if (cache->dirty) {
-    for (int i = 0; i < 3; i++) {
-      int err = fcp_mux_read(
-        device->hwdep, i, cache->mux_size[i], cache->values[i]
-      );
-      if (err < 0)
-        return err;
-    }
-    cache->dirty = false;
+  if (cache->dirty[mux_num]) {
+    int err = fcp_mux_read(
+      device->hwdep, mux_num, cache->mux_size[mux_num], cache->values[mux_num]
+    );
+    if (err < 0)
+      return err;
+    cache->dirty[mux_num] = false;
   }
 
   *values = cache->values[mux_num];
@@ -191,14 +238,27 @@ static int get_cached_mux_values(
 static int router_pin_to_input(
   struct fcp_device *device,
   int                router_pin
+) {
+  if (router_pin < 0 || router_pin >= MUX_ROUTER_PINS)
+    return 0;
+
+  return device->mux_cache->pin_to_input[router_pin];
+}
+
+/* Input index of an output, from the base rate table */
+static int output_input(
+  struct fcp_device *device,
+  const uint32_t    *values,
+  int                output
 ) {
   struct mux_cache *cache = device->mux_cache;
 
-  for (int i = 0; i < cache->input_count; i++)
-    if (cache->input_router_pin[i] == router_pin)
-      return i;
+  if (cache->output_fixed_input[output] >= 0)
+    return cache->output_fixed_input[output];
 
-  return 0;
+  return router_pin_to_input(
+    device, values[cache->output_router_slots[output * 3]] >> 12
+  );
 }
 
 static int read_mux_control(
@@ -206,8 +266,24 @@ static int read_mux_control(
   struct control_props *props,
   int                  *value
 ) {
+  uint32_t *values;
+  int err = get_cached_mux_values(device, 0, &values);
+  if (err < 0) {
+    log_error("Failed to read mux 0: %s", snd_strerror(err));
+    return err;
+  }
+
+  *value = output_input(device, values, props->offset);
+
+  return 0;
+}
+
+int mux_read_routing(struct fcp_device *device, uint16_t *inputs) {
   struct mux_cache *cache = device->mux_cache;
 
+  if (!cache)
+    return -EINVAL;
+
   uint32_t *values;
   int err = get_cached_mux_values(device, 0, &values);
   if (err < 0) {
@@ -215,55 +291,210 @@ static int read_mux_control(
     return err;
   }
 
-  if (cache->output_fixed_input[props->offset] >= 0) {
-    *value = cache->output_fixed_input[props->offset];
+  for (int i = 0; i < cache->output_count; i++)
+    inputs[i] = output_input(device, values, i);
+
+  return 0;
+}
+
+int flush_mux_cache(struct fcp_device *device) {
+  struct mux_cache *cache = device->mux_cache;
+  int ret = 0;
+
+  if (!cache)
     return 0;
+
+  for (int rate = 0; rate < 3; rate++) {
+    if (!cache->rate_changed[rate])
+      continue;
+
+    int changed = 0;
+    for (int i = 0; i < cache->mux_size[rate]; i++)
+      changed += cache->slot_changed[rate][i];
+
+    log_debug("Writing mux %d (%d slots changed)", rate, changed);
+
+    memset(cache->slot_changed[rate], 0, cache->mux_size[rate]);
+    cache->rate_changed[rate] = false;
+
+    int err = fcp_mux_write(
+      device->hwdep, rate, cache->mux_size[rate], cache->values[rate]
+    );
+    if (err < 0) {
+      log_error("Failed to write mux %d: %s", rate, snd_strerror(err));
+
+      // The device's table is now unknown, so re-read it next time
+      cache->dirty[rate] = true;
+      ret = err;
+    }
   }
 
-  int router_pin = values[cache->output_router_slots[props->offset * 3]] >> 12;
-  int input = router_pin_to_input(device, router_pin);
+  return ret;
+}
 
-  *value = input;
+/* Update the router slots for the output in each rate's table; they
+ * are written by flush_mux_cache()
+ */
+static int set_output_input(
+  struct fcp_device *device,
+  int                output,
+  int                input
+) {
+  struct mux_cache *cache = device->mux_cache;
+  int router_pin = cache->input_router_pin[input];
+
+  for (int rate = 0; rate < 3; rate++) {
+    int slot_num = cache->output_router_slots[output * 3 + rate];
+
+    // Output not available at this rate
+    if (slot_num < 0)
+      continue;
+
+    // Make sure the table is current before changing it
+    uint32_t *values;
+    int err = get_cached_mux_values(device, rate, &values);
+    if (err < 0) {
+      log_error("Failed to read mux %d: %s", rate, snd_strerror(err));
+      return err;
+    }
+
+    uint32_t new_value = (values[slot_num] & 0xFFF) | (router_pin << 12);
+
+    if (values[slot_num] == new_value)
+      continue;
+
+    values[slot_num] = new_value;
+    cache->slot_changed[rate][slot_num] = 1;
+    cache->rate_changed[rate] = true;
+  }
 
   return 0;
 }
 
+/* The changed tables are written immediately, or at the end of the
+ * batch if one is in progress
+ */
 static int write_mux_control(
   struct fcp_device    *device,
   struct control_props *props,
   int                   value
 ) {
   struct mux_cache *cache = device->mux_cache;
-  int router_pin = cache->input_router_pin[value];
 
-  for (int rate = 0; rate < 3; rate++) {
-    if (cache->output_fixed_input[props->offset] >= 0) {
-      log_error("Cannot write to fixed input %s", props->name);
-      return -EINVAL;
-    }
+  if (value < 0 || value >= cache->input_count) {
+    log_error("Invalid input %d for %s", value, props->name);
+    return -EINVAL;
+  }
+
+  if (cache->output_fixed_input[props->offset] >= 0) {
+    log_error("Cannot write to fixed input %s", props->name);
+    return -EINVAL;
+  }
+
+  if (cache->output_router_slots[props->offset * 3] < 0) {
+    log_error("Missing router slot for %s", props->name);
+    return -EINVAL;
+  }
+
+  int err = set_output_input(device, props->offset, value);
+  if (err < 0)
+    return err;
+
+  if (!device->batch_depth)
+    err = flush_mux_cache(device);
 
-    int slot_num = cache->output_router_slots[props->offset * 3 + rate];
+  // The routing control reads from the cache, so it can be updated
+  // straight away
+  if (err >= 0 && cache->routing_control >= 0)
+    device_refresh_controls(device, &cache->routing_control, 1);
 
-    if (slot_num < 0 && rate == 0) {
-      log_error("Missing router slot for %s", props->name);
+  return err;
+}
+
+int mux_write_routing(struct fcp_device *device, const uint16_t *inputs) {
+  struct mux_cache *cache = device->mux_cache;
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+
+  if (!cache)
+    return -EINVAL;
+
+  for (int i = 0; i < cache->output_count; i++) {
+    int fixed = cache->output_fixed_input[i];
+
+    if (inputs[i] >= cache->input_count ||
+        (fixed >= 0 && inputs[i] != fixed)) {
+      log_error("Invalid input %d for mux output %d", inputs[i], i);
       return -EINVAL;
     }
+  }
 
-    uint32_t *values = cache->values[rate];
-    values[slot_num] = (values[slot_num] & 0xFFF) | (router_pin << 12);
+  for (int i = 0; i < cache->output_count; i++) {
+    if (cache->output_fixed_input[i] >= 0)
+      continue;
 
-    int err = fcp_mux_write(
-      device->hwdep, rate, cache->mux_size[rate], values
-    );
-    if (err < 0) {
-      log_error("Failed to write mux %d: %s", rate, snd_strerror(err));
+    int err = set_output_input(device, i, inputs[i]);
+    if (err < 0)
       return err;
-    }
   }
 
+  int err = device->batch_depth ? 0 : flush_mux_cache(device);
+
+  // All the mux controls read from the cache, which already has the
+  // new values
+  int *indices = malloc(sizeof(int) * (ctrl_mgr->num_controls + 1));
+  int count = 0;
+
+  if (!indices) {
+    log_error("Cannot allocate memory for mux controls");
+    exit(1);
+  }
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++)
+    if (ctrl_mgr->controls[i].category == CATEGORY_MUX)
+      indices[count++] = i;
+
+  device_refresh_controls(device, indices, count);
+  free(indices);
+
+  return err;
+}
+
+static int read_routing_control(
+  struct fcp_device    *device,
+  struct control_props *props,
+  void                 *buf,
+  size_t                size
+) {
+  struct mux_cache *cache = device->mux_cache;
+  uint16_t inputs[cache->output_count + 1];
+
+  int err = mux_read_routing(device, inputs);
+  if (err < 0)
+    return err;
+
+  uint16_t *p = buf;
+  for (int i = 0; i < cache->output_count; i++)
+    p[i] = htole16(inputs[i]);
+
   return 0;
 }
 
+static int write_routing_control(
+  struct fcp_device    *device,
+  struct control_props *props,
+  const void           *buf,
+  size_t                size
+) {
+  struct mux_cache *cache = device->mux_cache;
+  uint16_t inputs[cache->output_count + 1];
+  const uint16_t *p = buf;
+
+  for (int i = 0; i < cache->output_count; i++)
+    inputs[i] = le16toh(p[i]);
+
+  return mux_write_routing(device, inputs);
+}
+
 static struct json_object *get_source_by_name(
   struct json_object *sources,
   const char         *name
@@ -326,10 +557,10 @@ void add_mux_controls(struct fcp_device *device) {
     .interface     = SND_CTL_ELEM_IFACE_MIXER,
     .category      = CATEGORY_MUX,
     .enum_count    = cache->input_count,
-    .enum_names    = (char **)cache->input_names,
+    .enum_names    = cache->input_names,
     .step          = 1,
     .read_only     = 0,
-    .notify_client = 0, /* TODO */
+    .notify_client = cache->notify_mask,
     .read_func     = read_mux_control,
     .write_func    = write_mux_control
   };
@@ -517,4 +748,26 @@ void add_mux_controls(struct fcp_device *device) {
       free(control_name);
     }
   }
+
+  /* The whole routing, as each output's input index (little-endian
+   * uint16_t), for reading or writing in one go
+   */
+  struct control_props routing_props = {
+    .name             = "Mux Routing",
+    .type             = SND_CTL_ELEM_TYPE_BYTES,
+    .interface        = SND_CTL_ELEM_IFACE_MIXER,
+    .category         = CATEGORY_MUX,
+    .size             = cache->output_count * sizeof(uint16_t),
+    .notify_client    = cache->notify_mask,
+    .read_bytes_func  = read_routing_control,
+    .write_bytes_func = write_routing_control
+  };
+
+  if (!cache->output_count)
+    return;
+
+  int index = device->ctrl_mgr.num_controls;
+
+  if (add_control(device, &routing_props) >= 0)
+    cache->routing_control = index;
 }
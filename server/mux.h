@@ -7,6 +7,9 @@
 #include "device.h"
 #include "fcp.h"
 
+/* Router pins are the low 12 bits of a mux value */
+#define MUX_ROUTER_PINS 0x1000
+
 /* Mux cache, one table per rate
  * 0 = 44.1/48kHz, 1 = 88.2/96kHz, 2 = 176.4/192kHz
  */
@@ -20,6 +23,11 @@ struct mux_cache {
   const char **input_names;
   uint16_t    *input_router_pin;
 
+  /* Input index of each router pin (MUX_ROUTER_PINS entries); 0
+   * (Off) for pins which aren't an input
+   */
+  int16_t *pin_to_input;
+
   /* Number of outputs */
   int output_count;
 
@@ -36,11 +44,55 @@ struct mux_cache {
    */
   int *output_fixed_input;
 
-  bool dirty;
+  /* Tables which need to be re-read from the device */
+  bool dirty[3];
+
+  /* Notifications which indicate that the routing has changed */
+  uint32_t notify_mask;
+
+  /* Slots changed since each rate's table was last written, and
+   * whether the table has any changed slots
+   */
+  uint8_t *slot_changed[3];
+  bool     rate_changed[3];
+
+  /* Index of the "Mux Routing" control, or -1 if there isn't one */
+  int routing_control;
 };
 
 struct fcp_device;
 
 void free_mux_cache(struct fcp_device *device);
+
+/* Mark every table without unwritten changes as needing to be
+ * re-read
+ */
 void invalidate_mux_cache(struct fcp_device *device);
+
+/* Invalidate the routing if a notification says it changed; the
+ * notification doesn't say which rate, so that's all the tables
+ */
+void mux_handle_notification(struct fcp_device *device, uint32_t notification);
+
+/* Get cached mux values, reading from the device first if necessary */
+int get_cached_mux_values(
+  struct fcp_device  *device,
+  int                 mux_num,
+  uint32_t          **values
+);
+
+/* Write the tables of any rates with changed slots */
+int flush_mux_cache(struct fcp_device *device);
+
+/* Get the input index of every output (output_count entries) from
+ * one read of the base rate table
+ */
+int mux_read_routing(struct fcp_device *device, uint16_t *inputs);
+
+/* Route every output to the input index given for it, writing each
+ * changed rate's table once; fixed outputs must be given their
+ * fixed input. The mux controls are then updated.
+ */
+int mux_write_routing(struct fcp_device *device, const uint16_t *inputs);
+
 void add_mux_controls(struct fcp_device *device);
@@ -5,12 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
-#include <alsa/sound/tlv.h>
 #include <json-c/json.h>
 
 #include "output-controls.h"
 #include "control-utils.h"
 #include "device-ops.h"
+#include "tlv.h"
 #include "log.h"
 
 /* Special handling for volume controls as we don't always get a
@@ -40,8 +40,13 @@ int write_data_control_vol(struct fcp_device *device, struct control_props *prop
     }
   }
 
-  /* Re-read from the device */
-  device_handle_notification(device, props->notify_client);
+  /* Re-read from the device, once the writes have been sent if
+   * they're being held back
+   */
+  if (device->batch_depth)
+    device->batch_notification |= props->notify_client;
+  else
+    device_handle_notification(device, props->notify_client);
 
   return 0;
 }
@@ -88,7 +93,7 @@ static int create_output_control(
 
   /* Create the control */
   struct control_props props = {
-    .name          = strdup(control_name),
+    .name          = control_name,
     .array_index   = array_index,
     .interface     = SND_CTL_ELEM_IFACE_MIXER,
     .category      = CATEGORY_DATA,
@@ -141,12 +146,10 @@ static int create_output_control(
     if (json_object_object_get_ex(control_config, "db-min", &db_min) &&
         json_object_object_get_ex(control_config, "db-max", &db_max)) {
 
-      unsigned int *tlv = calloc(4, sizeof(unsigned int));
-      tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
-      tlv[1] = 2 * sizeof(unsigned int);
-      tlv[2] = json_object_get_int(db_min) * 100;
-      tlv[3] = json_object_get_int(db_max) * 100;
-      props.tlv = tlv;
+      props.tlv = tlv_db_minmax(
+        json_object_get_int(db_min),
+        json_object_get_int(db_max)
+      );
     }
 
   } else if (!strcmp(type_str, "enum")) {
@@ -172,16 +175,10 @@ static int create_output_control(
       return -1;
     }
 
+    // add_control() keeps interned copies
     for (int i = 0; i < num_values; i++) {
       struct json_object *value = json_object_array_get_idx(values, i);
-      props.enum_names[i] = strdup(json_object_get_string(value));
-      if (!props.enum_names[i]) {
-        log_error("Cannot allocate memory for enum name");
-        for (int j = 0; j < i; j++)
-          free(props.enum_names[j]);
-        free(props.enum_names);
-        return -1;
-      }
+      props.enum_names[i] = json_object_get_string(value);
     }
 
   } else {
@@ -189,7 +186,10 @@ static int create_output_control(
     return -1;
   }
 
-  return add_control(device, &props);
+  int err = add_control(device, &props);
+  free(props.enum_names);
+
+  return err;
 }
 
 static int create_output_controls(
@@ -266,12 +266,14 @@ static int create_output_controls(
   return 0;
 }
 
-/* Build source enum list from output-group-sources in ALSA map */
+/* Build source enum list from output-group-sources in ALSA map;
+ * the values are shared by all the controls which use the list
+ */
 static int build_source_enum(
-  struct fcp_device  *device,
-  char             ***enum_names,
-  int               **enum_values,
-  int                *enum_count
+  struct fcp_device   *device,
+  const char        ***enum_names,
+  int                **enum_values,
+  int                 *enum_count
 ) {
   struct json_object *sources_array;
 
@@ -310,7 +312,7 @@ static int build_source_enum(
     if (entry && json_object_get_type(entry) == json_type_string) {
       const char *name = json_object_get_string(entry);
       if (name && name[0] != '\0') {
-        (*enum_names)[enum_idx] = strdup(name);
+        (*enum_names)[enum_idx] = name;
         (*enum_values)[enum_idx] = i;
         enum_idx++;
       }
@@ -320,14 +322,6 @@ static int build_source_enum(
   return 0;
 }
 
-static void free_source_enum(char **enum_names, int *enum_values, int enum_count) {
-  if (enum_names) {
-    for (int i = 0; i < enum_count; i++)
-      free(enum_names[i]);
-    free(enum_names);
-  }
-  free(enum_values);
-}
 
 /* Create output group controls (map, sources, trims) */
 static int create_output_group_controls(
@@ -335,7 +329,7 @@ static int create_output_group_controls(
   struct json_object *output_controls,
   struct json_object *enums
 ) {
-  char **source_enum_names = NULL;
+  const char **source_enum_names = NULL;
   int *source_enum_values = NULL;
   int source_enum_count = 0;
   int err;
@@ -367,15 +361,9 @@ static int create_output_group_controls(
     const char *type_str = json_object_get_string(type_obj);
 
     /* Find the member using dot notation */
-    struct json_object *member;
-    const char *member_type;
-    int offset;
-    int notify_device, notify_client;
+    struct devmap_member member;
 
-    err = find_member_by_path_with_notify(
-      device, control_path, &member, &member_type, &offset,
-      &notify_device, &notify_client, true
-    );
+    err = find_member_by_path(device, control_path, &member, true);
     if (err < 0) {
       log_debug("Output group member %s not found, skipping", control_path);
       continue;
@@ -397,10 +385,10 @@ static int create_output_group_controls(
         .step          = 1,
         .read_only     = 0,
         .value         = 0,
-        .offset        = offset,
-        .data_type     = devmap_type_to_data_type(member_type),
-        .notify_client = notify_client,
-        .notify_device = notify_device
+        .offset        = member.offset,
+        .data_type     = devmap_type_to_data_type(member.type),
+        .notify_client = member.path_notify_client,
+        .notify_device = member.path_notify_device
       };
 
       if (!strcmp(type_str, "bool-bitmap")) {
@@ -427,12 +415,8 @@ static int create_output_group_controls(
 
           props.type = SND_CTL_ELEM_TYPE_ENUMERATED;
           props.enum_count = source_enum_count;
-          props.enum_names = calloc(source_enum_count, sizeof(char *));
-          props.enum_values = calloc(source_enum_count, sizeof(int));
-          for (int j = 0; j < source_enum_count; j++) {
-            props.enum_names[j] = strdup(source_enum_names[j]);
-            props.enum_values[j] = source_enum_values[j];
-          }
+          props.enum_names = source_enum_names;
+          props.enum_values = source_enum_values;
           props.read_func = read_data_control;
           props.write_func = write_data_control;
         } else {
@@ -460,12 +444,10 @@ static int create_output_group_controls(
         struct json_object *db_min_obj, *db_max_obj;
         if (json_object_object_get_ex(control_config, "db-min", &db_min_obj) &&
             json_object_object_get_ex(control_config, "db-max", &db_max_obj)) {
-          unsigned int *tlv = calloc(4, sizeof(unsigned int));
-          tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
-          tlv[1] = 2 * sizeof(unsigned int);
-          tlv[2] = json_object_get_int(db_min_obj) * 100;
-          tlv[3] = json_object_get_int(db_max_obj) * 100;
-          props.tlv = tlv;
+          props.tlv = tlv_db_minmax(
+            json_object_get_int(db_min_obj),
+            json_object_get_int(db_max_obj)
+          );
         }
 
       } else {
@@ -477,13 +459,13 @@ static int create_output_group_controls(
       err = add_control(device, &props);
       if (err < 0) {
         free(name);
-        free_source_enum(source_enum_names, source_enum_values, source_enum_count);
+        free(source_enum_names);
         return err;
       }
     }
   }
 
-  free_source_enum(source_enum_names, source_enum_values, source_enum_count);
+  free(source_enum_names);
   return 0;
 }
 
@@ -0,0 +1,159 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "poller.h"
+#include "device-ops.h"
+#include "event-loop.h"
+#include "stats.h"
+#include "log.h"
+
+struct poll_entry {
+  int      index;        // In the control manager
+  int      last_value;   // As at the last poll
+  int      interval_ms;
+  uint64_t due_us;
+};
+
+struct control_poller {
+  struct poll_entry   *entries;
+  int                  count;
+  int                  max_ms;
+  struct event_source *timer;
+};
+
+/* Arm the timer for the entry due soonest */
+static void arm_timer(struct control_poller *poller) {
+  uint64_t now = stats_time_us();
+  uint64_t due = UINT64_MAX;
+
+  for (int i = 0; i < poller->count; i++)
+    if (poller->entries[i].due_us < due)
+      due = poller->entries[i].due_us;
+
+  // Rounded up; 0 would disarm the timer
+  int ms = due > now ? (due - now + 999) / 1000 : 1;
+
+  event_timer_arm(poller->timer, ms, 0);
+}
+
+static void handle_poll_timer(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  struct fcp_device *device = data;
+  struct control_poller *poller = device->poller;
+  struct control_props *controls = device->ctrl_mgr.controls;
+  uint64_t now = stats_time_us();
+  uint32_t notification = 0;
+
+  for (int i = 0; i < poller->count; i++)
+    if (poller->entries[i].due_us <= now)
+      notification |= controls[poller->entries[i].index].notify_client;
+
+  if (notification)
+    device_handle_notification(device, notification);
+
+  // Poll the controls which have changed since their last poll (at
+  // this one or from a notification) quickly again, and the others
+  // less often
+  now = stats_time_us();
+
+  for (int i = 0; i < poller->count; i++) {
+    struct poll_entry *entry = &poller->entries[i];
+    int value = controls[entry->index].value;
+
+    if (!(controls[entry->index].notify_client & notification))
+      continue;
+
+    if (value != entry->last_value) {
+      entry->interval_ms = POLLER_MIN_MS;
+      entry->last_value = value;
+    } else if (entry->interval_ms < poller->max_ms) {
+      entry->interval_ms *= 2;
+      if (entry->interval_ms > poller->max_ms)
+        entry->interval_ms = poller->max_ms;
+    }
+
+    entry->due_us = now + entry->interval_ms * 1000ULL;
+  }
+
+  arm_timer(poller);
+}
+
+int poller_start(struct fcp_device *device) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  int max_ms = POLLER_MAX_MS;
+
+  const char *env = getenv("FCP_POLL_MAX_MS");
+  if (env)
+    max_ms = atoi(env);
+  if (max_ms <= 0)
+    return 0;
+  if (max_ms < POLLER_MIN_MS)
+    max_ms = POLLER_MIN_MS;
+
+  int count = 0;
+  for (int i = 0; i < ctrl_mgr->num_controls; i++)
+    if (ctrl_mgr->controls[i].poll)
+      count++;
+
+  if (!count)
+    return 0;
+
+  struct control_poller *poller = calloc(1, sizeof(*poller));
+  if (poller)
+    poller->entries = calloc(count, sizeof(*poller->entries));
+  if (!poller || !poller->entries) {
+    log_error("Cannot allocate memory for control poller");
+    exit(1);
+  }
+
+  uint64_t now = stats_time_us();
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++) {
+    struct control_props *props = &ctrl_mgr->controls[i];
+
+    // Multi-component and BYTES controls aren't polled
+    if (!props->poll || !props->notify_client ||
+        props->component_count || props->type == SND_CTL_ELEM_TYPE_BYTES)
+      continue;
+
+    struct poll_entry *entry = &poller->entries[poller->count++];
+
+    entry->index = i;
+    entry->last_value = props->value;
+    entry->interval_ms = POLLER_MIN_MS;
+    entry->due_us = now + POLLER_MIN_MS * 1000ULL;
+  }
+
+  poller->max_ms = max_ms;
+  device->poller = poller;
+
+  if (!poller->count)
+    return 0;
+
+  poller->timer = event_add_timer(handle_poll_timer, device);
+  if (!poller->timer)
+    return -1;
+
+  log_debug("Polling %d controls", poller->count);
+
+  arm_timer(poller);
+  return 0;
+}
+
+void poller_stop(struct fcp_device *device) {
+  struct control_poller *poller = device->poller;
+
+  if (!poller)
+    return;
+
+  event_remove(poller->timer);
+  free(poller->entries);
+  free(poller);
+  device->poller = NULL;
+}
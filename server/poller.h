@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "device.h"
+
+/* Re-read the controls marked poll (sync status, autogain) so that
+ * clients see their changes without polling the device themselves
+ *
+ * Each control is re-read every POLLER_MIN_MS while its value is
+ * changing, backing off by doubling to $FCP_POLL_MAX_MS (default
+ * POLLER_MAX_MS; 0 disables polling) once it is stable. Re-reads go
+ * through device_handle_notification() with the control's
+ * notification bits, so changes reach ALSA and socket clients as
+ * notified changes do.
+ */
+
+#define POLLER_MIN_MS 50
+#define POLLER_MAX_MS 2000
+
+/* Start polling the device's poll controls, if it has any */
+int poller_start(struct fcp_device *device);
+
+void poller_stop(struct fcp_device *device);
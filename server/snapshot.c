@@ -0,0 +1,372 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "snapshot.h"
+#include "device-ops.h"
+#include "mix.h"
+#include "fcp.h"
+#include "log.h"
+#include "../shared/fcp-shared.h"
+
+static int mix_outputs(struct fcp_device *device) {
+  return device->mix_cache ? device->mix_output_count : 0;
+}
+
+static int mux_size(struct fcp_device *device, int rate) {
+  return device->mux_cache ? device->mux_cache->mux_size[rate] : 0;
+}
+
+static size_t snapshot_size(struct fcp_device *device) {
+  size_t size = sizeof(struct fcp_snapshot_header) +
+                device->app_space.size +
+                mix_outputs(device) * device->mix_input_count *
+                  sizeof(uint16_t);
+
+  for (int rate = 0; rate < 3; rate++)
+    size += mux_size(device, rate) * sizeof(uint32_t);
+
+  return size;
+}
+
+int snapshot_capture(
+  struct fcp_device  *device,
+  uint8_t           **data,
+  size_t             *size
+) {
+  int app_space_size = device->app_space.size;
+  int err;
+
+  // Changes still waiting to be written are part of the state
+  err = flush_mux_cache(device);
+  if (err < 0)
+    return err;
+  err = flush_mix_cache(device);
+  if (err < 0)
+    return err;
+
+  *size = snapshot_size(device);
+  *data = malloc(*size);
+  if (!*data) {
+    log_error("Cannot allocate memory for snapshot");
+    exit(1);
+  }
+
+  struct fcp_snapshot_header *header = (void *)*data;
+  uint8_t *p = (uint8_t *)(header + 1);
+
+  *header = (struct fcp_snapshot_header){
+    .magic            = htole32(FCP_SNAPSHOT_MAGIC),
+    .version          = htole16(FCP_SNAPSHOT_VERSION),
+    .usb_pid          = htole16(device->usb_pid),
+    .app_space_size   = htole32(app_space_size),
+    .mix_outputs      = htole16(mix_outputs(device)),
+    .mix_inputs       = htole16(device->mix_input_count),
+    .firmware_version = htole32(device->devmap_version)
+  };
+  for (int rate = 0; rate < 3; rate++)
+    header->mux_size[rate] = htole16(mux_size(device, rate));
+
+  for (int offset = 0; offset < app_space_size; offset += APP_SPACE_READ_MAX) {
+    int count = app_space_size - offset;
+    if (count > APP_SPACE_READ_MAX)
+      count = APP_SPACE_READ_MAX;
+
+    err = fcp_data_read_buf(device->hwdep, offset, count, p + offset);
+    if (err < 0)
+      goto error;
+  }
+  p += app_space_size;
+
+  for (int i = 0; i < mix_outputs(device); i++) {
+    int *values;
+
+    err = get_cached_mix_values(device, i, &values);
+    if (err < 0)
+      goto error;
+
+    for (int j = 0; j < device->mix_input_count; j++, p += 2)
+      *(uint16_t *)p = htole16(values[j]);
+  }
+
+  for (int rate = 0; rate < 3; rate++) {
+    uint32_t *values;
+
+    if (!mux_size(device, rate))
+      continue;
+
+    err = get_cached_mux_values(device, rate, &values);
+    if (err < 0)
+      goto error;
+
+    for (int j = 0; j < mux_size(device, rate); j++, p += 4)
+      *(uint32_t *)p = htole32(values[j]);
+  }
+
+  return 0;
+
+error:
+  log_error("Cannot read device state for snapshot: %s", snd_strerror(err));
+  free(*data);
+  *data = NULL;
+  return err;
+}
+
+static bool snapshot_matches(
+  struct fcp_device *device,
+  const uint8_t     *data,
+  size_t             size
+) {
+  const struct fcp_snapshot_header *header = (const void *)data;
+
+  if (size < sizeof(*header) ||
+      le32toh(header->magic) != FCP_SNAPSHOT_MAGIC ||
+      le16toh(header->version) != FCP_SNAPSHOT_VERSION) {
+    log_error("Invalid snapshot");
+    return false;
+  }
+
+  if (le16toh(header->usb_pid) != device->usb_pid ||
+      le32toh(header->app_space_size) != device->app_space.size ||
+      le16toh(header->mix_outputs) != mix_outputs(device) ||
+      le16toh(header->mix_inputs) != device->mix_input_count ||
+      le16toh(header->mux_size[0]) != mux_size(device, 0) ||
+      le16toh(header->mux_size[1]) != mux_size(device, 1) ||
+      le16toh(header->mux_size[2]) != mux_size(device, 2) ||
+      size != snapshot_size(device)) {
+    log_error("Snapshot is not from this model of device");
+    return false;
+  }
+
+  // 0 if the version couldn't be read, in which case the layouts
+  // can't be compared
+  uint32_t version = le32toh(header->firmware_version);
+  if (!version || version != device->devmap_version) {
+    log_error(
+      "Snapshot is from firmware %u, but the device is running %u",
+      version, device->devmap_version
+    );
+    return false;
+  }
+
+  const uint16_t *mix = (const uint16_t *)(
+    data + sizeof(*header) + device->app_space.size
+  );
+
+  for (int i = 0; i < mix_outputs(device) * device->mix_input_count; i++)
+    if (le16toh(mix[i]) > FCP_MIX_GAIN_MAX) {
+      log_error("Invalid mix value in snapshot");
+      return false;
+    }
+
+  return true;
+}
+
+/* Queue the APP_SPACE bytes of the writable controls which differ
+ * from the snapshot, and their device notifications
+ */
+static int restore_app_space(
+  struct fcp_device *device,
+  const uint8_t     *snapshot,
+  int               *changed,
+  int               *changed_count
+) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+  struct app_space *shadow = &device->app_space;
+  int *indices = malloc(sizeof(int) * (ctrl_mgr->num_controls + 1));
+  int count = 0;
+  int err = 0;
+
+  if (!indices) {
+    log_error("Cannot allocate memory for snapshot restore");
+    exit(1);
+  }
+
+  for (int i = 0; i < ctrl_mgr->num_controls; i++)
+    if (!ctrl_mgr->controls[i].read_only && ctrl_mgr->hot[i].range_count)
+      indices[count++] = i;
+
+  // Get the current bytes with as few reads as possible
+  err = app_space_prefetch(device, indices, count);
+  if (err < 0)
+    goto done;
+
+  for (int i = 0; i < count && err >= 0; i++) {
+    struct control_props *props = &ctrl_mgr->controls[indices[i]];
+    struct control_hot *hot = &ctrl_mgr->hot[indices[i]];
+    bool differs = false;
+
+    for (int j = 0; j < hot->range_count; j++) {
+      const struct app_space_range *range =
+        &ctrl_mgr->ranges[hot->range_first + j];
+      int start = range->start;
+      int size = range->end - range->start;
+
+      if (shadow->valid[start] &&
+          !memcmp(shadow->data + start, snapshot + start, size))
+        continue;
+
+      // Held back until the batch ends
+      err = app_space_write_buf(device, start, size, snapshot + start);
+      if (err < 0)
+        break;
+      differs = true;
+    }
+
+    if (!differs)
+      continue;
+
+    changed[(*changed_count)++] = indices[i];
+
+    if (props->notify_device && err >= 0)
+      err = app_space_notify(device, props->notify_device);
+  }
+
+done:
+  app_space_invalidate(device);
+  free(indices);
+  return err;
+}
+
+/* Update the cached mix rows which differ from the snapshot; sets
+ * rows_changed[] for each
+ */
+static int restore_mix(
+  struct fcp_device *device,
+  const uint8_t     *snapshot,
+  bool              *rows_changed
+) {
+  int inputs = device->mix_input_count;
+
+  for (int i = 0; i < mix_outputs(device); i++) {
+    const uint16_t *row = (const uint16_t *)snapshot + i * inputs;
+    int *values;
+
+    int err = get_cached_mix_values(device, i, &values);
+    if (err < 0)
+      return err;
+
+    for (int j = 0; j < inputs; j++) {
+      int value = le16toh(row[j]);
+
+      if (values[j] == value)
+        continue;
+
+      values[j] = value;
+      rows_changed[i] = true;
+    }
+
+    if (rows_changed[i])
+      device->mix_cache[i].pending = true;
+  }
+
+  return 0;
+}
+
+/* Update the cached mux tables which differ from the snapshot;
+ * returns 1 if any did
+ */
+static int restore_mux(struct fcp_device *device, const uint8_t *snapshot) {
+  struct mux_cache *cache = device->mux_cache;
+  const uint32_t *p = (const uint32_t *)snapshot;
+  int changed = 0;
+
+  for (int rate = 0; rate < 3; rate++) {
+    uint32_t *values;
+
+    if (!mux_size(device, rate))
+      continue;
+
+    int err = get_cached_mux_values(device, rate, &values);
+    if (err < 0)
+      return err;
+
+    for (int j = 0; j < cache->mux_size[rate]; j++, p++) {
+      uint32_t value = le32toh(*p);
+
+      if (values[j] == value)
+        continue;
+
+      values[j] = value;
+      cache->slot_changed[rate][j] = 1;
+      cache->rate_changed[rate] = true;
+      changed = 1;
+    }
+  }
+
+  return changed;
+}
+
+int snapshot_restore(
+  struct fcp_device *device,
+  const uint8_t     *data,
+  size_t             size
+) {
+  struct control_manager *ctrl_mgr = &device->ctrl_mgr;
+
+  if (!snapshot_matches(device, data, size))
+    return -EINVAL;
+
+  const uint8_t *app_space = data + sizeof(struct fcp_snapshot_header);
+  const uint8_t *mix = app_space + device->app_space.size;
+  const uint8_t *mux = mix +
+    mix_outputs(device) * device->mix_input_count * sizeof(uint16_t);
+
+  int *changed = malloc(sizeof(int) * (ctrl_mgr->num_controls + 1));
+  bool *rows_changed = calloc(mix_outputs(device) + 1, sizeof(bool));
+  int changed_count = 0;
+
+  if (!changed || !rows_changed) {
+    log_error("Cannot allocate memory for snapshot restore");
+    exit(1);
+  }
+
+  device_batch_begin(device);
+
+  int err = restore_app_space(device, app_space, changed, &changed_count);
+  int data_changes = changed_count;
+  int mux_changed = 0;
+
+  if (err >= 0)
+    err = restore_mix(device, mix, rows_changed);
+  if (err >= 0)
+    err = mux_changed = restore_mux(device, mux);
+
+  // Send the writes and notifications; the mix is written now even
+  // if its flush is debounced
+  int batch_err = device_batch_end(device);
+  int mix_err = flush_mix_cache(device);
+
+  if (err >= 0)
+    err = batch_err < 0 ? batch_err : mix_err;
+
+  // The mix and mux controls read from the caches, which already
+  // have the new values
+  for (int i = 0; i < ctrl_mgr->num_controls; i++) {
+    struct control_props *props = &ctrl_mgr->controls[i];
+
+    if ((props->category == CATEGORY_MIX &&
+         mix_outputs(device) &&
+         rows_changed[props->offset / device->mix_input_count]) ||
+        (props->category == CATEGORY_MUX && mux_changed > 0))
+      changed[changed_count++] = i;
+  }
+
+  device_refresh_controls(device, changed, changed_count);
+
+  log_debug(
+    "Restored snapshot: %d data controls, %d mix/mux controls changed",
+    data_changes,
+    changed_count - data_changes
+  );
+
+  free(changed);
+  free(rows_changed);
+
+  return err < 0 ? err : 0;
+}
@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fcp_device;
+
+/* Snapshots of the state of a device: the APP_SPACE bytes of its
+ * controls, all the mix rows, and the mux tables of all three rates
+ * (see struct fcp_snapshot_header)
+ *
+ * A restore compares the snapshot with the current state and sends
+ * only what differs, as a device batch: the changed APP_SPACE bytes
+ * are combined into a few writes, each changed mix row and mux
+ * table is written once, and each device notification is sent once.
+ * The changed controls are then updated directly rather than
+ * waiting for the device to notify.
+ */
+
+/* Make a snapshot of the device; the caller frees *data */
+int snapshot_capture(
+  struct fcp_device  *device,
+  uint8_t           **data,
+  size_t             *size
+);
+
+/* Put the device back to a snapshot; -EINVAL if it's not from this
+ * type of device
+ */
+int snapshot_restore(
+  struct fcp_device *device,
+  const uint8_t     *data,
+  size_t             size
+);
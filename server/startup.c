@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+
+#include "startup.h"
+#include "device.h"
+#include "stats.h"
+#include "log.h"
+
+static const char *phase_names[STARTUP_PHASE_COUNT] = {
+  [STARTUP_DEVICE_INIT] = "device_init",
+  [STARTUP_DEVMAP]      = "devmap",
+  [STARTUP_FAM]         = "fam",
+  [STARTUP_SYNC]        = "sync",
+  [STARTUP_METER]       = "meter",
+  [STARTUP_MIX]         = "mix",
+  [STARTUP_MUX]         = "mux",
+  [STARTUP_ESP_DFU]     = "esp_dfu",
+  [STARTUP_INPUT]       = "input",
+  [STARTUP_OUTPUT]      = "output",
+  [STARTUP_GLOBAL]      = "global",
+  [STARTUP_CREATE]      = "create",
+  [STARTUP_SOCKET]      = "socket",
+};
+
+void startup_phase_end(
+  struct fcp_device  *device,
+  enum startup_phase  phase,
+  uint64_t           *start
+) {
+  uint64_t now = stats_time_us();
+
+  device->startup_us[phase] += now - *start;
+  *start = now;
+}
+
+void startup_report(struct fcp_device *device) {
+  char buf[512];
+  int len = 0;
+  uint64_t total = 0;
+
+  // Phases which didn't run (e.g. no mixer) are left out
+  for (int i = 0; i < STARTUP_PHASE_COUNT; i++) {
+    uint32_t us = device->startup_us[i];
+
+    if (!us)
+      continue;
+    total += us;
+    if (len < (int)sizeof(buf))
+      len += snprintf(buf + len, sizeof(buf) - len, "%s%s %.1f",
+                      len ? ", " : "", phase_names[i], us / 1000.0);
+  }
+
+  log_info("Card %d started in %.1f ms (%s)",
+           device->card_num, total / 1000.0, len ? buf : "");
+}
@@ -0,0 +1,41 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+struct fcp_device;
+
+/* Phases of setting a device up; the time taken by each is logged
+ * once the device is being served, so that a slow start can be
+ * traced to its cause
+ */
+enum startup_phase {
+  STARTUP_DEVICE_INIT,
+  STARTUP_DEVMAP,       // Read (or wait for another device to read)
+  STARTUP_FAM,
+  STARTUP_SYNC,
+  STARTUP_METER,
+  STARTUP_MIX,
+  STARTUP_MUX,
+  STARTUP_ESP_DFU,
+  STARTUP_INPUT,
+  STARTUP_OUTPUT,
+  STARTUP_GLOBAL,
+  STARTUP_CREATE,       // ALSA elements and initial values
+  STARTUP_SOCKET,
+  STARTUP_PHASE_COUNT
+};
+
+/* Add the time since *start to the phase, and restart *start from
+ * now for the next phase
+ */
+void startup_phase_end(
+  struct fcp_device  *device,
+  enum startup_phase  phase,
+  uint64_t           *start
+);
+
+/* Log the time taken by each phase and in total */
+void startup_report(struct fcp_device *device);
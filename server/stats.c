@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "fcp.h"
+
+struct fcp_stats server_stats;
+
+static uint64_t start_time_us;
+
+void stats_init(void) {
+  memset(&server_stats, 0, sizeof(server_stats));
+  start_time_us = stats_time_us();
+}
+
+uint64_t stats_time_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_record(struct fcp_stats_histogram *hist, uint64_t value) {
+  uint32_t v = value > UINT32_MAX ? UINT32_MAX : value;
+
+  // Bucket i holds values below 2^i
+  int bucket = v ? 32 - __builtin_clz(v) : 0;
+  if (bucket >= FCP_STATS_BUCKETS)
+    bucket = FCP_STATS_BUCKETS - 1;
+
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total, v, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+  uint32_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (v > max &&
+         !__atomic_compare_exchange_n(
+           &hist->max, &max, v, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+         ))
+    ;
+}
+
+void stats_count(uint32_t *counter) {
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+struct fcp_stats_histogram *stats_fcp_cmd(uint32_t opcode) {
+  uint32_t category = opcode >> 12;
+
+  if (category == FCP_OPCODE_CATEGORY_DATA)
+    return &server_stats.fcp_cmd[FCP_STATS_CMD_DATA];
+  if (category < FCP_OPCODE_CATEGORY_COUNT)
+    return &server_stats.fcp_cmd[category];
+
+  // Unknown categories are counted with INIT
+  return &server_stats.fcp_cmd[FCP_OPCODE_CATEGORY_INIT];
+}
+
+void stats_snapshot(struct fcp_stats *stats) {
+  *stats = server_stats;
+  stats->uptime = (stats_time_us() - start_time_us) / 1000000;
+}
@@ -0,0 +1,29 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+#include "../shared/fcp-shared.h"
+
+/* Process-wide counters and histograms, cheap enough to be always
+ * on; clients get a copy with FCP_SOCKET_REQUEST_STATS
+ */
+extern struct fcp_stats server_stats;
+
+void stats_init(void);
+
+/* Monotonic time in microseconds */
+uint64_t stats_time_us(void);
+
+/* Add a sample; may be called from the device setup threads */
+void stats_record(struct fcp_stats_histogram *hist, uint64_t value);
+
+/* Count an event; may be called from the device setup threads */
+void stats_count(uint32_t *counter);
+
+/* The fcp_cmd histogram for an opcode */
+struct fcp_stats_histogram *stats_fcp_cmd(uint32_t opcode);
+
+void stats_snapshot(struct fcp_stats *stats);
@@ -0,0 +1,176 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "strpool.h"
+#include "log.h"
+
+// Size of each block that strings and lists are packed into
+#define STRPOOL_BLOCK_SIZE (64 * 1024)
+
+/* An interned string or list; the hash table holds pointers to
+ * these, list entries being the addresses of interned strings
+ */
+struct strpool_entry {
+  uint32_t hash;
+  int      count;  // -1 for a string, otherwise the list length
+  union {
+    const char  *string;
+    const char **list;
+  };
+};
+
+static struct {
+  char                 *block;
+  size_t                block_used;
+  struct strpool_entry *table;
+  int                   size;   // Power of 2
+  int                   count;
+} pool;
+
+// Devices are set up in parallel
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *pool_alloc(size_t size, size_t align) {
+  size_t start = (pool.block_used + align - 1) & ~(align - 1);
+
+  if (size > STRPOOL_BLOCK_SIZE / 4) {
+    void *p = malloc(size);
+    if (!p) {
+      log_error("Cannot allocate memory for string pool");
+      exit(1);
+    }
+    return p;
+  }
+
+  if (!pool.block || start + size > STRPOOL_BLOCK_SIZE) {
+    pool.block = malloc(STRPOOL_BLOCK_SIZE);
+    if (!pool.block) {
+      log_error("Cannot allocate memory for string pool");
+      exit(1);
+    }
+    start = 0;
+  }
+
+  pool.block_used = start + size;
+  return pool.block + start;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size) {
+  const unsigned char *p = data;
+
+  while (size--)
+    hash = (hash ^ *p++) * 16777619u;
+
+  return hash;
+}
+
+static void pool_grow(void) {
+  int new_size = pool.size ? pool.size * 2 : 1024;
+  struct strpool_entry *new_table = calloc(new_size, sizeof(*new_table));
+
+  if (!new_table) {
+    log_error("Cannot allocate memory for string pool");
+    exit(1);
+  }
+
+  for (int i = 0; i < pool.size; i++) {
+    struct strpool_entry *entry = &pool.table[i];
+
+    if (!entry->string)
+      continue;
+
+    int j = entry->hash & (new_size - 1);
+    while (new_table[j].string)
+      j = (j + 1) & (new_size - 1);
+    new_table[j] = *entry;
+  }
+
+  free(pool.table);
+  pool.table = new_table;
+  pool.size = new_size;
+}
+
+/* Find the entry for a string (count -1) or list, or the empty slot
+ * for it
+ */
+static struct strpool_entry *pool_find(
+  uint32_t    hash,
+  int         count,
+  const void *key
+) {
+  if (pool.count * 2 >= pool.size)
+    pool_grow();
+
+  for (int i = hash & (pool.size - 1); ; i = (i + 1) & (pool.size - 1)) {
+    struct strpool_entry *entry = &pool.table[i];
+
+    if (!entry->string)
+      return entry;
+    if (entry->hash != hash || entry->count != count)
+      continue;
+    if (count < 0 ? !strcmp(entry->string, key)
+                  : !memcmp(entry->list, key, count * sizeof(char *)))
+      return entry;
+  }
+}
+
+static const char *intern_locked(const char *s) {
+  uint32_t hash = hash_bytes(2166136261u, s, strlen(s));
+  struct strpool_entry *entry = pool_find(hash, -1, s);
+
+  if (!entry->string) {
+    size_t size = strlen(s) + 1;
+    char *copy = pool_alloc(size, 1);
+
+    memcpy(copy, s, size);
+    entry->hash = hash;
+    entry->count = -1;
+    entry->string = copy;
+    pool.count++;
+  }
+
+  return entry->string;
+}
+
+const char *strpool_intern(const char *s) {
+  pthread_mutex_lock(&pool_lock);
+  const char *result = intern_locked(s);
+  pthread_mutex_unlock(&pool_lock);
+
+  return result;
+}
+
+const char **strpool_intern_list(const char *const *strings, int count) {
+  const char *interned[count > 0 ? count : 1];
+
+  pthread_mutex_lock(&pool_lock);
+
+  // Lists of the same interned strings are the same list
+  for (int i = 0; i < count; i++)
+    interned[i] = intern_locked(strings[i]);
+
+  uint32_t hash = hash_bytes(2166136261u, interned, count * sizeof(char *));
+  struct strpool_entry *entry = pool_find(hash, count, interned);
+
+  if (!entry->string) {
+    const char **list = pool_alloc(
+      (count > 0 ? count : 1) * sizeof(char *), sizeof(char *)
+    );
+
+    memcpy(list, interned, count * sizeof(char *));
+    entry->hash = hash;
+    entry->count = count;
+    entry->list = list;
+    pool.count++;
+  }
+
+  const char **result = entry->list;
+  pthread_mutex_unlock(&pool_lock);
+
+  return result;
+}
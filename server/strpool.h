@@ -0,0 +1,18 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+/* Interned strings for the control and enum names
+ *
+ * Each distinct string is stored once, packed into large blocks, and
+ * each distinct list of strings (an enum's item names) is stored
+ * once, so controls with the same items share one list. Nothing is
+ * freed; the controls live as long as the server.
+ */
+
+/* Get the interned copy of a string */
+const char *strpool_intern(const char *s);
+
+/* Get the interned copy of a list of count strings */
+const char **strpool_intern_list(const char *const *strings, int count);
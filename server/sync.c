@@ -29,9 +29,10 @@ void add_sync_control(struct fcp_device *device) {
     .interface     = SND_CTL_ELEM_IFACE_MIXER,
     .type          = SND_CTL_ELEM_TYPE_ENUMERATED,
     .category      = CATEGORY_SYNC,
-    .enum_names    = (char **)sync_enum_names,
+    .enum_names    = sync_enum_names,
     .enum_count    = sync_enum_count,
     .read_only     = 1,
+    .poll          = 1,
     .notify_client = 8,
     .notify_device = 0,
     .offset        = 0,
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include <alsa/sound/tlv.h>
+
+#include "tlv.h"
+#include "log.h"
+
+const SNDRV_CTL_TLVD_DECLARE_DB_LINEAR(
+  tlv_mix_gain, SNDRV_CTL_TLVD_DB_GAIN_MUTE, 1200
+);
+
+struct db_scale {
+  unsigned int     tlv[4];
+  struct db_scale *next;
+};
+
+// Devices are set up in parallel
+static struct db_scale *db_scales;
+static pthread_mutex_t db_scales_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const unsigned int *tlv_db_minmax(int db_min, int db_max) {
+  struct db_scale *scale;
+
+  pthread_mutex_lock(&db_scales_lock);
+
+  for (scale = db_scales; scale; scale = scale->next)
+    if (scale->tlv[2] == (unsigned int)(db_min * 100) &&
+        scale->tlv[3] == (unsigned int)(db_max * 100))
+      goto done;
+
+  scale = malloc(sizeof(*scale));
+  if (!scale) {
+    log_error("Cannot allocate TLV memory");
+    exit(1);
+  }
+
+  scale->tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
+  scale->tlv[1] = 2 * sizeof(unsigned int);
+  scale->tlv[2] = db_min * 100;
+  scale->tlv[3] = db_max * 100;
+  scale->next = db_scales;
+  db_scales = scale;
+
+done:
+  pthread_mutex_unlock(&db_scales_lock);
+  return scale->tlv;
+}
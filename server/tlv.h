@@ -0,0 +1,17 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+/* dB scales (TLVs) of the controls
+ *
+ * Each distinct scale is made once and shared by every control (on
+ * every device) that uses it, rather than allocated per control.
+ * The TLVs are never freed.
+ */
+
+/* Linear mix gain: 0 is muted, FCP_MIX_GAIN_MAX is +12dB */
+extern const unsigned int tlv_mix_gain[4];
+
+/* Scale from db_min to db_max (in dB) over the control's range */
+const unsigned int *tlv_db_minmax(int db_min, int db_max);
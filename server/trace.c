@@ -0,0 +1,277 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "event-loop.h"
+#include "stats.h"
+#include "log.h"
+
+#define TRACE_MAX_DEVICES 16
+
+/* One of the two append buffers; records are added to the current
+ * one while the other is written out. writers counts the records
+ * being added, so that the buffer is only written once they are
+ * complete.
+ */
+struct trace_buffer {
+  uint8_t *data;
+  size_t   used;      // Reserved, including records that didn't fit
+  size_t   limit;     // Start of the first record that didn't fit
+  int      writers;
+};
+
+static struct trace_buffer buffers[2];
+static int current;
+static int trace_fd = -1;
+static uint64_t start_us;
+static uint32_t dropped;
+static struct event_source *flush_timer;
+
+static snd_hwdep_t *devices[TRACE_MAX_DEVICES];
+
+static void trace_close(void) {
+  trace_flush();
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+void trace_init(void) {
+  const char *path = getenv("FCP_TRACE");
+
+  if (!path || !*path)
+    return;
+
+  for (int i = 0; i < 2; i++) {
+    buffers[i].data = malloc(FCP_TRACE_BUFFER_SIZE);
+    if (!buffers[i].data) {
+      log_error("Cannot allocate memory for trace buffer");
+      exit(1);
+    }
+    buffers[i].limit = FCP_TRACE_BUFFER_SIZE;
+  }
+
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    log_error("Cannot open trace file %s: %s", path, strerror(errno));
+    return;
+  }
+
+  struct fcp_trace_header header = {
+    .magic   = FCP_TRACE_MAGIC,
+    .version = FCP_TRACE_VERSION,
+  };
+  if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+    log_error("Cannot write trace file %s: %s", path, strerror(errno));
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+
+  start_us = stats_time_us();
+  atexit(trace_close);
+
+  log_info("Tracing FCP traffic to %s", path);
+}
+
+static void handle_flush_timer(
+  struct event_source *source,
+  uint32_t             events,
+  void                *data
+) {
+  trace_flush();
+}
+
+int trace_start_flush_timer(void) {
+  if (trace_fd < 0)
+    return 0;
+
+  flush_timer = event_add_timer(handle_flush_timer, NULL);
+  if (!flush_timer)
+    return -1;
+
+  return event_timer_arm(flush_timer, FCP_TRACE_FLUSH_MS, FCP_TRACE_FLUSH_MS);
+}
+
+void trace_flush(void) {
+  if (trace_fd < 0)
+    return;
+
+  // New records go to the other buffer, which was emptied by the
+  // last flush; then wait for the records being added to this one
+  int old = __atomic_load_n(&current, __ATOMIC_RELAXED);
+  struct trace_buffer *buf = &buffers[old];
+
+  __atomic_store_n(&current, !old, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&buf->writers, __ATOMIC_ACQUIRE))
+    sched_yield();
+
+  size_t end = buf->used < buf->limit ? buf->used : buf->limit;
+
+  if (end && write(trace_fd, buf->data, end) != (ssize_t)end)
+    log_error("Cannot write trace file: %s", strerror(errno));
+
+  buf->used = 0;
+  buf->limit = FCP_TRACE_BUFFER_SIZE;
+
+  uint32_t count = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (count)
+    log_warning("Dropped %u trace records; buffer full", count);
+}
+
+static int device_index(snd_hwdep_t *hwdep) {
+  for (int i = 0; i < TRACE_MAX_DEVICES; i++) {
+    snd_hwdep_t *seen = __atomic_load_n(&devices[i], __ATOMIC_ACQUIRE);
+
+    if (!seen) {
+      snd_hwdep_t *expected = NULL;
+
+      if (__atomic_compare_exchange_n(
+            &devices[i], &expected, hwdep,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+          ))
+        return i;
+      seen = expected;
+    }
+
+    if (seen == hwdep)
+      return i;
+  }
+
+  return TRACE_MAX_DEVICES;
+}
+
+/* Reserve space for a record in the current buffer; the caller
+ * must call finish_record() once it's filled in
+ */
+static struct fcp_trace_record *reserve_record(
+  snd_hwdep_t *hwdep,
+  int          type,
+  uint32_t     opcode,
+  size_t       payload
+) {
+  struct trace_buffer *buf;
+  int i;
+
+  // Don't add to a buffer which is being written out
+  while (1) {
+    i = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    buf = &buffers[i];
+    __atomic_fetch_add(&buf->writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&current, __ATOMIC_SEQ_CST) == i)
+      break;
+    __atomic_fetch_sub(&buf->writers, 1, __ATOMIC_RELEASE);
+  }
+
+  size_t size = sizeof(struct fcp_trace_record) + payload;
+  size_t offset = __atomic_fetch_add(&buf->used, size, __ATOMIC_RELAXED);
+
+  if (offset + size > FCP_TRACE_BUFFER_SIZE) {
+    // Only the first record not to fit starts at or before the end
+    if (offset <= FCP_TRACE_BUFFER_SIZE)
+      buf->limit = offset;
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&buf->writers, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  struct fcp_trace_record *rec = (void *)(buf->data + offset);
+
+  rec->time_us = stats_time_us() - start_us;
+  rec->duration_us = 0;
+  rec->opcode = opcode;
+  rec->result = 0;
+  rec->req_size = 0;
+  rec->resp_size = 0;
+  rec->type = type;
+  rec->device = device_index(hwdep);
+  rec->reserved = 0;
+
+  return rec;
+}
+
+static void finish_record(struct fcp_trace_record *rec) {
+  int i = (uint8_t *)rec >= buffers[1].data &&
+          (uint8_t *)rec < buffers[1].data + FCP_TRACE_BUFFER_SIZE;
+
+  __atomic_fetch_sub(&buffers[i].writers, 1, __ATOMIC_RELEASE);
+}
+
+bool trace_enabled(void) {
+  return trace_fd >= 0;
+}
+
+void trace_cmd_begin(
+  struct trace_cmd *cmd,
+  snd_hwdep_t      *hwdep,
+  uint32_t          opcode,
+  const void       *req,
+  size_t            req_size,
+  size_t            resp_size,
+  void             *req_copy
+) {
+  cmd->req = NULL;
+
+  if (trace_fd < 0 || !req_copy)
+    return;
+
+  cmd->req = req_copy;
+  memcpy(cmd->req, req, req_size);
+
+  cmd->hwdep = hwdep;
+  cmd->opcode = opcode;
+  cmd->req_size = req_size;
+  cmd->resp_size = resp_size;
+  cmd->time_us = stats_time_us();
+}
+
+void trace_cmd_end(struct trace_cmd *cmd, int result, const void *resp) {
+  if (!cmd->req)
+    return;
+
+  uint64_t end_us = stats_time_us();
+  struct fcp_trace_record *rec = reserve_record(
+    cmd->hwdep, FCP_TRACE_CMD, cmd->opcode, cmd->req_size + cmd->resp_size
+  );
+
+  if (rec) {
+    uint8_t *data = (uint8_t *)(rec + 1);
+
+    rec->time_us = cmd->time_us - start_us;
+    rec->duration_us = end_us - cmd->time_us;
+    rec->result = result;
+    rec->req_size = cmd->req_size;
+    rec->resp_size = cmd->resp_size;
+    memcpy(data, cmd->req, cmd->req_size);
+
+    // The space for the response is kept so that the record size
+    // doesn't depend on the result; it's cleared if there isn't one
+    if (result < 0)
+      memset(data + cmd->req_size, 0, cmd->resp_size);
+    else
+      memcpy(data + cmd->req_size, resp, cmd->resp_size);
+
+    finish_record(rec);
+  }
+
+  cmd->req = NULL;
+}
+
+void trace_notification(snd_hwdep_t *hwdep, uint32_t notification) {
+  if (trace_fd < 0)
+    return;
+
+  struct fcp_trace_record *rec = reserve_record(
+    hwdep, FCP_TRACE_NOTIFICATION, notification, 0
+  );
+  if (rec)
+    finish_record(rec);
+}
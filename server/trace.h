@@ -0,0 +1,97 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/* Trace of the FCP commands and notifications exchanged with the
+ * devices, written to the file named by $FCP_TRACE for replaying
+ * with fcp-bench -r
+ *
+ * The file starts with a struct fcp_trace_header and is followed by
+ * records, each a struct fcp_trace_record then req_size request bytes
+ * and resp_size response bytes (little-endian, as sent).
+ *
+ * Records are appended to an in-memory buffer without locking and
+ * written out from the event loop, so tracing doesn't hold up the
+ * commands being traced. A command's record is only added once it
+ * has finished, so the writer never waits for one in flight; records
+ * are in the order the commands finished. Records which don't fit
+ * before the next write are dropped and counted.
+ */
+
+#define FCP_TRACE_MAGIC   "FCPTRACE"
+#define FCP_TRACE_VERSION 1
+
+#define FCP_TRACE_CMD          1
+#define FCP_TRACE_NOTIFICATION 2
+
+// Size of each of the two append buffers
+#define FCP_TRACE_BUFFER_SIZE (1024 * 1024)
+
+// How often the buffer is written to the file
+#define FCP_TRACE_FLUSH_MS 1000
+
+struct fcp_trace_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct fcp_trace_record {
+  uint64_t time_us;      // Since tracing started
+  uint32_t duration_us;  // Of the command
+  uint32_t opcode;       // Notification mask for notifications
+  int32_t  result;
+  uint16_t req_size;
+  uint16_t resp_size;    // Zero-filled if the command failed
+  uint8_t  type;
+  uint8_t  device;       // Order in which the device was first seen
+  uint16_t reserved;
+} __attribute__((packed));
+
+/* Open $FCP_TRACE if set; tracing is off otherwise */
+void trace_init(void);
+
+/* Write out the buffered records every FCP_TRACE_FLUSH_MS; call
+ * once the event loop is initialised
+ */
+int trace_start_flush_timer(void);
+
+/* Write out the buffered records; only called from the main thread */
+void trace_flush(void);
+
+/* Check if $FCP_TRACE is being written */
+bool trace_enabled(void);
+
+/* A command being traced, kept by the caller while it's sent */
+struct trace_cmd {
+  snd_hwdep_t *hwdep;
+  uint32_t     opcode;
+  uint64_t     time_us;
+  void        *req;        // Copy of the request; NULL if not tracing
+  size_t       req_size;
+  size_t       resp_size;
+};
+
+/* Record a command: trace_cmd_begin() before it is sent, while the
+ * request is in req, and trace_cmd_end() with the result and the
+ * response, which adds the record. The request is copied into
+ * req_copy, which the caller provides (as the response usually
+ * overwrites the request) and keeps until trace_cmd_end().
+ */
+void trace_cmd_begin(
+  struct trace_cmd *cmd,
+  snd_hwdep_t      *hwdep,
+  uint32_t          opcode,
+  const void       *req,
+  size_t            req_size,
+  size_t            resp_size,
+  void             *req_copy
+);
+void trace_cmd_end(struct trace_cmd *cmd, int result, const void *resp);
+
+void trace_notification(snd_hwdep_t *hwdep, uint32_t notification);
@@ -16,5 +16,9 @@ const char *fcp_socket_error_messages[] = {
   "Write error",
   "Not running leapfrog firmware",
   "Invalid state",
-  "Debug mode disabled (set FCP_DEBUG=1)"
+  "Debug mode disabled (set FCP_DEBUG=1)",
+  "Flash verification failed",
+  "Device busy with another update or erase",
+  "Snapshot is not from this model of device and firmware version",
+  "Invalid mux routing"
 };
@@ -19,7 +19,11 @@
 #define FCP_SOCKET_ERR_NOT_LEAPFROG    11
 #define FCP_SOCKET_ERR_INVALID_STATE   12
 #define FCP_SOCKET_ERR_DEBUG_DISABLED  13
-#define FCP_SOCKET_ERR_MAX             13
+#define FCP_SOCKET_ERR_VERIFY          14
+#define FCP_SOCKET_ERR_BUSY            15
+#define FCP_SOCKET_ERR_SNAPSHOT        16
+#define FCP_SOCKET_ERR_MUX_ROUTING     17
+#define FCP_SOCKET_ERR_MAX             17
 
 // Protocol constants
 #define FCP_SOCKET_PROTOCOL_VERSION 1
@@ -37,12 +41,81 @@
 #define FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE  0x0005
 #define FCP_SOCKET_REQUEST_FCP_CMD              0x0006
 
+// As APP_FIRMWARE_UPDATE, but each block is read back and compared
+#define FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_VERIFY 0x0007
+
+// Compare with the current App firmware and only write the blocks
+// which differ (no separate erase request needed)
+#define FCP_SOCKET_REQUEST_APP_FIRMWARE_UPDATE_DIFF   0x0008
+
+// As ESP_FIRMWARE_UPDATE, but also send TRANSFER_STATS responses
+#define FCP_SOCKET_REQUEST_ESP_FIRMWARE_UPDATE_STATS  0x0009
+
+// The request (header and payload, as it would be sent on the
+// socket) is in a file descriptor passed with SCM_RIGHTS; no
+// payload follows on the socket. The fd must be a memfd sealed with
+// at least F_SEAL_SHRINK and F_SEAL_WRITE; the server maps it rather
+// than copying it.
+#define FCP_SOCKET_REQUEST_FIRMWARE_FD                0x000a
+
+// Several FCP commands run back to back, with one DATA response
+#define FCP_SOCKET_REQUEST_FCP_CMD_BATCH              0x000b
+
+// Most commands in one FCP_CMD_BATCH request
+#define FCP_CMD_BATCH_MAX 1024
+
+// Push CONTROL_CHANGES responses to this client whenever controls
+// change at the device
+#define FCP_SOCKET_REQUEST_SUBSCRIBE                  0x000c
+
+// Push METER_LEVELS responses to this client; the payload is a
+// uint16_t interval in ms (0 to stop)
+#define FCP_SOCKET_REQUEST_METER_SUBSCRIBE            0x000d
+
+// Limits for the meter interval
+#define FCP_METER_INTERVAL_MIN 10
+#define FCP_METER_INTERVAL_MAX 10000
+
+// Get the server's counters and latency histograms; the DATA
+// response is a struct fcp_stats
+#define FCP_SOCKET_REQUEST_STATS                      0x000e
+
+// Get the device's APP_SPACE, mix, and mux as one snapshot (see
+// struct fcp_snapshot_header), in a DATA response
+#define FCP_SOCKET_REQUEST_SNAPSHOT                   0x000f
+
+// Put the device back to the snapshot in the payload, writing only
+// what differs from its current state
+#define FCP_SOCKET_REQUEST_RESTORE                    0x0010
+
+// Get the input of every mux output (see struct
+// fcp_mux_routing_header), in a DATA response
+#define FCP_SOCKET_REQUEST_MUX_ROUTING_READ           0x0011
+
+// Set the input of every mux output from the same layout,
+// writing each changed mux table once
+#define FCP_SOCKET_REQUEST_MUX_ROUTING_WRITE          0x0012
+
+#define FCP_SNAPSHOT_MAGIC   0x50414e53  // "SNAP"
+#define FCP_SNAPSHOT_VERSION 2
+
+// Histogram buckets; bucket i counts values below 2^i, and the last
+// one counts everything larger
+#define FCP_STATS_BUCKETS 24
+
+// FCP command slots are the opcode category, with DATA last
+#define FCP_STATS_CMD_DATA  10
+#define FCP_STATS_CMD_COUNT 11
+
 // Response types
 #define FCP_SOCKET_RESPONSE_VERSION  0x00
 #define FCP_SOCKET_RESPONSE_SUCCESS  0x01
 #define FCP_SOCKET_RESPONSE_ERROR    0x02
 #define FCP_SOCKET_RESPONSE_PROGRESS 0x03
 #define FCP_SOCKET_RESPONSE_DATA     0x04
+#define FCP_SOCKET_RESPONSE_TRANSFER_STATS 0x05
+#define FCP_SOCKET_RESPONSE_CONTROL_CHANGES 0x06
+#define FCP_SOCKET_RESPONSE_METER_LEVELS    0x07
 
 extern const char *fcp_socket_error_messages[];
 
@@ -74,6 +147,66 @@ struct progress_msg {
   uint8_t                      percent;
 };
 
+// Sent with each progress update when requested
+struct transfer_stats {
+  uint8_t  percent;
+  uint32_t bytes_done;
+  uint32_t bytes_per_sec;
+  uint32_t block_latency_us;  // Average time for the device to ack a block
+  uint16_t block_size;
+  uint8_t  window;            // Blocks written per acknowledgement
+};
+
+// CONTROL_CHANGES payload: one or more of these back to back, for
+// the controls changed by one device notification
+#define FCP_CONTROL_CHANGE_VALUES 0  // length int32_t values
+#define FCP_CONTROL_CHANGE_BYTES  1  // length bytes
+
+struct control_change {
+  uint32_t numid;   // ALSA control numid
+  uint8_t  kind;
+  uint16_t length;
+  uint8_t  data[];
+};
+
+// METER_LEVELS payload; levels are in the same order as the ALSA
+// meter control (see its labels TLV)
+struct meter_levels {
+  uint32_t seq;       // Increments with each meter read
+  uint16_t count;
+  uint32_t levels[];
+};
+
+struct fcp_stats_histogram {
+  uint32_t count;
+  uint32_t max;
+  uint64_t total;
+  uint32_t buckets[FCP_STATS_BUCKETS];
+};
+
+// STATS response payload; times are in microseconds and everything
+// counts from when the server started
+struct fcp_stats {
+  uint32_t uptime;           // Seconds
+  uint32_t notifications;    // Device notifications handled
+  uint32_t control_changes;  // ALSA changes written to the device
+  uint32_t fcp_cmd_errors;
+
+  // Time for each FCP command to complete, by opcode category
+  struct fcp_stats_histogram fcp_cmd[FCP_STATS_CMD_COUNT];
+
+  // From a notification arriving to each ALSA element write it
+  // causes
+  struct fcp_stats_histogram notify_to_alsa;
+
+  // From a batch of ALSA events to its writes reaching the device
+  struct fcp_stats_histogram alsa_to_device;
+
+  // Controls re-read from the device per notification (a count, not
+  // a time)
+  struct fcp_stats_histogram notify_rereads;
+};
+
 struct error_msg {
   struct fcp_socket_msg_header header;
   int16_t                      error_code;
@@ -85,4 +218,48 @@ struct fcp_cmd_request {
   uint8_t  req_data[];
 };
 
+// FCP_CMD_BATCH request payload: the count, then that many
+// fcp_cmd_batch_request entries back to back. The DATA response is
+// the count, then an fcp_cmd_batch_result for each command.
+struct fcp_cmd_batch_header {
+  uint32_t count;
+};
+
+struct fcp_cmd_batch_request {
+  uint32_t opcode;
+  uint32_t req_size;
+  uint32_t resp_size;
+  uint8_t  req_data[];
+};
+
+struct fcp_cmd_batch_result {
+  int32_t  error;      // 0, or the negative error from the command
+  uint32_t resp_size;  // Bytes of resp_data (zeroed on error)
+  uint8_t  resp_data[];
+};
+
+// Snapshot of a device's state, followed by app_space_size bytes of
+// APP_SPACE, mix_outputs * mix_inputs uint16_t mix values (by
+// output), then the mux_size[i] uint32_t mux values for each rate;
+// all little-endian. The APP_SPACE layout can change between
+// firmware versions, so it's only restored to the version it's from.
+struct fcp_snapshot_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t usb_pid;
+  uint32_t app_space_size;
+  uint16_t mix_outputs;
+  uint16_t mix_inputs;
+  uint16_t mux_size[3];
+  uint16_t reserved;
+  uint32_t firmware_version;  // versionStageRelease
+};
+
+// Mux routing, followed by output_count uint16_t input indices
+// (0 is Off) in the order of the mux controls; all little-endian
+struct fcp_mux_routing_header {
+  uint16_t output_count;
+  uint16_t input_count;
+};
+
 #pragma pack(pop)